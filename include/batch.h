@@ -0,0 +1,85 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "file_operations.h"
+
+/**
+ * Operations a manifest entry can request
+ */
+typedef enum {
+    BATCH_COPY = 0,         // Copy a file or directory tree
+    BATCH_MOVE,             // Move a file or directory tree
+    BATCH_COMPARE,          // Compare two files
+    BATCH_CHECKSUM,         // Checksum one file (--hash algorithm)
+    BATCH_OP_COUNT
+} BatchOp;
+
+/**
+ * Manifest encodings (--batch-format)
+ */
+typedef enum {
+    BATCH_FORMAT_AUTO = 0,  // JSON if it starts with '[' or '{', NUL if it holds a NUL byte
+    BATCH_FORMAT_LINES,     // One entry per line, fields separated by tabs
+    BATCH_FORMAT_NUL,       // NUL-terminated paths, as find -print0 writes them
+    BATCH_FORMAT_JSON       // Array (or sequence) of {"op", "src", "dest"} objects
+} BatchFormat;
+
+/**
+ * Parse an operation name ("copy", "move", "compare", "checksum")
+ * @param name: Operation name
+ * @param op: Receives the operation
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_batch_op(const char *name, BatchOp *op);
+
+/**
+ * Parse a manifest format name ("auto", "lines", "nul", "json")
+ * @param name: Format name
+ * @param format: Receives the format
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_batch_format(const char *name, BatchFormat *format);
+
+// A parsed manifest
+typedef struct Batch Batch;
+
+/**
+ * Read and parse a manifest (--batch)
+ * Lines: "src<TAB>dest", or "op<TAB>src[<TAB>dest]" when the first field
+ * names an operation; blank lines and lines starting with '#' are skipped.
+ * NUL: src and dest paths for default_op (just the path for checksum).
+ * JSON: an array of objects, or objects one after another, with "op"
+ * (default_op if missing), "src" (or "path") and "dest".
+ * @param manifest: Manifest file, or "-" for stdin
+ * @param format: Manifest encoding
+ * @param default_op: Operation for entries that do not name one
+ * @return Parsed manifest, or NULL (after printing why) if it cannot be
+ *         read or any entry is malformed
+ */
+Batch *batch_load(const char *manifest, BatchFormat format, BatchOp default_op);
+
+/**
+ * Run every entry of a manifest in this process
+ * With -j N all entries share one pool of N workers: directory copies are
+ * enumerated on the calling thread, other entries run as one task each,
+ * so entries run concurrently and must not depend on one another. With
+ * --durable, copies only appear under their destination names once the
+ * whole manifest has run (moved trees excepted). One stats object
+ * collects everything. A failed entry does not stop the
+ * others; one tab-separated result line per entry is printed in manifest
+ * order once all have finished.
+ * @param batch: Manifest from batch_load
+ * @param filter: Compiled include/exclude patterns for copies (can be NULL)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS if every entry succeeded, otherwise the first failed
+ *         entry's error code
+ */
+int batch_run(Batch *batch, const CopyFilter *filter, CopyStats *stats);
+
+/**
+ * Free a manifest
+ * @param batch: Manifest from batch_load (can be NULL)
+ */
+void batch_free(Batch *batch);
+
+#endif // BATCH_H
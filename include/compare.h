@@ -0,0 +1,52 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include "file_operations.h"
+
+// Bytes of each file mapped at a time when comparing through mmap()
+#define COMPARE_MAP_WINDOW (64 * 1024 * 1024)
+
+/**
+ * Find the first byte where two buffers differ
+ * Uses AVX2 or NEON when the CPU has them.
+ * @param a: First buffer
+ * @param b: Second buffer
+ * @param len: Bytes to compare
+ * @return Index of the first differing byte, or len if the buffers are equal
+ */
+size_t compare_buffers(const void *a, const void *b, size_t len);
+
+/**
+ * Describe the comparison kernel selected for this CPU
+ * @return Static string such as "avx2" or "generic"
+ */
+const char *compare_implementation(void);
+
+/**
+ * Compare two files and locate the first difference
+ * Regular files on local filesystems are mapped with MADV_SEQUENTIAL;
+ * network filesystems and special files are read with large buffers.
+ * @param file1: First file path
+ * @param file2: Second file path
+ * @param diff_offset: Receives the offset of the first differing byte
+ *                     (the shorter size if one file is a prefix of the
+ *                     other); can be NULL, which lets files of different
+ *                     sizes be rejected without reading them
+ * @return SUCCESS if identical, ERROR_FILES_DIFFER if different, error code on failure
+ */
+int compare_files_at(const char *file1, const char *file2, off_t *diff_offset);
+
+/**
+ * Compare two open files (see compare_files_at)
+ * Reads with pread() and mmap(), so file offsets are left untouched.
+ * @param fd1: First file descriptor
+ * @param st1: First file status
+ * @param fd2: Second file descriptor
+ * @param st2: Second file status
+ * @param diff_offset: Receives the offset of the first differing byte (can be NULL)
+ * @return SUCCESS if identical, ERROR_FILES_DIFFER if different, error code on failure
+ */
+int compare_fds(int fd1, const struct stat *st1, int fd2, const struct stat *st2,
+                off_t *diff_offset);
+
+#endif // COMPARE_H
@@ -0,0 +1,101 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "file_operations.h"
+
+// Unit of compression: each block becomes a complete gzip member, zstd
+// frame or LZ4 frame, so blocks compress independently on -j workers and
+// the concatenation is still a stream the usual tools decode
+#define COMPRESS_BLOCK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Inline compression stage of the copy path
+ * With --compress, each copied file is read, compressed and written
+ * under its name plus the codec suffix (.gz, .zst, .lz4). Files whose
+ * extension says they are compressed already (archives, images, audio,
+ * video) are copied as they are. With --decompress, sources carrying a
+ * codec suffix and its magic number are unpacked and written without
+ * the suffix; everything else is copied as it is. Codecs are compiled in
+ * when their library was found at build time (USE_ZLIB, USE_ZSTD,
+ * USE_LZ4).
+ */
+
+// What the stage does with one file
+typedef enum {
+    CODING_COPY = 0,        // Plain copy
+    CODING_COMPRESS,
+    CODING_DECOMPRESS
+} CodingAction;
+
+/**
+ * Parse a "--compress" argument: "zstd", "lz4", "gzip", optionally
+ * followed by ":LEVEL"
+ * @param arg: Argument text
+ * @param codec: Receives the codec
+ * @param level: Receives the level (0 when not given)
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown codec or level
+ */
+int parse_compress_codec(const char *arg, CompressCodec *codec, int *level);
+
+/**
+ * Check whether a codec was compiled in
+ * @param codec: Codec
+ * @return 1 if available, 0 otherwise
+ */
+int compress_available(CompressCodec codec);
+
+/**
+ * Get the printable name of a codec
+ * @param codec: Codec
+ * @return Static string such as "zstd"
+ */
+const char *compress_codec_name(CompressCodec codec);
+
+/**
+ * Check whether --compress or --decompress is in effect
+ * @return 1 if files may be rewritten by the stage, 0 otherwise
+ */
+int compress_active(void);
+
+/**
+ * Decide how a file is copied and name its destination
+ * The source name picks the action: a compressed extension keeps a file
+ * out of --compress, a codec suffix (confirmed by the magic number) puts
+ * it through --decompress. The destination gains the suffix, or loses
+ * it, unless it was named that way already.
+ * @param src_fd: Source descriptor (magic numbers are read with pread)
+ * @param src_stat: Source status
+ * @param src_name: Source path or name
+ * @param dest_name: Destination name as the copy would use it
+ * @param coded_name: Receives the destination name for the stage
+ * @param size: Size of coded_name
+ * @param codec: Receives the codec to use
+ * @return CODING_COPY (coded_name is left alone), CODING_COMPRESS or
+ *         CODING_DECOMPRESS
+ */
+CodingAction compress_plan(int src_fd, const struct stat *src_stat, const char *src_name,
+                           const char *dest_name, char *coded_name, size_t size,
+                           CompressCodec *codec);
+
+/**
+ * Copy a file through the compression stage
+ * Compression reads blocks on the calling thread and, for files of at
+ * least two blocks copied outside a worker pool, compresses them on -j
+ * threads while the next blocks are read; output keeps block order.
+ * Decompression is a single stream (any number of concatenated members
+ * or frames).
+ * @param src_fd: Source descriptor at offset 0
+ * @param dest_fd: Destination descriptor (empty)
+ * @param src_stat: Source status
+ * @param action: CODING_COMPRESS or CODING_DECOMPRESS
+ * @param codec: Codec from compress_plan
+ * @param label: Name shown in the progress bar
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param written: Receives the bytes written to the destination
+ * @return SUCCESS on success, ERROR_FILE_READ for a corrupt compressed
+ *         source, other error codes on failure
+ */
+int compress_fd_data(int src_fd, int dest_fd, const struct stat *src_stat, CodingAction action,
+                     CompressCodec codec, const char *label, CopyStats *stats, off_t *written);
+
+#endif // COMPRESS_H
@@ -0,0 +1,123 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include "file_operations.h"
+#include "hash.h"
+
+// Largest request handed to copy_file_range()/sendfile() in one call
+#define ENGINE_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Alignment required for O_DIRECT offsets and lengths
+#define DIRECT_IO_ALIGN 4096
+
+// Files at least this large get readahead/fadvise hints and a preallocated destination
+#define COPY_HINT_MIN_SIZE (1024 * 1024)
+
+// Readahead requested up front; SEQUENTIAL keeps the kernel reading ahead after that
+#define COPY_READAHEAD_SIZE (8 * 1024 * 1024)
+
+// --cache-neutral hands copied data back to the page cache in steps of this size
+#define CACHE_RELEASE_CHUNK (8 * 1024 * 1024)
+
+// Default range size of --split; ranges stay DIRECT_IO_ALIGN-aligned
+#define SPLIT_DEFAULT_SIZE (64 * 1024 * 1024)
+#define SPLIT_MIN_SIZE (1024 * 1024)
+
+// copy_fd_data flags
+#define COPY_FD_DIRECT 0x1      // A descriptor uses O_DIRECT: only reflink or aligned read()/write()
+
+/**
+ * Outcome of copy_fd_data
+ */
+typedef struct {
+    CopyEngine engine;      // Engine that copied the data
+    off_t data_bytes;       // Bytes of file data transferred (holes excluded)
+    int sparse;             // 1 if holes were skipped and recreated
+} CopyFdResult;
+
+/**
+ * Get printable name of a copy engine
+ * @param engine: Engine identifier
+ * @return Static string such as "copy_file_range"
+ */
+const char *copy_engine_name(CopyEngine engine);
+
+/**
+ * Parse an engine name as printed by copy_engine_name
+ * @param name: Engine name ("auto", "reflink", "copy_file_range", ...)
+ * @param engine: Receives the parsed engine
+ * @return SUCCESS on success, ERROR_INVALID_PATH if name is unknown
+ */
+int parse_copy_engine(const char *name, CopyEngine *engine);
+
+/**
+ * Copy all data from one open descriptor to another
+ * Tries FICLONE, copy_file_range(), sendfile() and read()/write() in
+ * that order, starting at the preferred engine, and falls back to the
+ * next one whenever an engine is unsupported for this pair of files.
+ * Sparse sources (fewer blocks allocated than their size) are copied
+ * extent by extent using SEEK_DATA/SEEK_HOLE, leaving holes unwritten.
+ * When hash is given, every byte of the file (holes as zeros) is fed to
+ * it as it passes through the copy buffer; this forces the read()/write()
+ * engine since the in-kernel engines never expose the data.
+ * Unless a descriptor uses O_DIRECT, large sources are read with
+ * sequential readahead and the destination is preallocated with
+ * fallocate; --cache-neutral drops copied ranges of both files from the
+ * page cache as the copy goes (writing the destination back first).
+ * With --split and -j, a file of at least two ranges copied outside a
+ * worker pool is cut into split_size ranges that -j threads copy at
+ * once with copy_file_range() or pread()/pwrite(), sharing one progress
+ * bar.
+ * Both descriptors must be positioned at offset 0.
+ * @param src_fd: Source descriptor (opened for reading)
+ * @param dest_fd: Destination descriptor (opened for writing, empty)
+ * @param src_stat: Source status (size and st_blksize pick the buffer)
+ * @param flags: COPY_FD_* flags
+ * @param label: Name shown in the progress bar
+ * @param hash: Receives the copied data (can be NULL)
+ * @param out: Receives the engine used and bytes transferred (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_fd_data(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                 const char *label, HashContext *hash, CopyFdResult *out);
+
+/**
+ * Copy the data of a file from an offset on (--resume)
+ * Bytes before offset are taken to be in the destination already; the
+ * rest goes over with copy_file_range() (pread()/pwrite() where that is
+ * unsupported or the engine is read_write) at explicit offsets, and the
+ * destination is cut to the source size.
+ * @param src_fd: Source descriptor
+ * @param dest_fd: Destination descriptor (opened for writing)
+ * @param src_stat: Source status
+ * @param offset: First byte to copy
+ * @param flags: COPY_FD_* flags
+ * @param label: Name shown in the progress bar
+ * @param out: Receives the engine used and bytes transferred
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_fd_from(int src_fd, int dest_fd, const struct stat *src_stat, off_t offset, int flags,
+                 const char *label, CopyFdResult *out);
+
+/**
+ * Open a file with O_DIRECT, falling back to buffered I/O
+ * @param path: File path
+ * @param flags: open() flags (O_DIRECT is added)
+ * @param mode: Creation mode
+ * @param direct: Set to 1 if the descriptor uses O_DIRECT, 0 otherwise
+ * @return File descriptor, or -1 on failure
+ */
+int open_direct(const char *path, int flags, mode_t mode, int *direct);
+
+/**
+ * openat() counterpart of open_direct
+ * @param dirfd: Directory descriptor path is relative to (or AT_FDCWD)
+ * @param path: File path
+ * @param flags: open() flags (O_DIRECT is added)
+ * @param mode: Creation mode
+ * @param direct: Set to 1 if the descriptor uses O_DIRECT, 0 otherwise
+ * @return File descriptor, or -1 on failure
+ */
+int openat_direct(int dirfd, const char *path, int flags, mode_t mode, int *direct);
+
+#endif // COPY_ENGINE_H
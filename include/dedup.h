@@ -0,0 +1,75 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "file_operations.h"
+
+// Bytes hashed at each end of a file to tell same-sized files apart
+#define DEDUP_PARTIAL_SIZE (64 * 1024)
+
+/**
+ * Links to earlier copies within one directory copy
+ * Files the source already hardlinks (same device and inode) are linked
+ * again at the destination instead of being expanded into separate
+ * copies. With --dedup, files with identical contents are materialized
+ * from the first copy too: candidates are grouped by size, then by an
+ * XXH64 of their first and last DEDUP_PARTIAL_SIZE bytes, then by a
+ * SHA-256 of the whole file, so only files that might match are read
+ * twice. The table (DedupTable, declared in file_operations.h) is safe
+ * to share between worker threads.
+ */
+
+// A file whose copy later files may link to
+typedef struct DedupEntry DedupEntry;
+
+/**
+ * Parse a dedup mode name ("hardlink", "reflink")
+ * @param name: Mode name
+ * @param mode: Receives the mode
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_dedup_mode(const char *name, DedupMode *mode);
+
+/**
+ * Create an empty table
+ * @param mode: How duplicate contents are materialized (DEDUP_OFF keeps
+ *              only source hardlinks)
+ * @return New table, or NULL if out of memory
+ */
+DedupTable *dedup_table_new(DedupMode mode);
+
+/**
+ * Free a table and everything recorded in it
+ * @param table: Table from dedup_table_new (can be NULL)
+ */
+void dedup_table_free(DedupTable *table);
+
+/**
+ * Create the destination as a link to an earlier copy if it is one
+ * Waits if that copy is still being written by another thread. When no
+ * earlier copy fits (or linking fails), the file is recorded so later
+ * ones can link to it, and the caller copies it as usual.
+ * @param table: Table of the running copy
+ * @param src_fd: Source descriptor at offset 0 (left at offset 0)
+ * @param src_stat: Source status
+ * @param src_path: Source path (reopened to hash earlier candidates)
+ * @param dest_dirfd: Directory descriptor dest_name is relative to
+ * @param dest_name: Destination file to create
+ * @param dest_path: Full destination path, linked to by later files
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param claim: Set when the caller copies the file; report the outcome
+ *               with dedup_finish. NULL if nothing was recorded.
+ * @return 1 if the destination was created as a link, 0 to copy it
+ */
+int dedup_link_file(DedupTable *table, int src_fd, const struct stat *src_stat,
+                    const char *src_path, int dest_dirfd, const char *dest_name,
+                    const char *dest_path, CopyStats *stats, DedupEntry **claim);
+
+/**
+ * Report how copying a claimed file went, waking threads waiting on it
+ * @param table: Table of the running copy
+ * @param claim: Claim from dedup_link_file
+ * @param result: Outcome of the copy (only SUCCESS can be linked to)
+ */
+void dedup_finish(DedupTable *table, DedupEntry *claim, int result);
+
+#endif // DEDUP_H
@@ -0,0 +1,101 @@
+#ifndef DIR_LIST_H
+#define DIR_LIST_H
+
+#include "file_operations.h"
+#include "path_arena.h"
+
+// Bytes of formatted listing collected before each write to the stream
+#define LIST_OUTPUT_BUFFER (64 * 1024)
+
+// Entries per page of the file explorer
+#define BROWSE_PAGE_SIZE 100
+
+/**
+ * Directory listing engine
+ * Entries come from getdents64() batches and are only stat()ed for what
+ * is shown or sorted on: statx() is asked for the fields in use, without
+ * following symlinks (which are listed as links) and without forcing a
+ * sync on network filesystems. Sorting by name needs no stat at all, so
+ * only the page being shown is stat()ed. Unsorted listings are written as
+ * each batch arrives, so a directory of millions of entries starts
+ * printing at once; everything past the page is only counted.
+ */
+
+/**
+ * Listing order
+ */
+typedef enum {
+    LIST_SORT_NONE = 0,     // As the filesystem returns entries (streamed)
+    LIST_SORT_NAME,         // By name, byte order
+    LIST_SORT_SIZE,         // Largest first; directories count as empty
+    LIST_SORT_TIME          // Newest first
+} ListSort;
+
+/**
+ * Which entries to list, in which order
+ */
+typedef struct {
+    ListSort sort;
+    int reverse;            // Reverse the order (not with LIST_SORT_NONE)
+    size_t skip;            // Entries to skip before the page
+    size_t limit;           // Entries on the page (0 for all)
+} ListOptions;
+
+/**
+ * One listed entry
+ * Fields not asked for stay 0; mode always carries at least the type.
+ */
+typedef struct {
+    const DirEntry *entry;
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+} ListItem;
+
+/**
+ * One page of a directory
+ */
+typedef struct {
+    ListItem *items;
+    size_t count;           // Items on the page
+    size_t total;           // Entries in the directory
+} ListPage;
+
+/**
+ * Set listing options to the defaults (directory order, everything)
+ * @param options: Options to initialize
+ */
+void init_list_options(ListOptions *options);
+
+/**
+ * Parse a sort key name ("none", "name", "size", "time")
+ * @param name: Key name
+ * @param sort: Receives the order
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_list_sort(const char *name, ListSort *sort);
+
+/**
+ * Read one page of a directory, sorted
+ * Entries that vanish before they are stat()ed are left out.
+ * @param dir_fd: Directory opened with O_RDONLY | O_DIRECTORY
+ * @param options: Sort order and page
+ * @param mask: STATX_* fields the caller needs for the page; sizes of
+ *              directories are not fetched
+ * @param arena: Arena the page is allocated from
+ * @param page: Receives the page
+ * @return SUCCESS, or ERROR_DIR_OPEN if reading or allocating failed
+ */
+int list_page_read(int dir_fd, const ListOptions *options, unsigned int mask, Arena *arena,
+                   ListPage *page);
+
+/**
+ * List directory contents with details
+ * @param path: Directory path to list
+ * @param options: Sort order and page (NULL for the defaults)
+ * @param out: Stream to write the listing to
+ * @return SUCCESS on success, error code on failure
+ */
+int list_directory(const char *path, const ListOptions *options, FILE *out);
+
+#endif // DIR_LIST_H
@@ -0,0 +1,104 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include "file_operations.h"
+#include <limits.h>
+
+/**
+ * Crash-safe copies (--durable)
+ * Each file is written under a temporary name in its destination
+ * directory and only renamed into place once its data is on disk, so
+ * after a crash a destination name holds either the old file or the
+ * complete new one. Instead of an fsync per file, committed files wait in
+ * a batch: writeback is started as each file is committed, and once
+ * DURABLE_BATCH_FILES files or DURABLE_BATCH_BYTES bytes are waiting, the
+ * whole batch is made durable with one syncfs per filesystem (or an
+ * fdatasync per file), renamed, and each parent directory is fsynced once.
+ */
+
+#define DURABLE_BATCH_FILES 256
+#define DURABLE_BATCH_BYTES (256L * 1024 * 1024)
+
+/**
+ * A destination file being written under its temporary name
+ */
+typedef struct {
+    int dir_fd;                     // Directory holding both names (owned)
+    char name[NAME_MAX + 1];        // Final name
+    char temp[NAME_MAX + 1];        // Name written until the batch commits
+} DurableFile;
+
+/**
+ * Source file of a move, unlinked only once its copy is durable
+ */
+typedef struct {
+    int dirfd;                      // Directory the name is relative to
+    const char *name;               // Source name
+} DurableSource;
+
+/**
+ * Parse a durability mode name ("syncfs", "fdatasync")
+ * @param name: Mode name
+ * @param mode: Receives the mode
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_durable_mode(const char *name, DurableMode *mode);
+
+/**
+ * Create the temporary file a destination is written to
+ * @param file: Receives the directory and both names
+ * @param dirfd: Directory path is relative to (or AT_FDCWD; O_PATH is fine)
+ * @param path: Final destination path
+ * @param direct: Open with O_DIRECT if the filesystem allows it
+ * @param direct_used: Set to 1 if the descriptor uses O_DIRECT (can be NULL)
+ * @return Descriptor of the new file, or -1 (errno set) on failure
+ */
+int durable_open(DurableFile *file, int dirfd, const char *path, int direct, int *direct_used);
+
+/**
+ * Hand a fully written file to the current batch
+ * Takes ownership of fd and file->dir_fd. The file keeps its temporary
+ * name until the batch is flushed, which may happen right here on the
+ * calling thread when this file fills the batch.
+ * @param file: File from durable_open
+ * @param fd: Its descriptor
+ * @param size: Bytes written, counted towards DURABLE_BATCH_BYTES
+ * @param source: Move source to unlink after the rename (can be NULL)
+ * @return SUCCESS, or an error code if the file could not be queued and
+ *         had to be (but could not be) made durable on its own
+ */
+int durable_commit(DurableFile *file, int fd, off_t size, const DurableSource *source);
+
+/**
+ * Throw away a file that failed before its commit
+ * @param file: File from durable_open
+ * @param fd: Its descriptor (closed), or -1
+ */
+void durable_abort(DurableFile *file, int fd);
+
+/**
+ * Keep operations from flushing when they finish (batch mode holds while
+ * its entries run, then flushes once); holds nest
+ */
+void durable_hold(void);
+
+/**
+ * Undo one durable_hold (does not flush)
+ */
+void durable_release(void);
+
+/**
+ * Check whether finished operations should leave their files pending
+ * @return 1 while any hold is in place, 0 otherwise
+ */
+int durable_held(void);
+
+/**
+ * Make every committed file durable and rename it into place
+ * @param stats: Statistics charged with the fsync time (can be NULL)
+ * @return SUCCESS, or ERROR_FILE_WRITE if any file committed since the
+ *         last call could not be synced or renamed
+ */
+int durable_flush(CopyStats *stats);
+
+#endif // DURABLE_H
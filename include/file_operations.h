@@ -12,10 +12,15 @@
 #include <fcntl.h>
 #include <time.h>
 
-// Buffer size for file operations
-#define BUFFER_SIZE 8192
+// Buffer sizes for file operations (see io_buffer_size)
+#define BUFFER_SIZE 8192                     // Fallback when the size is unknown
+#define MIN_LARGE_BUFFER (1024 * 1024)       // Smallest buffer for large files
+#define MAX_BUFFER_SIZE (16 * 1024 * 1024)   // Largest buffer for any file
 #define MAX_PATH 4096
 
+// Files at least this large are opened with O_DIRECT in --direct mode
+#define DIRECT_IO_MIN_SIZE (4 * 1024 * 1024)
+
 // Return codes
 #define SUCCESS 0
 #define ERROR_FILE_OPEN -1
@@ -26,9 +31,151 @@
 #define ERROR_INVALID_PATH -6
 #define ERROR_MOVE_FAILED -7
 #define ERROR_FILES_DIFFER -8
+#define ERROR_VERIFY_FAILED -9
+
+/**
+ * Data transfer engines, in the order copy_file tries them
+ */
+typedef enum {
+    COPY_ENGINE_AUTO = 0,        // Try every engine below, fastest first
+    COPY_ENGINE_REFLINK,         // FICLONE ioctl (shares extents, btrfs/XFS)
+    COPY_ENGINE_COPY_FILE_RANGE, // copy_file_range() in-kernel copy
+    COPY_ENGINE_SENDFILE,        // sendfile() in-kernel copy
+    COPY_ENGINE_READ_WRITE,      // Userspace read()/write() loop
+    COPY_ENGINE_IO_URING,        // Batched io_uring requests (small files only)
+    COPY_ENGINE_COUNT
+} CopyEngine;
+
+/**
+ * How progress is rendered
+ */
+typedef enum {
+    PROGRESS_AUTO = 0,      // Per-file bars on a TTY (tree-wide with -j), none otherwise
+    PROGRESS_NONE,          // No progress output
+    PROGRESS_FILE,          // One bar for the file being copied
+    PROGRESS_TREE           // One line of totals for the whole operation
+} ProgressMode;
+
+/**
+ * Checksum algorithms
+ */
+typedef enum {
+    HASH_MD5 = 0,           // MD5 (RFC 1321), compatible with md5sum
+    HASH_SHA256,            // SHA-256, compatible with sha256sum
+    HASH_XXH64,             // XXH64, fast non-cryptographic integrity check
+    HASH_COUNT
+} HashAlgorithm;
+
+/**
+ * How a copy is checked against the data that was written (--verify)
+ */
+typedef enum {
+    VERIFY_NONE = 0,        // Trust the copy
+    VERIFY_CACHED,          // Re-read the destination, page cache allowed
+    VERIFY_DROP,            // Write back and drop the destination from the cache first
+    VERIFY_DIRECT           // Re-read the destination with O_DIRECT
+} VerifyMode;
+
+/**
+ * When an existing destination file counts as up to date (--sync)
+ */
+typedef enum {
+    SYNC_OFF = 0,           // Always copy
+    SYNC_MTIME,             // Skip if size and modification time match
+    SYNC_CHECKSUM           // Skip if contents match
+} SyncMode;
+
+/**
+ * How --durable makes a batch of copies safe before renaming them into place
+ */
+typedef enum {
+    DURABLE_OFF = 0,        // Write destinations in place, leave writeback to the kernel
+    DURABLE_SYNCFS,         // One syncfs per destination filesystem per batch
+    DURABLE_FDATASYNC       // One fdatasync per file (filesystems shared with other writers)
+} DurableMode;
+
+/**
+ * How a directory copy materializes files with identical contents (--dedup)
+ */
+typedef enum {
+    DEDUP_OFF = 0,          // Copy every file (source hardlinks are still kept)
+    DEDUP_HARDLINK,         // Hardlink duplicates to the first copy
+    DEDUP_REFLINK           // FICLONE the first copy: shared extents, separate files
+} DedupMode;
+
+/**
+ * Codec of the inline compression stage (--compress, --decompress)
+ */
+typedef enum {
+    COMPRESS_NONE = 0,      // Plain copies
+    COMPRESS_GZIP,          // zlib, one gzip member per block
+    COMPRESS_ZSTD,          // One zstd frame per block
+    COMPRESS_LZ4,           // One LZ4 frame per block
+    COMPRESS_CODEC_COUNT
+} CompressCodec;
+
+/**
+ * Order in which a directory walk visits the entries of a directory (--order)
+ */
+typedef enum {
+    WALK_ORDER_DIRECTORY = 0,   // As the filesystem returns them (hash order on ext4)
+    WALK_ORDER_INODE,           // By inode number, which tracks disk position
+    WALK_ORDER_EXTENT           // By physical offset of the first extent (FIEMAP)
+} WalkOrder;
+
+// Minimum time between progress redraws (10 Hz)
+#define PROGRESS_INTERVAL_NS 100000000L
+
+/**
+ * Process-wide copy options (set once from the command line or menu)
+ */
+typedef struct {
+    CopyEngine engine;      // Preferred engine, COPY_ENGINE_AUTO to probe
+    int jobs;               // Worker threads for directory copies (-j)
+    int use_io_uring;       // Batch small files through io_uring if built in
+    int queue_depth;        // Files kept in flight per io_uring instance
+    int direct_io;          // Bypass the page cache for large files (--direct)
+    ProgressMode progress;  // Progress output (--progress)
+    HashAlgorithm hash;     // Checksum algorithm (--hash)
+    VerifyMode verify;      // Hash while copying, then re-read the destination (--verify)
+    SyncMode sync;          // Skip or patch up-to-date destination files (--sync)
+    int delete_extraneous;  // Remove destination entries missing from the source (--delete)
+    const char *index_path; // Metadata index of the last run (--index), NULL for none
+    int index_trust_dirs;   // Sync unchanged directories from the index alone
+    const char *stats_json; // Write statistics as JSON here (--stats-json), "-" for stdout
+    size_t buffer_size;     // Fixed I/O buffer size (--buffer-size), 0 to size per file
+    DurableMode durable;    // Temp file, batched sync, then rename (--durable)
+    int cache_neutral;      // Drop copied data of both files from the page cache
+    DedupMode dedup;        // Link duplicate files within a directory copy (--dedup)
+    int tree_hash;          // Checksums are tree hashes of 4 MB chunks (--tree-hash)
+    size_t split_size;      // Copy large files as ranges this size with -j threads, 0 off
+    CompressCodec compress; // Write copies compressed with this codec (--compress)
+    int compress_level;     // Codec level, 0 for the codec's default
+    int decompress;         // Unpack compressed sources while copying (--decompress)
+    WalkOrder order;        // Entry order of directory walks (--order)
+    const char *resume_path; // Checkpoint journal (--resume), NULL for none
+    unsigned long long bwlimit;    // Bytes per second (--bwlimit), 0 unlimited
+    unsigned long long iops_limit; // Requests per second (--iops-limit), 0 unlimited
+    const char *limit_file; // Limits re-read while copying (--limit-file), NULL for none
+} CopyOptions;
+
+/**
+ * Initialize copy options with defaults
+ * @param opts: Pointer to CopyOptions structure
+ */
+void init_copy_options(CopyOptions *opts);
+
+/**
+ * Replace the active copy options
+ * @param opts: Options to copy into the active set
+ */
+void set_copy_options(const CopyOptions *opts);
 
-// Pattern matching
-#define MAX_PATTERNS 10
+/**
+ * Get the active copy options
+ * @return Pointer to the active options (never NULL)
+ */
+const CopyOptions *get_copy_options(void);
 
 /**
  * Copy a single file from source to destination
@@ -40,6 +187,90 @@
  */
 int copy_file(const char *src_path, const char *dest_path);
 
+/**
+ * Forward declaration, see NEW FEATURES - Progress Statistics
+ */
+typedef struct CopyStats CopyStats;
+
+/**
+ * Forward declaration, see dedup.h
+ */
+typedef struct DedupTable DedupTable;
+
+/**
+ * Copy a single file and record it in statistics
+ * @param src_path: Source file path
+ * @param dest_path: Destination file path or directory (see copy_file)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_file_with_stats(const char *src_path, const char *dest_path, CopyStats *stats);
+
+/**
+ * Copy one file found by a directory walk
+ * Names are resolved with openat() against the directory descriptors
+ * (AT_FDCWD and full paths work too). dest_name is always the file to
+ * create: unlike copy_file, no stat() checks whether it is a directory.
+ * @param src_dirfd: Directory descriptor src_name is relative to
+ * @param src_name: Source file name
+ * @param src_stat: Source status from the walk, or NULL to fstat() after opening
+ * @param dest_dirfd: Directory descriptor dest_name is relative to
+ * @param dest_name: Destination file name
+ * @param label: Source path shown in progress output
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param dest_path: Full destination path, if links may point at this copy
+ * @param links: Earlier copies of the same walk to link to (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_file_at(int src_dirfd, const char *src_name, const struct stat *src_stat,
+                 int dest_dirfd, const char *dest_name, const char *label, CopyStats *stats,
+                 const char *dest_path, DedupTable *links);
+
+/**
+ * Move one file found by a directory walk to another filesystem
+ * The copy is verified against what reached the disk (at least
+ * VERIFY_DROP) before the source is unlinked. A symlink is recreated
+ * rather than followed.
+ * @param src_dirfd: Directory descriptor src_name is relative to
+ * @param src_name: Source file name
+ * @param src_stat: Source status from the walk, or NULL
+ * @param dest_dirfd: Directory descriptor dest_name is relative to
+ * @param dest_name: Destination file name
+ * @param label: Source path shown in progress output
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure (the source is kept)
+ */
+int move_file_at(int src_dirfd, const char *src_name, const struct stat *src_stat,
+                 int dest_dirfd, const char *dest_name, const char *label, CopyStats *stats);
+
+// walk_entry_type results
+#define WALK_ERROR -1
+#define WALK_FILE 0
+#define WALK_DIR 1
+
+/**
+ * Classify a directory entry, using d_type whenever the filesystem fills it
+ * Only DT_UNKNOWN entries and symlinks (followed, as stat() would) cost an
+ * fstatat() call; its result is returned so the caller need not stat again.
+ * @param dirfd: Descriptor of the directory being read
+ * @param name: Entry name
+ * @param d_type: Entry type from readdir() (DT_UNKNOWN if not known)
+ * @param st: Receives the entry status when *have_stat is set
+ * @param have_stat: Set to 1 if st was filled in, 0 otherwise
+ * @return WALK_DIR, WALK_FILE, or WALK_ERROR if the entry cannot be stat'ed
+ */
+int walk_entry_type(int dirfd, const char *name, unsigned char d_type, struct stat *st,
+                    int *have_stat);
+
+/**
+ * Check whether a directory entry is a symbolic link
+ * @param dirfd: Descriptor of the directory being read
+ * @param name: Entry name
+ * @param d_type: Entry type from readdir() (DT_UNKNOWN if not known)
+ * @return 1 for a symlink, 0 otherwise (fstatat() only for DT_UNKNOWN)
+ */
+int walk_entry_is_symlink(int dirfd, const char *name, unsigned char d_type);
+
 /**
  * Copy a directory recursively from source to destination
  * @param src_path: Source directory path
@@ -48,6 +279,15 @@ int copy_file(const char *src_path, const char *dest_path);
  */
 int copy_directory(const char *src_path, const char *dest_path);
 
+/**
+ * Copy a directory recursively and record it in statistics
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_directory_with_stats(const char *src_path, const char *dest_path, CopyStats *stats);
+
 /**
  * Check if a path is a directory
  * @param path: Path to check
@@ -76,6 +316,33 @@ int create_directory(const char *path);
  */
 long get_file_size(const char *path);
 
+/**
+ * Choose an I/O buffer size for a file
+ * Small files get a buffer that holds them in one read; larger files get
+ * 1-16 MB. The result is a multiple of the page size and st_blksize.
+ * A --buffer-size setting replaces the choice (still rounded up).
+ * @param st: File status (NULL if unknown)
+ * @return Buffer size in bytes
+ */
+size_t io_buffer_size(const struct stat *st);
+
+/**
+ * Allocate a page-aligned I/O buffer (suitable for O_DIRECT)
+ * @param size: Buffer size in bytes
+ * @return Buffer to release with free(), or NULL on failure
+ */
+void *io_buffer_alloc(size_t size);
+
+/**
+ * Read at an offset until the buffer is full or end of file
+ * @param fd: Descriptor opened for reading
+ * @param buffer: Destination buffer
+ * @param size: Bytes wanted
+ * @param offset: File offset to read from
+ * @return Bytes read (short only at end of file), or -1 on error
+ */
+ssize_t pread_full(int fd, void *buffer, size_t size, off_t offset);
+
 /**
  * Print error message based on error code
  * @param error_code: Error code from operations
@@ -83,6 +350,15 @@ long get_file_size(const char *path);
  */
 void print_error(int error_code, const char *context);
 
+/**
+ * Describe an error code as print_error does, without the context
+ * @param error_code: Error code from operations
+ * @param saved_errno: errno at the time of the failure
+ * @param buffer: Receives the message
+ * @param size: Size of buffer
+ */
+void format_error(int error_code, int saved_errno, char *buffer, size_t size);
+
 /**
  * Display copy progress
  * @param current: Current bytes copied
@@ -91,22 +367,103 @@ void print_error(int error_code, const char *context);
  */
 void display_progress(long current, long total, const char *filename);
 
+/**
+ * Display tree-wide progress from statistics (PROGRESS_TREE mode only)
+ * Redraws at most every PROGRESS_INTERVAL_NS unless forced.
+ * @param stats: Statistics of the running operation
+ * @param force: 1 to redraw regardless of the rate limit
+ */
+void display_tree_progress(const CopyStats *stats, int force);
+
+/**
+ * Terminate the progress line, if one is on screen
+ */
+void finish_progress(void);
+
+/**
+ * Resolve PROGRESS_AUTO against stdout and the job count
+ * @return Progress mode in effect
+ */
+ProgressMode effective_progress_mode(void);
+
+/**
+ * Read the monotonic clock
+ * @return Nanoseconds since an arbitrary fixed point
+ */
+long monotonic_ns(void);
+
+/**
+ * Enable or disable per-file progress output for the calling thread
+ * (worker threads of a parallel copy run with progress disabled)
+ * @param enabled: 1 to show progress, 0 to hide it
+ */
+void set_progress_enabled(int enabled);
+
+/**
+ * Check whether per-file progress is shown on the calling thread
+ * @return 1 if enabled, 0 otherwise
+ */
+int progress_enabled(void);
+
 // ============================================================================
 // NEW FEATURES - Progress Statistics
 // ============================================================================
 
+/**
+ * Where copy time goes (see stats.h for how it is measured)
+ */
+typedef enum {
+    STATS_WALK = 0,         // Opening, creating and stat'ing directories and entries
+    STATS_OPEN,             // Opening and closing files
+    STATS_READ,             // read()/pread()
+    STATS_WRITE,            // write()/pwrite() and in-kernel copies
+    STATS_FSYNC,            // Flushing data to disk
+    STATS_METADATA,         // fstat, permissions, times, sizes, hole lookups
+    STATS_HASH,             // Checksumming in userspace (not syscalls)
+    STATS_THROTTLE,         // Waiting for --bwlimit/--iops-limit
+    STATS_PHASE_COUNT
+} StatsPhase;
+
+// Per-file copy time histogram: bucket 0 is under 1 us, bucket i >= 1
+// holds [2^(i-1), 2^i) us, and the last bucket everything slower
+#define STATS_LATENCY_BUCKETS 32
+
 /**
  * Structure to hold copy statistics
+ * Fields are atomic so worker threads of a parallel copy can update
+ * one shared structure.
  */
-typedef struct {
-    long total_files;
-    long total_dirs;
-    long total_bytes;
-    long copied_bytes;
-    time_t start_time;
-    time_t current_time;
-    double transfer_speed;  // bytes per second
-} CopyStats;
+struct CopyStats {
+    _Atomic long total_files;
+    _Atomic long total_dirs;
+    _Atomic long total_bytes;       // logical size of copied files
+    _Atomic long physical_bytes;    // file data actually transferred (holes excluded)
+    _Atomic long sparse_files;      // files copied with their holes preserved
+    _Atomic long verified_files;    // files whose destination was re-read and matched
+    _Atomic long skipped_files;     // files already up to date (--sync)
+    _Atomic long skipped_bytes;
+    _Atomic long delta_files;       // files patched in place (only changed blocks written)
+    _Atomic long deleted_files;     // extraneous destination entries removed (--delete)
+    _Atomic long linked_files;      // source hardlinks recreated instead of copied
+    _Atomic long deduped_files;     // duplicate contents linked to an earlier copy (--dedup)
+    _Atomic long deduped_bytes;     // logical size of linked files, not written again
+    _Atomic long compressed_files;  // files written compressed (--compress)
+    _Atomic long decompressed_files; // compressed sources written plain (--decompress)
+    _Atomic long plain_bytes;       // uncompressed side of those files
+    _Atomic long packed_bytes;      // compressed side of those files
+    _Atomic long codec_cpu_ns;      // CPU time spent compressing and decompressing
+    _Atomic long resumed_files;     // partial copies continued from a checkpoint (--resume)
+    _Atomic long resumed_bytes;     // bytes of those files not copied again
+    _Atomic long copied_bytes;
+    long start_ns;                  // CLOCK_MONOTONIC at init_stats
+    _Atomic long current_ns;        // CLOCK_MONOTONIC at the last update
+    _Atomic double transfer_speed;  // bytes per second
+    _Atomic long engine_files[COPY_ENGINE_COUNT];  // files copied by each engine
+    _Atomic long phase_ns[STATS_PHASE_COUNT];      // time spent in each phase
+    _Atomic long phase_calls[STATS_PHASE_COUNT];   // calls timed in each phase
+    _Atomic long file_latency[STATS_LATENCY_BUCKETS];
+    _Atomic long file_latency_max_ns;
+};
 
 /**
  * Initialize copy statistics
@@ -127,6 +484,13 @@ void update_stats(CopyStats *stats, long bytes);
  */
 void display_stats(const CopyStats *stats);
 
+/**
+ * Get the wall-clock time between init_stats and the last update
+ * @param stats: Pointer to CopyStats structure
+ * @return Elapsed nanoseconds
+ */
+long stats_elapsed_ns(const CopyStats *stats);
+
 /**
  * Calculate transfer speed
  * @param stats: Pointer to CopyStats structure
@@ -146,7 +510,7 @@ long estimate_time_remaining(const CopyStats *stats);
 // ============================================================================
 
 /**
- * Compare two files byte-by-byte
+ * Compare two files byte-by-byte (see compare_files_at for the offset)
  * @param file1: First file path
  * @param file2: Second file path
  * @return SUCCESS if identical, ERROR_FILES_DIFFER if different, error code on failure
@@ -161,10 +525,24 @@ int compare_files(const char *file1, const char *file2);
  */
 int calculate_md5(const char *filepath, char *checksum);
 
+/**
+ * Calculate a checksum of a file with the given algorithm
+ * With --tree-hash the result is the tree hash of parallel_hash.h,
+ * computed by -j workers unless called from a pool worker.
+ * @param filepath: Path to file
+ * @param algorithm: Checksum algorithm
+ * @param checksum: Buffer to store hex checksum (must be at least 65 bytes)
+ * @return SUCCESS on success, error code on failure
+ */
+int calculate_checksum(const char *filepath, HashAlgorithm algorithm, char *checksum);
+
 /**
  * Verify file integrity using checksum
+ * The algorithm is chosen from the checksum length (32 hex digits: MD5,
+ * 64: SHA-256, 16: XXH64), falling back to the --hash option. With
+ * --tree-hash the expected checksum is a tree hash.
  * @param filepath: Path to file
- * @param expected_checksum: Expected MD5 checksum
+ * @param expected_checksum: Expected hex checksum (case-insensitive)
  * @return SUCCESS if match, ERROR_FILES_DIFFER if mismatch, error code on failure
  */
 int verify_checksum(const char *filepath, const char *expected_checksum);
@@ -183,6 +561,10 @@ int move_file(const char *src_path, const char *dest_path);
 
 /**
  * Move a directory from source to destination
+ * Across filesystems, each file is unlinked as soon as its copy is
+ * verified (with -j, by the worker that copied it), so the move never
+ * holds two full copies of the tree; emptied source directories are
+ * removed at the end. Files that fail stay in the source.
  * @param src_path: Source directory path
  * @param dest_path: Destination directory path
  * @return SUCCESS on success, error code on failure
@@ -190,7 +572,27 @@ int move_file(const char *src_path, const char *dest_path);
 int move_directory(const char *src_path, const char *dest_path);
 
 /**
- * Remove directory recursively
+ * Move a file and record any copy it needs in statistics
+ * A rename within one filesystem moves no data and is not counted.
+ * @param src_path: Source file path
+ * @param dest_path: Destination file path
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int move_file_with_stats(const char *src_path, const char *dest_path, CopyStats *stats);
+
+/**
+ * Move a directory and record any copy it needs in statistics
+ * Called from a pool worker (batch mode), the tree is moved on that thread.
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int move_directory_with_stats(const char *src_path, const char *dest_path, CopyStats *stats);
+
+/**
+ * Remove directory recursively (in parallel with -j, see tree_remove.h)
  * @param path: Directory path to remove
  * @return SUCCESS on success, error code on failure
  */
@@ -200,6 +602,11 @@ int remove_directory(const char *path);
 // NEW FEATURES - Pattern Matching & Filtering
 // ============================================================================
 
+/**
+ * Compiled include/exclude patterns (see filter.h)
+ */
+typedef struct CopyFilter CopyFilter;
+
 /**
  * Check if filename matches pattern
  * @param filename: Filename to check
@@ -234,6 +641,18 @@ int copy_directory_filtered(const char *src_path, const char *dest_path,
                             const char **include_patterns, const char **exclude_patterns,
                             CopyStats *stats);
 
+/**
+ * Copy directory through a compiled filter
+ * Excluded directories are pruned without being opened.
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param filter: Compiled patterns (NULL copies everything)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int copy_directory_with_filter(const char *src_path, const char *dest_path,
+                               const CopyFilter *filter, CopyStats *stats);
+
 /**
  * Check if file should be copied based on patterns
  * @param filename: Filename to check
@@ -244,15 +663,9 @@ int copy_directory_filtered(const char *src_path, const char *dest_path,
 int should_copy_file(const char *filename, const char **include_patterns,
                      const char **exclude_patterns);
 
-/**
- * List directory contents with details
- * @param path: Directory path to list
- * @return SUCCESS on success, error code on failure
- */
-int list_directory(const char *path);
-
 /**
  * Browse filesystem interactively (simple file explorer)
+ * Entries are listed by name, BROWSE_PAGE_SIZE at a time.
  * @param start_path: Starting directory path
  */
 void browse_filesystem(const char *start_path);
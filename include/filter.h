@@ -0,0 +1,114 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "file_operations.h"
+
+/**
+ * Compiled include/exclude pattern sets
+ * Patterns are fnmatch() globs. Without a '/' they match entry names at
+ * any depth: literal names go into a hash table and "*suffix" /
+ * "prefix*" patterns into tries, so matching costs about one pass over
+ * the name whatever the number of patterns; only the remaining globs are
+ * tried one by one. A pattern containing a '/' is anchored at the copy
+ * root and matched against the relative path segment by segment, where
+ * a segment that is just "**" spans any number of directories, and a
+ * trailing one matches everything inside the directory before it. A
+ * leading "**" segment is dropped, since what is left then matches at
+ * any depth anyway.
+ *
+ * Exclude patterns follow .gitignore rules: a match prunes directories
+ * as well as files, a trailing '/' matches directories only, and a
+ * leading '!' re-includes what an earlier pattern excluded (the last
+ * matching pattern wins). Include patterns select files; directories
+ * are descended into unless every include pattern is anchored and none
+ * can match below them.
+ *
+ * A CopyFilter is read-only once built and may be shared by threads.
+ */
+
+/**
+ * Create an empty filter (copies everything)
+ * @return New filter, or NULL if out of memory
+ */
+CopyFilter *filter_create(void);
+
+/**
+ * Create a filter from NULL-terminated pattern arrays
+ * @param include_patterns: Include patterns (can be NULL)
+ * @param exclude_patterns: Exclude patterns (can be NULL)
+ * @return New filter, or NULL if out of memory
+ */
+CopyFilter *filter_from_patterns(const char **include_patterns, const char **exclude_patterns);
+
+/**
+ * Add an include pattern
+ * @param filter: Filter being built
+ * @param pattern: Glob matched against file names or relative paths
+ * @return SUCCESS on success, error code on failure
+ */
+int filter_add_include(CopyFilter *filter, const char *pattern);
+
+/**
+ * Add an exclude pattern (see the rules above)
+ * @param filter: Filter being built
+ * @param pattern: Glob, optionally with a leading '!' or trailing '/'
+ * @return SUCCESS on success, error code on failure
+ */
+int filter_add_exclude(CopyFilter *filter, const char *pattern);
+
+/**
+ * Add the exclude patterns of a .gitignore-style file
+ * Blank lines and lines starting with '#' are skipped, unescaped
+ * trailing spaces are dropped, and "\#" / "\!" start a literal pattern.
+ * @param filter: Filter being built
+ * @param path: Pattern file
+ * @return SUCCESS on success, ERROR_FILE_OPEN if the file cannot be read
+ */
+int filter_load_excludes(CopyFilter *filter, const char *path);
+
+/**
+ * Check whether a filter has any patterns
+ * @param filter: Filter (can be NULL)
+ * @return 1 if some entries may be filtered out, 0 otherwise
+ */
+int filter_active(const CopyFilter *filter);
+
+/**
+ * Check whether a filter copies only selected files (include patterns)
+ * Directories left without matching files are then not created.
+ * @param filter: Filter (can be NULL)
+ * @return 1 if there are include patterns, 0 otherwise
+ */
+int filter_selects_files(const CopyFilter *filter);
+
+/**
+ * Decide whether a file is copied
+ * @param filter: Filter (NULL copies everything)
+ * @param path: Path relative to the copy root ("dir/file.txt")
+ * @return 1 to copy, 0 to skip
+ */
+int filter_wants_file(const CopyFilter *filter, const char *path);
+
+/**
+ * Decide whether a directory is descended into
+ * @param filter: Filter (NULL descends everywhere)
+ * @param path: Path relative to the copy root
+ * @return 1 to descend, 0 to prune the whole subtree
+ */
+int filter_wants_dir(const CopyFilter *filter, const char *path);
+
+/**
+ * Get the part of a walked path below the copy root
+ * @param path: Path that starts with the root
+ * @param root_len: Length of the root path the walk started from
+ * @return Relative path within path (without leading slashes)
+ */
+const char *filter_relative_path(const char *path, size_t root_len);
+
+/**
+ * Free a filter
+ * @param filter: Filter to free (can be NULL)
+ */
+void filter_free(CopyFilter *filter);
+
+#endif // FILTER_H
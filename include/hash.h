@@ -0,0 +1,132 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "file_operations.h"
+#include <stdint.h>
+
+// Largest digest produced by any algorithm (SHA-256)
+#define HASH_MAX_DIGEST 32
+
+// Buffer size for a hex digest including the terminating NUL
+#define HASH_MAX_HEX (HASH_MAX_DIGEST * 2 + 1)
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Md5Context;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256Context;
+
+typedef struct {
+    uint64_t acc[4];
+    uint64_t length;
+    unsigned char block[32];
+    size_t used;
+} Xxh64Context;
+
+/**
+ * Streaming hash state for any supported algorithm
+ */
+typedef struct {
+    HashAlgorithm algorithm;
+    union {
+        Md5Context md5;
+        Sha256Context sha256;
+        Xxh64Context xxh64;
+    } u;
+} HashContext;
+
+/**
+ * Start a new hash computation
+ * @param ctx: Hash state to initialize
+ * @param algorithm: Algorithm to use
+ */
+void hash_init(HashContext *ctx, HashAlgorithm algorithm);
+
+/**
+ * Feed data into a hash
+ * @param ctx: Hash state
+ * @param data: Bytes to hash
+ * @param len: Number of bytes
+ */
+void hash_update(HashContext *ctx, const void *data, size_t len);
+
+/**
+ * Finish a hash computation
+ * @param ctx: Hash state (must be initialized again before reuse)
+ * @param digest: Receives the digest (at least HASH_MAX_DIGEST bytes)
+ * @return Digest length in bytes
+ */
+size_t hash_final(HashContext *ctx, unsigned char *digest);
+
+/**
+ * Finish a hash computation as lower-case hex
+ * @param ctx: Hash state
+ * @param hex: Receives the digest (at least HASH_MAX_HEX bytes)
+ */
+void hash_final_hex(HashContext *ctx, char *hex);
+
+/**
+ * Format a digest as lower-case hex
+ * @param digest: Digest bytes
+ * @param len: Digest length
+ * @param hex: Receives the hex digest (at least len * 2 + 1 bytes)
+ */
+void hash_to_hex(const unsigned char *digest, size_t len, char *hex);
+
+/**
+ * Get digest length of an algorithm
+ * @param algorithm: Algorithm
+ * @return Digest length in bytes
+ */
+size_t hash_digest_size(HashAlgorithm algorithm);
+
+/**
+ * Get printable name of an algorithm
+ * @param algorithm: Algorithm
+ * @return Static string such as "sha256"
+ */
+const char *hash_name(HashAlgorithm algorithm);
+
+/**
+ * Parse an algorithm name as printed by hash_name
+ * @param name: Algorithm name ("md5", "sha256", "xxh64")
+ * @param algorithm: Receives the parsed algorithm
+ * @return SUCCESS on success, ERROR_INVALID_PATH if name is unknown
+ */
+int parse_hash_algorithm(const char *name, HashAlgorithm *algorithm);
+
+/**
+ * Describe the implementation selected for this CPU
+ * @param algorithm: Algorithm
+ * @return Static string such as "sha-ni" or "generic"
+ */
+const char *hash_implementation(HashAlgorithm algorithm);
+
+/**
+ * Feed everything from a descriptor's current offset to end of file into a hash
+ * O_DIRECT descriptors are dropped to buffered reads if the kernel
+ * refuses an unaligned request.
+ * @param fd: Descriptor opened for reading
+ * @param ctx: Initialized hash state
+ * @return SUCCESS on success, ERROR_FILE_READ on failure
+ */
+int hash_fd(int fd, HashContext *ctx);
+
+/**
+ * Hash a whole file
+ * @param filepath: Path to file
+ * @param algorithm: Algorithm to use
+ * @param hex: Receives the hex digest (at least HASH_MAX_HEX bytes)
+ * @return SUCCESS on success, error code on failure
+ */
+int hash_file(const char *filepath, HashAlgorithm algorithm, char *hex);
+
+#endif // HASH_H
@@ -0,0 +1,156 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "file_operations.h"
+#include "hash.h"
+#include <stdint.h>
+
+// On-disk format identification
+#define INDEX_MAGIC "FCINDEX"
+#define INDEX_VERSION 1
+
+// Entry types
+#define INDEX_TYPE_FILE 0
+#define INDEX_TYPE_DIR 1
+
+// Entry flags
+#define INDEX_HAS_DEST 0x01     // dest_* fields describe the copy
+#define INDEX_HAS_DIGEST 0x02   // digest holds a checksum of the source
+#define INDEX_COMPLETE 0x04     // Directory: every entry it had is in the index
+
+/**
+ * One source path and the state it was in when last copied or hashed
+ * Entries are fixed-size and sorted by (parent directory, name), so a
+ * directory's children are contiguous and found by binary search.
+ */
+typedef struct {
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;          // ctime cannot be set back like mtime can
+    int64_t ctime_nsec;
+    uint64_t dest_ino;
+    int64_t dest_ctime_sec;
+    int64_t dest_ctime_nsec;
+    uint32_t path;              // Offset of the relative path in the string table
+    uint16_t path_len;
+    uint16_t name;              // Offset of the last component within the path
+    uint32_t children;          // Directory: entries the walk found in it
+    uint8_t type;               // INDEX_TYPE_*
+    uint8_t flags;              // INDEX_* flags
+    uint8_t algorithm;          // HashAlgorithm of digest
+    uint8_t digest_len;
+    unsigned char digest[HASH_MAX_DIGEST];
+} IndexEntry;
+
+/**
+ * Load the index for a copy of src_root into dest_root (--index)
+ * An existing index file is used only if it was written for the same
+ * roots; otherwise every entry is rebuilt by this run. Paths given to
+ * the other index functions must start with src_root.
+ * @param index_path: Index file
+ * @param src_root: Source directory, or "" to key entries by absolute path
+ * @param dest_root: Destination directory (can be NULL for checksums)
+ * @param merge: Keep entries this run does not touch (the checksum cache);
+ *               otherwise the saved index holds only what this run saw
+ * @return SUCCESS on success, error code on failure
+ */
+int index_open(const char *index_path, const char *src_root, const char *dest_root, int merge);
+
+/**
+ * Write the entries recorded by this run and release the index
+ * The file is replaced atomically, so an interrupted run keeps the old one.
+ * @return SUCCESS on success, error code on failure
+ */
+int index_close(void);
+
+/**
+ * Check whether an index is open
+ * @return 1 if index_open succeeded and index_close has not been called
+ */
+int index_active(void);
+
+/**
+ * Skip a file whose source and copy are unchanged since the last run (--sync)
+ * The source must match the recorded size, times and inode, and the
+ * destination the recorded inode and ctime. The entry is carried over.
+ * @param path: Source path
+ * @param src_stat: Current source status
+ * @param dest_dirfd: Directory descriptor dest_name is relative to (or AT_FDCWD)
+ * @param dest_name: Destination file name
+ * @return 1 if the file can be skipped, 0 otherwise
+ */
+int index_skip_file(const char *path, const struct stat *src_stat,
+                    int dest_dirfd, const char *dest_name);
+
+/**
+ * Record a file after it was copied, synced or hashed
+ * @param path: Source path
+ * @param src_stat: Source status the copy was made from
+ * @param dest_dirfd: Directory descriptor dest_name is relative to (or AT_FDCWD)
+ * @param dest_name: Destination file name (NULL if there is no copy)
+ * @param algorithm: Algorithm of digest
+ * @param digest: Checksum of the source (NULL if none was computed)
+ * @param digest_len: Bytes in digest
+ */
+void index_record_file(const char *path, const struct stat *src_stat,
+                       int dest_dirfd, const char *dest_name,
+                       HashAlgorithm algorithm, const unsigned char *digest, size_t digest_len);
+
+/**
+ * Record a directory after its entries were handed to the copy
+ * Its destination is looked up when the index is saved; it is marked
+ * INDEX_COMPLETE only if all children entries were recorded too.
+ * @param path: Source directory path
+ * @param src_stat: Source status taken before reading the directory
+ * @param children: Entries read from the directory
+ */
+void index_record_dir(const char *path, const struct stat *src_stat, size_t children);
+
+/**
+ * Look up a directory that can be synced from the index alone
+ * Only with --index-trust-dirs and --sync: the directory and its copy
+ * must be unchanged and its entry complete. Files changed in place do
+ * not touch their directory, so this trusts that nothing was.
+ * @param path: Source directory path
+ * @param src_stat: Current source status
+ * @param dest_stat: Current destination status
+ * @return Directory entry, or NULL if the directory must be read
+ */
+const IndexEntry *index_trusted_dir(const char *path, const struct stat *src_stat,
+                                    const struct stat *dest_stat);
+
+/**
+ * List the entries recorded under a directory
+ * @param dir: Directory entry from index_trusted_dir
+ * @param first: Receives the first child (children are contiguous)
+ * @return Number of children
+ */
+size_t index_children(const IndexEntry *dir, const IndexEntry **first);
+
+/**
+ * Get the last path component of an entry
+ * @param entry: Entry from the loaded index
+ * @return NUL-terminated name inside the mapped index
+ */
+const char *index_entry_name(const IndexEntry *entry);
+
+/**
+ * Carry an unchanged entry over into the index being written
+ * @param entry: Entry from the loaded index
+ */
+void index_keep(const IndexEntry *entry);
+
+/**
+ * Get a cached checksum for an unchanged file
+ * @param path: File path
+ * @param st: Current file status
+ * @param algorithm: Wanted algorithm
+ * @param digest: Receives the digest (HASH_MAX_DIGEST bytes)
+ * @return Digest length, or 0 if nothing usable is cached
+ */
+size_t index_cached_digest(const char *path, const struct stat *st,
+                           HashAlgorithm algorithm, unsigned char *digest);
+
+#endif // INDEX_H
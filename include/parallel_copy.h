@@ -0,0 +1,63 @@
+#ifndef PARALLEL_COPY_H
+#define PARALLEL_COPY_H
+
+#include "file_operations.h"
+#include "thread_pool.h"
+
+// A directory copy running on a shared pool (see parallel_copy_start)
+typedef struct CopyJob CopyJob;
+
+/**
+ * Copy a directory tree with a pool of worker threads
+ * The calling thread enumerates the source tree; workers create the
+ * destination directories and copy files. A directory's contents are
+ * only queued once the directory itself exists. Failures are collected
+ * and reported at the end instead of stopping the copy.
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param filter: Compiled include/exclude patterns (can be NULL)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param jobs: Number of worker threads
+ * @return SUCCESS if every entry was copied, otherwise the first error code
+ */
+int parallel_copy_directory(const char *src_path, const char *dest_path,
+                            const CopyFilter *filter, CopyStats *stats, int jobs);
+
+/**
+ * Queue a directory copy on a pool shared with other work (batch mode)
+ * Like parallel_copy_directory, but the tree is enumerated on the calling
+ * thread into pool and this returns once everything is queued. Call
+ * parallel_copy_finish after thread_pool_wait has returned.
+ * @param pool: Pool to queue the copy on (not a pool the caller works for)
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param filter: Compiled include/exclude patterns (can be NULL)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param result: Receives SUCCESS, or the error that stopped the copy from starting
+ * @return Job to finish, or NULL if nothing was queued
+ */
+CopyJob *parallel_copy_start(ThreadPool *pool, const char *src_path, const char *dest_path,
+                             const CopyFilter *filter, CopyStats *stats, int *result);
+
+/**
+ * Report and release a job queued with parallel_copy_start
+ * @param job: Job whose pool has been waited for
+ * @return SUCCESS if every entry was copied, otherwise the first error code
+ */
+int parallel_copy_finish(CopyJob *job);
+
+/**
+ * Move a directory tree to another filesystem with a pool of worker threads
+ * Like parallel_copy_directory, but each worker unlinks a source file as
+ * soon as its copy is verified (see move_file_at), so copying and
+ * deleting overlap. Source directories are left for the caller to remove.
+ * @param src_path: Source directory path
+ * @param dest_path: Destination directory path
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param jobs: Number of worker threads
+ * @return SUCCESS if every file was moved, otherwise the first error code
+ */
+int parallel_move_directory(const char *src_path, const char *dest_path,
+                            CopyStats *stats, int jobs);
+
+#endif // PARALLEL_COPY_H
@@ -0,0 +1,63 @@
+#ifndef PARALLEL_HASH_H
+#define PARALLEL_HASH_H
+
+#include "file_operations.h"
+
+// Leaf size of a tree hash; also the unit of work handed to a worker
+#define TREE_HASH_CHUNK (4 * 1024 * 1024)
+
+// Domain separation bytes, so a leaf can never pass for a parent
+#define TREE_HASH_LEAF 0x00
+#define TREE_HASH_NODE 0x01
+
+/**
+ * Tree hash of one file (--tree-hash)
+ * The file is split into TREE_HASH_CHUNK-byte chunks (an empty file is
+ * one empty chunk). Each leaf is H(0x00 || chunk); each level then pairs
+ * neighbours as H(0x01 || left || right), moving an odd node at the end
+ * up unchanged, until one root is left. Workers pread and hash chunks
+ * independently, so the digest is the same for any number of jobs but is
+ * not the one sha256sum prints.
+ * @param fd: Descriptor opened for reading (its offset is not used)
+ * @param algorithm: Hash used for leaves and parents
+ * @param jobs: Worker threads (1 hashes on the calling thread)
+ * @param digest: Receives the root digest (at least HASH_MAX_DIGEST bytes)
+ * @param len: Receives the digest length
+ * @return SUCCESS on success, error code on failure
+ */
+int tree_hash_fd(int fd, HashAlgorithm algorithm, int jobs, unsigned char *digest, size_t *len);
+
+/**
+ * Tree hash of a file by path
+ * @param filepath: Path to file
+ * @param algorithm: Hash used for leaves and parents
+ * @param jobs: Worker threads
+ * @param hex: Receives the hex root digest (at least HASH_MAX_HEX bytes)
+ * @return SUCCESS on success, error code on failure
+ */
+int tree_hash_file(const char *filepath, HashAlgorithm algorithm, int jobs, char *hex);
+
+/**
+ * Print one checksum line the way sha256sum/md5sum do
+ * Paths holding a backslash or newline are escaped and the line starts
+ * with a backslash, as "sha256sum -c" expects.
+ * @param out: Output stream
+ * @param hex: Hex digest
+ * @param path: File path
+ */
+void print_checksum_line(FILE *out, const char *hex, const char *path);
+
+/**
+ * Checksum every regular file below a directory with a worker pool
+ * Symlinks to files are hashed; symlinked directories are not entered.
+ * Lines are written sorted by path once every file is hashed, so the
+ * manifest does not depend on the number of jobs.
+ * @param dir_path: Directory to walk
+ * @param algorithm: Checksum algorithm (--tree-hash applies per file)
+ * @param jobs: Worker threads
+ * @param out: Manifest stream
+ * @return SUCCESS if every file was hashed, otherwise the first error code
+ */
+int checksum_directory(const char *dir_path, HashAlgorithm algorithm, int jobs, FILE *out);
+
+#endif // PARALLEL_HASH_H
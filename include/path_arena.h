@@ -0,0 +1,179 @@
+#ifndef PATH_ARENA_H
+#define PATH_ARENA_H
+
+#include "file_operations.h"
+#include <stdint.h>
+
+// Smallest arena chunk; larger requests get a chunk of their own size
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// Bytes of entries requested from the kernel per getdents64() call
+#define DIR_BATCH_BUFFER (256 * 1024)
+
+/**
+ * Memory for tree walks that does not grow with MAX_PATH or with depth
+ * A PathBuf holds the path of the entry being visited: each level pushes
+ * one component and pops it again, so the whole walk shares one buffer
+ * that grows to the deepest path and never truncates. An Arena is a
+ * stack of chunks: a directory's entry batch is allocated on top, the
+ * subdirectories below it allocate above that, and the level releases
+ * everything back to its mark when it is done. Neither is thread-safe;
+ * a worker thread uses its own.
+ * Directories are read with getdents64() in DIR_BATCH_BUFFER requests and
+ * can then be sorted (--order): ext4 and XFS return names in hash order,
+ * so copying in that order seeks all over a rotating disk, while inode
+ * numbers and extent offsets follow the on-disk layout.
+ */
+
+/**
+ * Growable path; data is always NUL-terminated
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} PathBuf;
+
+/**
+ * One chunk of an arena
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+/**
+ * Stack allocator
+ */
+typedef struct {
+    ArenaChunk *top;
+    ArenaChunk *spare;      // Last chunk released, kept for the next allocation
+    char *scratch;          // getdents64() buffer, allocated on first use
+} Arena;
+
+/**
+ * Allocation state to return to
+ */
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+/**
+ * Directory entry as read into a batch (mirrors struct dirent)
+ */
+typedef struct {
+    ino_t d_ino;
+    uint64_t sort_key;      // Set by dir_batch_sort
+    unsigned char d_type;   // DT_* value, DT_UNKNOWN if the filesystem did not say
+    char d_name[];
+} DirEntry;
+
+/**
+ * Entries of one directory, without "." and ".."
+ */
+typedef struct {
+    DirEntry **entries;
+    size_t count;
+} DirBatch;
+
+/**
+ * Start a path
+ * @param path: Path to initialize
+ * @param root: Initial contents
+ * @return 0 on success, -1 if out of memory
+ */
+int path_buf_init(PathBuf *path, const char *root);
+
+/**
+ * Append "/name" (just "name" to an empty path or one ending in '/')
+ * @param path: Path to extend
+ * @param name: Component to append
+ * @return 0 on success, -1 if out of memory (the path is unchanged)
+ */
+int path_buf_push(PathBuf *path, const char *name);
+
+/**
+ * Cut a path back to an earlier length
+ * @param path: Path to shorten
+ * @param len: Length saved from path->len before the pushes to undo
+ */
+void path_buf_pop(PathBuf *path, size_t len);
+
+/**
+ * Free a path's buffer
+ * @param path: Path to release
+ */
+void path_buf_free(PathBuf *path);
+
+/**
+ * Allocate from an arena (8-byte aligned)
+ * @param arena: Arena (zero-initialized before first use)
+ * @param size: Bytes to allocate
+ * @return Memory valid until the arena is released past it, or NULL
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Remember the arena's state
+ * @param arena: Arena
+ * @return Mark for arena_release
+ */
+ArenaMark arena_mark(const Arena *arena);
+
+/**
+ * Free everything allocated since a mark
+ * @param arena: Arena
+ * @param mark: Mark from arena_mark
+ */
+void arena_release(Arena *arena, ArenaMark mark);
+
+/**
+ * Free all chunks of an arena
+ * @param arena: Arena
+ */
+void arena_free(Arena *arena);
+
+/**
+ * Parse a walk order name ("directory", "inode", "extent")
+ * @param name: Order name
+ * @param order: Receives the order
+ * @return SUCCESS, or ERROR_INVALID_PATH for an unknown name
+ */
+int parse_walk_order(const char *name, WalkOrder *order);
+
+/**
+ * Read the next getdents64() request's worth of entries into an arena
+ * For consumers that act on entries as they arrive instead of the whole
+ * directory at once.
+ * @param fd: Directory opened with O_RDONLY | O_DIRECTORY
+ * @param arena: Arena the batch is allocated from
+ * @param batch: Receives the entries; count is 0 at the end of the directory
+ * @return SUCCESS, or ERROR_DIR_OPEN if reading or allocating failed
+ */
+int dir_batch_next(int fd, Arena *arena, DirBatch *batch);
+
+/**
+ * Read the remaining entries of a directory into an arena
+ * @param fd: Directory opened with O_RDONLY | O_DIRECTORY
+ * @param arena: Arena the batch is allocated from
+ * @param batch: Receives the entries in directory order
+ * @return SUCCESS, or ERROR_DIR_OPEN if reading or allocating failed
+ */
+int dir_batch_read(int fd, Arena *arena, DirBatch *batch);
+
+/**
+ * Put a batch into walk order
+ * WALK_ORDER_INODE sorts by inode number. WALK_ORDER_EXTENT asks FIEMAP
+ * for the physical offset of each regular file's first block and sorts
+ * by that (one open() per file); entries without extents come last, by
+ * inode, and a filesystem without FIEMAP falls back to inode order.
+ * @param batch: Batch to sort
+ * @param dir_fd: Descriptor of the directory the batch was read from
+ * @param order: Order to apply (WALK_ORDER_DIRECTORY leaves it alone)
+ */
+void dir_batch_sort(DirBatch *batch, int dir_fd, WalkOrder order);
+
+#endif // PATH_ARENA_H
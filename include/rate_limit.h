@@ -0,0 +1,106 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "file_operations.h"
+
+// Largest debt a request may leave: requests are cut to this much time
+// of the flow's bandwidth, so throttled copies move in small even steps
+#define RATE_SLICE_NS 50000000L
+
+// Tokens a flow may save up while it is busy elsewhere (compressing,
+// walking directories), so pauses shorter than this cost no bandwidth
+#define RATE_BURST_NS 250000000L
+
+// Smallest request a bandwidth limit cuts a copy down to
+#define RATE_MIN_REQUEST (64 * 1024)
+
+// A flow that moved nothing for this long no longer takes a share
+#define RATE_IDLE_NS 1000000000L
+
+// How often the --limit-file is checked for changes
+#define RATE_RELOAD_NS 1000000000L
+
+/**
+ * Bandwidth and request rate limits (--bwlimit, --iops-limit)
+ * The copy engines ask rate_limit_request() how much to move in one
+ * request and report what they moved with rate_limit_account(), which
+ * sleeps while the caller's flow is in debt. Every regular copy is one
+ * flow shared by all its threads; batch mode gives each entry its own,
+ * and the limits are divided evenly among the flows that are moving data,
+ * so a large tree cannot starve the small entries next to it. Limits can
+ * be changed while copying through --limit-file: the file is checked
+ * once a second, or at once on SIGHUP.
+ */
+
+/**
+ * Token state of one flow (zero-initialize, then bind it)
+ */
+typedef struct RateFlow {
+    struct RateFlow *next;  // Chain of flows that moved data recently
+    int linked;
+    double bytes;           // Byte tokens; negative while in debt
+    double ops;             // Request tokens
+    long refill_ns;         // Last time tokens were added
+    long last_ns;           // Last request accounted
+} RateFlow;
+
+/**
+ * Parse a rate such as 0, 500, 20K, 50M or 1G (binary multiples)
+ * @param arg: Rate text
+ * @param rate: Receives the rate (0 for unlimited)
+ * @return SUCCESS, or ERROR_INVALID_PATH for malformed text
+ */
+int parse_rate(const char *arg, unsigned long long *rate);
+
+/**
+ * Parse an --ionice argument and apply it to the process
+ * "idle", "best-effort[:LEVEL]" or "realtime[:LEVEL]" (LEVEL 0-7, 0 is
+ * the highest). Threads started afterwards inherit the priority; it only
+ * takes effect under I/O schedulers that honour priorities (BFQ).
+ * @param arg: Class and level
+ * @return SUCCESS, ERROR_INVALID_PATH for malformed text or
+ *         ERROR_FILE_OPEN if the kernel refused (realtime needs root)
+ */
+int rate_set_ionice(const char *arg);
+
+/**
+ * Start limiting with the active options' --bwlimit, --iops-limit and
+ * --limit-file
+ * @return SUCCESS, or ERROR_FILE_OPEN if the limit file cannot be read
+ */
+int rate_limit_start(void);
+
+/**
+ * Check whether any limit can apply
+ * @return 1 if requests are accounted, 0 otherwise
+ */
+int rate_limit_active(void);
+
+/**
+ * Make flow the one this thread's I/O is charged to (NULL: the shared one)
+ * @param flow: Flow to charge
+ * @return Previous flow, to be bound again when done
+ */
+RateFlow *rate_bind(RateFlow *flow);
+
+/**
+ * Drop a flow from the scheduler before its memory goes away
+ * @param flow: Flow no thread is bound to any more
+ */
+void rate_flow_release(RateFlow *flow);
+
+/**
+ * Size the next request under the bandwidth limit
+ * @param want: Bytes the caller would move in one request
+ * @return want, or less (a multiple of RATE_MIN_REQUEST) while limited
+ */
+size_t rate_limit_request(size_t want);
+
+/**
+ * Charge one request that moved bytes to this thread's flow
+ * Sleeps (timed as STATS_THROTTLE) until the flow is out of debt.
+ * @param bytes: Bytes moved
+ */
+void rate_limit_account(size_t bytes);
+
+#endif // RATE_LIMIT_H
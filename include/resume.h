@@ -0,0 +1,149 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "file_operations.h"
+#include <stdint.h>
+
+// First line of a journal
+#define RESUME_MAGIC "FCRESUME 1"
+
+// A file in progress records its offset each time this much more of it
+// is on disk; smaller files are simply copied again
+#define RESUME_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+// Bytes before a recorded offset compared with the source on resume
+#define RESUME_VERIFY_SIZE (1024 * 1024)
+
+// Finished-file records collected before each write to the journal
+#define RESUME_BUFFER (16 * 1024)
+
+/**
+ * Checkpoint journal of a copy (--resume)
+ * An append-only text file next to the destination: a header naming both
+ * roots, then one record per finished file and one per checkpoint of a
+ * large file in progress, each carrying the source size and mtime it was
+ * made against. Paths are relative to the source root and length-prefixed,
+ * so any name fits. A checkpoint is written only after fdatasync() of the
+ * destination, so the offset it names is on disk. Finished-file records
+ * are buffered; losing some to a crash only means copying those files
+ * again. A later run with the same roots skips finished files whose
+ * source is unchanged and copy is complete, and continues a partial file
+ * from its last checkpoint once the bytes before it match the source.
+ * The journal is removed when the copy completes.
+ */
+
+/**
+ * Checkpoint state of the file being copied on this thread
+ */
+typedef struct {
+    const char *key;        // Path relative to the source root
+    size_t key_len;
+    const struct stat *src_stat;
+    int dest_fd;
+    off_t next;             // Offset at which the next checkpoint is due
+} ResumeFile;
+
+/**
+ * Default journal of a copy to dest_root: "DEST.filecopy-resume"
+ * @param dest_root: Destination path
+ * @param journal: Receives the journal path
+ * @param size: Size of journal
+ */
+void resume_default_journal(const char *dest_root, char *journal, size_t size);
+
+/**
+ * Load the journal of an earlier run and start appending to it
+ * A journal written for other roots, or not a journal at all, is
+ * replaced.
+ * @param journal: Journal file
+ * @param src_root: Source file or directory
+ * @param dest_root: Destination
+ * @return SUCCESS on success, ERROR_FILE_OPEN if the journal cannot be written
+ */
+int resume_open(const char *journal, const char *src_root, const char *dest_root);
+
+/**
+ * Close the journal
+ * @param finished: Nonzero if the copy completed; the journal is removed
+ * @return SUCCESS on success, ERROR_FILE_WRITE if records were lost
+ */
+int resume_close(int finished);
+
+/**
+ * Check whether a journal is open
+ * @return 1 if resume_open succeeded and resume_close has not been called
+ */
+int resume_active(void);
+
+/**
+ * Skip a file an earlier run finished
+ * The source must have the recorded size and mtime and the destination
+ * the source's size.
+ * @param path: Source path
+ * @param src_stat: Current source status
+ * @param dest_dirfd: Directory descriptor dest_name is relative to (or AT_FDCWD)
+ * @param dest_name: Destination name
+ * @return 1 if the file can be skipped, 0 if it has to be copied
+ */
+int resume_skip_file(const char *path, const struct stat *src_stat,
+                     int dest_dirfd, const char *dest_name);
+
+/**
+ * Get the offset an earlier run reached in a file
+ * @param path: Source path
+ * @param src_stat: Current source status
+ * @return Last checkpoint, or 0 if there is none for this source
+ */
+off_t resume_offset(const char *path, const struct stat *src_stat);
+
+/**
+ * Check that a partial copy matches the source before an offset
+ * @param src_fd: Source descriptor
+ * @param dest_fd: Destination descriptor (opened for reading and writing)
+ * @param offset: Offset from resume_offset
+ * @return 1 if the copy can continue from offset, 0 otherwise
+ */
+int resume_verify(int src_fd, int dest_fd, off_t offset);
+
+/**
+ * Start checkpointing a file copied on this thread
+ * Nothing is recorded for files below RESUME_CHECKPOINT_SIZE.
+ * @param file: State kept by the caller until resume_end
+ * @param path: Source path
+ * @param src_stat: Source status
+ * @param dest_fd: Destination descriptor
+ * @param offset: Offset the copy starts at
+ */
+void resume_begin(ResumeFile *file, const char *path, const struct stat *src_stat,
+                  int dest_fd, off_t offset);
+
+/**
+ * Note that the file started by resume_begin is copied up to end
+ * Called by the copy engines as data moves; records a checkpoint once
+ * RESUME_CHECKPOINT_SIZE more has been copied.
+ * @param end: Bytes [0, end) of the destination are written
+ */
+void resume_checkpoint(off_t end);
+
+/**
+ * Make file the one this thread's checkpoints go to (NULL: none)
+ * Lets the workers of a split copy checkpoint the caller's file; calls
+ * on the same file must be serialized.
+ * @param file: State from resume_begin on another thread
+ * @return Previous file, to be bound again when done
+ */
+ResumeFile *resume_bind(ResumeFile *file);
+
+/**
+ * Stop checkpointing on this thread
+ */
+void resume_end(void);
+
+/**
+ * Record a finished file
+ * @param path: Source path
+ * @param src_stat: Source status the copy was made from
+ */
+void resume_record_file(const char *path, const struct stat *src_stat);
+
+#endif // RESUME_H
@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "file_operations.h"
+
+/**
+ * Per-phase timing of copy syscalls
+ * A thread binds the CopyStats it works for; STATS_TIMED then measures
+ * a call with CLOCK_MONOTONIC and adds it to a thread-local tally, which
+ * stats_flush moves into the shared counters (once per file, so threads
+ * do not contend on every read and write). With nothing bound, timing
+ * costs one thread-local load.
+ */
+
+/**
+ * Time one statement and charge it to a phase as one call
+ * @param phase: StatsPhase to charge
+ * @param statement: The call, typically "n = read(...)"
+ */
+#define STATS_TIMED(phase, statement) \
+    do { \
+        long stats_start_ = stats_clock(); \
+        statement; \
+        stats_charge((phase), stats_start_); \
+    } while (0)
+
+/**
+ * Make stats the target of this thread's timings (NULL stops timing)
+ * Pending timings for the previous target are flushed first. Callers
+ * put the previous target back when done, so no thread keeps pointing
+ * at statistics that go out of scope.
+ * @param stats: Statistics to charge (can be NULL)
+ * @return Previous target
+ */
+CopyStats *stats_bind(CopyStats *stats);
+
+/**
+ * Read the clock if this thread has statistics bound
+ * @return CLOCK_MONOTONIC nanoseconds, or 0 when not timing
+ */
+long stats_clock(void);
+
+/**
+ * Charge the time since start to a phase (errno is preserved)
+ * @param phase: Phase to charge
+ * @param start: Value returned by stats_clock (0 charges nothing)
+ */
+void stats_charge(StatsPhase phase, long start);
+
+/**
+ * Add this thread's pending timings to the bound statistics
+ */
+void stats_flush(void);
+
+/**
+ * Record one file's copy time in the latency histogram and flush
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param start: Value returned by stats_clock when the file was started
+ */
+void stats_file_done(CopyStats *stats, long start);
+
+/**
+ * Mark the end of an operation: stop the clock shown by display_stats
+ * @param stats: Pointer to statistics structure
+ */
+void stats_stop(CopyStats *stats);
+
+/**
+ * Get the printable name of a phase
+ * @param phase: Phase
+ * @return Static string such as "read"
+ */
+const char *stats_phase_name(StatsPhase phase);
+
+/**
+ * Estimate a per-file latency percentile from the histogram
+ * @param stats: Pointer to statistics structure
+ * @param percentile: Wanted percentile (0-100)
+ * @return Upper bound of the bucket holding it in nanoseconds, 0 if no files
+ */
+long stats_latency_percentile(const CopyStats *stats, double percentile);
+
+/**
+ * Write statistics as a JSON object (--stats-json)
+ * @param stats: Pointer to statistics structure
+ * @param path: Output file, or "-" for stdout
+ * @return SUCCESS on success, ERROR_FILE_WRITE on failure
+ */
+int stats_write_json(const CopyStats *stats, const char *path);
+
+#endif // STATS_H
@@ -0,0 +1,57 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "file_operations.h"
+
+// Changed files at least this large are patched in place instead of rewritten
+#define SYNC_DELTA_MIN_SIZE (16 * 1024 * 1024)
+
+// Granularity of in-place updates: only blocks that differ are written
+#define SYNC_BLOCK_SIZE (64 * 1024)
+
+/**
+ * What sync_file decided for one file
+ */
+typedef enum {
+    SYNC_ACTION_COPY = 0,   // Destination missing or changed: copy the whole file
+    SYNC_ACTION_SKIP,       // Destination already up to date
+    SYNC_ACTION_DELTA       // Changed blocks were written into the destination
+} SyncAction;
+
+/**
+ * Bring one destination file up to date without a full copy if possible
+ * Files whose size and modification time match are skipped (with
+ * SYNC_CHECKSUM their contents must match instead). Large changed files
+ * are compared block by block and only differing blocks are rewritten;
+ * the destination then gets the source size, mode and times.
+ * @param src_fd: Source descriptor (opened for reading)
+ * @param src_stat: Source status
+ * @param label: Source path shown in the progress bar
+ * @param dest_dirfd: Directory descriptor dest_name is relative to (or AT_FDCWD)
+ * @param dest_name: Destination file name
+ * @param action: Receives the action taken
+ * @param written: Receives bytes written to the destination (SYNC_ACTION_DELTA)
+ * @return SUCCESS on success, error code on failure
+ */
+int sync_file(int src_fd, const struct stat *src_stat, const char *label,
+              int dest_dirfd, const char *dest_name, SyncAction *action, off_t *written);
+
+/**
+ * Delete destination entries that no longer exist in the source (--delete)
+ * Entries excluded by the filter are kept, as they were never synced.
+ * Entries are looked up relative to the descriptors, so the directories
+ * may lie deeper than PATH_MAX; the paths are for filters and messages.
+ * @param src_dirfd: Descriptor of the source directory
+ * @param dest_dirfd: Descriptor of the destination directory (O_PATH is enough)
+ * @param src_dir: Source directory path
+ * @param dest_dir: Destination directory path
+ * @param filter: Compiled include/exclude patterns (can be NULL)
+ * @param root_len: Length of the copy's source root, for relative paths
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int sync_delete_extraneous(int src_dirfd, int dest_dirfd, const char *src_dir,
+                           const char *dest_dir, const CopyFilter *filter, size_t root_len,
+                           CopyStats *stats);
+
+#endif // SYNC_H
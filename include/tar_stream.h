@@ -0,0 +1,51 @@
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include "file_operations.h"
+#include "filter.h"
+
+// Archive block size; headers and padded file data come in these units
+#define TAR_BLOCK_SIZE 512
+
+/**
+ * Streaming POSIX tar (ustar, with pax extended headers where ustar runs
+ * out: long names and link targets, sizes of 8 GB and more, large ids)
+ * Members are named relative to the copied tree, so streaming a tree out
+ * of one process and into another amounts to copy_directory: the tar
+ * equivalent of "tar -C src -c . | tar -C dest -x". The stream never
+ * touches an intermediate file; it can go to a regular file, a pipe or
+ * a socket (such as stdout handed to ssh or nc).
+ */
+
+/**
+ * Write a file or directory tree as a tar stream
+ * Directories come before their contents; symlinks are stored as links,
+ * files the tree hardlinks are stored once and linked after that. File
+ * data is sent with sendfile() where the kernel supports the pair of
+ * descriptors, otherwise with read()/write().
+ * @param src_path: File or directory to archive
+ * @param out_fd: Descriptor the stream is written to
+ * @param filter: Include/exclude filter for directory walks (can be NULL)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure (the stream is then
+ *         left without its end-of-archive blocks)
+ */
+int tar_write_tree(const char *src_path, int out_fd, const CopyFilter *filter, CopyStats *stats);
+
+/**
+ * Unpack a tar stream into a directory
+ * Regular files, directories, symlinks, hardlinks and FIFOs are created
+ * (plus devices when running as root); other member types are skipped
+ * with a warning. Absolute member names are made relative and members
+ * with ".." components are refused; intermediate symlinks are never
+ * followed, so a stream cannot write outside the destination. Modes and
+ * mtimes are restored, ownership too when running as root. Data coming
+ * from a pipe is moved into place with splice().
+ * @param in_fd: Descriptor the stream is read from
+ * @param dest_path: Directory to unpack into (created if missing)
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+int tar_extract(int in_fd, const char *dest_path, CopyStats *stats);
+
+#endif // TAR_STREAM_H
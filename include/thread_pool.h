@@ -0,0 +1,65 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+// Upper bound for worker threads (-j)
+#define MAX_WORKERS 256
+
+/**
+ * Task callback run on a worker thread
+ * @param arg: Argument given to thread_pool_submit
+ */
+typedef void (*TaskFunc)(void *arg);
+
+/**
+ * Opaque work-stealing thread pool
+ * Every worker owns a deque: it pops its own newest task first and, when
+ * the deque is empty, steals the oldest task from another worker.
+ */
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * Create a thread pool and start its workers
+ * @param num_threads: Number of worker threads (1..MAX_WORKERS)
+ * @return New pool, or NULL on failure
+ */
+ThreadPool *thread_pool_create(int num_threads);
+
+/**
+ * Queue a task
+ * Tasks submitted from a worker go to that worker's own deque; tasks
+ * submitted from other threads are spread round-robin over all workers.
+ * @param pool: Thread pool
+ * @param func: Task callback
+ * @param arg: Argument passed to func
+ * @return 0 on success, -1 on allocation failure
+ */
+int thread_pool_submit(ThreadPool *pool, TaskFunc func, void *arg);
+
+/**
+ * Wait until every submitted task (including tasks they submit) is done
+ * @param pool: Thread pool
+ */
+void thread_pool_wait(ThreadPool *pool);
+
+/**
+ * Stop the workers and free the pool (pending tasks are run first)
+ * @param pool: Thread pool (can be NULL)
+ */
+void thread_pool_destroy(ThreadPool *pool);
+
+/**
+ * Get the number of worker threads
+ * @param pool: Thread pool
+ * @return Worker count
+ */
+int thread_pool_size(const ThreadPool *pool);
+
+/**
+ * Get the index of the calling worker thread
+ * @return Worker index in [0, thread_pool_size), or -1 if not a worker
+ */
+int thread_pool_worker_index(void);
+
+#endif // THREAD_POOL_H
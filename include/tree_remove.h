@@ -0,0 +1,38 @@
+#ifndef TREE_REMOVE_H
+#define TREE_REMOVE_H
+
+#include "file_operations.h"
+
+/**
+ * Remove a directory tree
+ * Every directory is opened once and its entries are removed with
+ * unlinkat() relative to it, so an entry costs a single syscall (plus an
+ * fstatat() only when unlink refuses a DT_UNKNOWN entry). Symbolic links
+ * are removed, never followed. With jobs > 1 subdirectories are handed
+ * to a worker pool; a directory is removed by whichever thread finishes
+ * its last subdirectory. Called from a pool worker, the tree is removed
+ * on that thread. Failures are reported and do not stop the removal.
+ * @param path: Directory to remove (not followed if it is a symlink)
+ * @param jobs: Number of worker threads (1 removes on the calling thread)
+ * @param empty_dirs_only: Leave files alone and remove only directories
+ *                         that end up empty (after a move)
+ * @return SUCCESS if the whole tree is gone, ERROR_DIR_OPEN if path cannot
+ *         be opened, ERROR_FILE_WRITE if some entries remain
+ */
+int tree_remove(const char *path, int jobs, int empty_dirs_only);
+
+/**
+ * Remove a directory tree named relative to an open directory
+ * Same as tree_remove, for trees whose full path may exceed the kernel's
+ * PATH_MAX.
+ * @param dirfd: Directory descriptor name is relative to (or AT_FDCWD)
+ * @param name: Directory to remove
+ * @param path: Full path of the directory, for messages
+ * @param jobs: Number of worker threads (1 removes on the calling thread)
+ * @param empty_dirs_only: Leave files alone and remove only directories
+ *                         that end up empty (after a move)
+ * @return As tree_remove
+ */
+int tree_remove_at(int dirfd, const char *name, const char *path, int jobs, int empty_dirs_only);
+
+#endif // TREE_REMOVE_H
@@ -0,0 +1,107 @@
+#ifndef URING_COPY_H
+#define URING_COPY_H
+
+#include "file_operations.h"
+
+// Files up to this size are batched through io_uring; larger files
+// go through copy_file so they can use the in-kernel engines
+#define URING_MAX_FILE_SIZE (1024 * 1024)
+
+// Per-file staging buffer for io_uring read/write
+#define URING_BUFFER_SIZE (128 * 1024)
+
+// Files collected before a batch is handed to io_uring
+#define URING_BATCH_FILES 256
+
+// Default and maximum number of files kept in flight (--queue-depth)
+#define URING_DEFAULT_QUEUE_DEPTH 64
+#define URING_MAX_QUEUE_DEPTH 1024
+
+/**
+ * One file in an io_uring copy batch
+ */
+typedef struct {
+    char *src_path;
+    char *dest_path;
+    off_t size;             // Source size from the directory walk
+    mode_t mode;            // Source permissions
+} UringCopyItem;
+
+/**
+ * A batch of small files waiting to be copied
+ */
+typedef struct {
+    UringCopyItem items[URING_BATCH_FILES];
+    size_t count;
+} UringBatch;
+
+/**
+ * Callback for a file that failed inside a batch
+ * @param ctx: Context pointer given to uring_batch_flush
+ * @param item: The failed file
+ * @param error_code: ERROR_* code
+ * @param saved_errno: errno value describing the failure
+ */
+typedef void (*UringErrorFunc)(void *ctx, const UringCopyItem *item,
+                               int error_code, int saved_errno);
+
+/**
+ * Check whether the io_uring backend is compiled in and enabled
+ * (--verify, --sync and --index turn it off)
+ * @return 1 if directory walkers should batch small files, 0 otherwise
+ */
+int uring_copy_enabled(void);
+
+/**
+ * Check whether a file should be batched rather than copied directly
+ * @param st: Source file status
+ * @return 1 for small regular files when io_uring is enabled, 0 otherwise
+ */
+int uring_wants_file(const struct stat *st);
+
+/**
+ * Allocate an empty batch
+ * @return New batch, or NULL on allocation failure
+ */
+UringBatch *uring_batch_new(void);
+
+/**
+ * Append a file to a batch
+ * @param batch: Batch (must not be full, see uring_batch_full)
+ * @param src_path: Source file path
+ * @param dest_path: Destination file path
+ * @param st: Source file status
+ * @return SUCCESS on success, ERROR_FILE_OPEN on allocation failure
+ */
+int uring_batch_add(UringBatch *batch, const char *src_path, const char *dest_path,
+                    const struct stat *st);
+
+/**
+ * Check whether a batch has reached URING_BATCH_FILES entries
+ * @param batch: Batch
+ * @return 1 if full, 0 otherwise
+ */
+int uring_batch_full(const UringBatch *batch);
+
+/**
+ * Copy every file in a batch through one io_uring instance, then empty it
+ * Keeps up to --queue-depth files in flight; each file's openat, read,
+ * write and close requests are submitted asynchronously, and permissions
+ * are set with fchmod (io_uring has no chmod opcode) before closing.
+ * Falls back to copy_file when the kernel refuses io_uring.
+ * @param batch: Batch to copy
+ * @param stats: Pointer to statistics structure (can be NULL)
+ * @param on_error: Called for every file that fails (can be NULL)
+ * @param ctx: Passed to on_error
+ * @return SUCCESS if all files were copied, otherwise the first error code
+ */
+int uring_batch_flush(UringBatch *batch, CopyStats *stats,
+                      UringErrorFunc on_error, void *ctx);
+
+/**
+ * Free a batch and any paths it still owns
+ * @param batch: Batch (can be NULL)
+ */
+void uring_batch_free(UringBatch *batch);
+
+#endif // URING_COPY_H
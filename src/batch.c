@@ -0,0 +1,660 @@
+#include "batch.h"
+#include "compare.h"
+#include "durable.h"
+#include "filter.h"
+#include "hash.h"
+#include "parallel_copy.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+static const char *op_names[BATCH_OP_COUNT] = {
+    "copy",
+    "move",
+    "compare",
+    "checksum",
+};
+
+// One manifest entry and, once batch, its outcome
+typedef struct {
+    BatchOp op;
+    char *src;              // Strings point into the manifest buffer
+    char *dest;             // NULL for checksum
+    Batch *batch;
+    CopyJob *tree;          // Directory copy queued on the shared pool
+    RateFlow flow;          // Each entry's own share of --bwlimit/--iops-limit
+    int result;
+    int saved_errno;
+    off_t diff_offset;      // First difference (compare)
+    char checksum[HASH_MAX_HEX];
+} BatchEntry;
+
+struct Batch {
+    char *buffer;           // Manifest contents
+    const char *manifest;   // For messages
+    BatchOp default_op;
+    const CopyFilter *filter;
+    CopyStats *stats;
+    BatchEntry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+int parse_batch_op(const char *name, BatchOp *op) {
+    for (int i = 0; i < BATCH_OP_COUNT; i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            *op = (BatchOp)i;
+            return SUCCESS;
+        }
+    }
+    return ERROR_INVALID_PATH;
+}
+
+int parse_batch_format(const char *name, BatchFormat *format) {
+    static const char *names[] = { "auto", "lines", "nul", "json" };
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *format = (BatchFormat)i;
+            return SUCCESS;
+        }
+    }
+    return ERROR_INVALID_PATH;
+}
+
+static void manifest_error(const Batch *batch, const char *where, long number,
+                           const char *message) {
+    fprintf(stderr, "Error (%s, %s %ld): %s\n", batch->manifest, where, number, message);
+}
+
+// Read the whole manifest, NUL-terminated; *len excludes the terminator
+static char *read_manifest(const char *path, size_t *len) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    size_t capacity = 64 * 1024, used = 0;
+    char *buffer;
+    ssize_t n;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    buffer = malloc(capacity);
+    while (buffer != NULL) {
+        if (used + 1 == capacity) {
+            char *grown = realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        n = read(fd, buffer + used, capacity - used - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(buffer);
+            buffer = NULL;
+            break;
+        }
+        if (n == 0) {
+            buffer[used] = '\0';
+            *len = used;
+            break;
+        }
+        used += n;
+    }
+
+    if (fd != STDIN_FILENO) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return buffer;
+}
+
+// Append an entry after checking it has the paths its operation needs
+static int add_entry(Batch *batch, BatchOp op, char *src, char *dest,
+                     const char *where, long number) {
+    if (src == NULL || *src == '\0') {
+        manifest_error(batch, where, number, "missing source path");
+        return ERROR_INVALID_PATH;
+    }
+    if (op == BATCH_CHECKSUM && dest != NULL) {
+        manifest_error(batch, where, number, "checksum takes a single path");
+        return ERROR_INVALID_PATH;
+    }
+    if (op != BATCH_CHECKSUM && (dest == NULL || *dest == '\0')) {
+        manifest_error(batch, where, number, "missing destination path");
+        return ERROR_INVALID_PATH;
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? batch->capacity * 2 : 256;
+        BatchEntry *grown = realloc(batch->entries, capacity * sizeof(BatchEntry));
+        if (grown == NULL) {
+            manifest_error(batch, where, number, "out of memory");
+            return ERROR_INVALID_PATH;
+        }
+        batch->entries = grown;
+        batch->capacity = capacity;
+    }
+
+    BatchEntry *entry = &batch->entries[batch->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->op = op;
+    entry->src = src;
+    entry->dest = dest;
+    entry->batch = batch;
+    return SUCCESS;
+}
+
+// ============================================================================
+// Manifest formats
+// ============================================================================
+
+static int parse_lines(Batch *batch, char *buffer, size_t len) {
+    char *end = buffer + len;
+    long number = 0;
+
+    for (char *line = buffer; line < end; ) {
+        char *newline = memchr(line, '\n', end - line);
+        char *next = newline != NULL ? newline + 1 : end;
+        char *fields[4];
+        int count = 0;
+        BatchOp op = batch->default_op;
+
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+        number++;
+        size_t line_len = strlen(line);
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line[line_len - 1] = '\0';
+        }
+
+        if (*line != '\0' && *line != '#') {
+            for (char *field = line; field != NULL && count < 4; count++) {
+                fields[count] = field;
+                field = strchr(field, '\t');
+                if (field != NULL) {
+                    *field++ = '\0';
+                }
+            }
+
+            int first = 0;
+            if (count >= 2 && parse_batch_op(fields[0], &op) == SUCCESS) {
+                first = 1;
+            }
+            if (count - first > 2) {
+                manifest_error(batch, "line", number, "too many fields");
+                return ERROR_INVALID_PATH;
+            }
+            if (add_entry(batch, op, fields[first], count - first > 1 ? fields[first + 1] : NULL,
+                          "line", number) != SUCCESS) {
+                return ERROR_INVALID_PATH;
+            }
+        }
+        line = next;
+    }
+    return SUCCESS;
+}
+
+static int parse_nul(Batch *batch, char *buffer, size_t len) {
+    char *end = buffer + len;
+    int paths = batch->default_op == BATCH_CHECKSUM ? 1 : 2;
+    long number = 0;
+
+    for (char *field = buffer; field < end; ) {
+        char *fields[2] = { NULL, NULL };
+
+        for (int i = 0; i < paths && field < end; i++) {
+            fields[i] = field;
+            field += strlen(field) + 1;
+        }
+        number++;
+        if (add_entry(batch, batch->default_op, fields[0], fields[1], "entry", number) != SUCCESS) {
+            return ERROR_INVALID_PATH;
+        }
+    }
+    return SUCCESS;
+}
+
+static void skip_space(char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') {
+        (*p)++;
+    }
+}
+
+static int hex_value(const char *p, unsigned *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') *value |= c - '0';
+        else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+        else return 0;
+    }
+    return 1;
+}
+
+// Encode a code point as UTF-8 at *out
+static void put_utf8(char **out, unsigned cp) {
+    char *w = *out;
+
+    if (cp < 0x80) {
+        *w++ = (char)cp;
+    } else if (cp < 0x800) {
+        *w++ = (char)(0xC0 | (cp >> 6));
+        *w++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *w++ = (char)(0xE0 | (cp >> 12));
+        *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *w++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *w++ = (char)(0xF0 | (cp >> 18));
+        *w++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *w++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *w++ = (char)(0x80 | (cp & 0x3F));
+    }
+    *out = w;
+}
+
+// Decode a JSON string in place (the result is never longer than the source)
+static int json_string(char **p, char **value) {
+    char *r = *p, *w;
+
+    if (*r != '"') {
+        return 0;
+    }
+    w = *value = ++r;
+    while (*r != '"') {
+        unsigned cp, low;
+
+        if (*r == '\0' || (unsigned char)*r < 0x20) {
+            return 0;
+        }
+        if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        r++;
+        switch (*r) {
+            case '"': case '\\': case '/': *w++ = *r; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u':
+                if (!hex_value(r + 1, &cp)) {
+                    return 0;
+                }
+                r += 4;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    if (r[1] != '\\' || r[2] != 'u' || !hex_value(r + 3, &low) ||
+                        low < 0xDC00 || low >= 0xE000) {
+                        return 0;
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    r += 6;
+                }
+                if (cp == 0) {
+                    return 0;   // Paths cannot hold NUL
+                }
+                put_utf8(&w, cp);
+                break;
+            default:
+                return 0;
+        }
+        r++;
+    }
+    *w = '\0';
+    *p = r + 1;
+    return 1;
+}
+
+// Skip any JSON value (only strings are used, the rest is ignored)
+static int json_skip(char **p, int depth) {
+    char *ignored;
+
+    skip_space(p);
+    if (depth > 64) {
+        return 0;
+    }
+    if (**p == '"') {
+        return json_string(p, &ignored);
+    }
+    if (**p == '{' || **p == '[') {
+        char close = **p == '{' ? '}' : ']';
+        (*p)++;
+        skip_space(p);
+        if (**p == close) {
+            (*p)++;
+            return 1;
+        }
+        while (1) {
+            if (close == '}') {
+                skip_space(p);
+                if (!json_string(p, &ignored)) return 0;
+                skip_space(p);
+                if (*(*p)++ != ':') return 0;
+            }
+            if (!json_skip(p, depth + 1)) return 0;
+            skip_space(p);
+            if (**p == ',') {
+                (*p)++;
+                continue;
+            }
+            if (*(*p)++ != close) return 0;
+            return 1;
+        }
+    }
+
+    // Number, true, false or null
+    char *start = *p;
+    while (**p != '\0' && strchr(",}] \t\r\n", **p) == NULL) {
+        (*p)++;
+    }
+    return *p > start;
+}
+
+static int json_entry(Batch *batch, char **p, long number) {
+    char *key, *value, *op_name = NULL, *src = NULL, *dest = NULL;
+    BatchOp op = batch->default_op;
+
+    if (**p != '{') {
+        return 0;
+    }
+    (*p)++;
+    skip_space(p);
+    if (**p == '}') {
+        (*p)++;
+    } else {
+        while (1) {
+            skip_space(p);
+            if (!json_string(p, &key)) return 0;
+            skip_space(p);
+            if (*(*p)++ != ':') return 0;
+            skip_space(p);
+
+            int wanted = strcmp(key, "op") == 0 || strcmp(key, "src") == 0 ||
+                         strcmp(key, "path") == 0 || strcmp(key, "dest") == 0;
+            if (wanted && **p == '"') {
+                if (!json_string(p, &value)) return 0;
+                if (strcmp(key, "op") == 0) op_name = value;
+                else if (strcmp(key, "dest") == 0) dest = value;
+                else src = value;
+            } else if (!json_skip(p, 1)) {
+                return 0;
+            }
+            skip_space(p);
+            if (**p == ',') {
+                (*p)++;
+                continue;
+            }
+            if (*(*p)++ != '}') return 0;
+            break;
+        }
+    }
+
+    if (op_name != NULL && parse_batch_op(op_name, &op) != SUCCESS) {
+        manifest_error(batch, "entry", number, "unknown operation");
+        return -1;
+    }
+    return add_entry(batch, op, src, dest, "entry", number) == SUCCESS ? 1 : -1;
+}
+
+static int parse_json(Batch *batch, char *buffer) {
+    char *p = buffer;
+    long number = 0;
+    int array, parsed = 1;
+
+    skip_space(&p);
+    array = *p == '[';
+    if (array) {
+        p++;
+        skip_space(&p);
+        if (*p == ']') {
+            p++;
+            array = 0;
+        }
+    }
+
+    // An array of objects, or objects one after another (JSON Lines)
+    while (*p != '\0' && parsed == 1) {
+        parsed = json_entry(batch, &p, ++number);
+        skip_space(&p);
+        if (parsed == 1 && array) {
+            if (*p == ',') {
+                p++;
+                skip_space(&p);
+            } else if (*p == ']') {
+                p++;
+                skip_space(&p);
+                array = 0;
+                break;
+            } else {
+                parsed = 0;
+            }
+        }
+    }
+
+    if (parsed == 1 && (array || *p != '\0')) {
+        parsed = 0;
+    }
+    if (parsed == 0) {
+        manifest_error(batch, "byte", (long)(p - buffer), "JSON syntax error");
+    }
+    return parsed == 1 ? SUCCESS : ERROR_INVALID_PATH;
+}
+
+// ============================================================================
+// Running entries
+// ============================================================================
+
+static void run_entry(BatchEntry *entry) {
+    Batch *batch = entry->batch;
+    CopyStats *outer = stats_bind(batch->stats);
+    RateFlow *outer_flow = rate_bind(&entry->flow);
+
+    switch (entry->op) {
+        case BATCH_COPY:
+            if (is_directory(entry->src)) {
+                entry->result = copy_directory_with_filter(entry->src, entry->dest,
+                                                           batch->filter, batch->stats);
+            } else {
+                const char *name = strrchr(entry->src, '/');
+                entry->result = SUCCESS;
+                if (filter_wants_file(batch->filter, name != NULL ? name + 1 : entry->src)) {
+                    entry->result = copy_file_with_stats(entry->src, entry->dest, batch->stats);
+                }
+            }
+            break;
+        case BATCH_MOVE:
+            if (is_directory(entry->src)) {
+                entry->result = move_directory_with_stats(entry->src, entry->dest, batch->stats);
+            } else {
+                entry->result = move_file_with_stats(entry->src, entry->dest, batch->stats);
+            }
+            break;
+        case BATCH_COMPARE:
+            entry->result = compare_files_at(entry->src, entry->dest, &entry->diff_offset);
+            break;
+        default:
+            entry->result = calculate_checksum(entry->src, get_copy_options()->hash,
+                                               entry->checksum);
+            break;
+    }
+    entry->saved_errno = errno;
+
+    stats_bind(outer);
+    rate_bind(outer_flow);
+    rate_flow_release(&entry->flow);
+}
+
+static void entry_task(void *arg) {
+    set_progress_enabled(0);
+    run_entry(arg);
+}
+
+// Run all entries: on the calling thread, or through one pool shared by all
+static void run_entries(Batch *batch) {
+    int jobs = get_copy_options()->jobs;
+    ThreadPool *pool = jobs > 1 ? thread_pool_create(jobs) : NULL;
+
+    printf("Batch: %zu entries from %s (%d jobs)\n", batch->count, batch->manifest,
+           pool != NULL ? thread_pool_size(pool) : 1);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        BatchEntry *entry = &batch->entries[i];
+
+        if (pool == NULL) {
+            run_entry(entry);
+        } else if (entry->op == BATCH_COPY && is_directory(entry->src)) {
+            // The job's workers charge the entry's flow
+            RateFlow *outer_flow = rate_bind(&entry->flow);
+            entry->tree = parallel_copy_start(pool, entry->src, entry->dest, batch->filter,
+                                              batch->stats, &entry->result);
+            entry->saved_errno = errno;
+            rate_bind(outer_flow);
+        } else if (thread_pool_submit(pool, entry_task, entry) != 0) {
+            run_entry(entry);
+        }
+    }
+
+    if (pool == NULL) {
+        return;
+    }
+    thread_pool_wait(pool);
+    thread_pool_destroy(pool);
+    if (batch->stats != NULL) {
+        display_tree_progress(batch->stats, 1);
+    }
+    finish_progress();
+
+    for (size_t i = 0; i < batch->count; i++) {
+        BatchEntry *entry = &batch->entries[i];
+        if (entry->tree != NULL) {
+            entry->result = parallel_copy_finish(entry->tree);
+            entry->saved_errno = errno;
+            entry->tree = NULL;
+            rate_flow_release(&entry->flow);
+        }
+    }
+}
+
+// Print one tab-separated result line per entry, in manifest order
+static int report_entries(const Batch *batch) {
+    size_t failed = 0;
+    int first = SUCCESS;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        const BatchEntry *entry = &batch->entries[i];
+        char message[256];
+
+        printf("%s\t%s\t%s", entry->result == SUCCESS ? "ok" : "FAILED",
+               op_names[entry->op], entry->src);
+        if (entry->dest != NULL) {
+            printf("\t%s", entry->dest);
+        }
+        if (entry->result == SUCCESS) {
+            if (entry->op == BATCH_CHECKSUM) {
+                printf("\t%s", entry->checksum);
+            }
+            printf("\n");
+            continue;
+        }
+
+        format_error(entry->result, entry->saved_errno, message, sizeof(message));
+        if (entry->result == ERROR_FILES_DIFFER) {
+            printf("\t%s at byte offset %lld\n", message, (long long)entry->diff_offset);
+        } else {
+            printf("\t%s\n", message);
+        }
+        if (first == SUCCESS) {
+            first = entry->result;
+        }
+        failed++;
+    }
+
+    printf("Batch complete: %zu succeeded, %zu failed\n", batch->count - failed, failed);
+    return first;
+}
+
+Batch *batch_load(const char *manifest, BatchFormat format, BatchOp default_op) {
+    Batch *batch = calloc(1, sizeof(Batch));
+    size_t len = 0;
+    int result;
+
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->buffer = read_manifest(manifest, &len);
+    if (batch->buffer == NULL) {
+        print_error(ERROR_FILE_READ, manifest);
+        free(batch);
+        return NULL;
+    }
+    batch->manifest = strcmp(manifest, "-") == 0 ? "stdin" : manifest;
+    batch->default_op = default_op;
+
+    if (format == BATCH_FORMAT_AUTO) {
+        const char *p = batch->buffer;
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+        }
+        if (*p == '[' || *p == '{') {
+            format = BATCH_FORMAT_JSON;
+        } else if (memchr(batch->buffer, '\0', len) != NULL) {
+            format = BATCH_FORMAT_NUL;
+        } else {
+            format = BATCH_FORMAT_LINES;
+        }
+    }
+
+    if (format == BATCH_FORMAT_JSON) {
+        result = parse_json(batch, batch->buffer);
+    } else if (format == BATCH_FORMAT_NUL) {
+        result = parse_nul(batch, batch->buffer, len);
+    } else {
+        result = parse_lines(batch, batch->buffer, len);
+    }
+
+    if (result != SUCCESS) {
+        batch_free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+int batch_run(Batch *batch, const CopyFilter *filter, CopyStats *stats) {
+    batch->filter = filter;
+    batch->stats = stats;
+
+    // --durable: entries fill shared batches, flushed once at the end
+    int durable = get_copy_options()->durable != DURABLE_OFF;
+    int flushed = SUCCESS;
+    if (durable) {
+        durable_hold();
+    }
+    run_entries(batch);
+    if (durable) {
+        durable_release();
+        flushed = durable_flush(stats);
+    }
+
+    int result = report_entries(batch);
+    return result != SUCCESS ? result : flushed;
+}
+
+void batch_free(Batch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+    free(batch->entries);
+    free(batch->buffer);
+    free(batch);
+}
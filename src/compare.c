@@ -0,0 +1,294 @@
+#include "compare.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_CODE 1
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_CODE 1
+#endif
+
+// Filesystems where mmap() gains nothing or misbehaves on concurrent change
+#define FS_NFS_MAGIC  0x6969
+#define FS_SMB_MAGIC  0x517B
+#define FS_CIFS_MAGIC 0xFF534D42
+#define FS_SMB2_MAGIC 0xFE534D42
+#define FS_FUSE_MAGIC 0x65735546
+#define FS_9P_MAGIC   0x01021997
+#define FS_CEPH_MAGIC 0x00C36400
+
+typedef size_t (*CompareFunc)(const unsigned char *a, const unsigned char *b, size_t len);
+
+// Eight bytes at a time, then byte by byte to find the exact position
+static size_t compare_generic(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t i = 0;
+
+    while (i + 8 <= len) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) {
+            break;
+        }
+        i += 8;
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef HAVE_AVX2_CODE
+__attribute__((target("avx2")))
+static size_t compare_avx2(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t i = 0;
+
+    // Two vectors per iteration; only a mismatch pays for the movemask scan
+    while (i + 64 <= len) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                        _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                                        _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) != 0xFFFFFFFFu) {
+            uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(eq0);
+            if (diff != 0) {
+                return i + (size_t)__builtin_ctz(diff);
+            }
+            diff = ~(uint32_t)_mm256_movemask_epi8(eq1);
+            return i + 32 + (size_t)__builtin_ctz(diff);
+        }
+        i += 64;
+    }
+
+    while (i + 32 <= len) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                       _mm256_loadu_si256((const __m256i *)(b + i)));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(eq);
+        if (diff != 0) {
+            return i + (size_t)__builtin_ctz(diff);
+        }
+        i += 32;
+    }
+
+    return i + compare_generic(a + i, b + i, len - i);
+}
+#endif
+
+#ifdef HAVE_NEON_CODE
+static size_t compare_neon(const unsigned char *a, const unsigned char *b, size_t len) {
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        uint8x16_t eq0 = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint8x16_t eq1 = vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+        if (vminvq_u8(vandq_u8(eq0, eq1)) != 0xFF) {
+            break;
+        }
+        i += 32;
+    }
+
+    return i + compare_generic(a + i, b + i, len - i);
+}
+#endif
+
+static CompareFunc compare_kernel = compare_generic;
+static const char *compare_kernel_name = "generic";
+static pthread_once_t compare_once = PTHREAD_ONCE_INIT;
+
+static void compare_select(void) {
+#ifdef HAVE_AVX2_CODE
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        compare_kernel = compare_avx2;
+        compare_kernel_name = "avx2";
+    }
+#endif
+#ifdef HAVE_NEON_CODE
+    compare_kernel = compare_neon;
+    compare_kernel_name = "neon";
+#endif
+}
+
+size_t compare_buffers(const void *a, const void *b, size_t len) {
+    pthread_once(&compare_once, compare_select);
+    return compare_kernel(a, b, len);
+}
+
+const char *compare_implementation(void) {
+    pthread_once(&compare_once, compare_select);
+    return compare_kernel_name;
+}
+
+// Regular files on local filesystems are compared through mmap()
+static int mmap_friendly(int fd, const struct stat *st) {
+    struct statfs fs;
+
+    if (!S_ISREG(st->st_mode) || st->st_size <= 0) {
+        return 0;
+    }
+    if (fstatfs(fd, &fs) != 0) {
+        return 0;
+    }
+    switch ((unsigned long)fs.f_type) {
+        case FS_NFS_MAGIC:
+        case FS_SMB_MAGIC:
+        case FS_CIFS_MAGIC:
+        case FS_SMB2_MAGIC:
+        case FS_FUSE_MAGIC:
+        case FS_9P_MAGIC:
+        case FS_CEPH_MAGIC:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// Compare from offset to end of file with large read() buffers
+static int compare_read(int fd1, int fd2, const struct stat *st, off_t offset,
+                        off_t *diff_offset) {
+    size_t buffer_size = io_buffer_size(st);
+    char *buffer1 = io_buffer_alloc(buffer_size);
+    char *buffer2 = io_buffer_alloc(buffer_size);
+    int result = SUCCESS;
+
+    if (buffer1 == NULL || buffer2 == NULL) {
+        free(buffer1);
+        free(buffer2);
+        return ERROR_FILE_READ;
+    }
+
+    posix_fadvise(fd1, offset, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd2, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (1) {
+        ssize_t bytes1 = pread_full(fd1, buffer1, buffer_size, offset);
+        ssize_t bytes2 = pread_full(fd2, buffer2, buffer_size, offset);
+
+        if (bytes1 < 0 || bytes2 < 0) {
+            result = ERROR_FILE_READ;
+            break;
+        }
+
+        size_t common = (size_t)(bytes1 < bytes2 ? bytes1 : bytes2);
+        size_t same = compare_buffers(buffer1, buffer2, common);
+        if (same < common || bytes1 != bytes2) {
+            *diff_offset = offset + (off_t)same;
+            result = ERROR_FILES_DIFFER;
+            break;
+        }
+
+        if (bytes1 == 0) {
+            break;
+        }
+        offset += bytes1;
+    }
+
+    free(buffer1);
+    free(buffer2);
+    return result;
+}
+
+// Compare the first length bytes window by window through mmap()
+// If a mapping fails, *done stops short of length and the caller reads the rest
+static int compare_mapped(int fd1, int fd2, off_t length, off_t *done, off_t *diff_offset) {
+    off_t offset = 0;
+
+    while (offset < length) {
+        size_t window = (length - offset) < COMPARE_MAP_WINDOW ?
+                        (size_t)(length - offset) : COMPARE_MAP_WINDOW;
+        void *map1 = mmap(NULL, window, PROT_READ, MAP_PRIVATE, fd1, offset);
+        if (map1 == MAP_FAILED) {
+            break;
+        }
+        void *map2 = mmap(NULL, window, PROT_READ, MAP_PRIVATE, fd2, offset);
+        if (map2 == MAP_FAILED) {
+            munmap(map1, window);
+            break;
+        }
+
+        madvise(map1, window, MADV_SEQUENTIAL);
+        madvise(map2, window, MADV_SEQUENTIAL);
+
+        size_t same = compare_buffers(map1, map2, window);
+
+        munmap(map1, window);
+        munmap(map2, window);
+
+        if (same < window) {
+            *diff_offset = offset + (off_t)same;
+            *done = offset;
+            return ERROR_FILES_DIFFER;
+        }
+        offset += window;
+    }
+
+    *done = offset;
+    return SUCCESS;
+}
+
+int compare_fds(int fd1, const struct stat *st1, int fd2, const struct stat *st2,
+                off_t *diff_offset) {
+    off_t offset = 0;
+    off_t local;
+    int result = SUCCESS;
+
+    if (diff_offset == NULL) {
+        diff_offset = &local;
+    }
+    *diff_offset = -1;
+
+    int regular = S_ISREG(st1->st_mode) && S_ISREG(st2->st_mode);
+    off_t common = st1->st_size < st2->st_size ? st1->st_size : st2->st_size;
+
+    // Sizes already tell; only scan when the caller wants the offset
+    if (regular && st1->st_size != st2->st_size && diff_offset == &local) {
+        return ERROR_FILES_DIFFER;
+    }
+
+    if (regular && mmap_friendly(fd1, st1) && mmap_friendly(fd2, st2)) {
+        result = compare_mapped(fd1, fd2, common, &offset, diff_offset);
+        if (result == SUCCESS && offset >= common && st1->st_size != st2->st_size) {
+            *diff_offset = common;
+            result = ERROR_FILES_DIFFER;
+        }
+    }
+
+    // Special files, network filesystems, or mmap() refused part way
+    if (result == SUCCESS && (!regular || offset < common || common == 0)) {
+        result = compare_read(fd1, fd2, st1, offset, diff_offset);
+    }
+
+    return result;
+}
+
+int compare_files_at(const char *file1, const char *file2, off_t *diff_offset) {
+    struct stat st1, st2;
+    int fd1, fd2;
+    int result;
+
+    fd1 = open(file1, O_RDONLY);
+    if (fd1 < 0) {
+        return ERROR_FILE_OPEN;
+    }
+    fd2 = open(file2, O_RDONLY);
+    if (fd2 < 0) {
+        close(fd1);
+        return ERROR_FILE_OPEN;
+    }
+
+    if (fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0) {
+        result = ERROR_FILE_READ;
+    } else {
+        result = compare_fds(fd1, &st1, fd2, &st2, diff_offset);
+    }
+
+    close(fd1);
+    close(fd2);
+    return result;
+}
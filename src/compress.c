@@ -0,0 +1,600 @@
+#include "compress.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Size of the reads and writes around a decoder
+#define DECODE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    const char *name;
+    const char *suffix;
+    unsigned char magic[4];
+    size_t magic_len;
+    int default_level;
+    int max_level;
+} CodecInfo;
+
+static const CodecInfo codecs[COMPRESS_CODEC_COUNT] = {
+    { "none", "", { 0 }, 0, 0, 0 },
+    { "gzip", ".gz", { 0x1f, 0x8b }, 2, 6, 9 },
+    { "zstd", ".zst", { 0x28, 0xb5, 0x2f, 0xfd }, 4, 3, 19 },
+    { "lz4", ".lz4", { 0x04, 0x22, 0x4d, 0x18 }, 4, 1, 12 },
+};
+
+// Extensions of data that is compressed already: another pass only burns CPU
+static const char *packed_extensions[] = {
+    "gz", "tgz", "zst", "xz", "txz", "bz2", "tbz2", "lz4", "lzma", "lz", "7z", "zip", "rar",
+    "jar", "war", "apk", "whl", "deb", "rpm", "cab", "docx", "xlsx", "pptx", "odt", "ods",
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "avif", "mp3", "aac", "ogg", "opus", "flac",
+    "m4a", "mp4", "m4v", "mkv", "webm", "mov", "avi", "wmv",
+    NULL
+};
+
+// One block of the compressing pipeline
+typedef struct {
+    CompressCodec codec;
+    int level;
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_cap;
+    size_t out_len;
+    int result;
+    long cpu_ns;
+} CodecBlock;
+
+static long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compress_available(CompressCodec codec) {
+    switch (codec) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return 1;
+#endif
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char *compress_codec_name(CompressCodec codec) {
+    if ((int)codec < 0 || codec >= COMPRESS_CODEC_COUNT) {
+        return "unknown";
+    }
+    return codecs[codec].name;
+}
+
+int parse_compress_codec(const char *arg, CompressCodec *codec, int *level) {
+    const char *colon = strchr(arg, ':');
+    size_t len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+
+    for (int i = COMPRESS_GZIP; i < COMPRESS_CODEC_COUNT; i++) {
+        if (strlen(codecs[i].name) != len || strncmp(arg, codecs[i].name, len) != 0) {
+            continue;
+        }
+        *codec = (CompressCodec)i;
+        *level = 0;
+        if (colon != NULL) {
+            char *end;
+            long value = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || value < 1 || value > codecs[i].max_level) {
+                return ERROR_INVALID_PATH;
+            }
+            *level = (int)value;
+        }
+        return SUCCESS;
+    }
+    return ERROR_INVALID_PATH;
+}
+
+int compress_active(void) {
+    const CopyOptions *opts = get_copy_options();
+    return opts->compress != COMPRESS_NONE || opts->decompress;
+}
+
+static int has_packed_extension(const char *name) {
+    const char *slash = strrchr(name, '/');
+    const char *dot = strrchr(slash != NULL ? slash + 1 : name, '.');
+
+    if (dot == NULL || dot[1] == '\0') {
+        return 0;
+    }
+    for (int i = 0; packed_extensions[i] != NULL; i++) {
+        if (strcasecmp(dot + 1, packed_extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0 &&
+           name[len - suffix_len - 1] != '/';
+}
+
+CodingAction compress_plan(int src_fd, const struct stat *src_stat, const char *src_name,
+                           const char *dest_name, char *coded_name, size_t size,
+                           CompressCodec *codec) {
+    const CopyOptions *opts = get_copy_options();
+    size_t len = strlen(dest_name);
+
+    if (!S_ISREG(src_stat->st_mode) || len >= size) {
+        return CODING_COPY;
+    }
+
+    if (opts->compress != COMPRESS_NONE) {
+        const char *suffix = codecs[opts->compress].suffix;
+        if (has_packed_extension(src_name)) {
+            return CODING_COPY;
+        }
+        if (has_suffix(dest_name, suffix)) {
+            memcpy(coded_name, dest_name, len + 1);
+        } else if ((size_t)snprintf(coded_name, size, "%s%s", dest_name, suffix) >= size) {
+            return CODING_COPY;
+        }
+        *codec = opts->compress;
+        return CODING_COMPRESS;
+    }
+
+    if (!opts->decompress) {
+        return CODING_COPY;
+    }
+
+    // The suffix picks the codec; the magic number confirms it
+    for (int i = COMPRESS_GZIP; i < COMPRESS_CODEC_COUNT; i++) {
+        const CodecInfo *info = &codecs[i];
+        unsigned char magic[4];
+
+        if (!compress_available((CompressCodec)i) || !has_suffix(src_name, info->suffix)) {
+            continue;
+        }
+        if (pread(src_fd, magic, info->magic_len, 0) != (ssize_t)info->magic_len ||
+            memcmp(magic, info->magic, info->magic_len) != 0) {
+            continue;
+        }
+        memcpy(coded_name, dest_name, len + 1);
+        if (has_suffix(dest_name, info->suffix)) {
+            coded_name[len - strlen(info->suffix)] = '\0';
+        }
+        *codec = (CompressCodec)i;
+        return CODING_DECOMPRESS;
+    }
+    return CODING_COPY;
+}
+
+static int write_out(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n;
+        STATS_TIMED(STATS_WRITE, n = write(fd, buffer, len));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERROR_FILE_WRITE;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+// ============================================================================
+// COMPRESSION
+// ============================================================================
+
+static size_t block_bound(CompressCodec codec, size_t len) {
+    switch (codec) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP:
+            return compressBound((uLong)len) + 32;     // gzip wrapper is larger than zlib's
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            return LZ4F_compressFrameBound(len, NULL);
+#endif
+        default:
+            (void)len;
+            return 0;
+    }
+}
+
+// Compress one block into a self-contained member or frame
+static void compress_block(void *arg) {
+    CodecBlock *block = arg;
+    long start = thread_cpu_ns();
+
+    block->result = ERROR_FILE_WRITE;
+    switch (block->codec) {
+#ifdef HAVE_ZLIB
+        case COMPRESS_GZIP: {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (deflateInit2(&zs, block->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                break;
+            }
+            zs.next_in = (Bytef *)block->in;
+            zs.avail_in = (uInt)block->in_len;
+            zs.next_out = (Bytef *)block->out;
+            zs.avail_out = (uInt)block->out_cap;
+            if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+                block->out_len = zs.total_out;
+                block->result = SUCCESS;
+            }
+            deflateEnd(&zs);
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            size_t n = ZSTD_compress(block->out, block->out_cap, block->in, block->in_len, block->level);
+            if (!ZSTD_isError(n)) {
+                block->out_len = n;
+                block->result = SUCCESS;
+            }
+            break;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4: {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = block->level;
+            size_t n = LZ4F_compressFrame(block->out, block->out_cap, block->in, block->in_len, &prefs);
+            if (!LZ4F_isError(n)) {
+                block->out_len = n;
+                block->result = SUCCESS;
+            }
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+    block->cpu_ns = thread_cpu_ns() - start;
+}
+
+// Fill up to count blocks from the source; returns the blocks filled or -1
+static int read_blocks(int src_fd, CodecBlock *blocks, int count, off_t *offset, int *eof) {
+    int filled = 0;
+
+    while (filled < count && !*eof) {
+        ssize_t n;
+        STATS_TIMED(STATS_READ, n = pread_full(src_fd, blocks[filled].in, COMPRESS_BLOCK_SIZE, *offset));
+        if (n < 0) {
+            return -1;
+        }
+        if (n < COMPRESS_BLOCK_SIZE) {
+            *eof = 1;
+        }
+        // An empty file still becomes one (empty) member, which decoders accept
+        if (n == 0 && *offset > 0) {
+            break;
+        }
+        blocks[filled].in_len = (size_t)n;
+        *offset += n;
+        rate_limit_account((size_t)n);
+        filled++;
+    }
+    return filled;
+}
+
+static int compress_stream(int src_fd, int dest_fd, const struct stat *src_stat, CompressCodec codec,
+                           const char *label, CopyStats *stats, off_t *written) {
+    const CopyOptions *opts = get_copy_options();
+    int level = opts->compress_level > 0 ? opts->compress_level : codecs[codec].default_level;
+    int workers = opts->jobs > 1 && thread_pool_worker_index() < 0 &&
+                  src_stat->st_size >= 2 * COMPRESS_BLOCK_SIZE ? opts->jobs : 1;
+    // Two rounds of blocks: one compresses while the other is read and written
+    int depth = workers;
+    CodecBlock *blocks = calloc(2 * depth, sizeof(CodecBlock));
+    ThreadPool *pool = NULL;
+    off_t offset = 0;
+    long cpu_ns = 0;
+    int eof = 0;
+    int count[2] = { 0, 0 };
+    int cur = 0;
+    int result = SUCCESS;
+
+    *written = 0;
+    if (blocks == NULL) {
+        return ERROR_FILE_READ;
+    }
+    for (int i = 0; i < 2 * depth && result == SUCCESS; i++) {
+        blocks[i].codec = codec;
+        blocks[i].level = level;
+        blocks[i].out_cap = block_bound(codec, COMPRESS_BLOCK_SIZE);
+        blocks[i].in = io_buffer_alloc(COMPRESS_BLOCK_SIZE);
+        blocks[i].out = malloc(blocks[i].out_cap);
+        if (blocks[i].in == NULL || blocks[i].out == NULL) {
+            result = ERROR_FILE_READ;
+        }
+    }
+    if (result == SUCCESS && workers > 1) {
+        pool = thread_pool_create(workers);
+    }
+
+    if (result == SUCCESS) {
+        count[cur] = read_blocks(src_fd, blocks, depth, &offset, &eof);
+        if (count[cur] < 0) {
+            result = ERROR_FILE_READ;
+        }
+    }
+    while (result == SUCCESS && count[cur] > 0) {
+        CodecBlock *round = blocks + cur * depth;
+        CodecBlock *next = blocks + (!cur) * depth;
+
+        for (int i = 0; i < count[cur]; i++) {
+            if (pool == NULL || thread_pool_submit(pool, compress_block, &round[i]) != 0) {
+                compress_block(&round[i]);
+            }
+        }
+
+        // Read ahead while the workers compress
+        count[!cur] = eof ? 0 : read_blocks(src_fd, next, depth, &offset, &eof);
+        if (pool != NULL) {
+            thread_pool_wait(pool);
+        }
+        if (count[!cur] < 0) {
+            result = ERROR_FILE_READ;
+            break;
+        }
+
+        for (int i = 0; i < count[cur] && result == SUCCESS; i++) {
+            result = round[i].result;
+            if (result == SUCCESS) {
+                result = write_out(dest_fd, round[i].out, round[i].out_len);
+                *written += round[i].out_len;
+            }
+            cpu_ns += round[i].cpu_ns;
+        }
+        display_progress(offset, src_stat->st_size, label);
+        cur = !cur;
+    }
+
+    if (pool != NULL) {
+        thread_pool_destroy(pool);
+    }
+    for (int i = 0; i < 2 * depth; i++) {
+        free(blocks[i].in);
+        free(blocks[i].out);
+    }
+    free(blocks);
+
+    if (result == SUCCESS && stats != NULL) {
+        stats->compressed_files++;
+        stats->plain_bytes += offset;
+        stats->packed_bytes += *written;
+        stats->codec_cpu_ns += cpu_ns;
+    }
+    return result;
+}
+
+// ============================================================================
+// DECOMPRESSION
+// ============================================================================
+
+// Running totals of one decode
+typedef struct {
+    int dest_fd;
+    off_t size;             // Source size, for progress
+    off_t consumed;         // Compressed bytes read
+    off_t produced;         // Plain bytes written
+    long cpu_ns;
+    const char *label;
+} DecodeState;
+
+static ssize_t read_input(int src_fd, char *buffer, DecodeState *state) {
+    ssize_t n;
+
+    do {
+        STATS_TIMED(STATS_READ, n = read(src_fd, buffer, DECODE_BUFFER_SIZE));
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        state->consumed += n;
+        display_progress(state->consumed, state->size, state->label);
+        rate_limit_account((size_t)n);
+    }
+    return n;
+}
+
+static int emit(DecodeState *state, const char *buffer, size_t len) {
+    state->produced += len;
+    return len > 0 ? write_out(state->dest_fd, buffer, len) : SUCCESS;
+}
+
+#ifdef HAVE_ZLIB
+// Any number of gzip members, one after another
+static int decode_gzip(int src_fd, char *in, char *out, DecodeState *state) {
+    z_stream zs;
+    int ended = 0;
+    int result = SUCCESS;
+    ssize_t n;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        return ERROR_FILE_READ;
+    }
+    while (result == SUCCESS && (n = read_input(src_fd, in, state)) > 0) {
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = (uInt)n;
+        while (result == SUCCESS && zs.avail_in > 0) {
+            if (ended) {
+                inflateReset(&zs);
+                ended = 0;
+            }
+            zs.next_out = (Bytef *)out;
+            zs.avail_out = DECODE_BUFFER_SIZE;
+            long start = thread_cpu_ns();
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            state->cpu_ns += thread_cpu_ns() - start;
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                result = ERROR_FILE_READ;
+                break;
+            }
+            result = emit(state, out, DECODE_BUFFER_SIZE - zs.avail_out);
+            ended = rc == Z_STREAM_END;
+        }
+    }
+    if (result == SUCCESS && (n < 0 || !ended)) {
+        result = ERROR_FILE_READ;       // Read error or a member cut short
+    }
+    inflateEnd(&zs);
+    return result;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// Any number of zstd frames, one after another
+static int decode_zstd(int src_fd, char *in, char *out, DecodeState *state) {
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    size_t out_size = ZSTD_DStreamOutSize() < DECODE_BUFFER_SIZE ? ZSTD_DStreamOutSize()
+                                                                 : DECODE_BUFFER_SIZE;
+    size_t last = 1;
+    int result = SUCCESS;
+    ssize_t n;
+
+    if (stream == NULL) {
+        return ERROR_FILE_READ;
+    }
+    ZSTD_initDStream(stream);
+    while (result == SUCCESS && (n = read_input(src_fd, in, state)) > 0) {
+        ZSTD_inBuffer input = { in, (size_t)n, 0 };
+        while (result == SUCCESS && input.pos < input.size) {
+            ZSTD_outBuffer output = { out, out_size, 0 };
+            long start = thread_cpu_ns();
+            last = ZSTD_decompressStream(stream, &output, &input);
+            state->cpu_ns += thread_cpu_ns() - start;
+            if (ZSTD_isError(last)) {
+                result = ERROR_FILE_READ;
+                break;
+            }
+            result = emit(state, out, output.pos);
+        }
+    }
+    if (result == SUCCESS && (n < 0 || last != 0)) {
+        result = ERROR_FILE_READ;
+    }
+    ZSTD_freeDStream(stream);
+    return result;
+}
+#endif
+
+#ifdef HAVE_LZ4
+// Any number of LZ4 frames, one after another
+static int decode_lz4(int src_fd, char *in, char *out, DecodeState *state) {
+    LZ4F_dctx *dctx;
+    size_t last = 1;
+    int result = SUCCESS;
+    ssize_t n;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        return ERROR_FILE_READ;
+    }
+    while (result == SUCCESS && (n = read_input(src_fd, in, state)) > 0) {
+        const char *p = in;
+        size_t left = (size_t)n;
+        while (result == SUCCESS && left > 0) {
+            size_t out_len = DECODE_BUFFER_SIZE, in_len = left;
+            long start = thread_cpu_ns();
+            last = LZ4F_decompress(dctx, out, &out_len, p, &in_len, NULL);
+            state->cpu_ns += thread_cpu_ns() - start;
+            if (LZ4F_isError(last) || (in_len == 0 && out_len == 0)) {
+                result = ERROR_FILE_READ;
+                break;
+            }
+            result = emit(state, out, out_len);
+            p += in_len;
+            left -= in_len;
+        }
+    }
+    if (result == SUCCESS && (n < 0 || last != 0)) {
+        result = ERROR_FILE_READ;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    return result;
+}
+#endif
+
+static int decompress_stream(int src_fd, int dest_fd, const struct stat *src_stat, CompressCodec codec,
+                             const char *label, CopyStats *stats, off_t *written) {
+    DecodeState state = { dest_fd, src_stat->st_size, 0, 0, 0, label };
+    char *in = io_buffer_alloc(DECODE_BUFFER_SIZE);
+    char *out = io_buffer_alloc(DECODE_BUFFER_SIZE);
+    int result = ERROR_FILE_READ;
+
+    if (in != NULL && out != NULL) {
+        errno = 0;
+        switch (codec) {
+#ifdef HAVE_ZLIB
+            case COMPRESS_GZIP:
+                result = decode_gzip(src_fd, in, out, &state);
+                break;
+#endif
+#ifdef HAVE_ZSTD
+            case COMPRESS_ZSTD:
+                result = decode_zstd(src_fd, in, out, &state);
+                break;
+#endif
+#ifdef HAVE_LZ4
+            case COMPRESS_LZ4:
+                result = decode_lz4(src_fd, in, out, &state);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+    free(in);
+    free(out);
+
+    // Decoders fail on bad data, not on a system call
+    if (result != SUCCESS && errno == 0) {
+        errno = EBADMSG;
+    }
+    *written = state.produced;
+    if (result == SUCCESS && stats != NULL) {
+        stats->decompressed_files++;
+        stats->plain_bytes += state.produced;
+        stats->packed_bytes += state.consumed;
+        stats->codec_cpu_ns += state.cpu_ns;
+    }
+    return result;
+}
+
+int compress_fd_data(int src_fd, int dest_fd, const struct stat *src_stat, CodingAction action,
+                     CompressCodec codec, const char *label, CopyStats *stats, off_t *written) {
+    if (src_stat->st_size >= COMPRESS_BLOCK_SIZE) {
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (action == CODING_COMPRESS) {
+        return compress_stream(src_fd, dest_fd, src_stat, codec, label, stats, written);
+    }
+    return decompress_stream(src_fd, dest_fd, src_stat, codec, label, stats, written);
+}
@@ -0,0 +1,791 @@
+#include "copy_engine.h"
+#include "rate_limit.h"
+#include "resume.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+// Internal result: engine cannot handle this pair of files, try the next one
+#define ENGINE_UNSUPPORTED 1
+
+// --cache-neutral: how much of a copy has been handed back to the page cache
+typedef struct {
+    int src_fd;
+    int dest_fd;
+    off_t dropped;          // Destination [0, dropped) is out of the cache
+    off_t flushing;         // [dropped, flushing) is being written back
+} CacheRelease;
+
+// Release state of the copy running on this thread, NULL when not wanted
+static _Thread_local CacheRelease *active_release = NULL;
+
+static const char *engine_names[COPY_ENGINE_COUNT] = {
+    "auto",
+    "reflink",
+    "copy_file_range",
+    "sendfile",
+    "read_write",
+    "io_uring"
+};
+
+const char *copy_engine_name(CopyEngine engine) {
+    if ((int)engine < 0 || engine >= COPY_ENGINE_COUNT) {
+        return "unknown";
+    }
+    return engine_names[engine];
+}
+
+int parse_copy_engine(const char *name, CopyEngine *engine) {
+    // io_uring is a directory-walk batch mode, not a per-file engine
+    for (int i = 0; i <= COPY_ENGINE_READ_WRITE; i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            *engine = (CopyEngine)i;
+            return SUCCESS;
+        }
+    }
+    return ERROR_INVALID_PATH;
+}
+
+// Errors meaning "this kernel/filesystem can't do it", not "the copy failed"
+static int is_unsupported_errno(int err) {
+    return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP ||
+           err == EXDEV || err == EINVAL || err == ENOTTY || err == EBADF;
+}
+
+// Share the source extents with the destination (whole file, no data I/O)
+static int engine_reflink(int src_fd, int dest_fd) {
+#ifdef FICLONE
+    int result;
+    STATS_TIMED(STATS_WRITE, result = ioctl(dest_fd, FICLONE, src_fd));
+    if (result == 0) {
+        return SUCCESS;
+    }
+    if (is_unsupported_errno(errno) || errno == EPERM) {
+        return ENGINE_UNSUPPORTED;
+    }
+    return ERROR_FILE_WRITE;
+#else
+    (void)src_fd;
+    (void)dest_fd;
+    return ENGINE_UNSUPPORTED;
+#endif
+}
+
+// Give back the page cache used by the copy up to end. Source pages are
+// clean and go at once; destination pages must be written back first, so
+// they are dropped one chunk behind while the next chunk is in flight.
+static void release_copied(off_t end) {
+    CacheRelease *release = active_release;
+
+    if (release == NULL || end - release->flushing < CACHE_RELEASE_CHUNK) {
+        return;
+    }
+
+    posix_fadvise(release->src_fd, release->flushing, end - release->flushing,
+                  POSIX_FADV_DONTNEED);
+    if (release->flushing > release->dropped) {
+        STATS_TIMED(STATS_FSYNC,
+                    sync_file_range(release->dest_fd, release->dropped,
+                                    release->flushing - release->dropped,
+                                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                    SYNC_FILE_RANGE_WAIT_AFTER));
+        posix_fadvise(release->dest_fd, release->dropped,
+                      release->flushing - release->dropped, POSIX_FADV_DONTNEED);
+        release->dropped = release->flushing;
+    }
+    sync_file_range(release->dest_fd, release->flushing, end - release->flushing,
+                    SYNC_FILE_RANGE_WRITE);
+    release->flushing = end;
+}
+
+// Drop whatever the copy still has in the page cache
+static void release_rest(CacheRelease *release) {
+    posix_fadvise(release->src_fd, 0, 0, POSIX_FADV_DONTNEED);
+    STATS_TIMED(STATS_FSYNC,
+                sync_file_range(release->dest_fd, 0, 0,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER));
+    posix_fadvise(release->dest_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Hints for a copy that moves data (a reflink shares extents instead):
+// read the source ahead aggressively and allocate the destination in one
+// go, which also keeps it from fragmenting. Sparse copies keep their holes.
+static void start_copy_hints(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                             int sparse) {
+    off_t size = src_stat->st_size;
+
+    if ((flags & COPY_FD_DIRECT) || !S_ISREG(src_stat->st_mode) || size < COPY_HINT_MIN_SIZE) {
+        return;
+    }
+
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    STATS_TIMED(STATS_READ,
+                readahead(src_fd, 0, size < COPY_READAHEAD_SIZE ? (size_t)size : COPY_READAHEAD_SIZE));
+    if (!sparse) {
+        STATS_TIMED(STATS_METADATA, fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, size));
+    }
+}
+
+static int engine_copy_file_range(int src_fd, int dest_fd, off_t size,
+                                  const char *label, off_t *copied) {
+    ssize_t n;
+
+    while (1) {
+        STATS_TIMED(STATS_WRITE,
+                    n = copy_file_range(src_fd, NULL, dest_fd, NULL,
+                                        rate_limit_request(ENGINE_CHUNK_SIZE), 0));
+        if (n <= 0) {
+            break;
+        }
+        *copied += n;
+        display_progress(*copied, size, label);
+        release_copied(*copied);
+        resume_checkpoint(*copied);
+        rate_limit_account((size_t)n);
+    }
+
+    if (n < 0) {
+        if (is_unsupported_errno(errno)) {
+            return ENGINE_UNSUPPORTED;
+        }
+        return ERROR_FILE_WRITE;
+    }
+
+    // Some filesystems report success with 0 bytes instead of an error
+    if (*copied < size) {
+        return ENGINE_UNSUPPORTED;
+    }
+
+    return SUCCESS;
+}
+
+static int engine_sendfile(int src_fd, int dest_fd, off_t size,
+                           const char *label, off_t *copied) {
+    ssize_t n;
+
+    while (1) {
+        STATS_TIMED(STATS_WRITE,
+                    n = sendfile(dest_fd, src_fd, NULL, rate_limit_request(ENGINE_CHUNK_SIZE)));
+        if (n <= 0) {
+            break;
+        }
+        *copied += n;
+        display_progress(*copied, size, label);
+        release_copied(*copied);
+        resume_checkpoint(*copied);
+        rate_limit_account((size_t)n);
+    }
+
+    if (n < 0) {
+        if (is_unsupported_errno(errno)) {
+            return ENGINE_UNSUPPORTED;
+        }
+        return ERROR_FILE_WRITE;
+    }
+
+    if (*copied < size) {
+        return ENGINE_UNSUPPORTED;
+    }
+
+    return SUCCESS;
+}
+
+// Stop using O_DIRECT on a descriptor (for an unaligned tail or offset);
+// returns 1 if it was in use, so a refused request is worth retrying
+static int drop_direct(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+    if (fl >= 0 && (fl & O_DIRECT)) {
+        return fcntl(fd, F_SETFL, fl & ~O_DIRECT) == 0;
+    }
+    return 0;
+}
+
+// Feed a hole to a hash as the zero bytes a reader would see
+static void hash_zeros(HashContext *hash, off_t length) {
+    static const unsigned char zeros[65536];
+
+    while (length > 0) {
+        size_t n = length < (off_t)sizeof(zeros) ? (size_t)length : sizeof(zeros);
+        STATS_TIMED(STATS_HASH, hash_update(hash, zeros, n));
+        length -= n;
+    }
+}
+
+static int engine_read_write(int src_fd, int dest_fd, const struct stat *src_stat,
+                             const char *label, HashContext *hash, off_t *copied) {
+    size_t buffer_size = io_buffer_size(src_stat);
+    char *buffer = io_buffer_alloc(buffer_size);
+    off_t size = src_stat->st_size;
+    ssize_t bytes_read;
+    int result = SUCCESS;
+
+    if (buffer == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    // Buffer and offsets stay aligned, so O_DIRECT descriptors accept every
+    // request except the short one at end of file
+    while (1) {
+        size_t want = rate_limit_request(buffer_size);
+        STATS_TIMED(STATS_READ, bytes_read = read(src_fd, buffer, want));
+        if (bytes_read < 0 && errno == EINVAL) {
+            // O_DIRECT refused this offset; continue buffered
+            drop_direct(src_fd);
+            STATS_TIMED(STATS_READ, bytes_read = read(src_fd, buffer, want));
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        if (hash != NULL) {
+            STATS_TIMED(STATS_HASH, hash_update(hash, buffer, (size_t)bytes_read));
+        }
+
+        if ((size_t)bytes_read % DIRECT_IO_ALIGN != 0) {
+            drop_direct(dest_fd);
+        }
+
+        ssize_t done = 0;
+        while (done < bytes_read) {
+            ssize_t bytes_written;
+            STATS_TIMED(STATS_WRITE,
+                        bytes_written = write(dest_fd, buffer + done, bytes_read - done));
+            if (bytes_written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL && drop_direct(dest_fd)) {
+                    continue;
+                }
+                result = ERROR_FILE_WRITE;
+                break;
+            }
+            done += bytes_written;
+        }
+        if (result != SUCCESS) {
+            break;
+        }
+        *copied += done;
+        display_progress(*copied, size, label);
+        release_copied(*copied);
+        resume_checkpoint(*copied);
+        rate_limit_account((size_t)done);
+    }
+
+    if (result == SUCCESS && bytes_read < 0) {
+        result = ERROR_FILE_READ;
+    }
+
+    free(buffer);
+    return result;
+}
+
+int open_direct(const char *path, int flags, mode_t mode, int *direct) {
+    return openat_direct(AT_FDCWD, path, flags, mode, direct);
+}
+
+int openat_direct(int dirfd, const char *path, int flags, mode_t mode, int *direct) {
+    int fd = openat(dirfd, path, flags | O_DIRECT, mode);
+    if (fd >= 0) {
+        *direct = 1;
+        return fd;
+    }
+
+    // tmpfs and some network filesystems reject O_DIRECT
+    *direct = 0;
+    if (errno != EINVAL) {
+        return -1;
+    }
+    return openat(dirfd, path, flags, mode);
+}
+
+// Copy [offset, offset + length) to the same offset in the destination;
+// *moved receives the bytes copied, fewer than length if the source shrank
+static int copy_range(int src_fd, int dest_fd, off_t offset, off_t length, int flags,
+                      char *buffer, size_t buffer_size, HashContext *hash, CopyEngine *engine,
+                      off_t *moved) {
+    off_t start = offset;
+    off_t end = offset + length;
+
+    if (!(flags & COPY_FD_DIRECT) && hash == NULL && *engine != COPY_ENGINE_READ_WRITE) {
+        off_t in = offset, out = offset;
+        while (in < end) {
+            size_t want = rate_limit_request(ENGINE_CHUNK_SIZE);
+            ssize_t n;
+            if ((off_t)want > end - in) {
+                want = (size_t)(end - in);
+            }
+            STATS_TIMED(STATS_WRITE, n = copy_file_range(src_fd, &in, dest_fd, &out, want, 0));
+            if (n <= 0) {
+                if (n < 0 && !is_unsupported_errno(errno)) {
+                    return ERROR_FILE_WRITE;
+                }
+                break;
+            }
+            rate_limit_account((size_t)n);
+        }
+        if (in >= end) {
+            *engine = COPY_ENGINE_COPY_FILE_RANGE;
+            *moved = in - start;
+            return SUCCESS;
+        }
+        // Unsupported: finish this range (and the rest) with pread/pwrite
+        offset = in;
+        *engine = COPY_ENGINE_READ_WRITE;
+    }
+
+    while (offset < end) {
+        size_t want = rate_limit_request(buffer_size);
+        ssize_t n;
+        if ((off_t)want > end - offset) {
+            want = (size_t)(end - offset);
+        }
+        STATS_TIMED(STATS_READ, n = pread(src_fd, buffer, want, offset));
+        if (n < 0 && errno == EINVAL) {
+            drop_direct(src_fd);
+            STATS_TIMED(STATS_READ, n = pread(src_fd, buffer, want, offset));
+        }
+        if (n < 0) {
+            return ERROR_FILE_READ;
+        }
+        if (n == 0) {
+            break;  // File shrank while we were copying it
+        }
+        if (hash != NULL) {
+            STATS_TIMED(STATS_HASH, hash_update(hash, buffer, (size_t)n));
+        }
+        if ((size_t)n % DIRECT_IO_ALIGN != 0) {
+            drop_direct(dest_fd);
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t w;
+            STATS_TIMED(STATS_WRITE, w = pwrite(dest_fd, buffer + done, n - done, offset + done));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL && drop_direct(dest_fd)) {
+                    continue;
+                }
+                return ERROR_FILE_WRITE;
+            }
+            done += w;
+        }
+        offset += n;
+        rate_limit_account((size_t)n);
+    }
+
+    *moved = offset - start;
+    return SUCCESS;
+}
+
+// Copy only the data extents of a sparse file, then set the final size so
+// trailing holes exist too. Returns ENGINE_UNSUPPORTED if the filesystem
+// cannot report holes.
+static int copy_sparse(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                       const char *label, HashContext *hash, CopyFdResult *out) {
+    off_t size = src_stat->st_size;
+    off_t data, hole = 0;
+    off_t hashed = 0;       // End of the data fed to hash so far
+    off_t moved;
+    size_t buffer_size = io_buffer_size(src_stat);
+    char *buffer;
+    int result = SUCCESS;
+
+    STATS_TIMED(STATS_METADATA, data = lseek(src_fd, 0, SEEK_DATA));
+    if (data < 0 && errno != ENXIO) {
+        return ENGINE_UNSUPPORTED;
+    }
+
+    buffer = io_buffer_alloc(buffer_size);
+    if (buffer == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    if ((flags & COPY_FD_DIRECT) || hash != NULL ||
+        get_copy_options()->engine == COPY_ENGINE_READ_WRITE) {
+        out->engine = COPY_ENGINE_READ_WRITE;
+    } else {
+        out->engine = COPY_ENGINE_COPY_FILE_RANGE;
+    }
+
+    while (data >= 0 && data < size) {
+        STATS_TIMED(STATS_METADATA, hole = lseek(src_fd, data, SEEK_HOLE));
+        if (hole < 0) {
+            hole = size;
+        }
+
+        if (hash != NULL) {
+            hash_zeros(hash, data - hashed);
+            hashed = hole;
+        }
+        result = copy_range(src_fd, dest_fd, data, hole - data, flags,
+                            buffer, buffer_size, hash, &out->engine, &moved);
+        if (result != SUCCESS) {
+            break;
+        }
+        out->data_bytes += moved;
+        display_progress(hole, size, label);
+        release_copied(hole);
+        resume_checkpoint(hole);
+
+        STATS_TIMED(STATS_METADATA, data = lseek(src_fd, hole, SEEK_DATA));
+    }
+
+    free(buffer);
+
+    if (result == SUCCESS && hash != NULL) {
+        hash_zeros(hash, size - hashed);
+    }
+    if (result == SUCCESS) {
+        int truncated;
+        STATS_TIMED(STATS_METADATA, truncated = ftruncate(dest_fd, size));
+        if (truncated != 0) {
+            result = ERROR_FILE_WRITE;
+        }
+    }
+    if (result == SUCCESS) {
+        out->sparse = 1;
+        display_progress(size, size, label);
+    }
+
+    return result;
+}
+
+// A file split into ranges that several workers copy at once (--split)
+typedef struct {
+    int src_fd;
+    int dest_fd;
+    const struct stat *src_stat;
+    off_t size;
+    off_t range_size;
+    int flags;
+    CopyEngine engine;          // Engine the workers start with
+    const char *label;
+    int progress;               // Progress switch of the calling thread
+    CopyStats *stats;           // Statistics of the calling thread
+    RateFlow *flow;             // Rate limit flow of the calling thread
+    ResumeFile *resume;         // Checkpoints of the calling thread, NULL if none
+    pthread_mutex_t lock;       // Protects done and prefix
+    unsigned char *done;        // Finished ranges, when checkpointing
+    long prefix;                // Ranges finished with none missing before them
+    atomic_long next;           // Next range to claim
+    atomic_long copied;         // Bytes copied by every worker so far
+    atomic_int fell_back;       // Some range needed pread/pwrite
+    atomic_int result;          // First error, SUCCESS if none
+} SplitCopy;
+
+// Worth splitting: a large plain copy started outside any worker pool
+// (directory copies already keep every worker busy with whole files)
+static int split_wanted(const struct stat *src_stat, HashContext *hash) {
+    const CopyOptions *opts = get_copy_options();
+
+    return opts->split_size > 0 && opts->jobs > 1 && hash == NULL &&
+           S_ISREG(src_stat->st_mode) && src_stat->st_size / 2 >= (off_t)opts->split_size &&
+           thread_pool_worker_index() < 0;
+}
+
+// Note a finished range; checkpoints cover the ranges done without a gap
+static void split_range_done(SplitCopy *split, long range) {
+    long ranges = (split->size + split->range_size - 1) / split->range_size;
+
+    if (split->done == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&split->lock);
+    split->done[range] = 1;
+    while (split->prefix < ranges && split->done[split->prefix]) {
+        split->prefix++;
+    }
+    resume_checkpoint(split->prefix < ranges ? split->prefix * split->range_size : split->size);
+    pthread_mutex_unlock(&split->lock);
+}
+
+static void copy_split_ranges(void *arg) {
+    SplitCopy *split = arg;
+    size_t buffer_size = io_buffer_size(split->src_stat);
+    char *buffer = io_buffer_alloc(buffer_size);
+    CopyStats *outer = stats_bind(split->stats);
+    RateFlow *outer_flow = rate_bind(split->flow);
+    ResumeFile *outer_resume = resume_bind(split->resume);
+    int progress = progress_enabled();
+    long range;
+
+    set_progress_enabled(split->progress);
+    if (buffer == NULL) {
+        atomic_store(&split->result, ERROR_FILE_READ);
+    }
+
+    while (atomic_load(&split->result) == SUCCESS &&
+           (range = atomic_fetch_add(&split->next, 1)) * split->range_size < split->size) {
+        off_t offset = range * split->range_size;
+        off_t end = offset + split->range_size < split->size ? offset + split->range_size : split->size;
+        CopyEngine engine = split->engine;
+
+        // Steps of one engine chunk keep the shared progress moving
+        while (offset < end) {
+            off_t length = end - offset < ENGINE_CHUNK_SIZE ? end - offset : ENGINE_CHUNK_SIZE;
+            off_t moved;
+            int result = copy_range(split->src_fd, split->dest_fd, offset, length, split->flags,
+                                    buffer, buffer_size, NULL, &engine, &moved);
+            if (result != SUCCESS) {
+                atomic_store(&split->result, result);
+                break;
+            }
+            display_progress(atomic_fetch_add(&split->copied, moved) + moved, split->size,
+                             split->label);
+            if (moved < length) {
+                break;  // The source shrank: nothing is left in this range
+            }
+            offset += length;
+        }
+        if (atomic_load(&split->result) == SUCCESS) {
+            split_range_done(split, range);
+        }
+        if (engine == COPY_ENGINE_READ_WRITE) {
+            atomic_store(&split->fell_back, 1);
+        }
+    }
+
+    set_progress_enabled(progress);
+    stats_bind(outer);
+    rate_bind(outer_flow);
+    resume_bind(outer_resume);
+    free(buffer);
+}
+
+// Copy a large file as split_size ranges, one worker per range at a time;
+// the calling thread works through ranges alongside the pool
+static int copy_split(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                      CopyEngine engine, const char *label, CopyFdResult *out) {
+    const CopyOptions *opts = get_copy_options();
+    off_t ranges = (src_stat->st_size + opts->split_size - 1) / opts->split_size;
+    int workers = opts->jobs < ranges ? opts->jobs : (int)ranges;
+    SplitCopy split;
+    ThreadPool *pool;
+
+    split.src_fd = src_fd;
+    split.dest_fd = dest_fd;
+    split.src_stat = src_stat;
+    split.size = src_stat->st_size;
+    split.range_size = (off_t)opts->split_size;
+    split.flags = flags;
+    split.engine = (flags & COPY_FD_DIRECT) ? COPY_ENGINE_READ_WRITE : engine;
+    split.label = label;
+    split.progress = progress_enabled();
+    split.stats = stats_bind(NULL);
+    stats_bind(split.stats);
+    split.flow = rate_bind(NULL);
+    rate_bind(split.flow);
+    split.resume = resume_bind(NULL);
+    resume_bind(split.resume);
+    split.done = split.resume != NULL ? calloc((size_t)ranges, 1) : NULL;
+    if (split.resume != NULL && split.done == NULL) {
+        // No room to track ranges: copy in order, which still checkpoints
+        return copy_fd_from(src_fd, dest_fd, src_stat, 0, flags, label, out);
+    }
+    pthread_mutex_init(&split.lock, NULL);
+    split.prefix = 0;
+    atomic_init(&split.next, 0);
+    atomic_init(&split.copied, 0);
+    atomic_init(&split.fell_back, 0);
+    atomic_init(&split.result, SUCCESS);
+
+    // Workers write out of order: allocate the whole file up front (the
+    // hints already did unless O_DIRECT is in use)
+    if (flags & COPY_FD_DIRECT) {
+        STATS_TIMED(STATS_METADATA, fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, split.size));
+    }
+
+    pool = thread_pool_create(workers - 1);
+    for (int w = 0; pool != NULL && w < workers - 1; w++) {
+        if (thread_pool_submit(pool, copy_split_ranges, &split) != 0) {
+            break;
+        }
+    }
+    copy_split_ranges(&split);
+    if (pool != NULL) {
+        thread_pool_wait(pool);
+        thread_pool_destroy(pool);
+    }
+    free(split.done);
+    pthread_mutex_destroy(&split.lock);
+
+    int result = atomic_load(&split.result);
+    if (result == SUCCESS) {
+        out->engine = atomic_load(&split.fell_back) || split.engine == COPY_ENGINE_READ_WRITE
+                          ? COPY_ENGINE_READ_WRITE : COPY_ENGINE_COPY_FILE_RANGE;
+        out->data_bytes = atomic_load(&split.copied);
+    }
+    return result;
+}
+
+static int copy_fd_engines(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                           const char *label, HashContext *hash, CopyFdResult *out) {
+    CopyEngine engine = get_copy_options()->engine;
+    off_t size = src_stat->st_size;
+    off_t copied = 0;
+    int hinted = 0;
+    int result = ENGINE_UNSUPPORTED;
+
+    out->engine = COPY_ENGINE_READ_WRITE;
+    out->data_bytes = 0;
+    out->sparse = 0;
+
+    if (engine == COPY_ENGINE_AUTO || engine > COPY_ENGINE_READ_WRITE) {
+        engine = COPY_ENGINE_REFLINK;
+    }
+
+    // Only read()/write() passes the data through a buffer we can hash
+    if (hash != NULL) {
+        engine = COPY_ENGINE_READ_WRITE;
+    }
+
+    // Sparse file: share extents if possible, otherwise copy data extents only
+    if (size > 0 && S_ISREG(src_stat->st_mode) &&
+        (off_t)src_stat->st_blocks * 512 < size) {
+        if (engine == COPY_ENGINE_REFLINK && engine_reflink(src_fd, dest_fd) == SUCCESS) {
+            out->engine = COPY_ENGINE_REFLINK;
+            out->data_bytes = (off_t)src_stat->st_blocks * 512;
+            out->sparse = 1;
+            display_progress(size, size, label);
+            return SUCCESS;
+        }
+        start_copy_hints(src_fd, dest_fd, src_stat, flags, 1);
+        result = copy_sparse(src_fd, dest_fd, src_stat, flags, label, hash, out);
+        if (result != ENGINE_UNSUPPORTED) {
+            return result;
+        }
+    }
+
+    // Files reporting size 0 (procfs, sysfs, pipes) only work with read()
+    if (size <= 0) {
+        engine = COPY_ENGINE_READ_WRITE;
+    }
+
+    // Every engine leaves both file offsets at the end of the data it
+    // transferred, so a fallback simply continues where the last one stopped
+    for (; engine <= COPY_ENGINE_READ_WRITE; engine++) {
+        if (engine != COPY_ENGINE_REFLINK && !hinted) {
+            start_copy_hints(src_fd, dest_fd, src_stat, flags, 0);
+            hinted = 1;
+            // Past reflink, the data has to move: spread it over workers
+            if (split_wanted(src_stat, hash)) {
+                return copy_split(src_fd, dest_fd, src_stat, flags, engine, label, out);
+            }
+        }
+        switch (engine) {
+            case COPY_ENGINE_REFLINK:
+                result = engine_reflink(src_fd, dest_fd);
+                if (result == SUCCESS) {
+                    copied = size;
+                    display_progress(copied, size, label);
+                }
+                break;
+            case COPY_ENGINE_COPY_FILE_RANGE:
+            case COPY_ENGINE_SENDFILE:
+                // In-kernel copies go through the page cache
+                if (flags & COPY_FD_DIRECT) {
+                    result = ENGINE_UNSUPPORTED;
+                } else if (engine == COPY_ENGINE_SENDFILE) {
+                    result = engine_sendfile(src_fd, dest_fd, size, label, &copied);
+                } else {
+                    result = engine_copy_file_range(src_fd, dest_fd, size, label, &copied);
+                }
+                break;
+            default:
+                result = engine_read_write(src_fd, dest_fd, src_stat, label, hash, &copied);
+                break;
+        }
+
+        if (result != ENGINE_UNSUPPORTED) {
+            break;
+        }
+    }
+
+    if (result == SUCCESS) {
+        out->engine = engine;
+        out->data_bytes = copied;
+    }
+
+    return result;
+}
+
+int copy_fd_data(int src_fd, int dest_fd, const struct stat *src_stat, int flags,
+                 const char *label, HashContext *hash, CopyFdResult *out) {
+    CacheRelease release = { src_fd, dest_fd, 0, 0 };
+    CopyFdResult local;
+    int result;
+
+    if (out == NULL) {
+        out = &local;
+    }
+
+    // O_DIRECT data never enters the page cache in the first place
+    if (!get_copy_options()->cache_neutral || (flags & COPY_FD_DIRECT) ||
+        !S_ISREG(src_stat->st_mode)) {
+        return copy_fd_engines(src_fd, dest_fd, src_stat, flags, label, hash, out);
+    }
+
+    active_release = &release;
+    result = copy_fd_engines(src_fd, dest_fd, src_stat, flags, label, hash, out);
+    active_release = NULL;
+
+    if (result == SUCCESS && out->engine != COPY_ENGINE_REFLINK) {
+        release_rest(&release);
+    }
+    return result;
+}
+
+int copy_fd_from(int src_fd, int dest_fd, const struct stat *src_stat, off_t offset, int flags,
+                 const char *label, CopyFdResult *out) {
+    size_t buffer_size = io_buffer_size(src_stat);
+    char *buffer = io_buffer_alloc(buffer_size);
+    CopyEngine engine = get_copy_options()->engine == COPY_ENGINE_READ_WRITE
+                        ? COPY_ENGINE_READ_WRITE : COPY_ENGINE_COPY_FILE_RANGE;
+    off_t size = src_stat->st_size;
+    struct stat dest_stat;
+    int result = SUCCESS;
+
+    out->engine = engine;
+    out->data_bytes = 0;
+    out->sparse = 0;
+    if (buffer == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    if (!(flags & COPY_FD_DIRECT)) {
+        posix_fadvise(src_fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    display_progress(offset, size, label);
+
+    // Chunk by chunk, so checkpoints keep coming as the rest is copied
+    while (offset < size) {
+        off_t length = size - offset < ENGINE_CHUNK_SIZE ? size - offset : ENGINE_CHUNK_SIZE;
+        off_t moved;
+        result = copy_range(src_fd, dest_fd, offset, length, flags, buffer, buffer_size,
+                            NULL, &engine, &moved);
+        if (result != SUCCESS) {
+            break;
+        }
+        offset += moved;
+        out->data_bytes += moved;
+        display_progress(offset, size, label);
+        resume_checkpoint(offset);
+        if (moved < length) {
+            break;  // The source shrank while we were copying it
+        }
+    }
+    free(buffer);
+
+    // An earlier run may have written past the source's current end
+    if (result == SUCCESS && fstat(dest_fd, &dest_stat) == 0 && dest_stat.st_size != size) {
+        STATS_TIMED(STATS_METADATA, result = ftruncate(dest_fd, size) == 0 ? SUCCESS
+                                                                           : ERROR_FILE_WRITE);
+    }
+    out->engine = engine;
+    return result;
+}
@@ -0,0 +1,480 @@
+#include "dedup.h"
+#include "hash.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+// Copy state of a recorded file
+typedef enum {
+    ENTRY_PENDING = 0,      // Being copied; linking to it has to wait
+    ENTRY_DONE,             // Copied, can be linked to
+    ENTRY_FAILED            // Not copied, never linked to
+} EntryState;
+
+struct DedupEntry {
+    DedupEntry *link_next;      // Chain in the (dev, inode) map
+    DedupEntry *size_next;      // Chain in the size map
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    char *src_path;
+    char *dest_path;
+    EntryState state;
+    int have_partial;
+    int have_full;
+    uint64_t partial;
+    unsigned char full[SHA256_DIGEST_SIZE];
+};
+
+// Chained hash map; entries are only freed with the table
+typedef struct {
+    DedupEntry **buckets;
+    size_t bucket_count;        // Power of two
+    size_t count;
+} EntryMap;
+
+struct DedupTable {
+    DedupMode mode;
+    pthread_mutex_t lock;
+    pthread_cond_t done;        // Broadcast whenever an entry stops being pending
+    EntryMap links;             // Source files with more than one link
+    EntryMap sizes;             // Candidates for content dedup
+    DedupEntry **all;           // Every entry, for freeing
+    size_t all_count;
+    size_t all_capacity;
+};
+
+int parse_dedup_mode(const char *name, DedupMode *mode) {
+    if (strcmp(name, "hardlink") == 0) {
+        *mode = DEDUP_HARDLINK;
+    } else if (strcmp(name, "reflink") == 0) {
+        *mode = DEDUP_REFLINK;
+    } else {
+        return ERROR_INVALID_PATH;
+    }
+    return SUCCESS;
+}
+
+// splitmix64 finalizer: spreads nearby sizes and inode numbers over the buckets
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t link_key(dev_t dev, ino_t ino) {
+    return mix((uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)ino);
+}
+
+// Next entry in whichever chain a map uses
+static DedupEntry **chain_next(const EntryMap *map, const DedupTable *table, DedupEntry *entry) {
+    return map == &table->links ? &entry->link_next : &entry->size_next;
+}
+
+static uint64_t entry_key(const EntryMap *map, const DedupTable *table, const DedupEntry *entry) {
+    return map == &table->links ? link_key(entry->dev, entry->ino) : mix((uint64_t)entry->size);
+}
+
+// Insert into a map, doubling its buckets when it gets as long as it is wide
+static int map_insert(DedupTable *table, EntryMap *map, DedupEntry *entry) {
+    if (map->count >= map->bucket_count) {
+        size_t count = map->bucket_count > 0 ? map->bucket_count * 2 : 1024;
+        DedupEntry **buckets = calloc(count, sizeof(DedupEntry *));
+        if (buckets == NULL) {
+            return ERROR_FILE_READ;
+        }
+        for (size_t i = 0; i < map->bucket_count; i++) {
+            DedupEntry *e = map->buckets[i];
+            while (e != NULL) {
+                DedupEntry *next = *chain_next(map, table, e);
+                size_t b = entry_key(map, table, e) & (count - 1);
+                *chain_next(map, table, e) = buckets[b];
+                buckets[b] = e;
+                e = next;
+            }
+        }
+        free(map->buckets);
+        map->buckets = buckets;
+        map->bucket_count = count;
+    }
+
+    size_t b = entry_key(map, table, entry) & (map->bucket_count - 1);
+    *chain_next(map, table, entry) = map->buckets[b];
+    map->buckets[b] = entry;
+    map->count++;
+    return SUCCESS;
+}
+
+DedupTable *dedup_table_new(DedupMode mode) {
+    DedupTable *table = calloc(1, sizeof(DedupTable));
+
+    if (table == NULL) {
+        return NULL;
+    }
+    table->mode = mode;
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->done, NULL);
+    return table;
+}
+
+void dedup_table_free(DedupTable *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < table->all_count; i++) {
+        free(table->all[i]->src_path);
+        free(table->all[i]->dest_path);
+        free(table->all[i]);
+    }
+    free(table->all);
+    free(table->links.buckets);
+    free(table->sizes.buckets);
+    pthread_cond_destroy(&table->done);
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+// Record a new pending entry (lock held)
+static DedupEntry *new_entry(DedupTable *table, const struct stat *st, const char *src_path,
+                             const char *dest_path) {
+    DedupEntry *entry;
+
+    if (table->all_count == table->all_capacity) {
+        size_t capacity = table->all_capacity > 0 ? table->all_capacity * 2 : 1024;
+        DedupEntry **grown = realloc(table->all, capacity * sizeof(DedupEntry *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        table->all = grown;
+        table->all_capacity = capacity;
+    }
+
+    entry = calloc(1, sizeof(DedupEntry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->src_path = strdup(src_path);
+    entry->dest_path = strdup(dest_path);
+    if (entry->src_path == NULL || entry->dest_path == NULL) {
+        free(entry->src_path);
+        free(entry->dest_path);
+        free(entry);
+        return NULL;
+    }
+    table->all[table->all_count++] = entry;
+    return entry;
+}
+
+// Wait until another thread has finished copying an entry (lock held)
+static EntryState wait_done(DedupTable *table, DedupEntry *entry) {
+    while (entry->state == ENTRY_PENDING) {
+        pthread_cond_wait(&table->done, &table->lock);
+    }
+    return entry->state;
+}
+
+// XXH64 of the first and last DEDUP_PARTIAL_SIZE bytes
+static int partial_hash(int fd, off_t size, uint64_t *out) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    HashContext ctx;
+    char *buffer = malloc(DEDUP_PARTIAL_SIZE);
+    off_t offsets[2] = { 0, size > DEDUP_PARTIAL_SIZE ? size - DEDUP_PARTIAL_SIZE : size };
+
+    if (buffer == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    hash_init(&ctx, HASH_XXH64);
+    for (int i = 0; i < 2; i++) {
+        size_t want = size - offsets[i] < DEDUP_PARTIAL_SIZE ? (size_t)(size - offsets[i])
+                                                             : DEDUP_PARTIAL_SIZE;
+        ssize_t n = 0;
+        if (want == 0) {
+            continue;
+        }
+        STATS_TIMED(STATS_READ, n = pread(fd, buffer, want, offsets[i]));
+        if (n != (ssize_t)want) {
+            free(buffer);
+            return ERROR_FILE_READ;
+        }
+        STATS_TIMED(STATS_HASH, hash_update(&ctx, buffer, want));
+    }
+    free(buffer);
+
+    hash_final(&ctx, digest);
+    memcpy(out, digest, sizeof(*out));
+    return SUCCESS;
+}
+
+// SHA-256 of the whole file, leaving the offset at 0
+static int full_hash(int fd, unsigned char *out) {
+    HashContext ctx;
+    int result;
+
+    hash_init(&ctx, HASH_SHA256);
+    result = hash_fd(fd, &ctx);
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        result = ERROR_FILE_READ;
+    }
+    if (result == SUCCESS) {
+        hash_final(&ctx, out);
+    }
+    return result;
+}
+
+// Fill in a candidate's hash from its source (lock not held)
+static int candidate_hash(DedupTable *table, DedupEntry *entry, int full) {
+    uint64_t partial = 0;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int have, fd, result;
+
+    pthread_mutex_lock(&table->lock);
+    have = full ? entry->have_full : entry->have_partial;
+    pthread_mutex_unlock(&table->lock);
+    if (have) {
+        return SUCCESS;
+    }
+
+    STATS_TIMED(STATS_OPEN, fd = open(entry->src_path, O_RDONLY));
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+    result = full ? full_hash(fd, digest) : partial_hash(fd, entry->size, &partial);
+    STATS_TIMED(STATS_OPEN, close(fd));
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    // Two threads may hash the same candidate; both get the same answer
+    pthread_mutex_lock(&table->lock);
+    if (full) {
+        memcpy(entry->full, digest, sizeof(digest));
+        entry->have_full = 1;
+    } else {
+        entry->partial = partial;
+        entry->have_partial = 1;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return SUCCESS;
+}
+
+// Look for an earlier copy with the same contents (lock not held)
+static DedupEntry *find_duplicate(DedupTable *table, int src_fd, const struct stat *st,
+                                  DedupEntry *ours) {
+    DedupEntry **candidates = NULL;
+    size_t count = 0, capacity = 0;
+    DedupEntry *match = NULL;
+
+    // Same size first: no file is read unless another one could match it
+    pthread_mutex_lock(&table->lock);
+    if (table->sizes.bucket_count > 0) {
+        size_t b = mix((uint64_t)st->st_size) & (table->sizes.bucket_count - 1);
+        for (DedupEntry *e = table->sizes.buckets[b]; e != NULL; e = e->size_next) {
+            if (e->size != st->st_size || e->state == ENTRY_FAILED) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 8;
+                DedupEntry **grown = realloc(candidates, capacity * sizeof(DedupEntry *));
+                if (grown == NULL) {
+                    break;
+                }
+                candidates = grown;
+            }
+            candidates[count++] = e;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    for (size_t i = 0; i < count && match == NULL; i++) {
+        DedupEntry *e = candidates[i];
+
+        if (!ours->have_partial) {
+            if (partial_hash(src_fd, st->st_size, &ours->partial) != SUCCESS) {
+                break;
+            }
+            ours->have_partial = 1;
+        }
+        if (candidate_hash(table, e, 0) != SUCCESS || e->partial != ours->partial) {
+            continue;
+        }
+
+        if (!ours->have_full) {
+            if (full_hash(src_fd, ours->full) != SUCCESS) {
+                break;
+            }
+            ours->have_full = 1;
+        }
+        if (candidate_hash(table, e, 1) != SUCCESS ||
+            memcmp(e->full, ours->full, SHA256_DIGEST_SIZE) != 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&table->lock);
+        if (wait_done(table, e) == ENTRY_DONE) {
+            match = e;
+        }
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    free(candidates);
+    return match;
+}
+
+// Create dest as a hardlink or reflink of an earlier copy
+static int make_link(DedupMode how, const char *target, int dest_dirfd, const char *dest_name,
+                     mode_t mode) {
+    int result;
+
+    if (how == DEDUP_HARDLINK) {
+        STATS_TIMED(STATS_METADATA, result = linkat(AT_FDCWD, target, dest_dirfd, dest_name, 0));
+        if (result != 0 && errno == EEXIST) {
+            // Replace what an earlier run left there
+            STATS_TIMED(STATS_METADATA, result = unlinkat(dest_dirfd, dest_name, 0));
+            if (result == 0) {
+                STATS_TIMED(STATS_METADATA,
+                            result = linkat(AT_FDCWD, target, dest_dirfd, dest_name, 0));
+            }
+        }
+        return result == 0 ? SUCCESS : ERROR_FILE_WRITE;
+    }
+
+    int target_fd, dest_fd;
+    STATS_TIMED(STATS_OPEN, target_fd = open(target, O_RDONLY));
+    if (target_fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+    STATS_TIMED(STATS_OPEN, dest_fd = openat(dest_dirfd, dest_name, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (dest_fd < 0) {
+        close(target_fd);
+        return ERROR_FILE_OPEN;
+    }
+    STATS_TIMED(STATS_WRITE, result = ioctl(dest_fd, FICLONE, target_fd));
+    if (result == 0) {
+        STATS_TIMED(STATS_METADATA, fchmod(dest_fd, mode));
+    }
+    close(target_fd);
+    STATS_TIMED(STATS_OPEN, close(dest_fd));
+    return result == 0 ? SUCCESS : ERROR_FILE_WRITE;
+}
+
+// Count a file materialized from an earlier copy
+static void count_link(CopyStats *stats, const struct stat *st, int hardlinked_source) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->total_files++;
+    if (hardlinked_source) {
+        stats->linked_files++;
+    } else {
+        stats->deduped_files++;
+    }
+    stats->deduped_bytes += st->st_size;
+    update_stats(stats, 0);
+}
+
+int dedup_link_file(DedupTable *table, int src_fd, const struct stat *src_stat,
+                    const char *src_path, int dest_dirfd, const char *dest_name,
+                    const char *dest_path, CopyStats *stats, DedupEntry **claim) {
+    DedupEntry *entry = NULL;
+    DedupEntry *match;
+    int by_content = table->mode != DEDUP_OFF && src_stat->st_size > 0;
+
+    *claim = NULL;
+    if (!S_ISREG(src_stat->st_mode) || (src_stat->st_nlink < 2 && !by_content)) {
+        return 0;
+    }
+
+    // Another name of a file already copied: link it the same way
+    if (src_stat->st_nlink > 1) {
+        pthread_mutex_lock(&table->lock);
+        if (table->links.bucket_count > 0) {
+            size_t b = link_key(src_stat->st_dev, src_stat->st_ino) &
+                       (table->links.bucket_count - 1);
+            for (DedupEntry *e = table->links.buckets[b]; e != NULL; e = e->link_next) {
+                if (e->dev == src_stat->st_dev && e->ino == src_stat->st_ino) {
+                    entry = e;
+                    break;
+                }
+            }
+        }
+        if (entry != NULL) {
+            EntryState state = wait_done(table, entry);
+            pthread_mutex_unlock(&table->lock);
+            if (state == ENTRY_DONE &&
+                make_link(DEDUP_HARDLINK, entry->dest_path, dest_dirfd, dest_name,
+                          src_stat->st_mode) == SUCCESS) {
+                count_link(stats, src_stat, 1);
+                return 1;
+            }
+            return 0;
+        }
+
+        entry = new_entry(table, src_stat, src_path, dest_path);
+        if (entry != NULL && map_insert(table, &table->links, entry) != SUCCESS) {
+            entry->state = ENTRY_FAILED;
+            entry = NULL;
+        }
+        pthread_mutex_unlock(&table->lock);
+
+        if (!by_content) {
+            *claim = entry;
+            return 0;
+        }
+    }
+
+    // Hashes land in a scratch entry until we know whether this file is new
+    DedupEntry ours = { 0 };
+    match = find_duplicate(table, src_fd, src_stat, &ours);
+
+    pthread_mutex_lock(&table->lock);
+    if (entry == NULL) {
+        entry = new_entry(table, src_stat, src_path, dest_path);
+    }
+    if (entry != NULL) {
+        entry->have_partial = ours.have_partial;
+        entry->partial = ours.partial;
+        entry->have_full = ours.have_full;
+        memcpy(entry->full, ours.full, sizeof(ours.full));
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (match != NULL &&
+        make_link(table->mode, match->dest_path, dest_dirfd, dest_name,
+                  src_stat->st_mode) == SUCCESS) {
+        // Later names of this inode can link to the new one
+        if (entry != NULL) {
+            dedup_finish(table, entry, SUCCESS);
+        }
+        count_link(stats, src_stat, 0);
+        return 1;
+    }
+
+    // First of its contents: later duplicates link to this copy
+    pthread_mutex_lock(&table->lock);
+    if (entry != NULL && map_insert(table, &table->sizes, entry) != SUCCESS) {
+        entry->state = ENTRY_FAILED;
+        pthread_cond_broadcast(&table->done);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    *claim = entry;
+    return 0;
+}
+
+void dedup_finish(DedupTable *table, DedupEntry *claim, int result) {
+    pthread_mutex_lock(&table->lock);
+    claim->state = result == SUCCESS ? ENTRY_DONE : ENTRY_FAILED;
+    pthread_cond_broadcast(&table->done);
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,379 @@
+#include "dir_list.h"
+
+// Fields the detailed listing shows
+#define LIST_FIELDS (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME)
+
+// Longest formatted line: the columns plus a NAME_MAX name
+#define LIST_LINE_MAX 512
+
+// Local times are cached per 15 minutes of UTC: zones are offset from
+// UTC by multiples of that, so the local minute follows from the slot
+#define TIME_SLOT_SECONDS 900
+#define TIME_CACHE_SLOTS 64
+
+typedef struct {
+    long long slot;
+    int valid;
+    struct tm tm;
+} TimeSlot;
+
+// Formatted lines waiting to be written
+typedef struct {
+    FILE *out;
+    size_t len;
+    char data[LIST_OUTPUT_BUFFER];
+} ListOutput;
+
+void init_list_options(ListOptions *options) {
+    options->sort = LIST_SORT_NONE;
+    options->reverse = 0;
+    options->skip = 0;
+    options->limit = 0;
+}
+
+int parse_list_sort(const char *name, ListSort *sort) {
+    if (strcmp(name, "none") == 0) {
+        *sort = LIST_SORT_NONE;
+    } else if (strcmp(name, "name") == 0) {
+        *sort = LIST_SORT_NAME;
+    } else if (strcmp(name, "size") == 0) {
+        *sort = LIST_SORT_SIZE;
+    } else if (strcmp(name, "time") == 0) {
+        *sort = LIST_SORT_TIME;
+    } else {
+        return ERROR_INVALID_PATH;
+    }
+    return SUCCESS;
+}
+
+// Fill the fields of mask an item does not have yet
+// Returns 0 on success, -1 if the entry cannot be stat()ed
+static int list_item_stat(int dir_fd, ListItem *item, unsigned int mask) {
+    struct statx stx;
+
+    // d_type answers for the type; directories show no size
+    if (item->mode == 0) {
+        mask |= STATX_TYPE;
+    } else {
+        mask &= ~STATX_TYPE;
+        if (S_ISDIR(item->mode)) {
+            mask &= ~STATX_SIZE;
+        }
+    }
+    if (mask == 0) {
+        return 0;
+    }
+
+    if (statx(dir_fd, item->entry->d_name,
+              AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+              mask, &stx) != 0) {
+        return -1;
+    }
+    if (mask & (STATX_TYPE | STATX_MODE)) {
+        item->mode = stx.stx_mode;
+    }
+    if ((mask & STATX_SIZE) && !S_ISDIR(item->mode)) {
+        item->size = (off_t)stx.stx_size;
+    }
+    if (mask & STATX_MTIME) {
+        item->mtime = (time_t)stx.stx_mtime.tv_sec;
+    }
+    return 0;
+}
+
+static void list_item_init(ListItem *item, const DirEntry *entry) {
+    item->entry = entry;
+    item->mode = entry->d_type != DT_UNKNOWN ? DTTOIF(entry->d_type) : 0;
+    item->size = 0;
+    item->mtime = 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    const ListItem *ia = a, *ib = b;
+    return strcmp(ia->entry->d_name, ib->entry->d_name);
+}
+
+static int compare_sizes(const void *a, const void *b) {
+    const ListItem *ia = a, *ib = b;
+    if (ia->size != ib->size) {
+        return ia->size > ib->size ? -1 : 1;
+    }
+    return compare_names(a, b);
+}
+
+static int compare_times(const void *a, const void *b) {
+    const ListItem *ia = a, *ib = b;
+    if (ia->mtime != ib->mtime) {
+        return ia->mtime > ib->mtime ? -1 : 1;
+    }
+    return compare_names(a, b);
+}
+
+int list_page_read(int dir_fd, const ListOptions *options, unsigned int mask, Arena *arena,
+                   ListPage *page) {
+    DirBatch batch;
+    unsigned int sort_mask = 0;
+    size_t count = 0;
+
+    page->items = NULL;
+    page->count = 0;
+    page->total = 0;
+
+    if (dir_batch_read(dir_fd, arena, &batch) != SUCCESS) {
+        return ERROR_DIR_OPEN;
+    }
+    if (batch.count == 0) {
+        return SUCCESS;
+    }
+    ListItem *items = arena_alloc(arena, batch.count * sizeof(ListItem));
+    if (items == NULL) {
+        errno = ENOMEM;
+        return ERROR_DIR_OPEN;
+    }
+
+    // Only the sort key is fetched for every entry, the rest for the page
+    if (options->sort == LIST_SORT_SIZE) {
+        sort_mask = STATX_SIZE;
+    } else if (options->sort == LIST_SORT_TIME) {
+        sort_mask = STATX_MTIME;
+    }
+    for (size_t i = 0; i < batch.count; i++) {
+        list_item_init(&items[count], batch.entries[i]);
+        if (sort_mask != 0 && list_item_stat(dir_fd, &items[count], sort_mask) != 0) {
+            continue;
+        }
+        count++;
+    }
+
+    if (options->sort != LIST_SORT_NONE) {
+        int (*compare)(const void *, const void *) =
+            options->sort == LIST_SORT_SIZE ? compare_sizes :
+            options->sort == LIST_SORT_TIME ? compare_times : compare_names;
+        qsort(items, count, sizeof(ListItem), compare);
+        if (options->reverse) {
+            for (size_t i = 0; i < count / 2; i++) {
+                ListItem swap = items[i];
+                items[i] = items[count - 1 - i];
+                items[count - 1 - i] = swap;
+            }
+        }
+    }
+
+    size_t start = options->skip < count ? options->skip : count;
+    size_t end = count;
+    if (options->limit > 0 && end - start > options->limit) {
+        end = start + options->limit;
+    }
+
+    page->items = items + start;
+    page->total = count;
+    for (size_t i = start; i < end; i++) {
+        if (list_item_stat(dir_fd, &items[i], mask & ~sort_mask) == 0) {
+            page->items[page->count++] = items[i];
+        }
+    }
+    return SUCCESS;
+}
+
+// Local time of t, one localtime_r() per cached slot
+static void list_local_time(TimeSlot *cache, time_t t, struct tm *tm) {
+    long long slot = (long long)t / TIME_SLOT_SECONDS;
+    if ((long long)t % TIME_SLOT_SECONDS < 0) {
+        slot--;
+    }
+    time_t start = (time_t)(slot * TIME_SLOT_SECONDS);
+    TimeSlot *cached = &cache[(unsigned long long)slot % TIME_CACHE_SLOTS];
+
+    if (!cached->valid || cached->slot != slot) {
+        if (localtime_r(&start, &cached->tm) == NULL) {
+            memset(&cached->tm, 0, sizeof(cached->tm));
+        }
+        cached->slot = slot;
+        // Historic offsets such as local mean time are not whole quarters
+        cached->valid = cached->tm.tm_sec == 0 && cached->tm.tm_min % 15 == 0;
+        if (!cached->valid) {
+            if (localtime_r(&t, tm) == NULL) {
+                memset(tm, 0, sizeof(*tm));
+            }
+            return;
+        }
+    }
+    *tm = cached->tm;
+    tm->tm_min += (int)((t - start) / 60);
+}
+
+static void list_output_flush(ListOutput *output) {
+    if (output->len > 0) {
+        fwrite(output->data, 1, output->len, output->out);
+        output->len = 0;
+    }
+    fflush(output->out);
+}
+
+static void list_output_text(ListOutput *output, const char *text) {
+    size_t len = strlen(text);
+
+    if (output->len + len > sizeof(output->data)) {
+        list_output_flush(output);
+    }
+    memcpy(output->data + output->len, text, len);
+    output->len += len;
+}
+
+static void list_output_item(ListOutput *output, const ListItem *item, TimeSlot *cache) {
+    mode_t mode = item->mode;
+    const char *type;
+    char perms[11];
+    char size_str[32];      // Worst-case long plus unit
+    struct tm tm;
+
+    if (output->len + LIST_LINE_MAX > sizeof(output->data)) {
+        list_output_flush(output);
+    }
+
+    // Type
+    if (S_ISDIR(mode)) {
+        type = "📁";
+    } else if (S_ISLNK(mode)) {
+        type = "🔗";
+    } else {
+        type = "📄";
+    }
+
+    // Permissions
+    perms[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+    perms[10] = '\0';
+
+    // Size
+    if (S_ISDIR(mode)) {
+        strcpy(size_str, "<DIR>");
+    } else {
+        long size = item->size;
+        if (size < 1024) {
+            snprintf(size_str, sizeof(size_str), "%ldB", size);
+        } else if (size < 1024 * 1024) {
+            snprintf(size_str, sizeof(size_str), "%.1fKB", size / 1024.0);
+        } else if (size < 1024 * 1024 * 1024) {
+            snprintf(size_str, sizeof(size_str), "%.1fMB", size / (1024.0 * 1024.0));
+        } else {
+            snprintf(size_str, sizeof(size_str), "%.1fGB", size / (1024.0 * 1024.0 * 1024.0));
+        }
+    }
+
+    // Modified time
+    list_local_time(cache, item->mtime, &tm);
+
+    int len = snprintf(output->data + output->len, sizeof(output->data) - output->len,
+                       "%-4s %-10s %-8s %04d-%02d-%02d %02d:%02d %s\n",
+                       type, perms, size_str, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                       tm.tm_hour, tm.tm_min, item->entry->d_name);
+    if (len > 0) {
+        size_t room = sizeof(output->data) - output->len - 1;
+        output->len += (size_t)len < room ? (size_t)len : room;
+    }
+}
+
+int list_directory(const char *path, const ListOptions *options, FILE *out) {
+    ListOptions defaults;
+    ListOutput *output;
+    TimeSlot cache[TIME_CACHE_SLOTS];
+    Arena arena = { NULL, NULL, NULL };
+    char line[LIST_LINE_MAX];
+    size_t shown = 0, total = 0;
+    int result = SUCCESS;
+
+    if (options == NULL) {
+        init_list_options(&defaults);
+        options = &defaults;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return ERROR_DIR_OPEN;
+    }
+    output = malloc(sizeof(ListOutput));
+    if (output == NULL) {
+        close(fd);
+        return ERROR_DIR_OPEN;
+    }
+    output->out = out;
+    output->len = 0;
+    memset(cache, 0, sizeof(cache));
+    tzset();
+
+    list_output_text(output, "\n");
+    snprintf(line, sizeof(line), "📂 Directory: %s\n", path);
+    list_output_text(output, line);
+    list_output_text(output, "════════════════════════════════════════════════════════\n");
+    snprintf(line, sizeof(line), "%-4s %-10s %-8s %-12s %s\n",
+             "Type", "Perms", "Size", "Modified", "Name");
+    list_output_text(output, line);
+    list_output_text(output, "────────────────────────────────────────────────────────\n");
+
+    if (options->sort == LIST_SORT_NONE) {
+        // Each batch is printed as it arrives; past the page it is only counted
+        ArenaMark empty = arena_mark(&arena);
+        DirBatch batch;
+
+        for (;;) {
+            arena_release(&arena, empty);
+            if (dir_batch_next(fd, &arena, &batch) != SUCCESS) {
+                result = ERROR_DIR_OPEN;
+                break;
+            }
+            if (batch.count == 0) {
+                break;
+            }
+            for (size_t i = 0; i < batch.count; i++) {
+                size_t index = total++;
+                ListItem item;
+
+                if (index < options->skip ||
+                    (options->limit > 0 && index - options->skip >= options->limit)) {
+                    continue;
+                }
+                list_item_init(&item, batch.entries[i]);
+                if (list_item_stat(fd, &item, LIST_FIELDS) != 0) {
+                    continue;
+                }
+                list_output_item(output, &item, cache);
+                shown++;
+            }
+            list_output_flush(output);
+        }
+    } else {
+        ListPage page;
+
+        result = list_page_read(fd, options, LIST_FIELDS, &arena, &page);
+        for (size_t i = 0; i < page.count; i++) {
+            list_output_item(output, &page.items[i], cache);
+        }
+        shown = page.count;
+        total = page.total;
+    }
+
+    list_output_text(output, "────────────────────────────────────────────────────────\n");
+    if (options->skip > 0 || options->limit > 0) {
+        size_t first = shown > 0 ? options->skip + 1 : 0;
+        snprintf(line, sizeof(line), "Showing %zu-%zu of %zu items\n",
+                 first, shown > 0 ? options->skip + shown : 0, total);
+    } else {
+        snprintf(line, sizeof(line), "Total: %zu items\n", shown);
+    }
+    list_output_text(output, line);
+    list_output_flush(output);
+
+    free(output);
+    arena_free(&arena);
+    close(fd);
+    return result;
+}
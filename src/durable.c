@@ -0,0 +1,329 @@
+#include "durable.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A committed file waiting for its batch
+typedef struct {
+    DurableFile file;
+    int fd;
+    int src_dirfd;              // Move source, unlinked after the rename
+    char *src_name;             // NULL when not a move
+    int dir;                    // Index into the batch's directories, -1 if not listed
+    int datasync;               // Needs its own fdatasync (no syncfs covered it)
+    int failed;
+} PendingFile;
+
+// A destination directory of a batch, fsynced once
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd;                     // One of the pending files' dir_fd
+} PendingDir;
+
+// Files committed since the last flush
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static PendingFile *pending = NULL;
+static size_t pending_count = 0;
+static off_t pending_bytes = 0;
+
+// Files that failed in a flush since the last durable_flush
+static atomic_long failed_files;
+static atomic_int flush_holds;
+static atomic_uint temp_serial;
+
+int parse_durable_mode(const char *name, DurableMode *mode) {
+    if (strcmp(name, "syncfs") == 0) {
+        *mode = DURABLE_SYNCFS;
+    } else if (strcmp(name, "fdatasync") == 0) {
+        *mode = DURABLE_FDATASYNC;
+    } else {
+        return ERROR_INVALID_PATH;
+    }
+    return SUCCESS;
+}
+
+// Hidden name next to the destination, unique within this process
+static void make_temp_name(char *temp, const char *name) {
+    unsigned serial = atomic_fetch_add(&temp_serial, 1);
+
+    if (strlen(name) + 32 <= NAME_MAX) {
+        snprintf(temp, NAME_MAX + 1, ".%s.fc%d-%u", name, (int)getpid(), serial);
+    } else {
+        snprintf(temp, NAME_MAX + 1, ".fc%d-%u", (int)getpid(), serial);
+    }
+}
+
+int durable_open(DurableFile *file, int dirfd, const char *path, int direct, int *direct_used) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    int fd = -1;
+
+    if (direct_used != NULL) {
+        *direct_used = 0;
+    }
+    if (*name == '\0' || strlen(name) > NAME_MAX) {
+        errno = *name == '\0' ? EISDIR : ENAMETOOLONG;
+        return -1;
+    }
+
+    // A readable descriptor, not O_PATH: it is fsynced after the rename
+    if (slash == NULL) {
+        STATS_TIMED(STATS_OPEN, file->dir_fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    } else {
+        char dir[MAX_PATH];
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+
+        if (len >= sizeof(dir)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+        STATS_TIMED(STATS_OPEN, file->dir_fd = openat(dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    }
+    if (file->dir_fd < 0) {
+        return -1;
+    }
+    strcpy(file->name, name);
+
+    // O_EXCL never reuses a name; a stale one from a crashed run is skipped
+    for (int attempt = 0; attempt < 8; attempt++) {
+        make_temp_name(file->temp, name);
+        STATS_TIMED(STATS_OPEN, fd = openat(file->dir_fd, file->temp,
+                                            O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+        if (fd >= 0 || errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        int saved_errno = errno;
+        close(file->dir_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Set afterwards: a failed O_DIRECT open may already have created the file
+    if (direct) {
+        int fl = fcntl(fd, F_GETFL);
+        if (fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0 && direct_used != NULL) {
+            *direct_used = 1;
+        }
+    }
+    return fd;
+}
+
+void durable_abort(DurableFile *file, int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlinkat(file->dir_fd, file->temp, 0);
+    close(file->dir_fd);
+}
+
+// Report one file of a batch and keep its old destination (if any)
+static void fail_file(PendingFile *entry, const char *what) {
+    fprintf(stderr, "Error (%s): Failed to %s - %s\n", entry->file.name, what, strerror(errno));
+    entry->failed = 1;
+}
+
+// Find or add the directory of a pending file
+static int add_dir(PendingDir *dirs, int *count, int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (dirs[i].dev == st.st_dev && dirs[i].ino == st.st_ino) {
+            return i;
+        }
+    }
+    dirs[*count].dev = st.st_dev;
+    dirs[*count].ino = st.st_ino;
+    dirs[*count].fd = fd;
+    return (*count)++;
+}
+
+// Sync, rename and release a batch; returns the number of files that failed
+static long flush_files(PendingFile *files, size_t count) {
+    DurableMode mode = get_copy_options()->durable;
+    PendingDir *dirs = malloc(count * sizeof(PendingDir));
+    int dir_count = 0;
+    long failed = 0;
+    int result;
+
+    for (size_t i = 0; i < count; i++) {
+        files[i].dir = dirs != NULL ? add_dir(dirs, &dir_count, files[i].file.dir_fd) : -1;
+        files[i].datasync = mode != DURABLE_SYNCFS || files[i].dir < 0;
+    }
+
+    // Data first: each filesystem once, or each file when syncfs is not wanted
+    for (int d = 0; d < dir_count && mode == DURABLE_SYNCFS; d++) {
+        int seen = 0;
+        for (int e = 0; e < d && !seen; e++) {
+            seen = dirs[e].dev == dirs[d].dev;
+        }
+        if (seen) {
+            continue;
+        }
+        STATS_TIMED(STATS_FSYNC, result = syncfs(dirs[d].fd));
+        if (result != 0) {
+            for (size_t i = 0; i < count; i++) {
+                if (files[i].dir >= 0 && dirs[files[i].dir].dev == dirs[d].dev) {
+                    files[i].datasync = 1;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].datasync) {
+            STATS_TIMED(STATS_FSYNC, result = fdatasync(files[i].fd));
+            if (result != 0) {
+                fail_file(&files[i], "sync file");
+            }
+        }
+    }
+
+    // Then the names, which now only ever point at complete files
+    for (size_t i = 0; i < count; i++) {
+        PendingFile *entry = &files[i];
+        if (entry->failed) {
+            unlinkat(entry->file.dir_fd, entry->file.temp, 0);
+            continue;
+        }
+        STATS_TIMED(STATS_METADATA, result = renameat(entry->file.dir_fd, entry->file.temp,
+                                                      entry->file.dir_fd, entry->file.name));
+        if (result != 0) {
+            fail_file(entry, "rename into place");
+            unlinkat(entry->file.dir_fd, entry->file.temp, 0);
+        }
+    }
+
+    // One fsync per directory covers every rename in it
+    for (int d = 0; d < dir_count; d++) {
+        STATS_TIMED(STATS_FSYNC, result = fsync(dirs[d].fd));
+        if (result != 0) {
+            for (size_t i = 0; i < count; i++) {
+                if (files[i].dir == d && !files[i].failed) {
+                    fail_file(&files[i], "sync directory");
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        PendingFile *entry = &files[i];
+        if (entry->dir < 0 && !entry->failed) {
+            STATS_TIMED(STATS_FSYNC, result = fsync(entry->file.dir_fd));
+            if (result != 0) {
+                fail_file(entry, "sync directory");
+            }
+        }
+
+        // A move gives up its source only once the copy is safe
+        if (entry->src_name != NULL) {
+            if (!entry->failed && unlinkat(entry->src_dirfd, entry->src_name, 0) != 0) {
+                fail_file(entry, "remove move source");
+            }
+            if (entry->src_dirfd >= 0) {
+                close(entry->src_dirfd);
+            }
+            free(entry->src_name);
+        }
+
+        STATS_TIMED(STATS_OPEN, close(entry->fd));
+        close(entry->file.dir_fd);
+        failed += entry->failed;
+    }
+
+    free(dirs);
+    return failed;
+}
+
+int durable_commit(DurableFile *file, int fd, off_t size, const DurableSource *source) {
+    PendingFile entry = { *file, fd, AT_FDCWD, NULL, -1, 0, 0 };
+    PendingFile *full = NULL;
+    size_t full_count = 0;
+    int queued = 0;
+
+    // Start writeback now, so the batch sync mostly waits for I/O in flight
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+    // The walk closes its directories long before the batch is flushed
+    if (source != NULL) {
+        entry.src_dirfd = source->dirfd == AT_FDCWD ? AT_FDCWD : dup(source->dirfd);
+        entry.src_name = strdup(source->name);
+        if (entry.src_name == NULL || entry.src_dirfd == -1) {
+            if (entry.src_dirfd >= 0) {
+                close(entry.src_dirfd);
+            }
+            free(entry.src_name);
+            durable_abort(file, fd);
+            return ERROR_MOVE_FAILED;
+        }
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    if (pending == NULL) {
+        pending = malloc(DURABLE_BATCH_FILES * sizeof(PendingFile));
+    }
+    if (pending != NULL) {
+        pending[pending_count++] = entry;
+        pending_bytes += size;
+        queued = 1;
+        if (pending_count >= DURABLE_BATCH_FILES || pending_bytes >= DURABLE_BATCH_BYTES) {
+            full = pending;
+            full_count = pending_count;
+            pending = NULL;
+            pending_count = 0;
+            pending_bytes = 0;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    // No memory for a batch: this file is a batch of its own
+    if (!queued) {
+        return flush_files(&entry, 1) == 0 ? SUCCESS : ERROR_FILE_WRITE;
+    }
+
+    // Whoever fills the batch flushes it; other threads keep copying
+    if (full != NULL) {
+        atomic_fetch_add(&failed_files, flush_files(full, full_count));
+        free(full);
+    }
+    return SUCCESS;
+}
+
+void durable_hold(void) {
+    atomic_fetch_add(&flush_holds, 1);
+}
+
+void durable_release(void) {
+    atomic_fetch_sub(&flush_holds, 1);
+}
+
+int durable_held(void) {
+    return atomic_load(&flush_holds) > 0;
+}
+
+int durable_flush(CopyStats *stats) {
+    CopyStats *outer = stats_bind(stats);
+    PendingFile *files;
+    size_t count;
+
+    pthread_mutex_lock(&pending_lock);
+    files = pending;
+    count = pending_count;
+    pending = NULL;
+    pending_count = 0;
+    pending_bytes = 0;
+    pthread_mutex_unlock(&pending_lock);
+
+    if (files != NULL) {
+        atomic_fetch_add(&failed_files, flush_files(files, count));
+        free(files);
+    }
+    stats_bind(outer);
+
+    return atomic_exchange(&failed_files, 0) == 0 ? SUCCESS : ERROR_FILE_WRITE;
+}
@@ -1,10 +1,73 @@
 #include "file_operations.h"
+#include "compare.h"
+#include "compress.h"
+#include "copy_engine.h"
+#include "dedup.h"
+#include "dir_list.h"
+#include "durable.h"
+#include "filter.h"
+#include "hash.h"
+#include "index.h"
+#include "parallel_copy.h"
+#include "parallel_hash.h"
+#include "path_arena.h"
+#include "resume.h"
+#include "stats.h"
+#include "sync.h"
+#include "tree_remove.h"
+#include "uring_copy.h"
 #include <fnmatch.h>
+#include <stdatomic.h>
 #include <pwd.h>
 #include <grp.h>
 
-// Global statistics for tracking
-static CopyStats global_stats;
+// Active options shared by every copy operation
+static CopyOptions active_options = { COPY_ENGINE_AUTO, 1, 1, URING_DEFAULT_QUEUE_DEPTH, 0,
+                                      PROGRESS_AUTO, HASH_SHA256, VERIFY_NONE,
+                                      SYNC_OFF, 0, NULL, 0, NULL, 0, DURABLE_OFF, 0,
+                                      DEDUP_OFF, 0, 0, COMPRESS_NONE,
+                                      0, 0, WALK_ORDER_DIRECTORY, NULL, 0, 0, NULL };
+
+// Per-thread progress switch (parallel workers turn it off)
+static _Thread_local int show_progress = 1;
+
+void init_copy_options(CopyOptions *opts) {
+    opts->engine = COPY_ENGINE_AUTO;
+    opts->jobs = 1;
+    opts->use_io_uring = 1;
+    opts->queue_depth = URING_DEFAULT_QUEUE_DEPTH;
+    opts->direct_io = 0;
+    opts->progress = PROGRESS_AUTO;
+    opts->hash = HASH_SHA256;
+    opts->verify = VERIFY_NONE;
+    opts->sync = SYNC_OFF;
+    opts->delete_extraneous = 0;
+    opts->index_path = NULL;
+    opts->index_trust_dirs = 0;
+    opts->stats_json = NULL;
+    opts->buffer_size = 0;
+    opts->durable = DURABLE_OFF;
+    opts->cache_neutral = 0;
+    opts->dedup = DEDUP_OFF;
+    opts->tree_hash = 0;
+    opts->split_size = 0;
+    opts->compress = COMPRESS_NONE;
+    opts->compress_level = 0;
+    opts->decompress = 0;
+    opts->order = WALK_ORDER_DIRECTORY;
+    opts->resume_path = NULL;
+    opts->bwlimit = 0;
+    opts->iops_limit = 0;
+    opts->limit_file = NULL;
+}
+
+void set_copy_options(const CopyOptions *opts) {
+    active_options = *opts;
+}
+
+const CopyOptions *get_copy_options(void) {
+    return &active_options;
+}
 
 // Check if a path exists
 int path_exists(const char *path) {
@@ -30,6 +93,77 @@ long get_file_size(const char *path) {
     return st.st_size;
 }
 
+// Round size up to a multiple of align (align must be a power of two)
+static size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+static size_t page_size(void) {
+    static size_t cached = 0;
+    if (cached == 0) {
+        long ps = sysconf(_SC_PAGESIZE);
+        cached = ps > 0 ? (size_t)ps : 4096;
+    }
+    return cached;
+}
+
+// Choose an I/O buffer size for a file
+size_t io_buffer_size(const struct stat *st) {
+    size_t align = page_size();
+    size_t size;
+
+    if (active_options.buffer_size > 0) {
+        return round_up(active_options.buffer_size, align);
+    }
+    if (st == NULL || st->st_size <= 0) {
+        return round_up(BUFFER_SIZE, align);
+    }
+
+    // st_blksize is the preferred I/O size; use it when it is a larger power of two
+    if (st->st_blksize > 0 && (size_t)st->st_blksize > align &&
+        ((size_t)st->st_blksize & ((size_t)st->st_blksize - 1)) == 0) {
+        align = (size_t)st->st_blksize;
+    }
+
+    if ((size_t)st->st_size <= MIN_LARGE_BUFFER) {
+        // Whole file in one read
+        size = (size_t)st->st_size;
+    } else {
+        // Around eight reads per file, within 1-16 MB
+        size = (size_t)st->st_size / 8;
+        if (size < MIN_LARGE_BUFFER) size = MIN_LARGE_BUFFER;
+        if (size > MAX_BUFFER_SIZE) size = MAX_BUFFER_SIZE;
+    }
+
+    return round_up(size, align);
+}
+
+// Allocate a page-aligned I/O buffer (suitable for O_DIRECT)
+void *io_buffer_alloc(size_t size) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, page_size(), size) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+ssize_t pread_full(int fd, void *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, (char *)buffer + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
 // Create directory with parent directories if needed
 int create_directory(const char *path) {
     char tmp[MAX_PATH];
@@ -43,67 +177,440 @@ int create_directory(const char *path) {
         tmp[len - 1] = 0;
     }
 
+    // Usually the parent exists: one mkdir() and no stat() at all
+    if (mkdir(tmp, 0755) == 0 || errno == EEXIST) {
+        return SUCCESS;
+    }
+    if (errno != ENOENT) {
+        return ERROR_DIR_CREATE;
+    }
+
     for (p = tmp + 1; *p; p++) {
         if (*p == '/') {
             *p = 0;
-            if (!path_exists(tmp)) {
-                if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-                    return ERROR_DIR_CREATE;
-                }
+            if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+                return ERROR_DIR_CREATE;
             }
             *p = '/';
         }
     }
     
-    if (!path_exists(tmp)) {
-        if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-            return ERROR_DIR_CREATE;
-        }
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+        return ERROR_DIR_CREATE;
     }
     
     return SUCCESS;
 }
 
+void set_progress_enabled(int enabled) {
+    show_progress = enabled;
+}
+
+int progress_enabled(void) {
+    return show_progress;
+}
+
+// Progress rendering state shared by all threads
+static _Atomic long progress_last_draw = 0;   // monotonic ns of the last redraw
+static _Atomic int progress_line_active = 0;   // a line is on screen without '\n'
+static atomic_flag progress_drawing = ATOMIC_FLAG_INIT;
+
+long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+ProgressMode effective_progress_mode(void) {
+    static int stdout_tty = -1;
+
+    if (active_options.progress != PROGRESS_AUTO) {
+        return active_options.progress;
+    }
+    if (stdout_tty < 0) {
+        stdout_tty = isatty(STDOUT_FILENO);
+    }
+    if (!stdout_tty) {
+        return PROGRESS_NONE;
+    }
+    // Per-file bars from many workers would overwrite each other
+    return active_options.jobs > 1 ? PROGRESS_TREE : PROGRESS_FILE;
+}
+
+// Claim the right to redraw: at most PROGRESS_INTERVAL_NS apart, one thread at a time
+static int progress_begin_draw(int force) {
+    long now = monotonic_ns();
+
+    if (!force && now - progress_last_draw < PROGRESS_INTERVAL_NS) {
+        return 0;
+    }
+    if (atomic_flag_test_and_set(&progress_drawing)) {
+        return 0;
+    }
+    progress_last_draw = now;
+    return 1;
+}
+
+static void progress_end_draw(const char *line, size_t len) {
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+    progress_line_active = 1;
+    atomic_flag_clear(&progress_drawing);
+}
+
 // Display copy progress
 void display_progress(long current, long total, const char *filename) {
+    char line[MAX_PATH + 128];
+    int len;
+
+    if (!show_progress || effective_progress_mode() != PROGRESS_FILE) {
+        return;
+    }
+
+    // Completion is drawn only for a bar already on screen
+    if (!progress_begin_draw(current >= total && progress_line_active)) {
+        return;
+    }
+
     if (total <= 0) {
-        printf("\rCopying: %s... ", filename);
-        fflush(stdout);
+        len = snprintf(line, sizeof(line), "\rCopying: %s... ", filename);
+    } else {
+        int percent = (int)((current * 100) / total);
+        int bar_width = 50;
+        int filled = (int)((bar_width * current) / total);
+
+        line[0] = '\r';
+        line[1] = '[';
+        for (int i = 0; i < bar_width; i++) {
+            line[2 + i] = i < filled ? '=' : (i == filled ? '>' : ' ');
+        }
+        len = 2 + bar_width;
+        len += snprintf(line + len, sizeof(line) - len, "] %d%% - %s", percent, filename);
+    }
+
+    if (len > (int)sizeof(line) - 1) {
+        len = (int)sizeof(line) - 1;
+    }
+    progress_end_draw(line, (size_t)len);
+}
+
+// Display tree-wide progress from statistics
+void display_tree_progress(const CopyStats *stats, int force) {
+    char line[160];
+    int len;
+
+    if (effective_progress_mode() != PROGRESS_TREE || !progress_begin_draw(force)) {
         return;
     }
-    
-    int percent = (int)((current * 100) / total);
-    int bar_width = 50;
-    int filled = (bar_width * current) / total;
-    
-    printf("\r[");
-    for (int i = 0; i < bar_width; i++) {
-        if (i < filled) printf("=");
-        else if (i == filled) printf(">");
-        else printf(" ");
+
+    long bytes = stats->copied_bytes;
+    double elapsed = (monotonic_ns() - stats->start_ns) / 1e9;
+    double speed = elapsed > 0 ? bytes / elapsed : 0.0;
+
+    len = snprintf(line, sizeof(line),
+                   "\rCopied %ld files, %ld dirs, %.1f MB (%.1f MB/s)   ",
+                   (long)stats->total_files, (long)stats->total_dirs,
+                   bytes / (1024.0 * 1024.0), speed / (1024.0 * 1024.0));
+    if (len > (int)sizeof(line) - 1) {
+        len = (int)sizeof(line) - 1;
+    }
+    progress_end_draw(line, (size_t)len);
+}
+
+// End the current progress line, if one is on screen
+void finish_progress(void) {
+    if (progress_line_active) {
+        progress_line_active = 0;
+        fputc('\n', stdout);
+        fflush(stdout);
     }
-    printf("] %d%% - %s", percent, filename);
-    fflush(stdout);
 }
 
 // Copy a single file from source to destination
 int copy_file(const char *src_path, const char *dest_path) {
-    int src_fd, dest_fd;
-    ssize_t bytes_read, bytes_written;
-    char buffer[BUFFER_SIZE];
-    long total_size, copied = 0;
-    char final_dest_path[MAX_PATH];
-    struct stat dest_stat;
+    return copy_file_with_stats(src_path, dest_path, NULL);
+}
+
+// Re-read a finished copy and compare it with the digest of the data written
+static int verify_copy(int dest_fd, int dest_dirfd, const char *dest_name,
+                       HashAlgorithm algorithm, const unsigned char *expected, size_t len,
+                       VerifyMode mode) {
+    unsigned char actual[HASH_MAX_DIGEST];
+    HashContext reread;
+    int direct = 0;
+    int fd, result;
+
+    // Only clean pages can be dropped, so write the copy back first
+    if (mode == VERIFY_DROP) {
+        STATS_TIMED(STATS_FSYNC, result = fdatasync(dest_fd));
+        if (result != 0) {
+            return ERROR_FILE_WRITE;
+        }
+    }
+
+    if (mode == VERIFY_DIRECT) {
+        STATS_TIMED(STATS_OPEN, fd = openat_direct(dest_dirfd, dest_name, O_RDONLY, 0, &direct));
+    } else {
+        STATS_TIMED(STATS_OPEN, fd = openat(dest_dirfd, dest_name, O_RDONLY));
+    }
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    if (mode == VERIFY_DROP) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    hash_init(&reread, algorithm);
+    result = hash_fd(fd, &reread);
+
+    // Leave the cache as we found it rather than full of the re-read
+    if (mode == VERIFY_DROP) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    STATS_TIMED(STATS_OPEN, close(fd));
+
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    hash_final(&reread, actual);
+    return memcmp(expected, actual, len) == 0 ? SUCCESS : ERROR_VERIFY_FAILED;
+}
+
+// Copy an open source file to dest_dirfd/dest_name, hashing it on the way
+// through when verify is set. The caller keeps ownership of src_fd. With
+// --durable the copy is written to a temporary name and handed to the
+// current batch, which also unlinks move_source (if any) once it is safe;
+// without it, the caller unlinks move_source itself.
+static int copy_open_file(int src_fd, const struct stat *src_stat, int dest_dirfd,
+                          const char *dest_name, const char *label, CopyStats *stats,
+                          VerifyMode verify, const DurableSource *move_source) {
+    int durable = active_options.durable != DURABLE_OFF;
+    DurableFile temp;
+    int out_dirfd = dest_dirfd;
+    const char *out_name = dest_name;
+    int dest_fd;
+    CopyFdResult copied;
+    HashContext hash;
+    unsigned char digest[HASH_MAX_DIGEST];
+    size_t digest_len = 0;
+    int direct_src = 0, direct_dest = 0;
+    char coded_name[MAX_PATH];
+    CompressCodec codec = COMPRESS_NONE;
+    CodingAction coding = CODING_COPY;
+    ResumeFile checkpoint;
+    off_t resume_from = 0;
+    int result;
+    long start = stats_clock();
+
+    // --compress/--decompress rename the destination and take over the data
+    if (move_source == NULL && compress_active()) {
+        coding = compress_plan(src_fd, src_stat, label, dest_name, coded_name, sizeof(coded_name),
+                               &codec);
+        if (coding != CODING_COPY) {
+            dest_name = coded_name;
+            out_name = coded_name;
+        }
+    }
+
+    // --resume: files an earlier run finished stay as they are
+    if (move_source == NULL && resume_active() &&
+        resume_skip_file(label, src_stat, dest_dirfd, dest_name)) {
+        if (stats != NULL) {
+            stats->skipped_files++;
+            stats->skipped_bytes += src_stat->st_size;
+        }
+        return SUCCESS;
+    }
+    // Only plain copies under their final name can go on from a checkpoint
+    int resumable = move_source == NULL && resume_active() && !durable &&
+                    verify == VERIFY_NONE && coding == CODING_COPY;
+
+    // Large files in --direct mode bypass the page cache; coded data
+    // comes in sizes O_DIRECT cannot write
+    int use_direct = active_options.direct_io && S_ISREG(src_stat->st_mode) &&
+                     src_stat->st_size >= DIRECT_IO_MIN_SIZE && coding == CODING_COPY;
+    if (use_direct) {
+        int fl = fcntl(src_fd, F_GETFL);
+        if (fl >= 0 && fcntl(src_fd, F_SETFL, fl | O_DIRECT) == 0) {
+            direct_src = 1;
+        }
+    }
+
+    // Sync mode: leave up-to-date files alone, patch large changed ones in place
+    if (active_options.sync != SYNC_OFF) {
+        SyncAction action;
+        off_t written;
+
+        result = sync_file(src_fd, src_stat, label, dest_dirfd, dest_name, &action, &written);
+        if (result != SUCCESS || action != SYNC_ACTION_COPY) {
+            if (show_progress && effective_progress_mode() == PROGRESS_FILE) {
+                finish_progress();
+            }
+            if (result == SUCCESS && stats != NULL) {
+                if (action == SYNC_ACTION_SKIP) {
+                    stats->skipped_files++;
+                    stats->skipped_bytes += src_stat->st_size;
+                } else {
+                    stats->total_files++;
+                    stats->delta_files++;
+                    stats->total_bytes += src_stat->st_size;
+                    stats->physical_bytes += written;
+                    stats->engine_files[COPY_ENGINE_READ_WRITE]++;
+                    update_stats(stats, src_stat->st_size);
+                    stats_file_done(stats, start);
+                }
+            }
+            if (result == SUCCESS) {
+                index_record_file(label, src_stat, dest_dirfd, dest_name,
+                                  active_options.hash, NULL, 0);
+                resume_record_file(label, src_stat);
+            }
+            return result;
+        }
+    }
+
+    // Open/create destination file; a partial copy is kept for resuming
+    if (resumable) {
+        resume_from = resume_offset(label, src_stat);
+    }
+    if (resume_from > 0) {
+        STATS_TIMED(STATS_OPEN, dest_fd = openat(dest_dirfd, dest_name, O_RDWR | O_CREAT, 0644));
+        if (dest_fd >= 0 && !resume_verify(src_fd, dest_fd, resume_from)) {
+            STATS_TIMED(STATS_METADATA, ftruncate(dest_fd, 0));
+            resume_from = 0;
+        }
+    } else if (durable) {
+        dest_fd = durable_open(&temp, dest_dirfd, dest_name, use_direct, &direct_dest);
+        if (dest_fd >= 0) {
+            out_dirfd = temp.dir_fd;
+            out_name = temp.temp;
+        }
+    } else if (use_direct) {
+        STATS_TIMED(STATS_OPEN,
+                    dest_fd = openat_direct(dest_dirfd, dest_name, O_WRONLY | O_CREAT | O_TRUNC,
+                                            0644, &direct_dest));
+    } else {
+        STATS_TIMED(STATS_OPEN,
+                    dest_fd = openat(dest_dirfd, dest_name, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    }
+    if (dest_fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    // Copy file content through the fastest engine available
+    if (verify != VERIFY_NONE) {
+        hash_init(&hash, active_options.hash);
+    }
+    if (resumable) {
+        resume_begin(&checkpoint, label, src_stat, dest_fd, resume_from);
+    }
+    if (coding != CODING_COPY) {
+        copied.engine = COPY_ENGINE_READ_WRITE;
+        copied.sparse = 0;
+        result = compress_fd_data(src_fd, dest_fd, src_stat, coding, codec, label, stats,
+                                  &copied.data_bytes);
+    } else if (resume_from > 0) {
+        result = copy_fd_from(src_fd, dest_fd, src_stat, resume_from,
+                              direct_src ? COPY_FD_DIRECT : 0, label, &copied);
+    } else {
+        result = copy_fd_data(src_fd, dest_fd, src_stat,
+                              (direct_src || direct_dest) ? COPY_FD_DIRECT : 0,
+                              label, verify != VERIFY_NONE ? &hash : NULL, &copied);
+    }
+    resume_end();
+
+    if (show_progress && effective_progress_mode() == PROGRESS_FILE) {
+        finish_progress();
+    }
+
+    if (result != SUCCESS) {
+        if (durable) {
+            durable_abort(&temp, dest_fd);
+        } else {
+            close(dest_fd);
+        }
+        return result;
+    }
+
+    // Copy file permissions
+    STATS_TIMED(STATS_METADATA, fchmod(dest_fd, src_stat->st_mode));
+
+    // Synced files carry the source mtime so the next run can skip them
+    if (active_options.sync != SYNC_OFF) {
+        struct timespec times[2] = { src_stat->st_atim, src_stat->st_mtim };
+        STATS_TIMED(STATS_METADATA, futimens(dest_fd, times));
+    }
+
+    // Only the destination is read again; the source was hashed while copying
+    if (verify != VERIFY_NONE) {
+        digest_len = hash_final(&hash, digest);
+        result = verify_copy(dest_fd, out_dirfd, out_name, active_options.hash,
+                             digest, digest_len, verify);
+    }
+
+    if (result != SUCCESS) {
+        if (durable) {
+            durable_abort(&temp, dest_fd);
+        } else {
+            close(dest_fd);
+        }
+        return result;
+    }
 
-    // Get source file size for progress
-    total_size = get_file_size(src_path);
+    // The digest of a verified copy doubles as the source checksum. A
+    // temporary name is the same inode the rename will publish.
+    index_record_file(label, src_stat, out_dirfd, out_name, active_options.hash,
+                      digest_len > 0 ? digest : NULL, digest_len);
+
+    if (durable) {
+        result = durable_commit(&temp, dest_fd, copied.data_bytes, move_source);
+        if (result != SUCCESS) {
+            return result;
+        }
+    } else {
+        STATS_TIMED(STATS_OPEN, close(dest_fd));
+    }
+    resume_record_file(label, src_stat);
+
+    if (stats != NULL) {
+        stats->total_files++;
+        stats->resumed_files += resume_from > 0;
+        stats->resumed_bytes += resume_from;
+        stats->verified_files += verify != VERIFY_NONE;
+        stats->total_bytes += src_stat->st_size;
+        stats->physical_bytes += copied.data_bytes;
+        stats->sparse_files += copied.sparse;
+        stats->engine_files[copied.engine]++;
+        update_stats(stats, src_stat->st_size);
+        stats_file_done(stats, start);
+    }
+
+    return SUCCESS;
+}
+
+// Copy a single file by path; dest_path may name a directory to copy into
+static int copy_file_checked(const char *src_path, const char *dest_path, CopyStats *stats,
+                             VerifyMode verify, const DurableSource *move_source) {
+    int src_fd;
+    char final_dest_path[MAX_PATH];
+    struct stat src_stat, dest_stat;
+    int result;
 
     // Open source file
-    src_fd = open(src_path, O_RDONLY);
+    STATS_TIMED(STATS_OPEN, src_fd = open(src_path, O_RDONLY));
     if (src_fd < 0) {
         return ERROR_FILE_OPEN;
     }
 
+    // Source size (for progress and the engine) and permissions
+    STATS_TIMED(STATS_METADATA, result = fstat(src_fd, &src_stat));
+    if (result != 0) {
+        close(src_fd);
+        return ERROR_FILE_READ;
+    }
+
     // Check if destination is a directory
     if (stat(dest_path, &dest_stat) == 0 && S_ISDIR(dest_stat.st_mode)) {
         // Destination is a directory, extract filename from source
@@ -122,51 +629,530 @@ int copy_file(const char *src_path, const char *dest_path) {
         final_dest_path[MAX_PATH - 1] = '\0';
     }
 
-    // Open/create destination file
-    dest_fd = open(final_dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dest_fd < 0) {
-        close(src_fd);
-        return ERROR_FILE_OPEN;
+    result = copy_open_file(src_fd, &src_stat, AT_FDCWD, final_dest_path, src_path,
+                            stats, verify, move_source);
+    STATS_TIMED(STATS_OPEN, close(src_fd));
+    return result;
+}
+
+// --durable: an operation is done once its files are on disk and in
+// place. Batch mode holds the flush so its entries share batches.
+static int finish_durable(int result, CopyStats *stats) {
+    if (active_options.durable == DURABLE_OFF || durable_held()) {
+        return result;
+    }
+
+    int flushed = durable_flush(stats);
+    return result != SUCCESS ? result : flushed;
+}
+
+// Copy a single file and record it in statistics
+int copy_file_with_stats(const char *src_path, const char *dest_path, CopyStats *stats) {
+    CopyStats *outer = stats_bind(stats);
+    int result = copy_file_checked(src_path, dest_path, stats, active_options.verify, NULL);
+    stats_bind(outer);
+    return finish_durable(result, stats);
+}
+
+// Copy a file found by a directory walk: no destination lookup, and the
+// walk's stat (if any) replaces the fstat after opening
+int copy_file_at(int src_dirfd, const char *src_name, const struct stat *src_stat,
+                 int dest_dirfd, const char *dest_name, const char *label, CopyStats *stats,
+                 const char *dest_path, DedupTable *links) {
+    DedupEntry *claim = NULL;
+    struct stat st;
+    int src_fd;
+    int result;
+
+    // Unchanged since the last run: no need to open either file
+    if (index_active() && active_options.sync != SYNC_OFF) {
+        if (src_stat == NULL) {
+            STATS_TIMED(STATS_METADATA, result = fstatat(src_dirfd, src_name, &st, 0));
+            if (result != 0) {
+                return ERROR_FILE_OPEN;
+            }
+            src_stat = &st;
+        }
+        if (index_skip_file(label, src_stat, dest_dirfd, dest_name)) {
+            if (stats != NULL) {
+                stats->skipped_files++;
+                stats->skipped_bytes += src_stat->st_size;
+            }
+            return SUCCESS;
+        }
+    }
+
+    STATS_TIMED(STATS_OPEN, src_fd = openat(src_dirfd, src_name, O_RDONLY));
+    if (src_fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    if (src_stat == NULL) {
+        STATS_TIMED(STATS_METADATA, result = fstat(src_fd, &st));
+        if (result != 0) {
+            close(src_fd);
+            return ERROR_FILE_READ;
+        }
+        src_stat = &st;
+    }
+
+    // Another name of a file already copied, or the same contents: link it
+    if (links != NULL && dedup_link_file(links, src_fd, src_stat, label, dest_dirfd, dest_name,
+                                         dest_path, stats, &claim)) {
+        STATS_TIMED(STATS_OPEN, close(src_fd));
+        return SUCCESS;
+    }
+
+    result = copy_open_file(src_fd, src_stat, dest_dirfd, dest_name, label, stats,
+                            active_options.verify, NULL);
+    STATS_TIMED(STATS_OPEN, close(src_fd));
+    if (claim != NULL) {
+        dedup_finish(links, claim, result);
+    }
+    return result;
+}
+
+// The source is about to go away: always check the copy against what
+// reached the disk, not just the page cache
+static VerifyMode move_verify_mode(void) {
+    VerifyMode verify = active_options.verify;
+    return verify == VERIFY_NONE || verify == VERIFY_CACHED ? VERIFY_DROP : verify;
+}
+
+// Recreate a symlink instead of copying what it points to
+static int move_symlink_at(int src_dirfd, const char *src_name,
+                           int dest_dirfd, const char *dest_name) {
+    char target[MAX_PATH];
+    ssize_t len = readlinkat(src_dirfd, src_name, target, sizeof(target) - 1);
+
+    if (len < 0) {
+        return ERROR_FILE_READ;
+    }
+    target[len] = '\0';
+
+    if (symlinkat(target, dest_dirfd, dest_name) == 0) {
+        return SUCCESS;
+    }
+    // Replace what an earlier copy left there
+    if (errno != EEXIST || unlinkat(dest_dirfd, dest_name, 0) != 0 ||
+        symlinkat(target, dest_dirfd, dest_name) != 0) {
+        return ERROR_FILE_WRITE;
+    }
+    return SUCCESS;
+}
+
+int move_file_at(int src_dirfd, const char *src_name, const struct stat *src_stat,
+                 int dest_dirfd, const char *dest_name, const char *label, CopyStats *stats) {
+    DurableSource source = { src_dirfd, src_name };
+    struct stat st;
+    int src_fd;
+    int result;
+
+    // O_NOFOLLOW makes the open itself the symlink check
+    STATS_TIMED(STATS_OPEN, src_fd = openat(src_dirfd, src_name, O_RDONLY | O_NOFOLLOW));
+    if (src_fd < 0) {
+        if (errno != ELOOP) {
+            return ERROR_FILE_OPEN;
+        }
+        result = move_symlink_at(src_dirfd, src_name, dest_dirfd, dest_name);
+    } else {
+        if (src_stat == NULL) {
+            if (fstat(src_fd, &st) != 0) {
+                close(src_fd);
+                return ERROR_FILE_READ;
+            }
+            src_stat = &st;
+        }
+        result = copy_open_file(src_fd, src_stat, dest_dirfd, dest_name, label, stats,
+                                move_verify_mode(), &source);
+        STATS_TIMED(STATS_OPEN, close(src_fd));
+        if (result == ERROR_VERIFY_FAILED) {
+            // A --durable bad copy never got past its temporary name
+            if (active_options.durable == DURABLE_OFF) {
+                unlinkat(dest_dirfd, dest_name, 0); // Remove bad copy
+            }
+            return ERROR_MOVE_FAILED;
+        }
+        // --durable: the batch unlinks the source after the rename
+        if (active_options.durable != DURABLE_OFF) {
+            return result;
+        }
+    }
+
+    if (result == SUCCESS && unlinkat(src_dirfd, src_name, 0) != 0) {
+        return ERROR_MOVE_FAILED;
+    }
+    return result;
+}
+
+// Copy a file found by a directory walk, batching small files for io_uring
+static int walk_copy_file(UringBatch **batch, int src_dirfd, int dest_dirfd, const char *name,
+                          const struct stat *known, const char *src_file,
+                          const char *dest_file, CopyStats *stats, DedupTable *links) {
+    struct stat st;
+
+    // Without io_uring the copier's fstat is the only stat this file gets
+    if (!uring_copy_enabled()) {
+        return copy_file_at(src_dirfd, name, known, dest_dirfd, name, src_file, stats,
+                            dest_file, links);
+    }
+
+    if (known == NULL) {
+        if (fstatat(src_dirfd, name, &st, 0) != 0) {
+            return ERROR_FILE_OPEN;
+        }
+        known = &st;
+    }
+
+    if (!uring_wants_file(known)) {
+        return copy_file_at(src_dirfd, name, known, dest_dirfd, name, src_file, stats,
+                            dest_file, links);
+    }
+
+    if (*batch == NULL) {
+        *batch = uring_batch_new();
+    }
+    if (*batch == NULL || uring_batch_add(*batch, src_file, dest_file, known) != SUCCESS) {
+        return copy_file_at(src_dirfd, name, known, dest_dirfd, name, src_file, stats,
+                            dest_file, links);
+    }
+    if (uring_batch_full(*batch)) {
+        return uring_batch_flush(*batch, stats, NULL, NULL);
+    }
+
+    return SUCCESS;
+}
+
+// Copy whatever a directory walk left in its batch
+static int walk_finish_batch(UringBatch *batch, CopyStats *stats) {
+    int result = uring_batch_flush(batch, stats, NULL, NULL);
+    uring_batch_free(batch);
+    return result;
+}
+
+int walk_entry_type(int dirfd, const char *name, unsigned char d_type, struct stat *st,
+                    int *have_stat) {
+    *have_stat = 0;
+
+    if (d_type == DT_DIR) {
+        return WALK_DIR;
+    }
+    if (d_type != DT_UNKNOWN && d_type != DT_LNK) {
+        return WALK_FILE;
+    }
+
+    // Filesystem did not say, or a symlink: follow it like stat() would
+    int result;
+    STATS_TIMED(STATS_WALK, result = fstatat(dirfd, name, st, 0));
+    if (result != 0) {
+        return WALK_ERROR;
+    }
+    *have_stat = 1;
+    return S_ISDIR(st->st_mode) ? WALK_DIR : WALK_FILE;
+}
+
+int walk_entry_is_symlink(int dirfd, const char *name, unsigned char d_type) {
+    struct stat st;
+
+    if (d_type != DT_UNKNOWN) {
+        return d_type == DT_LNK;
+    }
+    return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+}
+
+// Copy a directory recursively from source to destination
+int copy_directory(const char *src_path, const char *dest_path) {
+    return copy_directory_with_stats(src_path, dest_path, NULL);
+}
+
+static int copy_directory_recursive(const char *src_path, const char *dest_path,
+                                    const CopyFilter *filter, int move, CopyStats *stats);
+
+// Copy a directory recursively and record it in statistics
+int copy_directory_with_stats(const char *src_path, const char *dest_path, CopyStats *stats) {
+    return copy_directory_with_filter(src_path, dest_path, NULL, stats);
+}
+
+// Settings shared by every directory of a serial walk
+typedef struct {
+    const CopyFilter *filter;
+    size_t root_len;            // Length of the source root, for relative paths
+    int lazy;                   // Create directories only when a file needs them
+    int move;                   // Unlink each source file once it is copied
+    CopyStats *stats;
+    DedupTable *links;          // Earlier copies to link to (NULL for moves)
+    PathBuf *src;               // Path of the entry being visited, shared by all levels
+    PathBuf *dest;
+    Arena *arena;               // Entry batches of the directories being walked
+} TreeWalk;
+
+// One directory of a serial walk; its paths are the first src_len and
+// dest_len bytes of the walk's buffers while it is being walked
+typedef struct WalkDir {
+    struct WalkDir *parent;     // NULL for the root
+    const char *name;           // Name in the parent directory
+    size_t src_len;
+    size_t dest_len;
+    int dest_fd;                // O_PATH anchor, -1 while not created yet
+} WalkDir;
+
+static int copy_tree_at(const TreeWalk *walk, int src_fd, WalkDir *dir);
+
+// Count and announce a destination directory once it exists
+static void walk_dir_ready(const TreeWalk *walk, const WalkDir *dir) {
+    if (walk->stats != NULL) {
+        walk->stats->total_dirs++;
+    }
+
+    // The tree-wide progress line replaces per-directory messages
+    if (effective_progress_mode() != PROGRESS_TREE) {
+        printf("Copying directory%s: %.*s -> %.*s\n",
+               filter_active(walk->filter) ? " (filtered)" : "",
+               (int)dir->src_len, walk->src->data, (int)dir->dest_len, walk->dest->data);
+    }
+}
+
+// Create a lazily created destination directory and its missing parents
+static int walk_create_dest(const TreeWalk *walk, WalkDir *dir) {
+    int result;
+
+    if (dir->dest_fd >= 0) {
+        return SUCCESS;
+    }
+    result = walk_create_dest(walk, dir->parent);
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    STATS_TIMED(STATS_WALK, result = mkdirat(dir->parent->dest_fd, dir->name, 0755));
+    if (result != 0 && errno != EEXIST) {
+        return ERROR_DIR_CREATE;
+    }
+    STATS_TIMED(STATS_WALK,
+                dir->dest_fd = openat(dir->parent->dest_fd, dir->name, O_PATH | O_DIRECTORY));
+    if (dir->dest_fd < 0) {
+        return ERROR_DIR_CREATE;
+    }
+
+    walk_dir_ready(walk, dir);
+    return SUCCESS;
+}
+
+// Create dest_dirfd/name and copy src_dirfd/name into it; the walk's
+// paths already name the subdirectory
+static int copy_subdirectory(const TreeWalk *walk, int src_dirfd, WalkDir *parent,
+                             const char *name) {
+    WalkDir dir = { parent, name, walk->src->len, walk->dest->len, -1 };
+    int src_fd;
+    int result;
+
+    STATS_TIMED(STATS_WALK, src_fd = openat(src_dirfd, name, O_RDONLY | O_DIRECTORY));
+    if (src_fd < 0) {
+        return ERROR_DIR_OPEN;
+    }
+
+    if (walk->lazy) {
+        // A copy that already exists is synced (and --delete'd) as usual
+        if (parent->dest_fd >= 0) {
+            STATS_TIMED(STATS_WALK,
+                        dir.dest_fd = openat(parent->dest_fd, name, O_PATH | O_DIRECTORY));
+        }
+        return copy_tree_at(walk, src_fd, &dir);
+    }
+
+    STATS_TIMED(STATS_WALK, result = mkdirat(parent->dest_fd, name, 0755));
+    if (result != 0 && errno != EEXIST) {
+        close(src_fd);
+        return ERROR_DIR_CREATE;
+    }
+
+    // Only used as an anchor for *at() calls, never read
+    STATS_TIMED(STATS_WALK, dir.dest_fd = openat(parent->dest_fd, name, O_PATH | O_DIRECTORY));
+    if (dir.dest_fd < 0) {
+        close(src_fd);
+        return ERROR_DIR_CREATE;
+    }
+
+    return copy_tree_at(walk, src_fd, &dir);
+}
+
+// Point the walk's paths at dir/name
+static int walk_push(const TreeWalk *walk, const char *name) {
+    size_t src_len = walk->src->len;
+
+    if (path_buf_push(walk->src, name) != 0) {
+        return ERROR_DIR_OPEN;
+    }
+    if (path_buf_push(walk->dest, name) != 0) {
+        path_buf_pop(walk->src, src_len);
+        return ERROR_DIR_OPEN;
+    }
+    return SUCCESS;
+}
+
+// Point the walk's paths back at dir
+static void walk_pop(const TreeWalk *walk, const WalkDir *dir) {
+    path_buf_pop(walk->src, dir->src_len);
+    path_buf_pop(walk->dest, dir->dest_len);
+}
+
+// Sync a directory the index vouches for: files are skipped without a
+// stat, only subdirectories are opened (and checked in turn)
+static int copy_indexed_tree(const TreeWalk *walk, const IndexEntry *cached, int src_fd,
+                             WalkDir *dir, size_t *children) {
+    const IndexEntry *child;
+    int result = SUCCESS;
+
+    *children = index_children(cached, &child);
+
+    for (size_t i = 0; i < *children && result == SUCCESS; i++, child++) {
+        const char *name = index_entry_name(child);
+
+        if (child->type == INDEX_TYPE_DIR) {
+            result = walk_push(walk, name);
+            if (result == SUCCESS) {
+                result = copy_subdirectory(walk, src_fd, dir, name);
+                walk_pop(walk, dir);
+            }
+            continue;
+        }
+
+        index_keep(child);
+        if (walk->stats != NULL) {
+            walk->stats->skipped_files++;
+            walk->stats->skipped_bytes += child->size;
+        }
+    }
+
+    return result;
+}
+
+// Copy one entry of a directory; the walk's paths name the entry
+static int copy_tree_entry(const TreeWalk *walk, int src_dirfd, WalkDir *dir,
+                           const DirEntry *entry, UringBatch **batch) {
+    const char *relative = filter_relative_path(walk->src->data, walk->root_len);
+    struct stat st;
+    int have_stat;
+    int result;
+
+    // A move takes symlinks as they are instead of following them
+    int type;
+    if (walk->move && walk_entry_is_symlink(src_dirfd, entry->d_name, entry->d_type)) {
+        type = WALK_FILE;
+        have_stat = 0;
+    } else {
+        type = walk_entry_type(src_dirfd, entry->d_name, entry->d_type, &st, &have_stat);
+    }
+
+    switch (type) {
+        case WALK_DIR:
+            // Excluded subtrees are never opened
+            if (!filter_wants_dir(walk->filter, relative)) {
+                return SUCCESS;
+            }
+            return copy_subdirectory(walk, src_dirfd, dir, entry->d_name);
+        case WALK_FILE:
+            if (!filter_wants_file(walk->filter, relative)) {
+                return SUCCESS;
+            }
+            result = walk_create_dest(walk, dir);
+            if (result != SUCCESS) {
+                return result;
+            }
+            if (walk->move) {
+                return move_file_at(src_dirfd, entry->d_name, have_stat ? &st : NULL,
+                                    dir->dest_fd, entry->d_name, walk->src->data, walk->stats);
+            }
+            return walk_copy_file(batch, src_dirfd, dir->dest_fd, entry->d_name,
+                                  have_stat ? &st : NULL, walk->src->data, walk->dest->data,
+                                  walk->stats, walk->links);
+        default:
+            return ERROR_FILE_OPEN;
+    }
+}
+
+// Single-threaded depth-first copy relative to open directory descriptors
+// Takes ownership of src_fd and dir->dest_fd.
+static int copy_tree_at(const TreeWalk *walk, int src_fd, WalkDir *dir) {
+    DirBatch entries = { NULL, 0 };
+    struct stat dir_st, dest_st;
+    int result = SUCCESS;
+    UringBatch *batch = NULL;
+    const IndexEntry *cached = NULL;
+    size_t children = 0;
+    CopyStats *stats = walk->stats;
+    int filtered = filter_active(walk->filter);
+    ArenaMark mark = arena_mark(walk->arena);
+
+    // Directory state before reading it, so later changes show up next run
+    int indexed = index_active() && !filtered && fstat(src_fd, &dir_st) == 0;
+    if (indexed && fstat(dir->dest_fd, &dest_st) == 0) {
+        cached = index_trusted_dir(walk->src->data, &dir_st, &dest_st);
+    }
+
+    if (dir->dest_fd >= 0) {
+        walk_dir_ready(walk, dir);
+    }
+
+    // Drop what the source no longer has before copying into it
+    if (active_options.delete_extraneous && cached == NULL && dir->dest_fd >= 0) {
+        result = sync_delete_extraneous(src_fd, dir->dest_fd, walk->src->data,
+                                        walk->dest->data, walk->filter, walk->root_len, stats);
     }
-    
-    // Copy file content
-    while ((bytes_read = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            close(src_fd);
-            close(dest_fd);
-            return ERROR_FILE_WRITE;
+
+    if (cached != NULL) {
+        result = copy_indexed_tree(walk, cached, src_fd, dir, &children);
+    } else if (result == SUCCESS) {
+        // The whole directory is read (and put in --order) before anything
+        // below it is opened
+        result = dir_batch_read(src_fd, walk->arena, &entries);
+        children = entries.count;
+        dir_batch_sort(&entries, src_fd, active_options.order);
+    }
+
+    for (size_t i = 0; i < entries.count && result == SUCCESS; i++) {
+        // Full paths are only for messages, filters, io_uring batches and --delete
+        result = walk_push(walk, entries.entries[i]->d_name);
+        if (result == SUCCESS) {
+            result = copy_tree_entry(walk, src_fd, dir, entries.entries[i], &batch);
+            walk_pop(walk, dir);
         }
-        copied += bytes_written;
-        display_progress(copied, total_size, src_path);
     }
-    
-    printf("\n");
-    
-    if (bytes_read < 0) {
-        close(src_fd);
-        close(dest_fd);
-        return ERROR_FILE_READ;
+    arena_release(walk->arena, mark);
+
+    if (result == SUCCESS) {
+        result = walk_finish_batch(batch, stats);
+    } else {
+        uring_batch_free(batch);
     }
-    
-    // Copy file permissions
-    struct stat st;
-    if (fstat(src_fd, &st) == 0) {
-        fchmod(dest_fd, st.st_mode);
+
+    if (result == SUCCESS && indexed) {
+        index_record_dir(walk->src->data, &dir_st, children);
     }
-    
+
     close(src_fd);
-    close(dest_fd);
-    
-    return SUCCESS;
+    if (dir->dest_fd >= 0) {
+        close(dir->dest_fd);
+        dir->dest_fd = -1;
+    }
+
+    if (result == SUCCESS && !filtered && effective_progress_mode() != PROGRESS_TREE) {
+        printf("Directory copied successfully: %s\n", walk->dest->data);
+    }
+
+    return result;
 }
 
-// Copy a directory recursively from source to destination
-int copy_directory(const char *src_path, const char *dest_path) {
-    DIR *dir;
-    struct dirent *entry;
-    char src_file[MAX_PATH];
-    char dest_file[MAX_PATH];
+// Single-threaded depth-first directory copy
+static int copy_directory_recursive(const char *src_path, const char *dest_path,
+                                    const CopyFilter *filter, int move, CopyStats *stats) {
+    PathBuf src, dest;
+    Arena arena = { NULL, NULL, NULL };
+    // With include patterns, subdirectories appear only around matching files
+    TreeWalk walk = { filter, strlen(src_path), filter_selects_files(filter), move, stats, NULL,
+                      &src, &dest, &arena };
+    WalkDir root = { NULL, NULL, strlen(src_path), strlen(dest_path), -1 };
+    int src_fd;
     int result;
 
     // Create destination directory
@@ -176,87 +1162,86 @@ int copy_directory(const char *src_path, const char *dest_path) {
     }
 
     // Open source directory
-    dir = opendir(src_path);
-    if (dir == NULL) {
+    src_fd = open(src_path, O_RDONLY | O_DIRECTORY);
+    if (src_fd < 0) {
         return ERROR_DIR_OPEN;
     }
 
-    printf("Copying directory: %s -> %s\n", src_path, dest_path);
-
-    // Iterate through directory entries
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        // Build full paths
-        snprintf(src_file, MAX_PATH, "%s/%s", src_path, entry->d_name);
-        snprintf(dest_file, MAX_PATH, "%s/%s", dest_path, entry->d_name);
+    root.dest_fd = open(dest_path, O_PATH | O_DIRECTORY);
+    if (root.dest_fd < 0) {
+        close(src_fd);
+        return ERROR_DIR_CREATE;
+    }
 
-        // Check if entry is a directory
-        if (is_directory(src_file)) {
-            // Recursively copy subdirectory
-            result = copy_directory(src_file, dest_file);
-            if (result != SUCCESS) {
-                closedir(dir);
-                return result;
-            }
-        } else {
-            // Copy file
-            result = copy_file(src_file, dest_file);
-            if (result != SUCCESS) {
-                closedir(dir);
-                return result;
-            }
-        }
+    if (path_buf_init(&src, src_path) != 0 || path_buf_init(&dest, dest_path) != 0) {
+        path_buf_free(&src);
+        close(src_fd);
+        close(root.dest_fd);
+        return ERROR_DIR_OPEN;
     }
 
-    closedir(dir);
-    printf("Directory copied successfully: %s\n", dest_path);
+    // Moves keep inodes apart: a source hardlink is unlinked as it is moved
+    if (!move) {
+        walk.links = compress_active() ? NULL : dedup_table_new(active_options.dedup);
+    }
 
-    return SUCCESS;
+    CopyStats *outer = stats_bind(stats);
+    result = copy_tree_at(&walk, src_fd, &root);
+    stats_bind(outer);
+    dedup_table_free(walk.links);
+    arena_free(&arena);
+    path_buf_free(&src);
+    path_buf_free(&dest);
+    return result;
 }
 
 // Print error message based on error code
-void print_error(int error_code, const char *context) {
-    fprintf(stderr, "Error");
-    if (context != NULL && strlen(context) > 0) {
-        fprintf(stderr, " (%s)", context);
-    }
-    fprintf(stderr, ": ");
-
+void format_error(int error_code, int saved_errno, char *buffer, size_t size) {
     switch (error_code) {
         case ERROR_FILE_OPEN:
-            fprintf(stderr, "Failed to open file - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to open file - %s", strerror(saved_errno));
             break;
         case ERROR_FILE_READ:
-            fprintf(stderr, "Failed to read file - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to read file - %s", strerror(saved_errno));
             break;
         case ERROR_FILE_WRITE:
-            fprintf(stderr, "Failed to write file - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to write file - %s", strerror(saved_errno));
             break;
         case ERROR_DIR_CREATE:
-            fprintf(stderr, "Failed to create directory - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to create directory - %s", strerror(saved_errno));
             break;
         case ERROR_DIR_OPEN:
-            fprintf(stderr, "Failed to open directory - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to open directory - %s", strerror(saved_errno));
             break;
         case ERROR_INVALID_PATH:
-            fprintf(stderr, "Invalid path\n");
+            snprintf(buffer, size, "Invalid path");
             break;
         case ERROR_MOVE_FAILED:
-            fprintf(stderr, "Failed to move file/directory - %s\n", strerror(errno));
+            snprintf(buffer, size, "Failed to move file/directory - %s", strerror(saved_errno));
             break;
         case ERROR_FILES_DIFFER:
-            fprintf(stderr, "Files are different\n");
+            snprintf(buffer, size, "Files are different");
+            break;
+        case ERROR_VERIFY_FAILED:
+            snprintf(buffer, size, "Verification failed - destination does not match source");
             break;
         default:
-            fprintf(stderr, "Unknown error (code: %d)\n", error_code);
+            snprintf(buffer, size, "Unknown error (code: %d)", error_code);
             break;
     }
 }
 
+void print_error(int error_code, const char *context) {
+    char message[256];
+
+    format_error(error_code, errno, message, sizeof(message));
+    fprintf(stderr, "Error");
+    if (context != NULL && strlen(context) > 0) {
+        fprintf(stderr, " (%s)", context);
+    }
+    fprintf(stderr, ": %s\n", message);
+}
+
 // ============================================================================
 // PROGRESS STATISTICS IMPLEMENTATION
 // ============================================================================
@@ -265,22 +1250,55 @@ void init_stats(CopyStats *stats) {
     stats->total_files = 0;
     stats->total_dirs = 0;
     stats->total_bytes = 0;
+    stats->physical_bytes = 0;
+    stats->sparse_files = 0;
+    stats->verified_files = 0;
+    stats->skipped_files = 0;
+    stats->skipped_bytes = 0;
+    stats->delta_files = 0;
+    stats->deleted_files = 0;
+    stats->linked_files = 0;
+    stats->deduped_files = 0;
+    stats->deduped_bytes = 0;
+    stats->compressed_files = 0;
+    stats->decompressed_files = 0;
+    stats->plain_bytes = 0;
+    stats->packed_bytes = 0;
+    stats->codec_cpu_ns = 0;
+    stats->resumed_files = 0;
+    stats->resumed_bytes = 0;
     stats->copied_bytes = 0;
-    stats->start_time = time(NULL);
-    stats->current_time = stats->start_time;
+    stats->start_ns = monotonic_ns();
+    stats->current_ns = stats->start_ns;
     stats->transfer_speed = 0.0;
+    for (int i = 0; i < COPY_ENGINE_COUNT; i++) {
+        stats->engine_files[i] = 0;
+    }
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        stats->phase_ns[i] = 0;
+        stats->phase_calls[i] = 0;
+    }
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        stats->file_latency[i] = 0;
+    }
+    stats->file_latency_max_ns = 0;
 }
 
 void update_stats(CopyStats *stats, long bytes) {
     stats->copied_bytes += bytes;
-    stats->current_time = time(NULL);
+    stats->current_ns = monotonic_ns();
     stats->transfer_speed = calculate_speed(stats);
+    display_tree_progress(stats, 0);
+}
+
+long stats_elapsed_ns(const CopyStats *stats) {
+    return stats->current_ns - stats->start_ns;
 }
 
 double calculate_speed(const CopyStats *stats) {
-    time_t elapsed = stats->current_time - stats->start_time;
+    long elapsed = stats_elapsed_ns(stats);
     if (elapsed <= 0) return 0.0;
-    return (double)stats->copied_bytes / elapsed;
+    return (double)stats->copied_bytes * 1e9 / elapsed;
 }
 
 long estimate_time_remaining(const CopyStats *stats) {
@@ -290,6 +1308,8 @@ long estimate_time_remaining(const CopyStats *stats) {
 }
 
 void display_stats(const CopyStats *stats) {
+    display_tree_progress(stats, 1);
+    finish_progress();
     printf("\n");
     printf("╔════════════════════════════════════════════════════════╗\n");
     printf("║                  COPY STATISTICS                       ║\n");
@@ -308,8 +1328,83 @@ void display_stats(const CopyStats *stats) {
     }
     printf("\n");
 
-    time_t elapsed = stats->current_time - stats->start_time;
-    printf("  Time elapsed:      %ld seconds\n", elapsed);
+    // Holes and unchanged blocks of patched files are not transferred
+    if (stats->sparse_files > 0 || stats->delta_files > 0) {
+        printf("  Physical bytes:    %ld", stats->physical_bytes);
+        if (stats->physical_bytes >= 1024 * 1024) {
+            printf(" (%.2f MB)", stats->physical_bytes / (1024.0 * 1024.0));
+        } else if (stats->physical_bytes >= 1024) {
+            printf(" (%.2f KB)", stats->physical_bytes / 1024.0);
+        }
+        if (stats->sparse_files > 0) {
+            printf(", %ld sparse file(s)", stats->sparse_files);
+        }
+        printf("\n");
+    }
+
+    int engines_shown = 0;
+    for (int i = COPY_ENGINE_REFLINK; i < COPY_ENGINE_COUNT; i++) {
+        if (stats->engine_files[i] == 0) continue;
+        printf(engines_shown == 0 ? "  Copy engine:       " : ", ");
+        printf("%s (%ld)", copy_engine_name((CopyEngine)i), stats->engine_files[i]);
+        engines_shown++;
+    }
+    if (engines_shown > 0) {
+        printf("\n");
+    }
+
+    if (stats->verified_files > 0) {
+        printf("  Verified:          %ld file(s) (%s)\n", stats->verified_files,
+               hash_name(active_options.hash));
+    }
+
+    if (stats->skipped_files > 0) {
+        printf("  Up to date:        %ld file(s), %.2f MB skipped\n", stats->skipped_files,
+               stats->skipped_bytes / (1024.0 * 1024.0));
+    }
+    if (stats->delta_files > 0) {
+        printf("  Patched in place:  %ld file(s)\n", stats->delta_files);
+    }
+    if (stats->linked_files > 0 || stats->deduped_files > 0) {
+        printf("  Linked:            %ld hardlink(s), %ld duplicate(s), %.2f MB not copied\n",
+               stats->linked_files, stats->deduped_files,
+               stats->deduped_bytes / (1024.0 * 1024.0));
+    }
+    if (stats->compressed_files > 0 || stats->decompressed_files > 0) {
+        printf("  Compression:       %ld packed, %ld unpacked, %.2f MB plain / %.2f MB coded",
+               stats->compressed_files, stats->decompressed_files,
+               stats->plain_bytes / (1024.0 * 1024.0), stats->packed_bytes / (1024.0 * 1024.0));
+        if (stats->packed_bytes > 0) {
+            printf(" (ratio %.2f)", (double)stats->plain_bytes / stats->packed_bytes);
+        }
+        printf(", %.3f s CPU\n", stats->codec_cpu_ns / 1e9);
+    }
+    if (stats->resumed_files > 0) {
+        printf("  Resumed:           %ld file(s), %.2f MB kept from the interrupted run\n",
+               stats->resumed_files, stats->resumed_bytes / (1024.0 * 1024.0));
+    }
+    if (stats->deleted_files > 0) {
+        printf("  Deleted:           %ld extraneous entr%s\n", stats->deleted_files,
+               stats->deleted_files == 1 ? "y" : "ies");
+    }
+
+    printf("  Time elapsed:      %.3f seconds\n", stats_elapsed_ns(stats) / 1e9);
+
+    // Where the time went; phases overlap across worker threads
+    int phases_shown = 0;
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if (stats->phase_calls[i] == 0) continue;
+        printf(phases_shown == 0 ? "  Time by phase:     " : "                     ");
+        printf("%-9s %9.3f s  %ld call(s)\n", stats_phase_name((StatsPhase)i),
+               stats->phase_ns[i] / 1e9, stats->phase_calls[i]);
+        phases_shown++;
+    }
+    long p50 = stats_latency_percentile(stats, 50);
+    if (p50 > 0) {
+        printf("  Per-file time:     p50 <= %.1f us, p99 <= %.1f us, max %.1f us\n",
+               p50 / 1e3, stats_latency_percentile(stats, 99) / 1e3,
+               stats->file_latency_max_ns / 1e3);
+    }
 
     if (stats->transfer_speed > 0) {
         printf("  Transfer speed:    ");
@@ -340,113 +1435,83 @@ void display_stats(const CopyStats *stats) {
 // ============================================================================
 
 int compare_files(const char *file1, const char *file2) {
-    int fd1, fd2;
-    ssize_t bytes1, bytes2;
-    char buffer1[BUFFER_SIZE];
-    char buffer2[BUFFER_SIZE];
+    return compare_files_at(file1, file2, NULL);
+}
 
-    // Check if both files exist
-    if (!path_exists(file1) || !path_exists(file2)) {
-        return ERROR_FILE_OPEN;
-    }
+int calculate_md5(const char *filepath, char *checksum) {
+    return hash_file(filepath, HASH_MD5, checksum);
+}
 
-    // Check file sizes first
-    long size1 = get_file_size(file1);
-    long size2 = get_file_size(file2);
+int calculate_checksum(const char *filepath, HashAlgorithm algorithm, char *checksum) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    HashContext ctx;
+    struct stat st;
+    char *resolved;
+    size_t len;
+    int fd, result = SUCCESS;
 
-    if (size1 != size2) {
-        return ERROR_FILES_DIFFER;
+    // Tree digests are never cached; workers of a pool hash on their own thread
+    if (active_options.tree_hash) {
+        int jobs = thread_pool_worker_index() >= 0 ? 1 : active_options.jobs;
+        return tree_hash_file(filepath, algorithm, jobs, checksum);
     }
 
-    // Open both files
-    fd1 = open(file1, O_RDONLY);
-    if (fd1 < 0) {
-        return ERROR_FILE_OPEN;
+    if (!index_active()) {
+        return hash_file(filepath, algorithm, checksum);
     }
 
-    fd2 = open(file2, O_RDONLY);
-    if (fd2 < 0) {
-        close(fd1);
+    // The checksum cache is keyed by absolute path
+    resolved = realpath(filepath, NULL);
+    if (resolved == NULL || stat(resolved, &st) != 0) {
+        free(resolved);
         return ERROR_FILE_OPEN;
     }
 
-    // Compare byte by byte
-    while (1) {
-        bytes1 = read(fd1, buffer1, BUFFER_SIZE);
-        bytes2 = read(fd2, buffer2, BUFFER_SIZE);
-
-        if (bytes1 < 0 || bytes2 < 0) {
-            close(fd1);
-            close(fd2);
-            return ERROR_FILE_READ;
-        }
-
-        if (bytes1 != bytes2) {
-            close(fd1);
-            close(fd2);
-            return ERROR_FILES_DIFFER;
-        }
-
-        if (bytes1 == 0) {
-            // End of both files
-            break;
-        }
-
-        if (memcmp(buffer1, buffer2, bytes1) != 0) {
-            close(fd1);
-            close(fd2);
-            return ERROR_FILES_DIFFER;
+    // Stat taken before hashing: a change while reading invalidates the entry
+    len = index_cached_digest(resolved, &st, algorithm, digest);
+    if (len == 0) {
+        fd = open(resolved, O_RDONLY);
+        if (fd < 0) {
+            free(resolved);
+            return ERROR_FILE_OPEN;
         }
-    }
-
-    close(fd1);
-    close(fd2);
-
-    return SUCCESS;
-}
-
-// Simple MD5-like checksum (using a simple hash for demonstration)
-// For production, use OpenSSL or similar library
-int calculate_md5(const char *filepath, char *checksum) {
-    int fd;
-    ssize_t bytes_read;
-    char buffer[BUFFER_SIZE];
-    unsigned long hash = 5381;
-    unsigned long hash2 = 0;
-
-    fd = open(filepath, O_RDONLY);
-    if (fd < 0) {
-        return ERROR_FILE_OPEN;
-    }
-
-    while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        for (ssize_t i = 0; i < bytes_read; i++) {
-            hash = ((hash << 5) + hash) + buffer[i]; // hash * 33 + c
-            hash2 = hash2 * 31 + buffer[i];
+        hash_init(&ctx, algorithm);
+        result = hash_fd(fd, &ctx);
+        close(fd);
+        if (result == SUCCESS) {
+            len = hash_final(&ctx, digest);
+            index_record_file(resolved, &st, AT_FDCWD, NULL, algorithm, digest, len);
         }
     }
+    free(resolved);
 
-    close(fd);
-
-    if (bytes_read < 0) {
-        return ERROR_FILE_READ;
+    if (result == SUCCESS) {
+        hash_to_hex(digest, len, checksum);
     }
-
-    // Format as hex string (simplified checksum)
-    snprintf(checksum, 33, "%016lx%016lx", hash, hash2);
-
-    return SUCCESS;
+    return result;
 }
 
 int verify_checksum(const char *filepath, const char *expected_checksum) {
-    char actual_checksum[33];
-    int result = calculate_md5(filepath, actual_checksum);
+    char actual_checksum[HASH_MAX_HEX];
+    HashAlgorithm algorithm = active_options.hash;
+    size_t len = strlen(expected_checksum);
+
+    // The digest length tells md5sum, sha256sum and xxhsum output apart
+    for (int i = 0; i < HASH_COUNT; i++) {
+        if (len == hash_digest_size((HashAlgorithm)i) * 2) {
+            algorithm = (HashAlgorithm)i;
+            break;
+        }
+    }
 
+    int result = active_options.tree_hash
+                     ? calculate_checksum(filepath, algorithm, actual_checksum)
+                     : hash_file(filepath, algorithm, actual_checksum);
     if (result != SUCCESS) {
         return result;
     }
 
-    if (strcmp(actual_checksum, expected_checksum) != 0) {
+    if (strcasecmp(actual_checksum, expected_checksum) != 0) {
         return ERROR_FILES_DIFFER;
     }
 
@@ -458,36 +1523,14 @@ int verify_checksum(const char *filepath, const char *expected_checksum) {
 // ============================================================================
 
 int remove_directory(const char *path) {
-    DIR *dir;
-    struct dirent *entry;
-    char filepath[MAX_PATH];
-
-    dir = opendir(path);
-    if (dir == NULL) {
-        return ERROR_DIR_OPEN;
-    }
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        snprintf(filepath, MAX_PATH, "%s/%s", path, entry->d_name);
-
-        if (is_directory(filepath)) {
-            remove_directory(filepath);
-        } else {
-            unlink(filepath);
-        }
-    }
-
-    closedir(dir);
-    rmdir(path);
-
-    return SUCCESS;
+    return tree_remove(path, active_options.jobs, 0);
 }
 
 int move_file(const char *src_path, const char *dest_path) {
+    return move_file_with_stats(src_path, dest_path, NULL);
+}
+
+int move_file_with_stats(const char *src_path, const char *dest_path, CopyStats *stats) {
     // Try rename first (works if same filesystem)
     if (rename(src_path, dest_path) == 0) {
         return SUCCESS;
@@ -495,17 +1538,20 @@ int move_file(const char *src_path, const char *dest_path) {
 
     // If rename fails (different filesystem), copy then delete
     if (errno == EXDEV) {
-        int result = copy_file(src_path, dest_path);
-        if (result != SUCCESS) {
-            return result;
-        }
-
-        // Verify copy was successful before deleting
-        result = compare_files(src_path, dest_path);
-        if (result != SUCCESS) {
-            unlink(dest_path); // Remove incomplete copy
+        DurableSource source = { AT_FDCWD, src_path };
+        CopyStats *outer = stats_bind(stats);
+        int result = copy_file_checked(src_path, dest_path, stats, move_verify_mode(), &source);
+        stats_bind(outer);
+        if (result == ERROR_VERIFY_FAILED) {
+            if (active_options.durable == DURABLE_OFF) {
+                unlink(dest_path); // Remove bad copy
+            }
             return ERROR_MOVE_FAILED;
         }
+        // --durable: the batch unlinks the source after the rename
+        if (active_options.durable != DURABLE_OFF || result != SUCCESS) {
+            return finish_durable(result, stats);
+        }
 
         // Delete source file
         if (unlink(src_path) != 0) {
@@ -519,21 +1565,38 @@ int move_file(const char *src_path, const char *dest_path) {
 }
 
 int move_directory(const char *src_path, const char *dest_path) {
+    return move_directory_with_stats(src_path, dest_path, NULL);
+}
+
+int move_directory_with_stats(const char *src_path, const char *dest_path, CopyStats *stats) {
     // Try rename first
     if (rename(src_path, dest_path) == 0) {
         return SUCCESS;
     }
 
-    // If rename fails, copy then delete
+    // If rename fails, copy and delete file by file
     if (errno == EXDEV) {
-        int result = copy_directory(src_path, dest_path);
-        if (result != SUCCESS) {
-            return result;
+        int result;
+        // A pool worker must not wait on a pool of its own
+        if (active_options.jobs > 1 && thread_pool_worker_index() < 0) {
+            result = parallel_move_directory(src_path, dest_path, stats, active_options.jobs);
+        } else {
+            result = copy_directory_recursive(src_path, dest_path, NULL, 1, stats);
+        }
+
+        // Sources are unlinked as their batch commits, so even a held
+        // batch has to be flushed before the emptied directories go
+        if (active_options.durable != DURABLE_OFF) {
+            int flushed = durable_flush(stats);
+            result = result != SUCCESS ? result : flushed;
         }
 
-        // Delete source directory
-        result = remove_directory(src_path);
+        // Only the directories the move emptied are left to delete
+        int pruned = tree_remove(src_path, active_options.jobs, 1);
         if (result != SUCCESS) {
+            return result;
+        }
+        if (pruned != SUCCESS) {
             return ERROR_MOVE_FAILED;
         }
 
@@ -554,28 +1617,15 @@ int match_pattern(const char *filename, const char *pattern) {
 
 int should_copy_file(const char *filename, const char **include_patterns,
                      const char **exclude_patterns) {
-    // If exclude patterns exist, check them first
-    if (exclude_patterns != NULL) {
-        for (int i = 0; exclude_patterns[i] != NULL; i++) {
-            if (match_pattern(filename, exclude_patterns[i])) {
-                return 0; // Excluded
-            }
-        }
-    }
-
-    // If no include patterns, include by default
-    if (include_patterns == NULL || include_patterns[0] == NULL) {
-        return 1;
-    }
-
-    // Check include patterns
-    for (int i = 0; include_patterns[i] != NULL; i++) {
-        if (match_pattern(filename, include_patterns[i])) {
-            return 1; // Included
-        }
+    // One-off check: walks compile their filter once instead
+    CopyFilter *filter = filter_from_patterns(include_patterns, exclude_patterns);
+    if (filter == NULL) {
+        return 0;
     }
 
-    return 0; // Not matched by any include pattern
+    int wanted = filter_wants_file(filter, filename);
+    filter_free(filter);
+    return wanted;
 }
 
 int copy_file_filtered(const char *src_path, const char *dest_path,
@@ -594,83 +1644,33 @@ int copy_file_filtered(const char *src_path, const char *dest_path,
         return SUCCESS; // Skip this file
     }
 
-    // Copy the file
-    int result = copy_file(src_path, dest_path);
-
-    // Update statistics if provided
-    if (result == SUCCESS && stats != NULL) {
-        stats->total_files++;
-        long size = get_file_size(dest_path);
-        if (size > 0) {
-            stats->total_bytes += size;
-            update_stats(stats, size);
-        }
-    }
-
-    return result;
+    // Copy the file (statistics are updated by the copier)
+    return copy_file_with_stats(src_path, dest_path, stats);
 }
 
 int copy_directory_filtered(const char *src_path, const char *dest_path,
                             const char **include_patterns, const char **exclude_patterns,
                             CopyStats *stats) {
-    DIR *dir;
-    struct dirent *entry;
-    char src_file[MAX_PATH];
-    char dest_file[MAX_PATH];
-    int result;
-
-    // Create destination directory
-    result = create_directory(dest_path);
-    if (result != SUCCESS) {
-        return result;
-    }
-
-    if (stats != NULL) {
-        stats->total_dirs++;
-    }
-
-    // Open source directory
-    dir = opendir(src_path);
-    if (dir == NULL) {
+    CopyFilter *filter = filter_from_patterns(include_patterns, exclude_patterns);
+    if (filter == NULL) {
         return ERROR_DIR_OPEN;
     }
 
-    printf("Copying directory (filtered): %s -> %s\n", src_path, dest_path);
-
-    // Iterate through directory entries
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    int result = copy_directory_with_filter(src_path, dest_path, filter, stats);
+    filter_free(filter);
+    return result;
+}
 
-        // Build full paths
-        snprintf(src_file, MAX_PATH, "%s/%s", src_path, entry->d_name);
-        snprintf(dest_file, MAX_PATH, "%s/%s", dest_path, entry->d_name);
+int copy_directory_with_filter(const char *src_path, const char *dest_path,
+                               const CopyFilter *filter, CopyStats *stats) {
+    int result;
 
-        // Check if entry is a directory
-        if (is_directory(src_file)) {
-            // Recursively copy subdirectory
-            result = copy_directory_filtered(src_file, dest_file,
-                                            include_patterns, exclude_patterns, stats);
-            if (result != SUCCESS) {
-                closedir(dir);
-                return result;
-            }
-        } else {
-            // Copy file with filtering
-            result = copy_file_filtered(src_file, dest_file,
-                                       include_patterns, exclude_patterns, stats);
-            if (result != SUCCESS && result != SUCCESS) {
-                closedir(dir);
-                return result;
-            }
-        }
+    if (active_options.jobs > 1) {
+        result = parallel_copy_directory(src_path, dest_path, filter, stats, active_options.jobs);
+    } else {
+        result = copy_directory_recursive(src_path, dest_path, filter, 0, stats);
     }
-
-    closedir(dir);
-
-    return SUCCESS;
+    return finish_durable(result, stats);
 }
 
 // Get parent directory path
@@ -700,108 +1700,49 @@ void get_parent_directory(const char *path, char *parent, size_t size) {
     }
 }
 
-// List directory contents with details
-int list_directory(const char *path) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char full_path[MAX_PATH];
-    int count = 0;
-
-    dir = opendir(path);
-    if (dir == NULL) {
-        return ERROR_DIR_OPEN;
+// Move a browsed path to its parent, as get_parent_directory would
+static void browse_parent(PathBuf *path) {
+    while (path->len > 1 && path->data[path->len - 1] == '/') {
+        path_buf_pop(path, path->len - 1);
     }
 
-    printf("\n");
-    printf("📂 Directory: %s\n", path);
-    printf("════════════════════════════════════════════════════════\n");
-    printf("%-4s %-10s %-8s %-12s %s\n", "Type", "Perms", "Size", "Modified", "Name");
-    printf("────────────────────────────────────────────────────────\n");
-
-    while ((entry = readdir(dir)) != NULL) {
-        // Build full path
-        snprintf(full_path, MAX_PATH, "%s/%s", path, entry->d_name);
-
-        if (stat(full_path, &st) != 0) {
-            continue;
-        }
-
-        // Type
-        char type[5];
-        if (S_ISDIR(st.st_mode)) {
-            strcpy(type, "📁");
-        } else if (S_ISLNK(st.st_mode)) {
-            strcpy(type, "🔗");
-        } else {
-            strcpy(type, "📄");
-        }
-
-        // Permissions
-        char perms[11];
-        perms[0] = S_ISDIR(st.st_mode) ? 'd' : '-';
-        perms[1] = (st.st_mode & S_IRUSR) ? 'r' : '-';
-        perms[2] = (st.st_mode & S_IWUSR) ? 'w' : '-';
-        perms[3] = (st.st_mode & S_IXUSR) ? 'x' : '-';
-        perms[4] = (st.st_mode & S_IRGRP) ? 'r' : '-';
-        perms[5] = (st.st_mode & S_IWGRP) ? 'w' : '-';
-        perms[6] = (st.st_mode & S_IXGRP) ? 'x' : '-';
-        perms[7] = (st.st_mode & S_IROTH) ? 'r' : '-';
-        perms[8] = (st.st_mode & S_IWOTH) ? 'w' : '-';
-        perms[9] = (st.st_mode & S_IXOTH) ? 'x' : '-';
-        perms[10] = '\0';
-
-        // Size
-        char size_str[20];
-        if (S_ISDIR(st.st_mode)) {
-            strcpy(size_str, "<DIR>");
-        } else {
-            long size = st.st_size;
-            if (size < 1024) {
-                snprintf(size_str, sizeof(size_str), "%ldB", size);
-            } else if (size < 1024 * 1024) {
-                snprintf(size_str, sizeof(size_str), "%.1fKB", size / 1024.0);
-            } else if (size < 1024 * 1024 * 1024) {
-                snprintf(size_str, sizeof(size_str), "%.1fMB", size / (1024.0 * 1024.0));
-            } else {
-                snprintf(size_str, sizeof(size_str), "%.1fGB", size / (1024.0 * 1024.0 * 1024.0));
-            }
-        }
-
-        // Modified time
-        char time_str[20];
-        struct tm *timeinfo = localtime(&st.st_mtime);
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", timeinfo);
-
-        // Print entry
-        printf("%-4s %-10s %-8s %-12s %s\n", type, perms, size_str, time_str, entry->d_name);
-        count++;
+    char *last_slash = strrchr(path->data, '/');
+    if (last_slash == NULL) {
+        path_buf_pop(path, 0);
+        path_buf_push(path, ".");
+    } else {
+        path_buf_pop(path, last_slash == path->data ? 1 : (size_t)(last_slash - path->data));
     }
-
-    closedir(dir);
-
-    printf("────────────────────────────────────────────────────────\n");
-    printf("Total: %d items\n", count);
-
-    return SUCCESS;
 }
 
 // Browse filesystem interactively (simple file explorer)
 void browse_filesystem(const char *start_path) {
-    char current_path[MAX_PATH];
+    PathBuf current_path;
     char input[MAX_PATH];
-    char selected_path[MAX_PATH];
-    DIR *dir;
-    struct dirent *entry;
+    Arena arena = { NULL, NULL, NULL };
+    ArenaMark empty = arena_mark(&arena);
+    ListOptions list;
+    ListPage page;
+    int dir_fd;
     struct stat st;
     int choice;
 
+    // Entries are shown by name, one page at a time
+    init_list_options(&list);
+    list.sort = LIST_SORT_NAME;
+    list.limit = BROWSE_PAGE_SIZE;
+
     // Initialize current path
     if (start_path == NULL || strlen(start_path) == 0) {
-        getcwd(current_path, MAX_PATH);
-    } else {
-        strncpy(current_path, start_path, MAX_PATH - 1);
-        current_path[MAX_PATH - 1] = '\0';
+        char *cwd = getcwd(NULL, 0);
+        int failed = cwd == NULL || path_buf_init(&current_path, cwd) != 0;
+        free(cwd);
+        if (failed) {
+            printf("\n❌ Cannot determine the current directory\n");
+            return;
+        }
+    } else if (path_buf_init(&current_path, start_path) != 0) {
+        return;
     }
 
     while (1) {
@@ -814,17 +1755,25 @@ void browse_filesystem(const char *start_path) {
         printf("╚════════════════════════════════════════════════════════╝\n");
 
         // Display current path
-        printf("\n📍 Current Path: %s\n", current_path);
+        printf("\n📍 Current Path: %s\n", current_path.data);
 
         // List directory contents
-        dir = opendir(current_path);
-        if (dir == NULL) {
-            printf("\n❌ Cannot open directory: %s\n", current_path);
+        arena_release(&arena, empty);
+        dir_fd = open(current_path.data, O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0 &&
+            list_page_read(dir_fd, &list, STATX_TYPE | STATX_SIZE, &arena, &page) != SUCCESS) {
+            close(dir_fd);
+            dir_fd = -1;
+        }
+        if (dir_fd < 0) {
+            printf("\n❌ Cannot open directory: %s\n", current_path.data);
             printf("\nPress Enter to go back...");
             getchar();
-            get_parent_directory(current_path, current_path, MAX_PATH);
+            browse_parent(&current_path);
+            list.skip = 0;
             continue;
         }
+        close(dir_fd);
 
         printf("\n");
         printf("════════════════════════════════════════════════════════\n");
@@ -834,38 +1783,20 @@ void browse_filesystem(const char *start_path) {
         // Show parent directory option
         printf("  0  📁    <UP>        .. (Parent Directory)\n");
 
-        // Read and display entries
-        int index = 1;
-        char entries[100][MAX_PATH];  // Store up to 100 entries
-        int entry_count = 0;
-
-        while ((entry = readdir(dir)) != NULL && entry_count < 100) {
-            // Skip . and ..
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-
-            // Build full path
-            snprintf(selected_path, MAX_PATH, "%s/%s", current_path, entry->d_name);
-
-            if (stat(selected_path, &st) != 0) {
-                continue;
-            }
-
-            // Store entry name
-            strncpy(entries[entry_count], entry->d_name, MAX_PATH - 1);
-            entries[entry_count][MAX_PATH - 1] = '\0';
+        // Display the page (names live in the arena)
+        for (size_t i = 0; i < page.count; i++) {
+            const ListItem *item = &page.items[i];
 
             // Type and size
-            char type[5];
-            char size_str[20];
+            const char *type;
+            char size_str[32];
 
-            if (S_ISDIR(st.st_mode)) {
-                strcpy(type, "📁");
+            if (S_ISDIR(item->mode)) {
+                type = "📁";
                 strcpy(size_str, "<DIR>");
             } else {
-                strcpy(type, "📄");
-                long size = st.st_size;
+                type = S_ISLNK(item->mode) ? "🔗" : "📄";
+                long size = item->size;
                 if (size < 1024) {
                     snprintf(size_str, sizeof(size_str), "%ldB", size);
                 } else if (size < 1024 * 1024) {
@@ -875,19 +1806,23 @@ void browse_filesystem(const char *start_path) {
                 }
             }
 
-            printf(" %2d  %-4s %-10s  %s\n", index, type, size_str, entry->d_name);
-
-            index++;
-            entry_count++;
+            printf(" %2zu  %-4s %-10s  %s\n", i + 1, type, size_str, item->entry->d_name);
         }
-
-        closedir(dir);
+        int entry_count = (int)page.count;
 
         printf("────────────────────────────────────────────────────────\n");
-        printf("Total: %d items\n", entry_count);
+        if (page.total > BROWSE_PAGE_SIZE) {
+            printf("Items %zu-%zu of %zu\n", list.skip + (page.count > 0), list.skip + page.count,
+                   page.total);
+        } else {
+            printf("Total: %zu items\n", page.count);
+        }
         printf("\n");
         printf("Commands:\n");
         printf("  • Enter number to navigate/select\n");
+        if (page.total > BROWSE_PAGE_SIZE) {
+            printf("  • Type 'n' / 'b' for the next / previous page\n");
+        }
         printf("  • Type 'p' to show full path\n");
         printf("  • Type 'q' to quit explorer\n");
         printf("\n");
@@ -907,10 +1842,18 @@ void browse_filesystem(const char *start_path) {
         if (strcmp(input, "q") == 0 || strcmp(input, "Q") == 0) {
             break;
         } else if (strcmp(input, "p") == 0 || strcmp(input, "P") == 0) {
-            printf("\n Full Path: %s\n", current_path);
+            printf("\n Full Path: %s\n", current_path.data);
             printf("\nPress Enter to continue...");
             getchar();
             continue;
+        } else if (strcmp(input, "n") == 0 || strcmp(input, "N") == 0) {
+            if (list.skip + BROWSE_PAGE_SIZE < page.total) {
+                list.skip += BROWSE_PAGE_SIZE;
+            }
+            continue;
+        } else if (strcmp(input, "b") == 0 || strcmp(input, "B") == 0) {
+            list.skip = list.skip > BROWSE_PAGE_SIZE ? list.skip - BROWSE_PAGE_SIZE : 0;
+            continue;
         }
 
         // Handle number selection
@@ -918,32 +1861,36 @@ void browse_filesystem(const char *start_path) {
 
         if (choice == 0) {
             // Go to parent directory
-            get_parent_directory(current_path, current_path, MAX_PATH);
+            browse_parent(&current_path);
+            list.skip = 0;
         } else if (choice > 0 && choice <= entry_count) {
             // Navigate to selected entry
-            snprintf(selected_path, MAX_PATH, "%s/%s", current_path, entries[choice - 1]);
+            size_t parent_len = current_path.len;
+            const char *name = page.items[choice - 1].entry->d_name;
+            if (path_buf_push(&current_path, name) != 0) {
+                continue;
+            }
 
-            if (stat(selected_path, &st) == 0) {
-                if (S_ISDIR(st.st_mode)) {
-                    // It's a directory, navigate into it
-                    strncpy(current_path, selected_path, MAX_PATH - 1);
-                    current_path[MAX_PATH - 1] = '\0';
-                } else {
-                    // It's a file, show info and copy path
-                    printf("\n");
-                    printf("╔════════════════════════════════════════════════════════╗\n");
-                    printf("║                    FILE SELECTED                       ║\n");
-                    printf("╚════════════════════════════════════════════════════════╝\n");
-                    printf("\n");
-                    printf("  📄 File: %s\n", entries[choice - 1]);
-                    printf("  📍 Full Path: %s\n", selected_path);
-                    printf("  📊 Size: %ld bytes\n", st.st_size);
-                    printf("\n");
-                    printf("  Path copied! You can use this path for copy/move operations.\n");
-                    printf("\n");
-                    printf("Press Enter to continue...");
-                    getchar();
-                }
+            if (stat(current_path.data, &st) != 0) {
+                path_buf_pop(&current_path, parent_len);
+            } else if (S_ISDIR(st.st_mode)) {
+                list.skip = 0;
+            } else {
+                // It's a file, show info and copy path
+                printf("\n");
+                printf("╔════════════════════════════════════════════════════════╗\n");
+                printf("║                    FILE SELECTED                       ║\n");
+                printf("╚════════════════════════════════════════════════════════╝\n");
+                printf("\n");
+                printf("  📄 File: %s\n", name);
+                printf("  📍 Full Path: %s\n", current_path.data);
+                printf("  📊 Size: %ld bytes\n", st.st_size);
+                printf("\n");
+                printf("  Path copied! You can use this path for copy/move operations.\n");
+                printf("\n");
+                printf("Press Enter to continue...");
+                getchar();
+                path_buf_pop(&current_path, parent_len);
             }
         } else {
             printf("\n❌ Invalid choice!\n");
@@ -952,6 +1899,8 @@ void browse_filesystem(const char *start_path) {
         }
     }
 
+    arena_free(&arena);
+    path_buf_free(&current_path);
     printf("\n✅ Exited file explorer.\n");
 }
 
@@ -0,0 +1,608 @@
+#include "filter.h"
+#include <fnmatch.h>
+#include <stdint.h>
+
+// Pattern flags
+#define PATTERN_DIR_ONLY 0x01   // Trailing '/': matches directories only
+#define PATTERN_NEGATED 0x02    // Leading '!': re-includes
+
+#define NO_PATTERN (-1)
+
+// Last pattern (highest id) ending at a key, for any entry and for directories
+typedef struct {
+    int32_t any;
+    int32_t dir;
+} PatternBest;
+
+// Trie node; children form a linked list through sibling
+typedef struct {
+    int32_t child;
+    int32_t sibling;
+    unsigned char c;
+    PatternBest best;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;            // nodes[0] is the root
+    size_t count;
+    size_t capacity;
+} Trie;
+
+typedef struct {
+    char *key;                  // NULL for an empty slot
+    PatternBest best;
+} LiteralSlot;
+
+typedef struct {
+    char *glob;
+    int32_t id;
+} GlobPattern;
+
+// Pattern matched against the whole relative path, one segment at a time
+typedef struct {
+    char *buffer;               // Segments, NUL-separated
+    char **segments;            // "**" spans any number of path segments
+    size_t count;
+    int32_t id;
+} PathPattern;
+
+typedef struct {
+    uint8_t *flags;             // Indexed by pattern id (order of addition)
+    size_t count;
+    size_t capacity;
+
+    LiteralSlot *literals;      // Open addressing, capacity is a power of two
+    size_t literal_count;
+    size_t literal_capacity;
+
+    Trie suffixes;              // "*suffix", stored reversed
+    Trie prefixes;              // "prefix*"
+
+    GlobPattern *globs;         // Other name globs, by increasing id
+    size_t glob_count;
+    size_t glob_capacity;
+
+    PathPattern *paths;         // Patterns containing '/', by increasing id
+    size_t path_count;
+    size_t path_capacity;
+} PatternSet;
+
+struct CopyFilter {
+    PatternSet include;
+    PatternSet exclude;
+};
+
+static const PatternBest no_best = { NO_PATTERN, NO_PATTERN };
+
+// Grow an array to hold at least one more element
+static int reserve(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return SUCCESS;
+    }
+    size_t grown = *capacity ? *capacity * 2 : 16;
+    void *p = realloc(*array, grown * size);
+    if (p == NULL) {
+        return ERROR_FILE_READ;
+    }
+    *array = p;
+    *capacity = grown;
+    return SUCCESS;
+}
+
+static void set_best(PatternBest *best, int32_t id, int dir_only) {
+    // Ids only grow, so the newest pattern always wins
+    if (dir_only) {
+        best->dir = id;
+    } else {
+        best->any = id;
+    }
+}
+
+static void consider(int32_t *best, const PatternBest *candidate, int is_dir) {
+    if (candidate->any > *best) {
+        *best = candidate->any;
+    }
+    if (is_dir && candidate->dir > *best) {
+        *best = candidate->dir;
+    }
+}
+
+static uint64_t hash_name_bytes(const char *s) {
+    uint64_t h = 1469598103934665603ULL;     // FNV-1a
+
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static LiteralSlot *literal_slot(LiteralSlot *slots, size_t capacity, const char *key) {
+    size_t i = hash_name_bytes(key) & (capacity - 1);
+
+    while (slots[i].key != NULL && strcmp(slots[i].key, key) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static int literal_add(PatternSet *set, const char *key, int32_t id, int dir_only) {
+    // Keep the table at most half full
+    if ((set->literal_count + 1) * 2 > set->literal_capacity) {
+        size_t capacity = set->literal_capacity ? set->literal_capacity * 2 : 64;
+        LiteralSlot *slots = calloc(capacity, sizeof(LiteralSlot));
+        if (slots == NULL) {
+            return ERROR_FILE_READ;
+        }
+        for (size_t i = 0; i < set->literal_capacity; i++) {
+            if (set->literals[i].key != NULL) {
+                *literal_slot(slots, capacity, set->literals[i].key) = set->literals[i];
+            }
+        }
+        free(set->literals);
+        set->literals = slots;
+        set->literal_capacity = capacity;
+    }
+
+    LiteralSlot *slot = literal_slot(set->literals, set->literal_capacity, key);
+    if (slot->key == NULL) {
+        slot->key = strdup(key);
+        if (slot->key == NULL) {
+            return ERROR_FILE_READ;
+        }
+        slot->best = no_best;
+        set->literal_count++;
+    }
+    set_best(&slot->best, id, dir_only);
+    return SUCCESS;
+}
+
+static int32_t trie_node(Trie *trie, unsigned char c) {
+    if (reserve((void **)&trie->nodes, &trie->capacity, trie->count, sizeof(TrieNode)) != SUCCESS) {
+        return NO_PATTERN;
+    }
+    TrieNode *node = &trie->nodes[trie->count];
+    node->child = NO_PATTERN;
+    node->sibling = NO_PATTERN;
+    node->c = c;
+    node->best = no_best;
+    return (int32_t)trie->count++;
+}
+
+static int32_t trie_child(const Trie *trie, int32_t node, unsigned char c) {
+    int32_t child = trie->nodes[node].child;
+
+    while (child != NO_PATTERN && trie->nodes[child].c != c) {
+        child = trie->nodes[child].sibling;
+    }
+    return child;
+}
+
+// Insert len bytes of key, back to front if reversed
+static int trie_add(Trie *trie, const char *key, size_t len, int reversed,
+                    int32_t id, int dir_only) {
+    int32_t node;
+
+    if (trie->count == 0 && trie_node(trie, 0) == NO_PATTERN) {
+        return ERROR_FILE_READ;
+    }
+
+    node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)key[reversed ? len - 1 - i : i];
+        int32_t child = trie_child(trie, node, c);
+        if (child == NO_PATTERN) {
+            child = trie_node(trie, c);
+            if (child == NO_PATTERN) {
+                return ERROR_FILE_READ;
+            }
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    set_best(&trie->nodes[node].best, id, dir_only);
+    return SUCCESS;
+}
+
+// Best pattern along the path name spells through the trie
+static void trie_match(const Trie *trie, const char *name, size_t len, int reversed,
+                       int is_dir, int32_t *best) {
+    int32_t node = 0;
+
+    if (trie->count == 0) {
+        return;
+    }
+    consider(best, &trie->nodes[0].best, is_dir);
+    for (size_t i = 0; i < len; i++) {
+        node = trie_child(trie, node, (unsigned char)name[reversed ? len - 1 - i : i]);
+        if (node == NO_PATTERN) {
+            return;
+        }
+        consider(best, &trie->nodes[node].best, is_dir);
+    }
+}
+
+static int has_glob(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Split an anchored pattern into segments
+static int path_add(PatternSet *set, const char *pattern, int32_t id) {
+    PathPattern path;
+
+    if (reserve((void **)&set->paths, &set->path_capacity, set->path_count,
+                sizeof(PathPattern)) != SUCCESS) {
+        return ERROR_FILE_READ;
+    }
+
+    path.buffer = strdup(pattern);
+    path.segments = calloc(strlen(pattern) / 2 + 1, sizeof(char *));
+    path.count = 0;
+    path.id = id;
+    if (path.buffer == NULL || path.segments == NULL) {
+        free(path.buffer);
+        free(path.segments);
+        return ERROR_FILE_READ;
+    }
+
+    // Empty segments ("a//b") are dropped like the kernel drops them
+    for (char *save, *seg = strtok_r(path.buffer, "/", &save); seg != NULL;
+         seg = strtok_r(NULL, "/", &save)) {
+        path.segments[path.count++] = seg;
+    }
+
+    set->paths[set->path_count++] = path;
+    return SUCCESS;
+}
+
+static int set_add(PatternSet *set, const char *pattern, uint8_t flags) {
+    int dir_only = (flags & PATTERN_DIR_ONLY) != 0;
+    int32_t id;
+    int result;
+
+    // "**/name" matches at any depth, which is what a bare name does
+    while (strncmp(pattern, "**/", 3) == 0) {
+        pattern += 3;
+    }
+    size_t len = strlen(pattern);
+    if (len == 0) {
+        return SUCCESS;
+    }
+    if (set->count >= INT32_MAX ||
+        reserve((void **)&set->flags, &set->capacity, set->count, sizeof(uint8_t)) != SUCCESS) {
+        return ERROR_FILE_READ;
+    }
+    id = (int32_t)set->count;
+
+    if (strchr(pattern, '/') != NULL) {
+        // Any other slash anchors the pattern at the copy root
+        result = path_add(set, pattern[0] == '/' ? pattern + 1 : pattern, id);
+    } else if (!has_glob(pattern, len)) {
+        result = literal_add(set, pattern, id, dir_only);
+    } else if (pattern[0] == '*' && !has_glob(pattern + 1, len - 1)) {
+        result = trie_add(&set->suffixes, pattern + 1, len - 1, 1, id, dir_only);
+    } else if (pattern[len - 1] == '*' && !has_glob(pattern, len - 1)) {
+        result = trie_add(&set->prefixes, pattern, len - 1, 0, id, dir_only);
+    } else {
+        result = reserve((void **)&set->globs, &set->glob_capacity, set->glob_count,
+                         sizeof(GlobPattern));
+        if (result == SUCCESS) {
+            set->globs[set->glob_count].glob = strdup(pattern);
+            set->globs[set->glob_count].id = id;
+            result = set->globs[set->glob_count].glob != NULL ? SUCCESS : ERROR_FILE_READ;
+        }
+        if (result == SUCCESS) {
+            set->glob_count++;
+        }
+    }
+
+    if (result == SUCCESS) {
+        set->flags[set->count++] = flags;
+    }
+    return result;
+}
+
+// Match path segments against pattern segments
+static int match_segments(char *const *pattern, size_t np, char *const *path, size_t ns) {
+    while (np > 0) {
+        if (strcmp(pattern[0], "**") == 0) {
+            // A trailing "**" matches everything inside, not the directory itself
+            if (np == 1) {
+                return ns > 0;
+            }
+            for (size_t skip = 0; skip <= ns; skip++) {
+                if (match_segments(pattern + 1, np - 1, path + skip, ns - skip)) {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+        if (ns == 0 || fnmatch(pattern[0], path[0], 0) != 0) {
+            return 0;
+        }
+        pattern++;
+        path++;
+        np--;
+        ns--;
+    }
+    return ns == 0;
+}
+
+// Check whether anything below the directory path could still match
+static int match_below(char *const *pattern, size_t np, char *const *path, size_t ns) {
+    while (ns > 0) {
+        if (np == 0 || strcmp(pattern[0], "**") == 0) {
+            return np > 0;
+        }
+        if (fnmatch(pattern[0], path[0], 0) != 0) {
+            return 0;
+        }
+        pattern++;
+        path++;
+        np--;
+        ns--;
+    }
+    return np > 0;
+}
+
+// Relative path split into NUL-terminated segments
+typedef struct {
+    char buffer[MAX_PATH];
+    char *segments[MAX_PATH / 2];
+    size_t count;
+} SplitPath;
+
+static void split_path(SplitPath *split, const char *path) {
+    snprintf(split->buffer, sizeof(split->buffer), "%s", path);
+    split->count = 0;
+    for (char *save, *seg = strtok_r(split->buffer, "/", &save); seg != NULL;
+         seg = strtok_r(NULL, "/", &save)) {
+        split->segments[split->count++] = seg;
+    }
+}
+
+// Id of the last pattern matching path, or NO_PATTERN
+static int32_t set_match(const PatternSet *set, const char *path, int is_dir) {
+    int32_t best = NO_PATTERN;
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    size_t len = strlen(name);
+
+    if (set->count == 0) {
+        return NO_PATTERN;
+    }
+
+    if (set->literal_count > 0) {
+        const LiteralSlot *slot = literal_slot(set->literals, set->literal_capacity, name);
+        if (slot->key != NULL) {
+            consider(&best, &slot->best, is_dir);
+        }
+    }
+    trie_match(&set->suffixes, name, len, 1, is_dir, &best);
+    trie_match(&set->prefixes, name, len, 0, is_dir, &best);
+
+    // Newest first; older globs cannot beat what already matched
+    for (size_t i = set->glob_count; i-- > 0;) {
+        const GlobPattern *glob = &set->globs[i];
+        if (glob->id <= best) {
+            break;
+        }
+        if (!is_dir && (set->flags[glob->id] & PATTERN_DIR_ONLY)) {
+            continue;
+        }
+        if (fnmatch(glob->glob, name, 0) == 0) {
+            best = glob->id;
+            break;
+        }
+    }
+
+    if (set->path_count > 0 && set->paths[set->path_count - 1].id > best) {
+        SplitPath *split = malloc(sizeof(SplitPath));
+        if (split == NULL) {
+            return best;
+        }
+        split_path(split, path);
+        for (size_t i = set->path_count; i-- > 0;) {
+            const PathPattern *p = &set->paths[i];
+            if (p->id <= best) {
+                break;
+            }
+            if (!is_dir && (set->flags[p->id] & PATTERN_DIR_ONLY)) {
+                continue;
+            }
+            if (match_segments(p->segments, p->count, split->segments, split->count)) {
+                best = p->id;
+                break;
+            }
+        }
+        free(split);
+    }
+
+    return best;
+}
+
+// Could a file below directory path match one of the patterns?
+static int set_may_match_below(const PatternSet *set, const char *path) {
+    SplitPath *split;
+    int possible = 0;
+
+    // Name patterns can match at any depth
+    if (set->path_count < set->count) {
+        return 1;
+    }
+
+    split = malloc(sizeof(SplitPath));
+    if (split == NULL) {
+        return 1;
+    }
+    split_path(split, path);
+    for (size_t i = 0; i < set->path_count && !possible; i++) {
+        const PathPattern *p = &set->paths[i];
+        possible = match_below(p->segments, p->count, split->segments, split->count);
+    }
+    free(split);
+    return possible;
+}
+
+static void set_free(PatternSet *set) {
+    for (size_t i = 0; i < set->literal_capacity; i++) {
+        free(set->literals[i].key);
+    }
+    for (size_t i = 0; i < set->glob_count; i++) {
+        free(set->globs[i].glob);
+    }
+    for (size_t i = 0; i < set->path_count; i++) {
+        free(set->paths[i].buffer);
+        free(set->paths[i].segments);
+    }
+    free(set->literals);
+    free(set->globs);
+    free(set->paths);
+    free(set->suffixes.nodes);
+    free(set->prefixes.nodes);
+    free(set->flags);
+}
+
+CopyFilter *filter_create(void) {
+    return calloc(1, sizeof(CopyFilter));
+}
+
+CopyFilter *filter_from_patterns(const char **include_patterns, const char **exclude_patterns) {
+    CopyFilter *filter = filter_create();
+    int result = filter != NULL ? SUCCESS : ERROR_FILE_READ;
+
+    for (size_t i = 0; result == SUCCESS && include_patterns && include_patterns[i]; i++) {
+        result = filter_add_include(filter, include_patterns[i]);
+    }
+    for (size_t i = 0; result == SUCCESS && exclude_patterns && exclude_patterns[i]; i++) {
+        result = filter_add_exclude(filter, exclude_patterns[i]);
+    }
+
+    if (result != SUCCESS) {
+        filter_free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+int filter_add_include(CopyFilter *filter, const char *pattern) {
+    return set_add(&filter->include, pattern, 0);
+}
+
+int filter_add_exclude(CopyFilter *filter, const char *pattern) {
+    uint8_t flags = 0;
+    char *copy;
+    size_t len;
+    int result;
+
+    if (pattern[0] == '!') {
+        flags |= PATTERN_NEGATED;
+        pattern++;
+    }
+
+    copy = strdup(pattern);
+    if (copy == NULL) {
+        return ERROR_FILE_READ;
+    }
+    len = strlen(copy);
+    if (len > 1 && copy[len - 1] == '/') {
+        flags |= PATTERN_DIR_ONLY;
+        while (len > 1 && copy[len - 1] == '/') {
+            copy[--len] = '\0';
+        }
+    }
+
+    result = set_add(&filter->exclude, copy, flags);
+    free(copy);
+    return result;
+}
+
+int filter_load_excludes(CopyFilter *filter, const char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int result = SUCCESS;
+
+    if (file == NULL) {
+        return ERROR_FILE_OPEN;
+    }
+
+    while (result == SUCCESS && (len = getline(&line, &capacity, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (line[0] == '#') {
+            continue;
+        }
+        // Trailing spaces are ignored unless escaped with a backslash
+        while (len > 0 && line[len - 1] == ' ' && !(len > 1 && line[len - 2] == '\\')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            result = filter_add_exclude(filter, line);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return result;
+}
+
+int filter_active(const CopyFilter *filter) {
+    return filter != NULL && (filter->include.count > 0 || filter->exclude.count > 0);
+}
+
+const char *filter_relative_path(const char *path, size_t root_len) {
+    path += root_len;
+    while (*path == '/') {
+        path++;
+    }
+    return path;
+}
+
+int filter_selects_files(const CopyFilter *filter) {
+    return filter != NULL && filter->include.count > 0;
+}
+
+static int excluded(const CopyFilter *filter, const char *path, int is_dir) {
+    int32_t id = set_match(&filter->exclude, path, is_dir);
+    return id != NO_PATTERN && !(filter->exclude.flags[id] & PATTERN_NEGATED);
+}
+
+int filter_wants_file(const CopyFilter *filter, const char *path) {
+    if (filter == NULL) {
+        return 1;
+    }
+    if (excluded(filter, path, 0)) {
+        return 0;
+    }
+    return filter->include.count == 0 || set_match(&filter->include, path, 0) != NO_PATTERN;
+}
+
+int filter_wants_dir(const CopyFilter *filter, const char *path) {
+    if (filter == NULL) {
+        return 1;
+    }
+    if (excluded(filter, path, 1)) {
+        return 0;
+    }
+    // Anchored include patterns rule out subtrees they cannot reach
+    return filter->include.count == 0 || set_may_match_below(&filter->include, path);
+}
+
+void filter_free(CopyFilter *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    set_free(&filter->include);
+    set_free(&filter->exclude);
+    free(filter);
+}
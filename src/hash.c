@@ -0,0 +1,671 @@
+#include "hash.h"
+#include "stats.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HAVE_SHA_NI_CODE 1
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_ARM_SHA2_CODE 1
+#endif
+
+static const char *hash_names[HASH_COUNT] = {
+    "md5",
+    "sha256",
+    "xxh64"
+};
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline uint64_t rotl64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    return (uint64_t)load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+
+static inline uint32_t load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// ============================================================================
+// MD5 (RFC 1321)
+// ============================================================================
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_shift[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint32_t state[4], const unsigned char *block) {
+    uint32_t w[16];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = load_le32(block + i * 4);
+    }
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + rotl32(a + f + md5_k[i] + w[g], md5_shift[i]);
+        a = tmp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5_init(Md5Context *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void md5_update(Md5Context *ctx, const unsigned char *data, size_t len) {
+    ctx->length += len;
+
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        len -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        md5_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+
+    while (len >= 64) {
+        md5_block(ctx->state, data);
+        data += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->used = len;
+}
+
+static void md5_final(Md5Context *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (ctx->used < 56) ? 56 - ctx->used : 120 - ctx->used;
+
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (unsigned char)(bits >> (8 * i));
+    }
+    md5_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[i * 4 + j] = (unsigned char)(ctx->state[i] >> (8 * j));
+        }
+    }
+}
+
+// ============================================================================
+// SHA-256 (FIPS 180-4) with SHA-NI / ARMv8 crypto extensions when available
+// ============================================================================
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+typedef void (*Sha256BlocksFunc)(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+static void sha256_blocks_generic(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32_t w[64];
+
+    while (blocks-- > 0) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t S1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + S1 + ch + sha256_k[i] + w[i];
+            uint32_t S0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = S0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += 64;
+    }
+}
+
+#ifdef HAVE_SHA_NI_CODE
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, msg;
+    __m128i w[4];
+
+    // Reorder ABCD/EFGH into the ABEF/CDGH layout the instructions use
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks-- > 0) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), mask);
+        }
+
+        // 16 groups of four rounds; w[] holds the last 16 schedule words
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                __m128i t = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+            }
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static int cpu_has_sha_ni(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return 0;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return 0;
+    return (ebx & bit_SHA) != 0;
+}
+#endif
+
+#ifdef HAVE_ARM_SHA2_CODE
+static void sha256_blocks_arm(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+    uint32x4_t w[4];
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+
+        for (int i = 0; i < 4; i++) {
+            w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+        }
+
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                w[i & 3] = vsha256su1q_u32(vsha256su0q_u32(w[i & 3], w[(i + 1) & 3]),
+                                           w[(i + 2) & 3], w[(i + 3) & 3]);
+            }
+            uint32x4_t msg = vaddq_u32(w[i & 3], vld1q_u32(&sha256_k[i * 4]));
+            uint32x4_t prev = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, prev, msg);
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+static Sha256BlocksFunc sha256_blocks = sha256_blocks_generic;
+static const char *sha256_impl_name = "generic";
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+// Pick the fastest SHA-256 block function this CPU supports
+static void sha256_select(void) {
+#ifdef HAVE_SHA_NI_CODE
+    if (cpu_has_sha_ni()) {
+        sha256_blocks = sha256_blocks_shani;
+        sha256_impl_name = "sha-ni";
+    }
+#endif
+#ifdef HAVE_ARM_SHA2_CODE
+    if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+        sha256_blocks = sha256_blocks_arm;
+        sha256_impl_name = "armv8-sha2";
+    }
+#endif
+}
+
+static void sha256_init(Sha256Context *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&sha256_once, sha256_select);
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(Sha256Context *ctx, const unsigned char *data, size_t len) {
+    ctx->length += len;
+
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        len -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    if (len >= 64) {
+        sha256_blocks(ctx->state, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->used = len;
+}
+
+static void sha256_final(Sha256Context *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (ctx->used < 56) ? 56 - ctx->used : 120 - ctx->used;
+
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// ============================================================================
+// XXH64 (fast non-cryptographic hash, seed 0)
+// ============================================================================
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(Xxh64Context *ctx) {
+    ctx->acc[0] = XXH_P1 + XXH_P2;
+    ctx->acc[1] = XXH_P2;
+    ctx->acc[2] = 0;
+    ctx->acc[3] = (uint64_t)0 - XXH_P1;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void xxh64_stripes(uint64_t acc[4], const unsigned char *data, size_t stripes) {
+    uint64_t v1 = acc[0], v2 = acc[1], v3 = acc[2], v4 = acc[3];
+
+    // Four independent lanes keep the multiplier pipelines busy
+    while (stripes-- > 0) {
+        v1 = xxh64_round(v1, load_le64(data));
+        v2 = xxh64_round(v2, load_le64(data + 8));
+        v3 = xxh64_round(v3, load_le64(data + 16));
+        v4 = xxh64_round(v4, load_le64(data + 24));
+        data += 32;
+    }
+
+    acc[0] = v1;
+    acc[1] = v2;
+    acc[2] = v3;
+    acc[3] = v4;
+}
+
+static void xxh64_update(Xxh64Context *ctx, const unsigned char *data, size_t len) {
+    ctx->length += len;
+
+    if (ctx->used > 0) {
+        size_t take = 32 - ctx->used < len ? 32 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        len -= take;
+        if (ctx->used < 32) {
+            return;
+        }
+        xxh64_stripes(ctx->acc, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    if (len >= 32) {
+        xxh64_stripes(ctx->acc, data, len / 32);
+        data += len & ~(size_t)31;
+        len &= 31;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->used = len;
+}
+
+static void xxh64_final(Xxh64Context *ctx, unsigned char *digest) {
+    const unsigned char *p = ctx->block;
+    size_t left = ctx->used;
+    uint64_t h;
+
+    if (ctx->length >= 32) {
+        h = rotl64(ctx->acc[0], 1) + rotl64(ctx->acc[1], 7) +
+            rotl64(ctx->acc[2], 12) + rotl64(ctx->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh64_merge(h, ctx->acc[i]);
+        }
+    } else {
+        h = XXH_P5;
+    }
+
+    h += ctx->length;
+
+    while (left >= 8) {
+        h ^= xxh64_round(0, load_le64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        left -= 8;
+    }
+    if (left >= 4) {
+        h ^= (uint64_t)load_le32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    while (left > 0) {
+        h ^= (uint64_t)*p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+        p++;
+        left--;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    // Canonical (big-endian) form, as printed by xxhsum
+    for (int i = 0; i < 8; i++) {
+        digest[i] = (unsigned char)(h >> (56 - 8 * i));
+    }
+}
+
+// ============================================================================
+// STREAMING HASH INTERFACE
+// ============================================================================
+
+void hash_init(HashContext *ctx, HashAlgorithm algorithm) {
+    ctx->algorithm = algorithm;
+    switch (algorithm) {
+        case HASH_SHA256:
+            sha256_init(&ctx->u.sha256);
+            break;
+        case HASH_XXH64:
+            xxh64_init(&ctx->u.xxh64);
+            break;
+        default:
+            ctx->algorithm = HASH_MD5;
+            md5_init(&ctx->u.md5);
+            break;
+    }
+}
+
+void hash_update(HashContext *ctx, const void *data, size_t len) {
+    switch (ctx->algorithm) {
+        case HASH_SHA256:
+            sha256_update(&ctx->u.sha256, data, len);
+            break;
+        case HASH_XXH64:
+            xxh64_update(&ctx->u.xxh64, data, len);
+            break;
+        default:
+            md5_update(&ctx->u.md5, data, len);
+            break;
+    }
+}
+
+size_t hash_final(HashContext *ctx, unsigned char *digest) {
+    switch (ctx->algorithm) {
+        case HASH_SHA256:
+            sha256_final(&ctx->u.sha256, digest);
+            break;
+        case HASH_XXH64:
+            xxh64_final(&ctx->u.xxh64, digest);
+            break;
+        default:
+            md5_final(&ctx->u.md5, digest);
+            break;
+    }
+    return hash_digest_size(ctx->algorithm);
+}
+
+void hash_to_hex(const unsigned char *digest, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[len * 2] = '\0';
+}
+
+void hash_final_hex(HashContext *ctx, char *hex) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    size_t len = hash_final(ctx, digest);
+
+    hash_to_hex(digest, len, hex);
+}
+
+size_t hash_digest_size(HashAlgorithm algorithm) {
+    switch (algorithm) {
+        case HASH_SHA256: return 32;
+        case HASH_XXH64:  return 8;
+        default:          return 16;
+    }
+}
+
+const char *hash_name(HashAlgorithm algorithm) {
+    if ((int)algorithm < 0 || algorithm >= HASH_COUNT) {
+        return "unknown";
+    }
+    return hash_names[algorithm];
+}
+
+int parse_hash_algorithm(const char *name, HashAlgorithm *algorithm) {
+    for (int i = 0; i < HASH_COUNT; i++) {
+        if (strcasecmp(name, hash_names[i]) == 0) {
+            *algorithm = (HashAlgorithm)i;
+            return SUCCESS;
+        }
+    }
+    if (strcasecmp(name, "sha-256") == 0) {
+        *algorithm = HASH_SHA256;
+        return SUCCESS;
+    }
+    return ERROR_INVALID_PATH;
+}
+
+const char *hash_implementation(HashAlgorithm algorithm) {
+    if (algorithm == HASH_SHA256) {
+        pthread_once(&sha256_once, sha256_select);
+        return sha256_impl_name;
+    }
+    return "generic";
+}
+
+int hash_fd(int fd, HashContext *ctx) {
+    struct stat st;
+    ssize_t bytes_read;
+    size_t buffer_size;
+    char *buffer;
+
+    buffer_size = io_buffer_size(fstat(fd, &st) == 0 ? &st : NULL);
+    buffer = io_buffer_alloc(buffer_size);
+    if (buffer == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    while (1) {
+        STATS_TIMED(STATS_READ, bytes_read = read(fd, buffer, buffer_size));
+        if (bytes_read < 0 && errno == EINVAL) {
+            // O_DIRECT refused this request (unaligned tail); finish buffered
+            int fl = fcntl(fd, F_GETFL);
+            if (fl < 0 || !(fl & O_DIRECT) || fcntl(fd, F_SETFL, fl & ~O_DIRECT) != 0) {
+                break;
+            }
+            continue;
+        }
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        STATS_TIMED(STATS_HASH, hash_update(ctx, buffer, (size_t)bytes_read));
+    }
+
+    free(buffer);
+    return bytes_read < 0 ? ERROR_FILE_READ : SUCCESS;
+}
+
+int hash_file(const char *filepath, HashAlgorithm algorithm, char *hex) {
+    HashContext ctx;
+    int fd, result;
+
+    fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    hash_init(&ctx, algorithm);
+    result = hash_fd(fd, &ctx);
+    close(fd);
+
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    hash_final_hex(&ctx, hex);
+    return SUCCESS;
+}
@@ -0,0 +1,637 @@
+#include "index.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+/**
+ * File layout: header, count entries sorted by (parent, name), then the
+ * string table (both roots first, then every entry's path, NUL-terminated)
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    uint64_t strings_size;
+    uint32_t src_root;          // Offsets in the string table
+    uint32_t dest_root;
+} IndexHeader;
+
+// A sorted entry array and the strings its paths point into
+typedef struct {
+    const IndexEntry *entries;
+    size_t count;
+    const char *strings;
+} IndexView;
+
+static struct {
+    int active;
+    int merge;
+    char *file;
+    char *src_root;             // Prefix of the paths callers pass in
+    size_t src_root_len;
+    char *dest_root;
+
+    // Index from the previous run (mapped read-only, may be empty)
+    void *map;
+    size_t map_size;
+    IndexView old;
+
+    // Entries for the index being written
+    pthread_mutex_t lock;
+    IndexEntry *entries;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    uint32_t src_id;            // Offset of the resolved source root in strings
+} idx = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Absolute form of a root, so the same tree matches from any directory
+static char *resolve_root(const char *path) {
+    char *resolved;
+
+    if (path == NULL) {
+        return strdup("");
+    }
+    resolved = realpath(path, NULL);
+    return resolved != NULL ? resolved : strdup(path);
+}
+
+// Append a NUL-terminated string to the new string table (lock held)
+static int add_string(const char *s, size_t len, uint32_t *offset) {
+    if (idx.strings_size + len + 1 > idx.strings_capacity) {
+        size_t capacity = idx.strings_capacity ? idx.strings_capacity * 2 : 64 * 1024;
+        while (capacity < idx.strings_size + len + 1) {
+            capacity *= 2;
+        }
+        char *grown = realloc(idx.strings, capacity);
+        if (grown == NULL) {
+            return ERROR_FILE_WRITE;
+        }
+        idx.strings = grown;
+        idx.strings_capacity = capacity;
+    }
+    if (idx.strings_size + len + 1 > UINT32_MAX) {
+        return ERROR_FILE_WRITE;
+    }
+    memcpy(idx.strings + idx.strings_size, s, len);
+    idx.strings[idx.strings_size + len] = '\0';
+    *offset = (uint32_t)idx.strings_size;
+    idx.strings_size += len + 1;
+    return SUCCESS;
+}
+
+// Append an entry whose path is key (lock held)
+static void add_entry(const IndexEntry *entry, const char *key, size_t key_len) {
+    IndexEntry copy = *entry;
+
+    if (idx.count == idx.capacity) {
+        size_t capacity = idx.capacity ? idx.capacity * 2 : 1024;
+        IndexEntry *grown = realloc(idx.entries, capacity * sizeof(IndexEntry));
+        if (grown == NULL) {
+            return;
+        }
+        idx.entries = grown;
+        idx.capacity = capacity;
+    }
+    if (add_string(key, key_len, &copy.path) != SUCCESS) {
+        return;
+    }
+    idx.entries[idx.count++] = copy;
+}
+
+// Path relative to the source root, or NULL if path is outside it
+static const char *index_key(const char *path, size_t *len) {
+    if (strncmp(path, idx.src_root, idx.src_root_len) != 0) {
+        return NULL;
+    }
+    path += idx.src_root_len;
+    if (*path != '/' && *path != '\0') {
+        return NULL;
+    }
+    while (*path == '/') {
+        path++;
+    }
+    *len = strlen(path);
+    return *len <= UINT16_MAX ? path : NULL;
+}
+
+// Offset of the last component of key
+static uint16_t key_name(const char *key, size_t len) {
+    const char *slash = memrchr(key, '/', len);
+    return slash != NULL ? (uint16_t)(slash - key + 1) : 0;
+}
+
+static int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) {
+        return c;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+// Order by parent directory first so siblings end up next to each other
+static int compare_key(const char *a, size_t a_len, uint16_t a_name,
+                       const char *b, size_t b_len, uint16_t b_name) {
+    size_t a_dir = a_name ? a_name - 1u : 0;
+    size_t b_dir = b_name ? b_name - 1u : 0;
+    int c = compare_bytes(a, a_dir, b, b_dir);
+    if (c != 0) {
+        return c;
+    }
+    return compare_bytes(a + a_name, a_len - a_name, b + b_name, b_len - b_name);
+}
+
+static const IndexEntry *view_find(const IndexView *view, const char *key, size_t len) {
+    uint16_t name = key_name(key, len);
+    size_t lo = 0, hi = view->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const IndexEntry *e = &view->entries[mid];
+        int c = compare_key(view->strings + e->path, e->path_len, e->name, key, len, name);
+        if (c == 0) {
+            return e;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Children of dir: the run of entries whose parent is dir's path
+static size_t view_children(const IndexView *view, const char *dir, size_t dir_len,
+                            size_t *first) {
+    size_t lo = 0, hi = view->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const IndexEntry *e = &view->entries[mid];
+        size_t parent = e->name ? e->name - 1u : 0;
+        if (compare_bytes(view->strings + e->path, parent, dir, dir_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t end = lo;
+    while (end < view->count) {
+        const IndexEntry *e = &view->entries[end];
+        size_t parent = e->name ? e->name - 1u : 0;
+        if (compare_bytes(view->strings + e->path, parent, dir, dir_len) != 0) {
+            break;
+        }
+        end++;
+    }
+
+    // The root has an empty name and parent; it is not its own child
+    if (lo < end && view->entries[lo].path_len == 0) {
+        lo++;
+    }
+    *first = lo;
+    return end - lo;
+}
+
+// Map the previous index if it was written for the same roots
+static void load_index(const char *src_id, const char *dest_id) {
+    int fd = open(idx.file, O_RDONLY);
+    struct stat st;
+    const IndexHeader *header;
+
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    header = map;
+    size_t size = st.st_size;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION || header->entry_size != sizeof(IndexEntry) ||
+        header->count > size / sizeof(IndexEntry)) {
+        munmap(map, size);
+        return;
+    }
+
+    size_t entries_end = sizeof(IndexHeader) + header->count * sizeof(IndexEntry);
+    const char *strings = (const char *)map + entries_end;
+
+    if (entries_end + header->strings_size != size ||
+        header->strings_size == 0 || strings[header->strings_size - 1] != '\0' ||
+        header->src_root >= header->strings_size || header->dest_root >= header->strings_size ||
+        strcmp(strings + header->src_root, src_id) != 0 ||
+        strcmp(strings + header->dest_root, dest_id) != 0) {
+        munmap(map, size);
+        return;
+    }
+
+    // Paths must stay inside the string table
+    const IndexEntry *entries = (const IndexEntry *)(header + 1);
+    for (size_t i = 0; i < header->count; i++) {
+        if ((uint64_t)entries[i].path + entries[i].path_len >= header->strings_size ||
+            entries[i].name > entries[i].path_len) {
+            munmap(map, size);
+            return;
+        }
+    }
+
+    idx.map = map;
+    idx.map_size = size;
+    idx.old.entries = entries;
+    idx.old.count = header->count;
+    idx.old.strings = strings;
+}
+
+int index_open(const char *index_path, const char *src_root, const char *dest_root, int merge) {
+    char *src_id, *dest_id;
+    int result;
+
+    if (idx.active) {
+        return ERROR_INVALID_PATH;
+    }
+
+    idx.file = strdup(index_path);
+    idx.src_root = strdup(src_root);
+    idx.dest_root = dest_root != NULL ? strdup(dest_root) : NULL;
+    src_id = src_root[0] != '\0' ? resolve_root(src_root) : strdup("");
+    dest_id = resolve_root(dest_root);
+    if (idx.file == NULL || idx.src_root == NULL || (dest_root != NULL && idx.dest_root == NULL) ||
+        src_id == NULL || dest_id == NULL) {
+        result = ERROR_FILE_OPEN;
+        goto out;
+    }
+
+    // "dir/" and "dir" name the same root
+    idx.src_root_len = strlen(idx.src_root);
+    while (idx.src_root_len > 1 && idx.src_root[idx.src_root_len - 1] == '/') {
+        idx.src_root[--idx.src_root_len] = '\0';
+    }
+
+    idx.merge = merge;
+    load_index(src_id, dest_id);
+
+    result = add_string(src_id, strlen(src_id), &idx.src_id);
+    if (result != SUCCESS) {
+        goto out;
+    }
+
+    // The checksum cache keeps what it does not see this time
+    if (merge) {
+        for (size_t i = 0; i < idx.old.count; i++) {
+            const IndexEntry *e = &idx.old.entries[i];
+            add_entry(e, idx.old.strings + e->path, e->path_len);
+        }
+    }
+
+    idx.active = 1;
+
+out:
+    free(src_id);
+    free(dest_id);
+    if (result != SUCCESS) {
+        index_close();
+    }
+    return result;
+}
+
+int index_active(void) {
+    return idx.active;
+}
+
+static void set_source(IndexEntry *entry, const struct stat *st) {
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->ctime_sec = st->st_ctim.tv_sec;
+    entry->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static void set_dest(IndexEntry *entry, const struct stat *st) {
+    entry->dest_ino = st->st_ino;
+    entry->dest_ctime_sec = st->st_ctim.tv_sec;
+    entry->dest_ctime_nsec = st->st_ctim.tv_nsec;
+    entry->flags |= INDEX_HAS_DEST;
+}
+
+static int source_unchanged(const IndexEntry *entry, const struct stat *st) {
+    return entry->size == (uint64_t)st->st_size && entry->ino == st->st_ino &&
+           entry->mtime_sec == st->st_mtim.tv_sec && entry->mtime_nsec == st->st_mtim.tv_nsec &&
+           entry->ctime_sec == st->st_ctim.tv_sec && entry->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+static int dest_unchanged(const IndexEntry *entry, const struct stat *st) {
+    return (entry->flags & INDEX_HAS_DEST) && entry->dest_ino == st->st_ino &&
+           entry->dest_ctime_sec == st->st_ctim.tv_sec &&
+           entry->dest_ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+// Entry of the previous run for path, if any
+static const IndexEntry *find_old(const char *path, int type) {
+    size_t len;
+    const char *key;
+
+    if (!idx.active || idx.old.count == 0) {
+        return NULL;
+    }
+    key = index_key(path, &len);
+    if (key == NULL) {
+        return NULL;
+    }
+    const IndexEntry *entry = view_find(&idx.old, key, len);
+    return entry != NULL && entry->type == type ? entry : NULL;
+}
+
+void index_keep(const IndexEntry *entry) {
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.merge) {
+        add_entry(entry, idx.old.strings + entry->path, entry->path_len);
+    }
+    pthread_mutex_unlock(&idx.lock);
+}
+
+int index_skip_file(const char *path, const struct stat *src_stat,
+                    int dest_dirfd, const char *dest_name) {
+    struct stat dest_stat;
+
+    if (get_copy_options()->sync == SYNC_OFF) {
+        return 0;
+    }
+    const IndexEntry *entry = find_old(path, INDEX_TYPE_FILE);
+    if (entry == NULL || !source_unchanged(entry, src_stat)) {
+        return 0;
+    }
+    if (fstatat(dest_dirfd, dest_name, &dest_stat, 0) != 0 ||
+        dest_stat.st_size != src_stat->st_size || !dest_unchanged(entry, &dest_stat)) {
+        return 0;
+    }
+
+    index_keep(entry);
+    return 1;
+}
+
+void index_record_file(const char *path, const struct stat *src_stat,
+                       int dest_dirfd, const char *dest_name,
+                       HashAlgorithm algorithm, const unsigned char *digest, size_t digest_len) {
+    IndexEntry entry;
+    struct stat dest_stat;
+    size_t len;
+    const char *key;
+
+    if (!idx.active || (key = index_key(path, &len)) == NULL) {
+        return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.type = INDEX_TYPE_FILE;
+    entry.path_len = (uint16_t)len;
+    entry.name = key_name(key, len);
+    set_source(&entry, src_stat);
+
+    if (dest_name != NULL && fstatat(dest_dirfd, dest_name, &dest_stat, 0) == 0) {
+        set_dest(&entry, &dest_stat);
+    }
+    if (digest != NULL && digest_len <= HASH_MAX_DIGEST) {
+        entry.flags |= INDEX_HAS_DIGEST;
+        entry.algorithm = (uint8_t)algorithm;
+        entry.digest_len = (uint8_t)digest_len;
+        memcpy(entry.digest, digest, digest_len);
+    }
+
+    pthread_mutex_lock(&idx.lock);
+    add_entry(&entry, key, len);
+    pthread_mutex_unlock(&idx.lock);
+}
+
+void index_record_dir(const char *path, const struct stat *src_stat, size_t children) {
+    IndexEntry entry;
+    size_t len;
+    const char *key;
+
+    if (!idx.active || (key = index_key(path, &len)) == NULL) {
+        return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.type = INDEX_TYPE_DIR;
+    entry.path_len = (uint16_t)len;
+    entry.name = key_name(key, len);
+    entry.children = children > UINT32_MAX ? UINT32_MAX : (uint32_t)children;
+    set_source(&entry, src_stat);
+
+    pthread_mutex_lock(&idx.lock);
+    add_entry(&entry, key, len);
+    pthread_mutex_unlock(&idx.lock);
+}
+
+const IndexEntry *index_trusted_dir(const char *path, const struct stat *src_stat,
+                                    const struct stat *dest_stat) {
+    const CopyOptions *opts = get_copy_options();
+
+    if (!opts->index_trust_dirs || opts->sync == SYNC_OFF) {
+        return NULL;
+    }
+    const IndexEntry *entry = find_old(path, INDEX_TYPE_DIR);
+    if (entry == NULL || !(entry->flags & INDEX_COMPLETE) ||
+        !source_unchanged(entry, src_stat) || !dest_unchanged(entry, dest_stat)) {
+        return NULL;
+    }
+    return entry;
+}
+
+size_t index_children(const IndexEntry *dir, const IndexEntry **first) {
+    size_t start;
+    size_t count = view_children(&idx.old, idx.old.strings + dir->path, dir->path_len, &start);
+
+    *first = idx.old.entries + start;
+    return count;
+}
+
+const char *index_entry_name(const IndexEntry *entry) {
+    return idx.old.strings + entry->path + entry->name;
+}
+
+size_t index_cached_digest(const char *path, const struct stat *st,
+                           HashAlgorithm algorithm, unsigned char *digest) {
+    const IndexEntry *entry = find_old(path, INDEX_TYPE_FILE);
+
+    if (entry == NULL || !(entry->flags & INDEX_HAS_DIGEST) ||
+        entry->algorithm != (uint8_t)algorithm || !source_unchanged(entry, st)) {
+        return 0;
+    }
+    memcpy(digest, entry->digest, entry->digest_len);
+    index_keep(entry);
+    return entry->digest_len;
+}
+
+// Sort by key; for duplicates the entry recorded last comes first
+static int compare_order(const void *a, const void *b, void *arg) {
+    const IndexEntry *entries = arg;
+    uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+    const IndexEntry *x = &entries[i], *y = &entries[j];
+    int c = compare_key(idx.strings + x->path, x->path_len, x->name,
+                        idx.strings + y->path, y->path_len, y->name);
+    if (c != 0) {
+        return c;
+    }
+    return i < j ? 1 : -1;
+}
+
+// Finish directory entries: destination state and completeness
+static void finish_dirs(IndexEntry *entries, size_t count) {
+    IndexView view = { entries, count, idx.strings };
+    char dest[MAX_PATH];
+    struct stat st;
+
+    for (size_t i = 0; i < count; i++) {
+        IndexEntry *e = &entries[i];
+        size_t first;
+
+        if (e->type != INDEX_TYPE_DIR) {
+            continue;
+        }
+        if (view_children(&view, idx.strings + e->path, e->path_len, &first) == e->children) {
+            e->flags |= INDEX_COMPLETE;
+        }
+        if (idx.dest_root == NULL) {
+            continue;
+        }
+        if (e->path_len == 0) {
+            snprintf(dest, sizeof(dest), "%s", idx.dest_root);
+        } else {
+            snprintf(dest, sizeof(dest), "%s/%s", idx.dest_root, idx.strings + e->path);
+        }
+        if (stat(dest, &st) == 0 && S_ISDIR(st.st_mode)) {
+            set_dest(e, &st);
+        }
+    }
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return ERROR_FILE_WRITE;
+        }
+        p += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+// Sort, drop superseded duplicates and replace the index file
+static int save_index(void) {
+    uint32_t *order = malloc((idx.count ? idx.count : 1) * sizeof(uint32_t));
+    IndexEntry *out = malloc((idx.count ? idx.count : 1) * sizeof(IndexEntry));
+    IndexHeader header;
+    char tmp[MAX_PATH];
+    char *dest_id = resolve_root(idx.dest_root);
+    uint32_t dest_offset = 0;
+    size_t kept = 0;
+    int result = SUCCESS;
+
+    // Resolved only now: the destination may not have existed at index_open
+    if (dest_id == NULL || add_string(dest_id, strlen(dest_id), &dest_offset) != SUCCESS ||
+        order == NULL || out == NULL) {
+        free(dest_id);
+        free(order);
+        free(out);
+        return ERROR_FILE_WRITE;
+    }
+    free(dest_id);
+
+    for (size_t i = 0; i < idx.count; i++) {
+        order[i] = (uint32_t)i;
+    }
+    qsort_r(order, idx.count, sizeof(uint32_t), compare_order, idx.entries);
+
+    for (size_t i = 0; i < idx.count; i++) {
+        const IndexEntry *e = &idx.entries[order[i]];
+        if (kept > 0) {
+            const IndexEntry *last = &out[kept - 1];
+            if (compare_key(idx.strings + last->path, last->path_len, last->name,
+                            idx.strings + e->path, e->path_len, e->name) == 0) {
+                continue;
+            }
+        }
+        out[kept++] = *e;
+    }
+    free(order);
+
+    finish_dirs(out, kept);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.entry_size = sizeof(IndexEntry);
+    header.count = kept;
+    header.strings_size = idx.strings_size;
+    header.src_root = idx.src_id;
+    header.dest_root = dest_offset;
+
+    // Written beside the old index and renamed over it
+    snprintf(tmp, sizeof(tmp), "%s.tmp", idx.file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(out);
+        return ERROR_FILE_WRITE;
+    }
+    if (write_all(fd, &header, sizeof(header)) != SUCCESS ||
+        write_all(fd, out, kept * sizeof(IndexEntry)) != SUCCESS ||
+        write_all(fd, idx.strings, idx.strings_size) != SUCCESS || fsync(fd) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+    if (close(fd) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+    free(out);
+
+    if (result == SUCCESS && rename(tmp, idx.file) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+    if (result != SUCCESS) {
+        unlink(tmp);
+    }
+    return result;
+}
+
+int index_close(void) {
+    int result = SUCCESS;
+
+    if (idx.active) {
+        result = save_index();
+    }
+
+    if (idx.map != NULL) {
+        munmap(idx.map, idx.map_size);
+    }
+    free(idx.file);
+    free(idx.src_root);
+    free(idx.dest_root);
+    free(idx.entries);
+    free(idx.strings);
+    memset(&idx.old, 0, sizeof(idx.old));
+    idx.map = NULL;
+    idx.file = idx.src_root = idx.dest_root = NULL;
+    idx.entries = NULL;
+    idx.strings = NULL;
+    idx.count = idx.capacity = idx.strings_size = idx.strings_capacity = 0;
+    idx.active = 0;
+
+    return result;
+}
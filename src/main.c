@@ -1,4 +1,23 @@
 #include "file_operations.h"
+#include "batch.h"
+#include "compare.h"
+#include "compress.h"
+#include "copy_engine.h"
+#include "dedup.h"
+#include "dir_list.h"
+#include "durable.h"
+#include "filter.h"
+#include "hash.h"
+#include "index.h"
+#include "parallel_hash.h"
+#include "path_arena.h"
+#include "rate_limit.h"
+#include "resume.h"
+#include "stats.h"
+#include "tar_stream.h"
+#include "thread_pool.h"
+#include "uring_copy.h"
+#include <getopt.h>
 
 // Clear screen (cross-platform approach)
 void clear_screen() {
@@ -48,6 +67,19 @@ void get_input(const char *prompt, char *buffer, size_t size) {
     }
 }
 
+// Stop the clock, print statistics and write --stats-json if requested
+static void report_stats(CopyStats *stats, int display) {
+    const char *json = get_copy_options()->stats_json;
+
+    stats_stop(stats);
+    if (display) {
+        display_stats(stats);
+    }
+    if (json != NULL && stats_write_json(stats, json) != SUCCESS) {
+        print_error(ERROR_FILE_WRITE, json);
+    }
+}
+
 // Display file/directory information
 void display_info(const char *path) {
     struct stat st;
@@ -140,17 +172,20 @@ void handle_file_copy() {
     printf("📋 Copying file...\n");
     printf("────────────────────────────────────────────────────────\n");
 
-    clock_t start = clock();
-    result = copy_file(src, dest);
-    clock_t end = clock();
+    CopyStats stats;
+    init_stats(&stats);
 
-    double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
+    result = copy_file_with_stats(src, dest, &stats);
+    stats_stop(&stats);
+    double time_spent = stats_elapsed_ns(&stats) / 1e9;
 
     if (result == SUCCESS) {
         printf("✅ File copied successfully!\n");
         printf("⏱️  Time taken: %.3f seconds\n", time_spent);
+        report_stats(&stats, 1);
     } else {
         print_error(result, "File copy failed");
+        report_stats(&stats, 0);
     }
 }
 
@@ -183,17 +218,20 @@ void handle_directory_copy() {
     printf("📁 Copying directory recursively...\n");
     printf("────────────────────────────────────────────────────────\n");
 
-    clock_t start = clock();
-    result = copy_directory(src, dest);
-    clock_t end = clock();
+    CopyStats stats;
+    init_stats(&stats);
 
-    double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
+    result = copy_directory_with_stats(src, dest, &stats);
+    stats_stop(&stats);
+    double time_spent = stats_elapsed_ns(&stats) / 1e9;
 
     if (result == SUCCESS) {
         printf("✅ Directory copied successfully!\n");
         printf("⏱️  Time taken: %.3f seconds\n", time_spent);
+        report_stats(&stats, 1);
     } else {
         print_error(result, "Directory copy failed");
+        report_stats(&stats, 0);
     }
 }
 
@@ -297,11 +335,10 @@ void handle_directory_move() {
 // Handle filtered copy operation
 void handle_filtered_copy() {
     char src[MAX_PATH], dest[MAX_PATH];
-    char include_input[256], exclude_input[256];
-    const char *include_patterns[MAX_PATTERNS + 1] = {NULL};
-    const char *exclude_patterns[MAX_PATTERNS + 1] = {NULL};
+    char include_input[MAX_PATH], exclude_input[MAX_PATH], exclude_file[MAX_PATH];
+    CopyFilter *filter;
     CopyStats stats;
-    int result;
+    int result = SUCCESS;
 
     printf("\n");
     printf("╔════════════════════════════════════════════════════════╗\n");
@@ -321,29 +358,41 @@ void handle_filtered_copy() {
     printf("\n  Include patterns (comma-separated, e.g., *.txt,*.pdf):\n");
     get_input("  ", include_input, sizeof(include_input));
 
-    printf("  Exclude patterns (comma-separated, e.g., *.tmp,*.log):\n");
+    printf("  Exclude patterns (comma-separated, e.g., *.tmp,*.log,build/):\n");
     get_input("  ", exclude_input, sizeof(exclude_input));
 
+    printf("  Exclude file (.gitignore style, optional):\n");
+    get_input("  ", exclude_file, sizeof(exclude_file));
+
+    filter = filter_create();
+    if (filter == NULL) {
+        print_error(ERROR_FILE_READ, "Filtered copy failed");
+        return;
+    }
+
     // Parse include patterns
-    int inc_count = 0;
-    if (strlen(include_input) > 0) {
-        char *token = strtok(include_input, ",");
-        while (token != NULL && inc_count < MAX_PATTERNS) {
-            // Trim whitespace
-            while (*token == ' ') token++;
-            include_patterns[inc_count++] = token;
-            token = strtok(NULL, ",");
-        }
+    char *token = strtok(include_input, ",");
+    while (token != NULL && result == SUCCESS) {
+        // Trim whitespace
+        while (*token == ' ') token++;
+        result = filter_add_include(filter, token);
+        token = strtok(NULL, ",");
     }
 
     // Parse exclude patterns
-    int exc_count = 0;
-    if (strlen(exclude_input) > 0) {
-        char *token = strtok(exclude_input, ",");
-        while (token != NULL && exc_count < MAX_PATTERNS) {
-            while (*token == ' ') token++;
-            exclude_patterns[exc_count++] = token;
-            token = strtok(NULL, ",");
+    token = strtok(exclude_input, ",");
+    while (token != NULL && result == SUCCESS) {
+        while (*token == ' ') token++;
+        result = filter_add_exclude(filter, token);
+        token = strtok(NULL, ",");
+    }
+
+    if (result == SUCCESS && strlen(exclude_file) > 0) {
+        result = filter_load_excludes(filter, exclude_file);
+        if (result != SUCCESS) {
+            print_error(result, exclude_file);
+            filter_free(filter);
+            return;
         }
     }
 
@@ -353,29 +402,29 @@ void handle_filtered_copy() {
 
     init_stats(&stats);
 
-    if (is_directory(src)) {
-        result = copy_directory_filtered(src, dest,
-                                        inc_count > 0 ? include_patterns : NULL,
-                                        exc_count > 0 ? exclude_patterns : NULL,
-                                        &stats);
-    } else {
-        result = copy_file_filtered(src, dest,
-                                   inc_count > 0 ? include_patterns : NULL,
-                                   exc_count > 0 ? exclude_patterns : NULL,
-                                   &stats);
+    if (result == SUCCESS && is_directory(src)) {
+        result = copy_directory_with_filter(src, dest, filter, &stats);
+    } else if (result == SUCCESS) {
+        const char *filename = strrchr(src, '/');
+        if (filter_wants_file(filter, filename != NULL ? filename + 1 : src)) {
+            result = copy_file_with_stats(src, dest, &stats);
+        }
     }
+    filter_free(filter);
 
     if (result == SUCCESS) {
         printf("✅ Copy completed successfully!\n");
-        display_stats(&stats);
+        report_stats(&stats, 1);
     } else {
         print_error(result, "Filtered copy failed");
+        report_stats(&stats, 0);
     }
 }
 
 // Handle file comparison
 void handle_file_comparison() {
     char file1[MAX_PATH], file2[MAX_PATH];
+    off_t diff_offset;
     int result;
 
     printf("\n");
@@ -396,17 +445,16 @@ void handle_file_comparison() {
     printf("🔍 Comparing files...\n");
     printf("────────────────────────────────────────────────────────\n");
 
-    clock_t start = clock();
-    result = compare_files(file1, file2);
-    clock_t end = clock();
-
-    double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
+    long start = monotonic_ns();
+    result = compare_files_at(file1, file2, &diff_offset);
+    double time_spent = (monotonic_ns() - start) / 1e9;
 
     if (result == SUCCESS) {
         printf("✅ Files are identical!\n");
         printf("⏱️  Comparison time: %.3f seconds\n", time_spent);
     } else if (result == ERROR_FILES_DIFFER) {
         printf("❌ Files are different!\n");
+        printf("📍 First difference at byte offset %lld\n", (long long)diff_offset);
     } else {
         print_error(result, "File comparison failed");
     }
@@ -415,7 +463,9 @@ void handle_file_comparison() {
 // Handle checksum calculation
 void handle_checksum_calculation() {
     char filepath[MAX_PATH];
-    char checksum[33];
+    char checksum[HASH_MAX_HEX];
+    char algorithm_name[16];
+    HashAlgorithm algorithm = get_copy_options()->hash;
     int result;
 
     printf("\n");
@@ -431,15 +481,23 @@ void handle_checksum_calculation() {
         return;
     }
 
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "  Algorithm (md5, sha256, xxh64) [%s]: ", hash_name(algorithm));
+    get_input(prompt, algorithm_name, sizeof(algorithm_name));
+    if (algorithm_name[0] != '\0' && parse_hash_algorithm(algorithm_name, &algorithm) != SUCCESS) {
+        printf("\n❌ Unknown algorithm: %s\n", algorithm_name);
+        return;
+    }
+
     printf("\n");
     printf("🔐 Calculating checksum...\n");
     printf("────────────────────────────────────────────────────────\n");
 
-    result = calculate_md5(filepath, checksum);
+    result = calculate_checksum(filepath, algorithm, checksum);
 
     if (result == SUCCESS) {
         printf("✅ Checksum calculated successfully!\n");
-        printf("📝 Checksum: %s\n", checksum);
+        printf("📝 %s checksum: %s\n", hash_name(algorithm), checksum);
         printf("\n💡 Save this checksum to verify file integrity later.\n");
     } else {
         print_error(result, "Checksum calculation failed");
@@ -449,7 +507,7 @@ void handle_checksum_calculation() {
 // Handle checksum verification
 void handle_checksum_verification() {
     char filepath[MAX_PATH];
-    char expected_checksum[33];
+    char expected_checksum[HASH_MAX_HEX + 2];
     int result;
 
     printf("\n");
@@ -534,18 +592,698 @@ void handle_list_directory() {
         return;
     }
 
-    result = list_directory(dir_path);
+    ListOptions list;
+    char sort[16];
+    init_list_options(&list);
+    get_input("  Sort by name, size or time (Enter for directory order): ", sort, sizeof(sort));
+    if (strlen(sort) > 0 && parse_list_sort(sort, &list.sort) != SUCCESS) {
+        printf("\n❌ Unknown sort order!\n");
+        return;
+    }
+
+    result = list_directory(dir_path, &list, stdout);
 
     if (result != SUCCESS) {
         print_error(result, "Failed to list directory");
     }
 }
 
+// Display command line usage
+void print_usage(const char *program) {
+    printf("Usage: %s [options] [source destination]\n", program);
+    printf("       %s --checksum [--hash ALG] [--tree-hash] file|dir...\n", program);
+    printf("       %s --to-tar FILE|- [filters] source\n", program);
+    printf("       %s --from-tar FILE|- destination\n", program);
+    printf("       %s --list [--sort KEY] [--reverse] [--skip N] [--limit N] dir...\n", program);
+    printf("\n");
+    printf("Without source and destination the interactive menu is started.\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  --engine NAME     Copy engine: auto, reflink, copy_file_range,\n");
+    printf("                    sendfile, read_write (default: auto)\n");
+    printf("  -j, --jobs N      Copy directories with N worker threads\n");
+    printf("  --direct          Bypass the page cache (O_DIRECT) for files >= %d MB\n",
+           DIRECT_IO_MIN_SIZE / (1024 * 1024));
+    printf("  --progress MODE   auto, none, file or tree (default: auto, off when\n");
+    printf("                    stdout is not a terminal)\n");
+    printf("  --order ORDER     Order files are copied in within a directory: directory\n");
+    printf("                    (default, as the filesystem lists them), inode or extent\n");
+    printf("                    (by disk position, FIEMAP); keeps rotating disks sequential\n");
+    printf("  --cache-neutral   Drop copied data of source and destination from the page\n");
+    printf("                    cache as the copy goes (slower, keeps other data cached)\n");
+    printf("  --split[=SIZE]    Copy a file of at least two SIZE ranges (K/M/G suffix,\n");
+    printf("                    default: %d M) with -j threads working on separate\n",
+           SPLIT_DEFAULT_SIZE / (1024 * 1024));
+    printf("                    ranges (single-file copies, not with --verify)\n");
+    printf("  --buffer-size N   Fixed I/O buffer size in bytes (K/M suffix, at most %d MB)\n",
+           MAX_BUFFER_SIZE / (1024 * 1024));
+    printf("                    instead of sizing buffers per file\n");
+    printf("  --no-io-uring     Do not batch small files through io_uring\n");
+    printf("  --queue-depth N   Files kept in flight per io_uring batch (default: %d)\n",
+           URING_DEFAULT_QUEUE_DEPTH);
+    printf("  --hash ALG        Checksum algorithm: md5, sha256, xxh64 (default: sha256)\n");
+    printf("  --verify[=MODE]   Hash each file while copying, then re-read the copy:\n");
+    printf("                    drop (default: write back and bypass the cache),\n");
+    printf("                    direct (O_DIRECT re-read) or cached\n");
+    printf("  --sync[=MODE]     Skip files that are already up to date: mtime (default,\n");
+    printf("                    same size and mtime) or checksum (same contents);\n");
+    printf("                    large changed files only get their changed blocks\n");
+    printf("  --delete          Remove destination entries missing from the source\n");
+    printf("  --dedup MODE      Link files with identical contents (same size, partial\n");
+    printf("                    hash, then SHA-256) to their first copy: hardlink or\n");
+    printf("                    reflink; source hardlinks are always kept as links\n");
+    printf("  --compress C[:N]  Compress each copied file with codec C (zstd, lz4 or gzip,\n");
+    printf("                    at level N) into NAME.zst/.lz4/.gz; big files are\n");
+    printf("                    compressed in 4 MB blocks by -j threads; files that are\n");
+    printf("                    compressed already (archives, images, media) are copied\n");
+    printf("  --decompress      Unpack .zst/.lz4/.gz files while copying them\n");
+    printf("  --durable[=MODE]  Write each file under a temporary name and rename it into\n");
+    printf("                    place once it is on disk, syncing files in batches:\n");
+    printf("                    syncfs (default: once per filesystem) or fdatasync\n");
+    printf("                    (once per file); moves keep sources until then\n");
+    printf("  --resume[=FILE]   Journal finished files and checkpoints of large files in\n");
+    printf("                    FILE (default: DEST.filecopy-resume); rerun the same\n");
+    printf("                    copy with --resume to skip finished files and continue\n");
+    printf("                    a partial one from its last checkpoint (removed on success)\n");
+    printf("  --bwlimit RATE    Copy at most RATE bytes per second (K/M/G suffixes);\n");
+    printf("                    batch entries running at once share it evenly\n");
+    printf("  --iops-limit N    Issue at most N read/write requests per second\n");
+    printf("  --limit-file FILE Take the limits from FILE (\"RATE [IOPS]\", 0 for\n");
+    printf("                    unlimited), re-read each second and on SIGHUP\n");
+    printf("  --ionice CLASS[:N]\n");
+    printf("                    I/O priority: idle, best-effort or realtime, level N\n");
+    printf("                    0-7 (honoured by priority-aware schedulers such as BFQ)\n");
+    printf("  --include PAT     Copy only files matching PAT (repeatable)\n");
+    printf("  --exclude PAT     Skip files and directories matching PAT (repeatable;\n");
+    printf("                    'dir/' matches directories only, '!PAT' re-includes)\n");
+    printf("  --exclude-from FILE\n");
+    printf("                    Read exclude patterns from a .gitignore-style file\n");
+    printf("  --index FILE      Remember source and copy metadata in FILE: with --sync,\n");
+    printf("                    unchanged files are skipped without opening them;\n");
+    printf("                    with --checksum, unchanged files are not hashed again\n");
+    printf("  --index-trust-dirs\n");
+    printf("                    With --index and --sync, skip directories whose mtime\n");
+    printf("                    has not moved without reading them (misses files\n");
+    printf("                    rewritten in place)\n");
+    printf("  --checksum        Print checksums of the given files instead of copying;\n");
+    printf("                    a directory prints a sorted sha256sum-style manifest\n");
+    printf("                    of every file below it, hashed by -j workers\n");
+    printf("  --tree-hash       Checksum files as a tree of 4 MB chunks hashed by -j\n");
+    printf("                    workers (fast on huge files, differs from sha256sum)\n");
+    printf("  --to-tar FILE     Write the source (file or tree, filters apply) as a\n");
+    printf("                    ustar/pax stream to FILE (- for stdout, a pipe or socket)\n");
+    printf("  --from-tar FILE   Unpack a tar stream from FILE (- for stdin) into the\n");
+    printf("                    destination; piping --to-tar - src into --from-tar -\n");
+    printf("                    dest copies src to dest without staging files\n");
+    printf("  --list            List each directory instead of copying (symlinks as links);\n");
+    printf("                    unsorted listings print as the directory is read\n");
+    printf("  --sort KEY        Order --list by name, size (largest first) or time (newest\n");
+    printf("                    first); default: as the filesystem returns entries\n");
+    printf("  --reverse         Reverse the --sort order\n");
+    printf("  --skip N          Leave out the first N entries of --list\n");
+    printf("  --limit N         List at most N entries\n");
+    printf("  --batch FILE      Run every copy/move/compare/checksum listed in FILE\n");
+    printf("                    (- for stdin) in this process, sharing one worker pool\n");
+    printf("                    and one set of statistics; one result line per entry\n");
+    printf("  --batch-format F  Manifest format: auto (default), lines (tab-separated\n");
+    printf("                    \"[op] src dest\"), nul (src/dest paths, NUL-terminated)\n");
+    printf("                    or json ({\"op\", \"src\", \"dest\"} objects)\n");
+    printf("  --batch-op OP     Operation for entries that name none: copy (default),\n");
+    printf("                    move, compare or checksum\n");
+    printf("  --stats-json FILE Write statistics, per-phase times and the per-file\n");
+    printf("                    latency histogram as JSON to FILE (- for stdout)\n");
+    printf("  -h, --help        Display this help message\n");
+}
+
+// Action requested on the command line
+typedef enum {
+    CLI_COPY = 0,
+    CLI_CHECKSUM,
+    CLI_BATCH,
+    CLI_TAR_OUT,
+    CLI_TAR_IN,
+    CLI_LIST
+} CliAction;
+
+// --batch settings
+typedef struct {
+    const char *manifest;
+    BatchFormat format;
+    BatchOp op;
+} BatchRequest;
+
+// Parse a size argument such as 65536, 64K, 4M or 1G no larger than max
+static int parse_size(const char *arg, unsigned long long max, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+
+    if (end == arg) {
+        return ERROR_INVALID_PATH;
+    }
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value *= 1024 * 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || value == 0 || value > max) {
+        return ERROR_INVALID_PATH;
+    }
+    *size = (size_t)value;
+    return SUCCESS;
+}
+
+// Parse an entry count such as 0 or 1000
+static int parse_count(const char *arg, size_t *count) {
+    char *end;
+
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || *arg == '-' || errno != 0) {
+        return ERROR_INVALID_PATH;
+    }
+    *count = (size_t)value;
+    return SUCCESS;
+}
+
+// Add a --include/--exclude/--exclude-from argument to *filter, creating it on first use
+static int add_filter_option(CopyFilter **filter, int opt, const char *arg) {
+    int result;
+
+    if (*filter == NULL && (*filter = filter_create()) == NULL) {
+        return ERROR_FILE_READ;
+    }
+    if (opt == 'i') {
+        result = filter_add_include(*filter, arg);
+    } else if (opt == 'x') {
+        result = filter_add_exclude(*filter, arg);
+    } else {
+        result = filter_load_excludes(*filter, arg);
+    }
+    if (result != SUCCESS) {
+        print_error(result, arg);
+    }
+    return result;
+}
+
+// Parse command line options into opts and *filter
+// Returns index of the first positional argument, or -1 to exit
+int parse_options(int argc, char *argv[], CopyOptions *opts, CliAction *action,
+                  BatchRequest *batch, const char **archive, CopyFilter **filter,
+                  ListOptions *list, int *exit_code) {
+    static const struct option long_options[] = {
+        {"engine", required_argument, NULL, 'E'},
+        {"jobs",   required_argument, NULL, 'j'},
+        {"direct", no_argument,       NULL, 'D'},
+        {"progress", required_argument, NULL, 'P'},
+        {"no-io-uring", no_argument,     NULL, 'U'},
+        {"queue-depth", required_argument, NULL, 'Q'},
+        {"buffer-size", required_argument, NULL, 'B'},
+        {"cache-neutral", no_argument, NULL, 'N'},
+        {"order",  required_argument, NULL, 'A'},
+        {"split",  optional_argument, NULL, 'R'},
+        {"hash",   required_argument, NULL, 'H'},
+        {"checksum", no_argument,     NULL, 'C'},
+        {"tree-hash", no_argument,    NULL, 'M'},
+        {"verify", optional_argument, NULL, 'V'},
+        {"sync",   optional_argument, NULL, 'S'},
+        {"delete", no_argument,       NULL, 'X'},
+        {"durable", optional_argument, NULL, 'W'},
+        {"dedup",  required_argument, NULL, 'K'},
+        {"compress", required_argument, NULL, 'G'},
+        {"decompress", no_argument,   NULL, 'g'},
+        {"resume", optional_argument, NULL, 'u'},
+        {"bwlimit", required_argument, NULL, 'w'},
+        {"iops-limit", required_argument, NULL, 'q'},
+        {"limit-file", required_argument, NULL, 'c'},
+        {"ionice", required_argument, NULL, 'n'},
+        {"index",  required_argument, NULL, 'I'},
+        {"index-trust-dirs", no_argument, NULL, 'T'},
+        {"include", required_argument, NULL, 'i'},
+        {"exclude", required_argument, NULL, 'x'},
+        {"exclude-from", required_argument, NULL, 'F'},
+        {"stats-json", required_argument, NULL, 'O'},
+        {"list",   no_argument,       NULL, 'L'},
+        {"sort",   required_argument, NULL, 's'},
+        {"reverse", no_argument,      NULL, 'r'},
+        {"skip",   required_argument, NULL, 'k'},
+        {"limit",  required_argument, NULL, 'l'},
+        {"batch",  required_argument, NULL, 'b'},
+        {"to-tar", required_argument, NULL, 'Y'},
+        {"from-tar", required_argument, NULL, 'Z'},
+        {"batch-format", required_argument, NULL, 'f'},
+        {"batch-op", required_argument, NULL, 'o'},
+        {"help",   no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    *exit_code = 0;
+    *action = CLI_COPY;
+    while ((opt = getopt_long(argc, argv, "hj:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'E':
+                if (parse_copy_engine(optarg, &opts->engine) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown copy engine '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'j':
+                opts->jobs = atoi(optarg);
+                if (opts->jobs < 1 || opts->jobs > MAX_WORKERS) {
+                    fprintf(stderr, "Error: -j expects 1..%d worker threads\n", MAX_WORKERS);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'D':
+                opts->direct_io = 1;
+                break;
+            case 'P':
+                if (strcmp(optarg, "auto") == 0) {
+                    opts->progress = PROGRESS_AUTO;
+                } else if (strcmp(optarg, "none") == 0) {
+                    opts->progress = PROGRESS_NONE;
+                } else if (strcmp(optarg, "file") == 0) {
+                    opts->progress = PROGRESS_FILE;
+                } else if (strcmp(optarg, "tree") == 0) {
+                    opts->progress = PROGRESS_TREE;
+                } else {
+                    fprintf(stderr, "Error: Unknown progress mode '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'U':
+                opts->use_io_uring = 0;
+                break;
+            case 'Q':
+                opts->queue_depth = atoi(optarg);
+                if (opts->queue_depth < 1 || opts->queue_depth > URING_MAX_QUEUE_DEPTH) {
+                    fprintf(stderr, "Error: --queue-depth expects 1..%d\n", URING_MAX_QUEUE_DEPTH);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'B':
+                if (parse_size(optarg, MAX_BUFFER_SIZE, &opts->buffer_size) != SUCCESS) {
+                    fprintf(stderr, "Error: --buffer-size expects a size of at most %d MB\n",
+                            MAX_BUFFER_SIZE / (1024 * 1024));
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'N':
+                opts->cache_neutral = 1;
+                break;
+            case 'A':
+                if (parse_walk_order(optarg, &opts->order) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown walk order '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'M':
+                opts->tree_hash = 1;
+                break;
+            case 'R':
+                opts->split_size = SPLIT_DEFAULT_SIZE;
+                if (optarg != NULL && (parse_size(optarg, 1ULL << 40, &opts->split_size) != SUCCESS ||
+                                       opts->split_size < SPLIT_MIN_SIZE)) {
+                    fprintf(stderr, "Error: Invalid split size '%s' (at least %d MB)\n", optarg,
+                            SPLIT_MIN_SIZE / (1024 * 1024));
+                    *exit_code = 1;
+                    return -1;
+                }
+                // Aligned ranges keep O_DIRECT usable in every worker
+                opts->split_size = (opts->split_size + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+                break;
+            case 'H':
+                if (parse_hash_algorithm(optarg, &opts->hash) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown hash algorithm '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'C':
+                *action = CLI_CHECKSUM;
+                break;
+            case 'L':
+                *action = CLI_LIST;
+                break;
+            case 'u':
+                // "" picks the default journal next to the destination
+                opts->resume_path = optarg != NULL ? optarg : "";
+                break;
+            case 'w':
+            case 'q':
+                if (parse_rate(optarg, opt == 'w' ? &opts->bwlimit : &opts->iops_limit) != SUCCESS) {
+                    fprintf(stderr, "Error: Invalid rate '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'c':
+                opts->limit_file = optarg;
+                break;
+            case 'n': {
+                // Before any thread exists, so all of them inherit it
+                int result = rate_set_ionice(optarg);
+                if (result == ERROR_INVALID_PATH) {
+                    fprintf(stderr, "Error: Unknown I/O priority '%s'\n", optarg);
+                } else if (result != SUCCESS) {
+                    fprintf(stderr, "Error: Cannot set I/O priority '%s': %s\n", optarg,
+                            strerror(errno));
+                }
+                if (result != SUCCESS) {
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            }
+            case 's':
+                if (parse_list_sort(optarg, &list->sort) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown sort key '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'r':
+                list->reverse = 1;
+                break;
+            case 'k':
+            case 'l':
+                if (parse_count(optarg, opt == 'k' ? &list->skip : &list->limit) != SUCCESS) {
+                    fprintf(stderr, "Error: Invalid entry count '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'S':
+                if (optarg == NULL || strcmp(optarg, "mtime") == 0) {
+                    opts->sync = SYNC_MTIME;
+                } else if (strcmp(optarg, "checksum") == 0) {
+                    opts->sync = SYNC_CHECKSUM;
+                } else {
+                    fprintf(stderr, "Error: Unknown sync mode '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'X':
+                opts->delete_extraneous = 1;
+                break;
+            case 'K':
+                if (parse_dedup_mode(optarg, &opts->dedup) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown dedup mode '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'G':
+                if (parse_compress_codec(optarg, &opts->compress, &opts->compress_level) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown codec or level '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                if (!compress_available(opts->compress)) {
+                    fprintf(stderr, "Error: %s support was not built in\n",
+                            compress_codec_name(opts->compress));
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'g':
+                opts->decompress = 1;
+                break;
+            case 'W':
+                if (optarg == NULL) {
+                    opts->durable = DURABLE_SYNCFS;
+                } else if (parse_durable_mode(optarg, &opts->durable) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown durable mode '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'I':
+                opts->index_path = optarg;
+                break;
+            case 'T':
+                opts->index_trust_dirs = 1;
+                break;
+            case 'O':
+                opts->stats_json = optarg;
+                break;
+            case 'b':
+                *action = CLI_BATCH;
+                batch->manifest = optarg;
+                break;
+            case 'Y':
+            case 'Z':
+                *action = opt == 'Y' ? CLI_TAR_OUT : CLI_TAR_IN;
+                *archive = optarg;
+                break;
+            case 'f':
+                if (parse_batch_format(optarg, &batch->format) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown manifest format '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'o':
+                if (parse_batch_op(optarg, &batch->op) != SUCCESS) {
+                    fprintf(stderr, "Error: Unknown batch operation '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'i':
+            case 'x':
+            case 'F':
+                if (add_filter_option(filter, opt, optarg) != SUCCESS) {
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'V':
+                if (optarg == NULL || strcmp(optarg, "drop") == 0) {
+                    opts->verify = VERIFY_DROP;
+                } else if (strcmp(optarg, "cached") == 0) {
+                    opts->verify = VERIFY_CACHED;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    opts->verify = VERIFY_DIRECT;
+                } else {
+                    fprintf(stderr, "Error: Unknown verify mode '%s'\n", optarg);
+                    *exit_code = 1;
+                    return -1;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return -1;
+            default:
+                print_usage(argv[0]);
+                *exit_code = 1;
+                return -1;
+        }
+    }
+
+    // Coded copies differ from their sources in name and contents
+    if (opts->compress != COMPRESS_NONE || opts->decompress) {
+        const char *other = opts->compress != COMPRESS_NONE && opts->decompress ? "--decompress"
+                          : opts->sync != SYNC_OFF ? "--sync"
+                          : opts->verify != VERIFY_NONE ? "--verify"
+                          : opts->dedup != DEDUP_OFF ? "--dedup"
+                          : opts->delete_extraneous ? "--delete"
+                          : opts->resume_path != NULL ? "--resume" : NULL;
+        if (other != NULL) {
+            fprintf(stderr, "Error: --%s cannot be combined with %s\n",
+                    opts->compress != COMPRESS_NONE ? "compress" : "decompress", other);
+            *exit_code = 1;
+            return -1;
+        }
+    }
+
+    if (opts->resume_path != NULL && *action != CLI_COPY) {
+        fprintf(stderr, "Error: --resume only applies to copying a source to a destination\n");
+        *exit_code = 1;
+        return -1;
+    }
+
+    return optind;
+}
+
+// Print checksums in sha256sum/md5sum format, directories as a manifest
+// Returns process exit code
+int run_checksums(int count, char *paths[], HashAlgorithm algorithm, int jobs) {
+    char checksum[HASH_MAX_HEX];
+    int exit_code = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (is_directory(paths[i])) {
+            if (checksum_directory(paths[i], algorithm, jobs, stdout) != SUCCESS) {
+                exit_code = 1;
+            }
+            continue;
+        }
+        int result = calculate_checksum(paths[i], algorithm, checksum);
+        if (result != SUCCESS) {
+            print_error(result, paths[i]);
+            exit_code = 1;
+            continue;
+        }
+        print_checksum_line(stdout, checksum, paths[i]);
+    }
+
+    return exit_code;
+}
+
+// Stream a tree into a tar archive or unpack one; "-" is stdout/stdin
+// Returns process exit code
+int run_tar(CliAction action, const char *archive, const char *path, const CopyFilter *filter) {
+    int to_stdio = strcmp(archive, "-") == 0;
+    int out = action == CLI_TAR_OUT;
+    int fd, result;
+    CopyStats stats;
+
+    if (to_stdio) {
+        fd = out ? STDOUT_FILENO : STDIN_FILENO;
+    } else if (out) {
+        fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    } else {
+        fd = open(archive, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        print_error(ERROR_FILE_OPEN, archive);
+        return 1;
+    }
+
+    init_stats(&stats);
+    if (out) {
+        result = tar_write_tree(path, fd, filter, &stats);
+    } else {
+        result = tar_extract(fd, path, &stats);
+    }
+    if (!to_stdio && close(fd) != 0 && result == SUCCESS) {
+        result = ERROR_FILE_WRITE;
+    }
+
+    // Unpacking names the member that failed itself
+    if (result != SUCCESS && out) {
+        print_error(result, path);
+    }
+    // Statistics never go into a streamed archive
+    report_stats(&stats, result == SUCCESS && !(out && to_stdio));
+    return result == SUCCESS ? 0 : 1;
+}
+
 // Main function
 int main(int argc, char *argv[]) {
     int choice;
     char input[10];
     char path[MAX_PATH];
+    CopyOptions opts;
+    CopyFilter *filter = NULL;
+    CliAction action;
+    int exit_code;
+
+    init_copy_options(&opts);
+    BatchRequest batch = { NULL, BATCH_FORMAT_AUTO, BATCH_COPY };
+    const char *archive = NULL;
+    ListOptions list;
+    init_list_options(&list);
+    int first_arg = parse_options(argc, argv, &opts, &action, &batch, &archive, &filter,
+                                  &list, &exit_code);
+    if (first_arg < 0) {
+        filter_free(filter);
+        return exit_code;
+    }
+    // Nothing but the archive may reach a streamed stdout
+    if (action == CLI_TAR_OUT && strcmp(archive, "-") == 0) {
+        if (opts.stats_json != NULL && strcmp(opts.stats_json, "-") == 0) {
+            fprintf(stderr, "Error: --stats-json - would mix statistics into the archive\n");
+            filter_free(filter);
+            return 1;
+        }
+        opts.progress = PROGRESS_NONE;
+    }
+    set_copy_options(&opts);
+    if (rate_limit_start() != SUCCESS) {
+        print_error(ERROR_FILE_OPEN, opts.limit_file);
+        filter_free(filter);
+        return 1;
+    }
+
+    if (action == CLI_TAR_OUT || action == CLI_TAR_IN) {
+        if (argc - first_arg != 1) {
+            fprintf(stderr, "Error: --%s expects one %s\n",
+                    action == CLI_TAR_OUT ? "to-tar" : "from-tar",
+                    action == CLI_TAR_OUT ? "source path" : "destination directory");
+            filter_free(filter);
+            return 1;
+        }
+        exit_code = run_tar(action, archive, argv[first_arg], filter);
+        filter_free(filter);
+        return exit_code;
+    }
+
+    if (action == CLI_CHECKSUM) {
+        if (first_arg >= argc) {
+            fprintf(stderr, "Error: --checksum expects at least one file\n");
+            return 1;
+        }
+        if (opts.index_path != NULL && index_open(opts.index_path, "", NULL, 1) != SUCCESS) {
+            print_error(ERROR_FILE_OPEN, opts.index_path);
+            return 1;
+        }
+        exit_code = run_checksums(argc - first_arg, argv + first_arg, opts.hash, opts.jobs);
+        if (index_active() && index_close() != SUCCESS) {
+            print_error(ERROR_FILE_WRITE, opts.index_path);
+            exit_code = 1;
+        }
+        return exit_code;
+    }
+
+    if (action == CLI_LIST) {
+        if (first_arg >= argc) {
+            fprintf(stderr, "Error: --list expects at least one directory\n");
+            return 1;
+        }
+        exit_code = 0;
+        for (int i = first_arg; i < argc; i++) {
+            int result = list_directory(argv[i], &list, stdout);
+            if (result != SUCCESS) {
+                print_error(result, argv[i]);
+                exit_code = 1;
+            }
+        }
+        return exit_code;
+    }
+
+    if (action == CLI_BATCH) {
+        Batch *entries = batch_load(batch.manifest, batch.format, batch.op);
+        if (entries == NULL) {
+            filter_free(filter);
+            return 1;
+        }
+        CopyStats stats;
+        init_stats(&stats);
+        int result = batch_run(entries, filter, &stats);
+        batch_free(entries);
+        filter_free(filter);
+        report_stats(&stats, 1);
+        return result == SUCCESS ? 0 : 1;
+    }
+
+    // Drop the options so argv[1] and argv[2] are source and destination
+    argv[first_arg - 1] = argv[0];
+    argv += first_arg - 1;
+    argc -= first_arg - 1;
 
     // Handle command line arguments
     if (argc == 3) {
@@ -568,17 +1306,60 @@ int main(int argc, char *argv[]) {
         }
 
         int result;
+        CopyStats stats;
+        init_stats(&stats);
+
+        // The journal of an interrupted run says what is left to do
+        char journal[MAX_PATH];
+        if (opts.resume_path != NULL) {
+            if (opts.resume_path[0] != '\0') {
+                snprintf(journal, sizeof(journal), "%s", opts.resume_path);
+            } else {
+                resume_default_journal(argv[2], journal, sizeof(journal));
+            }
+            if (resume_open(journal, argv[1], argv[2]) != SUCCESS) {
+                print_error(ERROR_FILE_OPEN, journal);
+                return 1;
+            }
+        }
+
         if (is_directory(argv[1])) {
-            result = copy_directory(argv[1], argv[2]);
+            // The index describes one source tree and its copy
+            if (opts.index_path != NULL &&
+                index_open(opts.index_path, argv[1], argv[2], 0) != SUCCESS) {
+                print_error(ERROR_FILE_OPEN, opts.index_path);
+                return 1;
+            }
+            result = copy_directory_with_filter(argv[1], argv[2], filter, &stats);
+            if (index_active() && index_close() != SUCCESS) {
+                print_error(ERROR_FILE_WRITE, opts.index_path);
+            }
         } else {
-            result = copy_file(argv[1], argv[2]);
+            const char *filename = strrchr(argv[1], '/');
+            result = SUCCESS;
+            if (filter_wants_file(filter, filename != NULL ? filename + 1 : argv[1])) {
+                result = copy_file_with_stats(argv[1], argv[2], &stats);
+            }
+        }
+        filter_free(filter);
+
+        if (resume_active()) {
+            int closed = resume_close(result == SUCCESS);
+            if (result != SUCCESS) {
+                printf("💾 Progress kept in %s; run the same copy with --resume to continue\n",
+                       journal);
+            } else if (closed != SUCCESS) {
+                print_error(ERROR_FILE_WRITE, journal);
+            }
         }
 
         if (result == SUCCESS) {
             printf("✅ Copy completed successfully!\n");
+            report_stats(&stats, 1);
             return 0;
         } else {
             print_error(result, "Copy failed");
+            report_stats(&stats, 0);
             return 1;
         }
     }
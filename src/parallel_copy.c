@@ -0,0 +1,664 @@
+#include "parallel_copy.h"
+#include "compress.h"
+#include "dedup.h"
+#include "filter.h"
+#include "index.h"
+#include "path_arena.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include "sync.h"
+#include "thread_pool.h"
+#include "uring_copy.h"
+
+// Destination directory states
+#define DIR_PENDING 0
+#define DIR_READY 1
+#define DIR_FAILED 2
+
+typedef struct DirNode DirNode;
+
+typedef struct CopyTask {
+    char *src_path;
+    char *dest_path;
+    DirNode *node;          // Directory to create (NULL for a file)
+    DirNode *parent;        // Directory that must exist first
+    UringBatch *batch;      // Small files copied together (NULL otherwise)
+    struct stat st;         // Source status from the walk (valid if have_stat)
+    int have_stat;
+    CopyJob *job;
+    struct CopyTask *next;  // Link in the parent's waiting list
+} CopyTask;
+
+// A destination directory and the tasks waiting for it to be created
+struct DirNode {
+    pthread_mutex_t lock;
+    int state;
+    CopyTask *waiting;
+    DirNode *parent;        // NULL for the root
+    CopyTask *create;       // Lazy mode: creation not scheduled yet (producer only)
+    DirNode *all_next;      // Link in the job-wide list (for cleanup)
+};
+
+typedef struct CopyError {
+    char *path;
+    int code;
+    int saved_errno;
+    struct CopyError *next;
+} CopyError;
+
+struct CopyJob {
+    ThreadPool *pool;
+    CopyStats *stats;
+    RateFlow *flow;         // Rate limit flow of the thread that started the job
+    const CopyFilter *filter;
+    size_t root_len;        // Length of the source root, for relative paths
+    int lazy;               // Create directories only when a file needs them
+    int move;               // Unlink each source file once it is copied
+    DedupTable *links;      // Earlier copies to link to (NULL for moves)
+    PathBuf src;            // Producer only: path of the entry being walked
+    PathBuf dest;
+    Arena arena;            // Producer only: entry batches of the open directories
+
+    pthread_mutex_t lock;   // Protects errors and nodes
+    CopyError *errors;
+    CopyError **errors_tail;
+    long error_count;
+    DirNode *nodes;
+};
+
+static void record_error(CopyJob *job, const char *path, int code, int saved_errno) {
+    CopyError *error = malloc(sizeof(CopyError));
+    if (error == NULL) {
+        return;
+    }
+    error->path = strdup(path);
+    error->code = code;
+    error->saved_errno = saved_errno;
+    error->next = NULL;
+
+    pthread_mutex_lock(&job->lock);
+    *job->errors_tail = error;
+    job->errors_tail = &error->next;
+    job->error_count++;
+    pthread_mutex_unlock(&job->lock);
+}
+
+static DirNode *new_dir_node(CopyJob *job, DirNode *parent, int state) {
+    DirNode *node = calloc(1, sizeof(DirNode));
+    if (node == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&node->lock, NULL);
+    node->state = state;
+    node->parent = parent;
+
+    pthread_mutex_lock(&job->lock);
+    node->all_next = job->nodes;
+    job->nodes = node;
+    pthread_mutex_unlock(&job->lock);
+
+    return node;
+}
+
+static CopyTask *new_task(CopyJob *job, const char *src, const char *dest,
+                          DirNode *node, DirNode *parent) {
+    CopyTask *task = calloc(1, sizeof(CopyTask));
+    if (task == NULL) {
+        return NULL;
+    }
+    task->src_path = strdup(src);
+    task->dest_path = strdup(dest);
+    task->node = node;
+    task->parent = parent;
+    task->job = job;
+    if (task->src_path == NULL || task->dest_path == NULL) {
+        free(task->src_path);
+        free(task->dest_path);
+        free(task);
+        return NULL;
+    }
+    return task;
+}
+
+static void free_task(CopyTask *task) {
+    uring_batch_free(task->batch);
+    free(task->src_path);
+    free(task->dest_path);
+    free(task);
+}
+
+// Drop tasks whose directory could not be created, along with their subtrees
+static void fail_tasks(CopyTask *list) {
+    while (list != NULL) {
+        CopyTask *next = list->next;
+        if (list->node != NULL) {
+            pthread_mutex_lock(&list->node->lock);
+            list->node->state = DIR_FAILED;
+            CopyTask *orphans = list->node->waiting;
+            list->node->waiting = NULL;
+            pthread_mutex_unlock(&list->node->lock);
+            fail_tasks(orphans);
+        }
+        free_task(list);
+        list = next;
+    }
+}
+
+static void run_task(void *arg);
+
+// Queue a task now if its parent directory exists, or park it until it does
+static void schedule_task(CopyJob *job, CopyTask *task) {
+    DirNode *parent = task->parent;
+    int state;
+
+    pthread_mutex_lock(&parent->lock);
+    state = parent->state;
+    if (state == DIR_PENDING) {
+        task->next = parent->waiting;
+        parent->waiting = task;
+    }
+    pthread_mutex_unlock(&parent->lock);
+
+    if (state == DIR_READY) {
+        if (thread_pool_submit(job->pool, run_task, task) != 0) {
+            record_error(job, task->src_path, ERROR_FILE_OPEN, ENOMEM);
+            task->next = NULL;
+            fail_tasks(task);
+        }
+    } else if (state == DIR_FAILED) {
+        task->next = NULL;
+        fail_tasks(task);
+    }
+}
+
+// Producer: schedule creation of a lazily created directory and its parents
+static void activate_node(CopyJob *job, DirNode *node) {
+    CopyTask *task = node->create;
+
+    if (task == NULL) {
+        return;
+    }
+    node->create = NULL;
+    activate_node(job, node->parent);
+    schedule_task(job, task);
+}
+
+// Directory the index vouches for (see index_trusted_dir), or NULL
+static const IndexEntry *trusted_dir(const char *src_path, const struct stat *src_stat,
+                                     const char *dest_path) {
+    struct stat dest_stat;
+
+    if (!index_active() || stat(dest_path, &dest_stat) != 0) {
+        return NULL;
+    }
+    return index_trusted_dir(src_path, src_stat, &dest_stat);
+}
+
+// Remove destination entries the source no longer has (--delete)
+static void delete_extraneous(CopyJob *job, const char *src_path, const char *dest_path) {
+    struct stat st;
+
+    if (!get_copy_options()->delete_extraneous) {
+        return;
+    }
+    // Nothing was removed from a directory the index vouches for
+    if (index_active() && stat(src_path, &st) == 0 && trusted_dir(src_path, &st, dest_path)) {
+        return;
+    }
+
+    int src_fd = open(src_path, O_RDONLY | O_DIRECTORY);
+    int dest_fd = open(dest_path, O_PATH | O_DIRECTORY);
+    if (src_fd < 0 || dest_fd < 0 ||
+        sync_delete_extraneous(src_fd, dest_fd, src_path, dest_path, job->filter, job->root_len,
+                               job->stats) != SUCCESS) {
+        record_error(job, dest_path, ERROR_FILE_WRITE, errno);
+    }
+    if (src_fd >= 0) {
+        close(src_fd);
+    }
+    if (dest_fd >= 0) {
+        close(dest_fd);
+    }
+}
+
+static void run_directory_task(CopyTask *task) {
+    CopyJob *job = task->job;
+    DirNode *node = task->node;
+    CopyTask *ready;
+    int ok = 1;
+    int made;
+
+    STATS_TIMED(STATS_WALK, made = mkdir(task->dest_path, 0755));
+    if (made != 0 && !(errno == EEXIST && is_directory(task->dest_path))) {
+        record_error(job, task->dest_path, ERROR_DIR_CREATE, errno);
+        ok = 0;
+    } else {
+        if (job->stats != NULL) {
+            job->stats->total_dirs++;
+        }
+        delete_extraneous(job, task->src_path, task->dest_path);
+    }
+
+    pthread_mutex_lock(&node->lock);
+    node->state = ok ? DIR_READY : DIR_FAILED;
+    ready = node->waiting;
+    node->waiting = NULL;
+    pthread_mutex_unlock(&node->lock);
+
+    if (!ok) {
+        fail_tasks(ready);
+        return;
+    }
+
+    // Children go to this worker's deque; idle workers steal them
+    while (ready != NULL) {
+        CopyTask *next = ready->next;
+        ready->next = NULL;
+        schedule_task(job, ready);
+        ready = next;
+    }
+}
+
+static void batch_error(void *ctx, const UringCopyItem *item, int error_code, int saved_errno) {
+    record_error(ctx, item->src_path, error_code, saved_errno);
+}
+
+static void run_task(void *arg) {
+    CopyTask *task = arg;
+    CopyStats *outer = stats_bind(task->job->stats);
+    RateFlow *outer_flow = rate_bind(task->job->flow);
+
+    if (task->node != NULL) {
+        run_directory_task(task);
+    } else if (task->batch != NULL) {
+        set_progress_enabled(0);
+        uring_batch_flush(task->batch, task->job->stats, batch_error, task->job);
+    } else {
+        set_progress_enabled(0);
+        const struct stat *st = task->have_stat ? &task->st : NULL;
+        int result = task->job->move ?
+            move_file_at(AT_FDCWD, task->src_path, st, AT_FDCWD, task->dest_path,
+                         task->src_path, task->job->stats) :
+            copy_file_at(AT_FDCWD, task->src_path, st, AT_FDCWD, task->dest_path,
+                         task->src_path, task->job->stats, task->dest_path, task->job->links);
+        if (result != SUCCESS) {
+            record_error(task->job, task->src_path, result, errno);
+        }
+    }
+
+    stats_bind(outer);
+    rate_bind(outer_flow);
+    free_task(task);
+}
+
+// Hand a directory's batch of small files to the pool
+static void schedule_batch(CopyJob *job, UringBatch **batch, const char *src_path,
+                           const char *dest_path, DirNode *node) {
+    if (*batch == NULL || (*batch)->count == 0) {
+        return;
+    }
+    activate_node(job, node);
+
+    CopyTask *task = new_task(job, src_path, dest_path, NULL, node);
+    if (task == NULL) {
+        uring_batch_flush(*batch, job->stats, batch_error, job);
+        return;
+    }
+    task->batch = *batch;
+    *batch = NULL;
+    schedule_task(job, task);
+}
+
+static void enumerate_directory(CopyJob *job, DirNode *node);
+
+// Point the walk's paths at the current directory's entry name
+static int enumerate_push(CopyJob *job, const char *name) {
+    size_t src_len = job->src.len;
+
+    if (path_buf_push(&job->src, name) != 0) {
+        return ERROR_DIR_OPEN;
+    }
+    if (path_buf_push(&job->dest, name) != 0) {
+        path_buf_pop(&job->src, src_len);
+        return ERROR_DIR_OPEN;
+    }
+    return SUCCESS;
+}
+
+// Queue creation of a subdirectory, then walk it; the walk's paths name it
+static void enumerate_subdirectory(CopyJob *job, DirNode *node) {
+    DirNode *child = new_dir_node(job, node, DIR_PENDING);
+    CopyTask *task = child ? new_task(job, job->src.data, job->dest.data, child, node) : NULL;
+    if (task == NULL) {
+        record_error(job, job->src.data, ERROR_DIR_CREATE, ENOMEM);
+        return;
+    }
+
+    if (!job->lazy) {
+        schedule_task(job, task);
+        enumerate_directory(job, child);
+        return;
+    }
+
+    // Held back until a file needs it; a copy that already exists is
+    // synced (and --delete'd) as usual
+    child->create = task;
+    if (is_directory(job->dest.data)) {
+        activate_node(job, child);
+    }
+    enumerate_directory(job, child);
+
+    // Nothing below matched, so nothing waits for the directory
+    if (child->create != NULL) {
+        free_task(child->create);
+        child->create = NULL;
+    }
+}
+
+// Walk a directory the index vouches for: only subdirectories are visited
+static size_t enumerate_indexed(CopyJob *job, const IndexEntry *cached, DirNode *node) {
+    const IndexEntry *child;
+    size_t src_len = job->src.len, dest_len = job->dest.len;
+    size_t count = index_children(cached, &child);
+
+    for (size_t i = 0; i < count; i++, child++) {
+        if (child->type == INDEX_TYPE_DIR) {
+            if (enumerate_push(job, index_entry_name(child)) != SUCCESS) {
+                record_error(job, job->src.data, ERROR_DIR_OPEN, ENOMEM);
+                continue;
+            }
+            enumerate_subdirectory(job, node);
+            path_buf_pop(&job->src, src_len);
+            path_buf_pop(&job->dest, dest_len);
+            continue;
+        }
+
+        index_keep(child);
+        if (job->stats != NULL) {
+            job->stats->skipped_files++;
+            job->stats->skipped_bytes += child->size;
+        }
+    }
+
+    return count;
+}
+
+// Hand one entry of a directory to the pool; the walk's paths name it
+static void enumerate_entry(CopyJob *job, int dir_fd, const DirEntry *entry, DirNode *node,
+                            UringBatch **batch) {
+    const char *src_file = job->src.data;
+    const char *dest_file = job->dest.data;
+    struct stat st;
+    int have_stat;
+
+    // A move takes symlinks as they are instead of following them
+    int type;
+    if (job->move && walk_entry_is_symlink(dir_fd, entry->d_name, entry->d_type)) {
+        type = WALK_FILE;
+        have_stat = 0;
+    } else {
+        type = walk_entry_type(dir_fd, entry->d_name, entry->d_type, &st, &have_stat);
+    }
+    if (type == WALK_ERROR) {
+        record_error(job, src_file, ERROR_FILE_OPEN, errno);
+        return;
+    }
+
+    const char *relative = filter_relative_path(src_file, job->root_len);
+    if (type == WALK_DIR) {
+        // Excluded subtrees are never opened
+        if (filter_wants_dir(job->filter, relative)) {
+            enumerate_subdirectory(job, node);
+        }
+        return;
+    }
+
+    if (!filter_wants_file(job->filter, relative)) {
+        return;
+    }
+    // Batches cannot tell which sources a move may unlink
+    int batched = uring_copy_enabled() && !job->move;
+    if (batched && !have_stat) {
+        STATS_TIMED(STATS_WALK, have_stat = fstatat(dir_fd, entry->d_name, &st, 0) == 0);
+    }
+    if (batched && have_stat && uring_wants_file(&st)) {
+        if (*batch == NULL) {
+            *batch = uring_batch_new();
+        }
+        if (*batch != NULL && uring_batch_add(*batch, src_file, dest_file, &st) == SUCCESS) {
+            return;
+        }
+    }
+    CopyTask *task = new_task(job, src_file, dest_file, NULL, node);
+    if (task == NULL) {
+        record_error(job, src_file, ERROR_FILE_OPEN, ENOMEM);
+        return;
+    }
+    // The walk's stat saves the worker an fstat()
+    if (have_stat) {
+        task->st = st;
+        task->have_stat = 1;
+    }
+    activate_node(job, node);
+    schedule_task(job, task);
+}
+
+// Producer: walk the source tree and hand every entry to the pool; the
+// walk's paths name the directory
+static void enumerate_directory(CopyJob *job, DirNode *node) {
+    int dir_fd;
+    DirBatch entries = { NULL, 0 };
+    UringBatch *batch = NULL;
+    struct stat dir_st;
+    size_t children = 0;
+    size_t src_len = job->src.len, dest_len = job->dest.len;
+    ArenaMark mark = arena_mark(&job->arena);
+
+    STATS_TIMED(STATS_WALK, dir_fd = open(job->src.data, O_RDONLY | O_DIRECTORY));
+    if (dir_fd < 0) {
+        record_error(job, job->src.data, ERROR_DIR_OPEN, errno);
+        return;
+    }
+
+    // Directory state before reading it, so later changes show up next run
+    int filtered = filter_active(job->filter);
+    int indexed = index_active() && !filtered && fstat(dir_fd, &dir_st) == 0;
+    const IndexEntry *cached = indexed ? trusted_dir(job->src.data, &dir_st, job->dest.data) : NULL;
+
+    if (cached != NULL) {
+        children = enumerate_indexed(job, cached, node);
+    } else if (dir_batch_read(dir_fd, &job->arena, &entries) != SUCCESS) {
+        record_error(job, job->src.data, ERROR_DIR_OPEN, errno);
+        indexed = 0;
+    }
+    // Tasks go out in walk order, so workers pick files up in disk order
+    dir_batch_sort(&entries, dir_fd, get_copy_options()->order);
+
+    for (size_t i = 0; i < entries.count; i++) {
+        if (enumerate_push(job, entries.entries[i]->d_name) != SUCCESS) {
+            record_error(job, job->src.data, ERROR_DIR_OPEN, ENOMEM);
+            continue;
+        }
+        enumerate_entry(job, dir_fd, entries.entries[i], node, &batch);
+        path_buf_pop(&job->src, src_len);
+        path_buf_pop(&job->dest, dest_len);
+        children++;
+
+        if (batch != NULL && uring_batch_full(batch)) {
+            schedule_batch(job, &batch, job->src.data, job->dest.data, node);
+        }
+    }
+    arena_release(&job->arena, mark);
+
+    // Children that fail are not recorded, which keeps the entry incomplete
+    if (indexed) {
+        index_record_dir(job->src.data, &dir_st, children);
+    }
+
+    close(dir_fd);
+
+    schedule_batch(job, &batch, job->src.data, job->dest.data, node);
+    uring_batch_free(batch);
+}
+
+// Print collected failures and return the first error code
+static int report_errors(CopyJob *job) {
+    int first = SUCCESS;
+
+    if (job->error_count > 0) {
+        fprintf(stderr, "\n%ld error(s) during parallel copy:\n", job->error_count);
+    }
+
+    CopyError *error = job->errors;
+    while (error != NULL) {
+        CopyError *next = error->next;
+        if (first == SUCCESS) {
+            first = error->code;
+        }
+        errno = error->saved_errno;
+        print_error(error->code, error->path);
+        free(error->path);
+        free(error);
+        error = next;
+    }
+
+    return first;
+}
+
+// Set up a job and queue the whole tree on pool (the caller enumerates)
+static int start_job(CopyJob *job, ThreadPool *pool, const char *src_path,
+                     const char *dest_path, const CopyFilter *filter, int move,
+                     CopyStats *stats) {
+    int result;
+
+    // Create destination root before any worker needs it
+    result = create_directory(dest_path);
+    if (result != SUCCESS) {
+        return result;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->pool = pool;
+    job->stats = stats;
+    job->flow = rate_bind(NULL);
+    rate_bind(job->flow);
+    job->filter = filter;
+    job->root_len = strlen(src_path);
+    // With include patterns, subdirectories appear only around matching files
+    job->lazy = filter_selects_files(filter);
+    job->move = move;
+    // Moves keep inodes apart: a source hardlink is unlinked as it is moved.
+    // Coded copies are renamed per file, so there is nothing to link to.
+    job->links = move || compress_active() ? NULL : dedup_table_new(get_copy_options()->dedup);
+    job->errors_tail = &job->errors;
+    pthread_mutex_init(&job->lock, NULL);
+
+    DirNode *root = new_dir_node(job, NULL, DIR_READY);
+    if (root == NULL) {
+        dedup_table_free(job->links);
+        pthread_mutex_destroy(&job->lock);
+        return ERROR_DIR_CREATE;
+    }
+    if (stats != NULL) {
+        stats->total_dirs++;
+    }
+
+    printf("Copying directory (%d jobs): %s -> %s\n",
+           thread_pool_size(pool), src_path, dest_path);
+
+    CopyStats *outer = stats_bind(stats);
+
+    delete_extraneous(job, src_path, dest_path);
+
+    if (path_buf_init(&job->src, src_path) == 0 && path_buf_init(&job->dest, dest_path) == 0) {
+        enumerate_directory(job, root);
+    } else {
+        record_error(job, src_path, ERROR_DIR_OPEN, ENOMEM);
+    }
+    path_buf_free(&job->src);
+    path_buf_free(&job->dest);
+    arena_free(&job->arena);
+
+    stats_bind(outer);
+    return SUCCESS;
+}
+
+// Release a job whose tasks have all run; returns its first error code
+static int finish_job(CopyJob *job) {
+    int result;
+
+    while (job->nodes != NULL) {
+        DirNode *next = job->nodes->all_next;
+        pthread_mutex_destroy(&job->nodes->lock);
+        free(job->nodes);
+        job->nodes = next;
+    }
+
+    result = report_errors(job);
+    dedup_table_free(job->links);
+    pthread_mutex_destroy(&job->lock);
+    return result;
+}
+
+static int run_parallel_copy(const char *src_path, const char *dest_path,
+                             const CopyFilter *filter, int move, CopyStats *stats, int jobs) {
+    CopyJob job;
+    ThreadPool *pool;
+    int result;
+
+    pool = thread_pool_create(jobs);
+    if (pool == NULL) {
+        return ERROR_DIR_OPEN;
+    }
+
+    result = start_job(&job, pool, src_path, dest_path, filter, move, stats);
+
+    thread_pool_wait(pool);
+    thread_pool_destroy(pool);
+    if (result != SUCCESS) {
+        return result;
+    }
+    if (stats != NULL) {
+        display_tree_progress(stats, 1);
+    }
+    finish_progress();
+
+    result = finish_job(&job);
+    if (result == SUCCESS) {
+        printf("Directory copied successfully: %s\n", dest_path);
+    }
+
+    return result;
+}
+
+int parallel_copy_directory(const char *src_path, const char *dest_path,
+                            const CopyFilter *filter, CopyStats *stats, int jobs) {
+    return run_parallel_copy(src_path, dest_path, filter, 0, stats, jobs);
+}
+
+CopyJob *parallel_copy_start(ThreadPool *pool, const char *src_path, const char *dest_path,
+                             const CopyFilter *filter, CopyStats *stats, int *result) {
+    CopyJob *job = malloc(sizeof(CopyJob));
+
+    if (job == NULL) {
+        *result = ERROR_DIR_CREATE;
+        return NULL;
+    }
+    *result = start_job(job, pool, src_path, dest_path, filter, 0, stats);
+    if (*result != SUCCESS) {
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+int parallel_copy_finish(CopyJob *job) {
+    int result = finish_job(job);
+    free(job);
+    return result;
+}
+
+int parallel_move_directory(const char *src_path, const char *dest_path,
+                            CopyStats *stats, int jobs) {
+    return run_parallel_copy(src_path, dest_path, NULL, 1, stats, jobs);
+}
@@ -0,0 +1,303 @@
+#include "parallel_hash.h"
+#include "hash.h"
+#include "path_arena.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include <stdatomic.h>
+
+// A tree hash in progress: workers claim chunks until none are left
+typedef struct {
+    int fd;
+    HashAlgorithm algorithm;
+    off_t size;
+    size_t chunks;
+    size_t digest_len;
+    unsigned char *nodes;       // One digest per chunk, reduced in place to the root
+    atomic_size_t next;         // Next chunk to claim
+    atomic_int result;          // First error, SUCCESS if none
+} TreeHash;
+
+static void hash_chunks(void *arg) {
+    TreeHash *tree = arg;
+    const unsigned char leaf = TREE_HASH_LEAF;
+    char *buffer = io_buffer_alloc(TREE_HASH_CHUNK);
+    size_t i;
+
+    if (buffer == NULL) {
+        atomic_store(&tree->result, ERROR_FILE_READ);
+        return;
+    }
+
+    while ((i = atomic_fetch_add(&tree->next, 1)) < tree->chunks &&
+           atomic_load(&tree->result) == SUCCESS) {
+        off_t offset = (off_t)i * TREE_HASH_CHUNK;
+        size_t want = tree->size - offset < TREE_HASH_CHUNK ? (size_t)(tree->size - offset)
+                                                            : TREE_HASH_CHUNK;
+        HashContext ctx;
+        ssize_t got;
+
+        // A file that shrank while being hashed comes up short
+        STATS_TIMED(STATS_READ, got = pread_full(tree->fd, buffer, want, offset));
+        if (got != (ssize_t)want) {
+            atomic_store(&tree->result, ERROR_FILE_READ);
+            break;
+        }
+        hash_init(&ctx, tree->algorithm);
+        hash_update(&ctx, &leaf, 1);
+        STATS_TIMED(STATS_HASH, hash_update(&ctx, buffer, want));
+        hash_final(&ctx, tree->nodes + i * tree->digest_len);
+    }
+
+    free(buffer);
+}
+
+// Pair up each level until only the root is left
+static void reduce_tree(TreeHash *tree) {
+    const unsigned char node = TREE_HASH_NODE;
+    size_t len = tree->digest_len;
+    size_t count = tree->chunks;
+
+    while (count > 1) {
+        for (size_t j = 0; j < count / 2; j++) {
+            HashContext ctx;
+            hash_init(&ctx, tree->algorithm);
+            hash_update(&ctx, &node, 1);
+            hash_update(&ctx, tree->nodes + 2 * j * len, 2 * len);
+            hash_final(&ctx, tree->nodes + j * len);
+        }
+        if (count % 2 != 0) {
+            memmove(tree->nodes + (count / 2) * len, tree->nodes + (count - 1) * len, len);
+        }
+        count = (count + 1) / 2;
+    }
+}
+
+int tree_hash_fd(int fd, HashAlgorithm algorithm, int jobs, unsigned char *digest, size_t *len) {
+    TreeHash tree;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return ERROR_FILE_READ;
+    }
+
+    tree.fd = fd;
+    tree.algorithm = algorithm;
+    tree.size = st.st_size;
+    tree.chunks = st.st_size > 0 ? (size_t)((st.st_size + TREE_HASH_CHUNK - 1) / TREE_HASH_CHUNK) : 1;
+    tree.digest_len = hash_digest_size(algorithm);
+    tree.nodes = malloc(tree.chunks * tree.digest_len);
+    atomic_init(&tree.next, 0);
+    atomic_init(&tree.result, SUCCESS);
+    if (tree.nodes == NULL) {
+        return ERROR_FILE_READ;
+    }
+
+    // One task per worker; each keeps claiming chunks, so a slow read
+    // holds up only its own chunk
+    int workers = jobs < (int)tree.chunks ? jobs : (int)tree.chunks;
+    ThreadPool *pool = workers > 1 ? thread_pool_create(workers) : NULL;
+    if (pool != NULL) {
+        for (int w = 0; w < workers; w++) {
+            if (thread_pool_submit(pool, hash_chunks, &tree) != 0) {
+                break;
+            }
+        }
+        thread_pool_wait(pool);
+        thread_pool_destroy(pool);
+    }
+    // Whatever the pool did not get to (or all of it without one)
+    hash_chunks(&tree);
+
+    int result = atomic_load(&tree.result);
+    if (result == SUCCESS) {
+        reduce_tree(&tree);
+        memcpy(digest, tree.nodes, tree.digest_len);
+        *len = tree.digest_len;
+    }
+    free(tree.nodes);
+    return result;
+}
+
+int tree_hash_file(const char *filepath, HashAlgorithm algorithm, int jobs, char *hex) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    size_t len;
+    int fd = open(filepath, O_RDONLY);
+
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    int result = tree_hash_fd(fd, algorithm, jobs, digest, &len);
+    close(fd);
+    if (result == SUCCESS) {
+        hash_to_hex(digest, len, hex);
+    }
+    return result;
+}
+
+void print_checksum_line(FILE *out, const char *hex, const char *path) {
+    if (strpbrk(path, "\\\n") == NULL) {
+        fprintf(out, "%s  %s\n", hex, path);
+        return;
+    }
+
+    fprintf(out, "\\%s  ", hex);
+    for (const char *p = path; *p != '\0'; p++) {
+        if (*p == '\\') {
+            fputs("\\\\", out);
+        } else if (*p == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('\n', out);
+}
+
+// One file of a directory manifest
+typedef struct {
+    char *path;
+    HashAlgorithm algorithm;
+    int result;
+    int saved_errno;
+    char hex[HASH_MAX_HEX];
+} ManifestEntry;
+
+// Files found so far; entries are allocated one by one, so tasks keep
+// valid pointers while the array grows
+typedef struct {
+    ThreadPool *pool;
+    HashAlgorithm algorithm;
+    ManifestEntry **entries;
+    size_t count;
+    size_t capacity;
+    int walk_result;
+} Manifest;
+
+static void hash_entry(void *arg) {
+    ManifestEntry *entry = arg;
+
+    entry->result = calculate_checksum(entry->path, entry->algorithm, entry->hex);
+    entry->saved_errno = errno;
+}
+
+static void add_file(Manifest *manifest, const char *path) {
+    ManifestEntry *entry;
+
+    if (manifest->count == manifest->capacity) {
+        size_t capacity = manifest->capacity > 0 ? manifest->capacity * 2 : 1024;
+        ManifestEntry **grown = realloc(manifest->entries, capacity * sizeof(ManifestEntry *));
+        if (grown == NULL) {
+            manifest->walk_result = ERROR_FILE_READ;
+            return;
+        }
+        manifest->entries = grown;
+        manifest->capacity = capacity;
+    }
+
+    entry = calloc(1, sizeof(ManifestEntry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        manifest->walk_result = ERROR_FILE_READ;
+        return;
+    }
+    entry->algorithm = manifest->algorithm;
+    manifest->entries[manifest->count++] = entry;
+
+    if (manifest->pool == NULL || thread_pool_submit(manifest->pool, hash_entry, entry) != 0) {
+        hash_entry(entry);
+    }
+}
+
+// Add the files below path to the manifest; path is restored on return
+static void walk_manifest(Manifest *manifest, PathBuf *path) {
+    DIR *dir = opendir(path->data);
+    struct dirent *entry;
+    size_t len = path->len;
+
+    if (dir == NULL) {
+        print_error(ERROR_DIR_OPEN, path->data);
+        manifest->walk_result = ERROR_DIR_OPEN;
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        int have_stat;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (path_buf_push(path, entry->d_name) != 0) {
+            manifest->walk_result = ERROR_FILE_READ;
+            break;
+        }
+
+        int symlink = walk_entry_is_symlink(dirfd(dir), entry->d_name, entry->d_type);
+        int type = walk_entry_type(dirfd(dir), entry->d_name, entry->d_type, &st, &have_stat);
+        if (type == WALK_DIR && !symlink) {
+            walk_manifest(manifest, path);
+        } else if (type == WALK_FILE &&
+                   (have_stat || fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) &&
+                   S_ISREG(st.st_mode)) {
+            add_file(manifest, path->data);
+        } else if (type == WALK_ERROR && !symlink) {
+            print_error(ERROR_FILE_OPEN, path->data);
+            manifest->walk_result = ERROR_FILE_OPEN;
+        }
+        path_buf_pop(path, len);
+    }
+
+    closedir(dir);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const ManifestEntry *ea = *(const ManifestEntry *const *)a;
+    const ManifestEntry *eb = *(const ManifestEntry *const *)b;
+    return strcmp(ea->path, eb->path);
+}
+
+int checksum_directory(const char *dir_path, HashAlgorithm algorithm, int jobs, FILE *out) {
+    Manifest manifest = { NULL, algorithm, NULL, 0, 0, SUCCESS };
+    PathBuf root;
+    int result;
+
+    // "dir/" and "dir" name the same files
+    if (path_buf_init(&root, dir_path) != 0) {
+        return ERROR_FILE_READ;
+    }
+    while (root.len > 1 && root.data[root.len - 1] == '/') {
+        path_buf_pop(&root, root.len - 1);
+    }
+
+    if (jobs > 1) {
+        manifest.pool = thread_pool_create(jobs);
+    }
+    walk_manifest(&manifest, &root);
+    path_buf_free(&root);
+    if (manifest.pool != NULL) {
+        thread_pool_wait(manifest.pool);
+        thread_pool_destroy(manifest.pool);
+    }
+
+    qsort(manifest.entries, manifest.count, sizeof(ManifestEntry *), compare_entries);
+
+    result = manifest.walk_result;
+    for (size_t i = 0; i < manifest.count; i++) {
+        ManifestEntry *entry = manifest.entries[i];
+        if (entry->result == SUCCESS) {
+            print_checksum_line(out, entry->hex, entry->path);
+        } else {
+            errno = entry->saved_errno;
+            print_error(entry->result, entry->path);
+            if (result == SUCCESS) {
+                result = entry->result;
+            }
+        }
+        free(entry->path);
+        free(entry);
+    }
+    free(manifest.entries);
+
+    return result;
+}
@@ -0,0 +1,334 @@
+#include "path_arena.h"
+#include "stats.h"
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define ARENA_ALIGN 8
+
+// Sort key of entries without a known extent: after every physical offset
+#define NO_EXTENT_KEY (1ULL << 63)
+
+// Record layout of getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int path_buf_reserve(PathBuf *path, size_t len) {
+    if (len < path->cap) {
+        return 0;
+    }
+
+    size_t cap = path->cap > 0 ? path->cap : 256;
+    while (cap <= len) {
+        cap *= 2;
+    }
+    char *grown = realloc(path->data, cap);
+    if (grown == NULL) {
+        return -1;
+    }
+    path->data = grown;
+    path->cap = cap;
+    return 0;
+}
+
+int path_buf_init(PathBuf *path, const char *root) {
+    size_t len = strlen(root);
+
+    path->data = NULL;
+    path->len = 0;
+    path->cap = 0;
+    if (path_buf_reserve(path, len) != 0) {
+        return -1;
+    }
+    memcpy(path->data, root, len + 1);
+    path->len = len;
+    return 0;
+}
+
+int path_buf_push(PathBuf *path, const char *name) {
+    size_t name_len = strlen(name);
+    int slash = path->len > 0 && path->data[path->len - 1] != '/';
+
+    if (path_buf_reserve(path, path->len + slash + name_len) != 0) {
+        return -1;
+    }
+    if (slash) {
+        path->data[path->len++] = '/';
+    }
+    memcpy(path->data + path->len, name, name_len + 1);
+    path->len += name_len;
+    return 0;
+}
+
+void path_buf_pop(PathBuf *path, size_t len) {
+    if (len < path->len) {
+        path->len = len;
+        path->data[len] = '\0';
+    }
+}
+
+void path_buf_free(PathBuf *path) {
+    free(path->data);
+    path->data = NULL;
+    path->len = 0;
+    path->cap = 0;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->top;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // The spare chunk is reused when it fits, so walks that go down
+        // and up a level do not allocate on every directory
+        chunk = arena->spare;
+        arena->spare = NULL;
+        if (chunk == NULL || chunk->size < size) {
+            free(chunk);
+            size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->size = chunk_size;
+        }
+        chunk->used = 0;
+        chunk->prev = arena->top;
+        arena->top = chunk;
+    }
+
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+ArenaMark arena_mark(const Arena *arena) {
+    ArenaMark mark = { arena->top, arena->top != NULL ? arena->top->used : 0 };
+    return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+    while (arena->top != NULL && arena->top != mark.chunk) {
+        ArenaChunk *chunk = arena->top;
+        arena->top = chunk->prev;
+        if (arena->spare == NULL || arena->spare->size < chunk->size) {
+            free(arena->spare);
+            arena->spare = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    if (arena->top != NULL) {
+        arena->top->used = mark.used;
+    }
+}
+
+void arena_free(Arena *arena) {
+    ArenaMark empty = { NULL, 0 };
+
+    arena_release(arena, empty);
+    free(arena->spare);
+    arena->spare = NULL;
+    free(arena->scratch);
+    arena->scratch = NULL;
+}
+
+int parse_walk_order(const char *name, WalkOrder *order) {
+    if (strcmp(name, "directory") == 0) {
+        *order = WALK_ORDER_DIRECTORY;
+    } else if (strcmp(name, "inode") == 0) {
+        *order = WALK_ORDER_INODE;
+    } else if (strcmp(name, "extent") == 0) {
+        *order = WALK_ORDER_EXTENT;
+    } else {
+        return ERROR_INVALID_PATH;
+    }
+    return SUCCESS;
+}
+
+int dir_batch_next(int fd, Arena *arena, DirBatch *batch) {
+    batch->entries = NULL;
+    batch->count = 0;
+
+    // The scratch buffer is reused by every directory of the walk
+    if (arena->scratch == NULL && (arena->scratch = malloc(DIR_BATCH_BUFFER)) == NULL) {
+        return ERROR_DIR_OPEN;
+    }
+
+    // A buffer holding nothing but "." and ".." is not the end yet
+    while (batch->count == 0) {
+        long n;
+        STATS_TIMED(STATS_WALK,
+                    n = syscall(SYS_getdents64, fd, arena->scratch, DIR_BATCH_BUFFER));
+        if (n < 0) {
+            return ERROR_DIR_OPEN;
+        }
+        if (n == 0) {
+            return SUCCESS;
+        }
+
+        size_t count = 0;
+        for (long offset = 0; offset < n;) {
+            const struct linux_dirent64 *entry = (const void *)(arena->scratch + offset);
+            offset += entry->d_reclen;
+            count++;
+        }
+        batch->entries = arena_alloc(arena, count * sizeof(DirEntry *));
+        if (batch->entries == NULL) {
+            errno = ENOMEM;
+            return ERROR_DIR_OPEN;
+        }
+
+        for (long offset = 0; offset < n;) {
+            const struct linux_dirent64 *entry = (const void *)(arena->scratch + offset);
+            offset += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            size_t name_len = strlen(entry->d_name);
+            DirEntry *copy = arena_alloc(arena, sizeof(DirEntry) + name_len + 1);
+            if (copy == NULL) {
+                errno = ENOMEM;
+                return ERROR_DIR_OPEN;
+            }
+            copy->d_ino = (ino_t)entry->d_ino;
+            copy->sort_key = 0;
+            copy->d_type = entry->d_type;
+            memcpy(copy->d_name, entry->d_name, name_len + 1);
+            batch->entries[batch->count++] = copy;
+        }
+    }
+    return SUCCESS;
+}
+
+int dir_batch_read(int fd, Arena *arena, DirBatch *batch) {
+    // Pieces are chained while the count is unknown, then joined
+    typedef struct Piece {
+        struct Piece *next;
+        DirBatch batch;
+    } Piece;
+    Piece *head = NULL, **tail = &head;
+    size_t count = 0;
+
+    batch->entries = NULL;
+    batch->count = 0;
+
+    for (;;) {
+        Piece *piece = arena_alloc(arena, sizeof(Piece));
+        if (piece == NULL) {
+            errno = ENOMEM;
+            return ERROR_DIR_OPEN;
+        }
+        int result = dir_batch_next(fd, arena, &piece->batch);
+        if (result != SUCCESS) {
+            return result;
+        }
+        if (piece->batch.count == 0) {
+            break;
+        }
+        piece->next = NULL;
+        *tail = piece;
+        tail = &piece->next;
+        count += piece->batch.count;
+    }
+
+    // Most directories fit one request and need no joining
+    if (head == NULL || head->next == NULL) {
+        if (head != NULL) {
+            *batch = head->batch;
+        }
+        return SUCCESS;
+    }
+    batch->entries = arena_alloc(arena, count * sizeof(DirEntry *));
+    if (batch->entries == NULL) {
+        errno = ENOMEM;
+        return ERROR_DIR_OPEN;
+    }
+    for (Piece *piece = head; piece != NULL; piece = piece->next) {
+        memcpy(batch->entries + batch->count, piece->batch.entries,
+               piece->batch.count * sizeof(DirEntry *));
+        batch->count += piece->batch.count;
+    }
+    return SUCCESS;
+}
+
+// Physical offset of a file's first extent; *supported is cleared when
+// the filesystem has no FIEMAP
+static uint64_t first_extent(int dir_fd, const DirEntry *entry, int *supported) {
+    union {
+        struct fiemap map;
+        char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+    uint64_t key = NO_EXTENT_KEY | (uint64_t)entry->d_ino;
+    int fd;
+
+    // Only regular files have data to find; opening a FIFO would block
+    if (entry->d_type != DT_REG) {
+        return key;
+    }
+    STATS_TIMED(STATS_WALK, fd = openat(dir_fd, entry->d_name,
+                                        O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC));
+    if (fd < 0) {
+        return key;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int result;
+    STATS_TIMED(STATS_WALK, result = ioctl(fd, FS_IOC_FIEMAP, &request.map));
+    if (result != 0) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY) {
+            *supported = 0;
+        }
+    } else if (request.map.fm_mapped_extents > 0 &&
+               !(request.map.fm_extents[0].fe_flags &
+                 (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        // Delayed allocations and inline data have no offset worth sorting by
+        key = request.map.fm_extents[0].fe_physical & ~NO_EXTENT_KEY;
+    }
+    close(fd);
+    return key;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const DirEntry *ea = *(const DirEntry *const *)a;
+    const DirEntry *eb = *(const DirEntry *const *)b;
+
+    if (ea->sort_key != eb->sort_key) {
+        return ea->sort_key < eb->sort_key ? -1 : 1;
+    }
+    return ea->d_ino < eb->d_ino ? -1 : ea->d_ino > eb->d_ino;
+}
+
+void dir_batch_sort(DirBatch *batch, int dir_fd, WalkOrder order) {
+    int supported = 1;
+
+    if (order == WALK_ORDER_DIRECTORY || batch->count < 2) {
+        return;
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        DirEntry *entry = batch->entries[i];
+        entry->sort_key = (uint64_t)entry->d_ino;
+        if (order == WALK_ORDER_EXTENT && supported) {
+            entry->sort_key = first_extent(dir_fd, entry, &supported);
+        }
+    }
+    // Without FIEMAP the inode number is the best guess for every entry
+    if (!supported) {
+        for (size_t i = 0; i < batch->count; i++) {
+            batch->entries[i]->sort_key = (uint64_t)batch->entries[i]->d_ino;
+        }
+    }
+
+    qsort(batch->entries, batch->count, sizeof(DirEntry *), compare_entries);
+}
@@ -0,0 +1,362 @@
+#include "rate_limit.h"
+#include "stats.h"
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+// ioprio_set() encoding (linux/ioprio.h)
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+// Largest --limit-file read
+#define LIMIT_FILE_SIZE 256
+
+static struct {
+    atomic_int active;          // Requests are accounted
+    atomic_int flow_count;      // Flows sharing the limits, as last counted
+    _Atomic double byte_rate;   // Bytes per second, 0 unlimited
+    _Atomic double op_rate;     // Requests per second, 0 unlimited
+
+    pthread_mutex_t lock;
+    RateFlow shared;            // Flow of threads that bound none
+    RateFlow *flows;            // Flows that moved data recently
+
+    // --limit-file and what it held when last read
+    const char *file;
+    struct timespec file_mtime;
+    off_t file_size;
+    long checked_ns;
+} limits = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Set by SIGHUP: read the limit file on the next request
+static volatile sig_atomic_t reload_requested = 0;
+
+// Flow this thread's I/O is charged to, NULL for the shared one
+static _Thread_local RateFlow *bound_flow = NULL;
+
+int parse_rate(const char *arg, unsigned long long *rate) {
+    char *end;
+    unsigned long long value;
+    unsigned long long scale = 1;
+
+    if (arg == NULL || !isdigit((unsigned char)*arg)) {
+        return ERROR_INVALID_PATH;
+    }
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno != 0) {
+        return ERROR_INVALID_PATH;
+    }
+    switch (toupper((unsigned char)*end)) {
+        case 'K': scale = 1ULL << 10; end++; break;
+        case 'M': scale = 1ULL << 20; end++; break;
+        case 'G': scale = 1ULL << 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || (value != 0 && value > ULLONG_MAX / scale)) {
+        return ERROR_INVALID_PATH;
+    }
+    *rate = value * scale;
+    return SUCCESS;
+}
+
+int rate_set_ionice(const char *arg) {
+    static const struct { const char *name; int ioclass; } classes[] = {
+        { "idle", IOPRIO_CLASS_IDLE },
+        { "best-effort", IOPRIO_CLASS_BE },
+        { "realtime", IOPRIO_CLASS_RT },
+    };
+    const char *colon = strchr(arg, ':');
+    size_t name_len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+    int ioclass = -1;
+    int level = 4;          // The kernel's default best-effort level
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) == name_len &&
+            strncmp(classes[i].name, arg, name_len) == 0) {
+            ioclass = classes[i].ioclass;
+        }
+    }
+    if (ioclass < 0) {
+        return ERROR_INVALID_PATH;
+    }
+    if (colon != NULL) {
+        // The idle class has no levels
+        if (ioclass == IOPRIO_CLASS_IDLE || colon[1] < '0' || colon[1] > '7' ||
+            colon[2] != '\0') {
+            return ERROR_INVALID_PATH;
+        }
+        level = colon[1] - '0';
+    }
+    if (ioclass == IOPRIO_CLASS_IDLE) {
+        level = 0;
+    }
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                (ioclass << IOPRIO_CLASS_SHIFT) | level) != 0) {
+        return ERROR_FILE_OPEN;
+    }
+    return SUCCESS;
+}
+
+static void format_rate(char *text, size_t size, double rate, double scale, const char *unit) {
+    if (rate <= 0) {
+        snprintf(text, size, "unlimited");
+    } else {
+        snprintf(text, size, "%.1f %s/s", rate / scale, unit);
+    }
+}
+
+// Read "RATE [IOPS]" from the limit file; caller holds limits.lock or is
+// still single-threaded
+static int load_limit_file(int report) {
+    char text[LIMIT_FILE_SIZE];
+    char rate_text[LIMIT_FILE_SIZE];
+    char iops_text[LIMIT_FILE_SIZE] = "0";
+    unsigned long long byte_rate;
+    unsigned long long op_rate;
+    struct stat st;
+    ssize_t n;
+    int fd = open(limits.file, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+    if (fstat(fd, &st) != 0 || (n = read(fd, text, sizeof(text) - 1)) < 0) {
+        close(fd);
+        return ERROR_FILE_OPEN;
+    }
+    close(fd);
+    text[n] = '\0';
+
+    if (sscanf(text, "%255s %255s", rate_text, iops_text) < 1 ||
+        parse_rate(rate_text, &byte_rate) != SUCCESS ||
+        parse_rate(iops_text, &op_rate) != SUCCESS) {
+        if (report) {
+            fprintf(stderr, "Warning: ignoring malformed limit file %s\n", limits.file);
+        }
+        // Remember it anyway, so it is not reported again until it changes
+        limits.file_mtime = st.st_mtim;
+        limits.file_size = st.st_size;
+        return ERROR_INVALID_PATH;
+    }
+
+    limits.file_mtime = st.st_mtim;
+    limits.file_size = st.st_size;
+    if (report && ((double)byte_rate != atomic_load(&limits.byte_rate) ||
+                   (double)op_rate != atomic_load(&limits.op_rate))) {
+        char bytes[64];
+        char ops[64];
+        format_rate(bytes, sizeof(bytes), (double)byte_rate, 1024.0 * 1024.0, "MB");
+        format_rate(ops, sizeof(ops), (double)op_rate, 1.0, "requests");
+        fprintf(stderr, "\nRate limit changed: %s, %s\n", bytes, ops);
+    }
+    atomic_store(&limits.byte_rate, (double)byte_rate);
+    atomic_store(&limits.op_rate, (double)op_rate);
+    return SUCCESS;
+}
+
+// Pick up a changed limit file; caller holds limits.lock
+static void check_limit_file(long now) {
+    struct stat st;
+
+    if (limits.file == NULL ||
+        (!reload_requested && now - limits.checked_ns < RATE_RELOAD_NS)) {
+        return;
+    }
+    limits.checked_ns = now;
+
+    if (reload_requested) {
+        reload_requested = 0;
+    } else if (stat(limits.file, &st) != 0 ||
+               (st.st_mtim.tv_sec == limits.file_mtime.tv_sec &&
+                st.st_mtim.tv_nsec == limits.file_mtime.tv_nsec &&
+                st.st_size == limits.file_size)) {
+        // Unchanged, or gone for the moment: keep the limits in force
+        return;
+    }
+    load_limit_file(1);
+}
+
+static void request_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+int rate_limit_start(void) {
+    const CopyOptions *opts = get_copy_options();
+
+    atomic_store(&limits.byte_rate, (double)opts->bwlimit);
+    atomic_store(&limits.op_rate, (double)opts->iops_limit);
+    limits.file = opts->limit_file;
+
+    if (limits.file != NULL) {
+        struct sigaction action;
+
+        if (load_limit_file(0) != SUCCESS) {
+            return ERROR_FILE_OPEN;
+        }
+        limits.checked_ns = monotonic_ns();
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_reload;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGHUP, &action, NULL);
+    }
+
+    atomic_store(&limits.active, opts->bwlimit > 0 || opts->iops_limit > 0 ||
+                                 limits.file != NULL);
+    return SUCCESS;
+}
+
+int rate_limit_active(void) {
+    return atomic_load(&limits.active);
+}
+
+RateFlow *rate_bind(RateFlow *flow) {
+    RateFlow *previous = bound_flow;
+    bound_flow = flow;
+    return previous;
+}
+
+static void unlink_flow(RateFlow *flow) {
+    for (RateFlow **link = &limits.flows; *link != NULL; link = &(*link)->next) {
+        if (*link == flow) {
+            *link = flow->next;
+            break;
+        }
+    }
+    flow->next = NULL;
+    flow->linked = 0;
+}
+
+void rate_flow_release(RateFlow *flow) {
+    pthread_mutex_lock(&limits.lock);
+    if (flow->linked) {
+        unlink_flow(flow);
+    }
+    pthread_mutex_unlock(&limits.lock);
+}
+
+// Count the flows sharing the limits, dropping idle ones; caller holds
+// limits.lock
+static int count_flows(long now) {
+    int count = 0;
+    RateFlow **link = &limits.flows;
+
+    while (*link != NULL) {
+        RateFlow *flow = *link;
+        if (now - flow->last_ns > RATE_IDLE_NS) {
+            *link = flow->next;
+            flow->next = NULL;
+            flow->linked = 0;
+        } else {
+            count++;
+            link = &flow->next;
+        }
+    }
+    atomic_store(&limits.flow_count, count);
+    return count > 0 ? count : 1;
+}
+
+size_t rate_limit_request(size_t want) {
+    double byte_rate;
+    double share;
+    size_t limit;
+    int count;
+
+    if (!atomic_load(&limits.active) ||
+        (byte_rate = atomic_load(&limits.byte_rate)) <= 0) {
+        return want;
+    }
+    count = atomic_load(&limits.flow_count);
+    share = byte_rate / (count > 0 ? count : 1);
+
+    limit = (size_t)(share * RATE_SLICE_NS / 1e9);
+    limit -= limit % RATE_MIN_REQUEST;
+    if (limit < RATE_MIN_REQUEST) {
+        limit = RATE_MIN_REQUEST;
+    }
+    return want < limit ? want : limit;
+}
+
+// Add the tokens earned since the last refill, up to RATE_BURST_NS worth
+static double refill(double tokens, double rate, double elapsed_ns, double burst) {
+    if (rate <= 0) {
+        return 0;
+    }
+    tokens += rate * elapsed_ns / 1e9;
+    return tokens < burst ? tokens : burst;
+}
+
+void rate_limit_account(size_t bytes) {
+    RateFlow *flow;
+    double byte_share;
+    double op_share;
+    double wait_ns = 0;
+    long now;
+    int count;
+
+    if (!atomic_load(&limits.active)) {
+        return;
+    }
+    flow = bound_flow != NULL ? bound_flow : &limits.shared;
+    now = monotonic_ns();
+
+    pthread_mutex_lock(&limits.lock);
+    check_limit_file(now);
+
+    // A flow coming back keeps its debt, so idling cannot forgive it
+    if (!flow->linked) {
+        if (flow->refill_ns == 0) {
+            flow->refill_ns = now;
+        }
+        flow->next = limits.flows;
+        limits.flows = flow;
+        flow->linked = 1;
+    }
+    flow->last_ns = now;
+    count = count_flows(now);
+
+    byte_share = atomic_load(&limits.byte_rate) / count;
+    op_share = atomic_load(&limits.op_rate) / count;
+    flow->bytes = refill(flow->bytes, byte_share, (double)(now - flow->refill_ns),
+                         byte_share * RATE_BURST_NS / 1e9);
+    flow->ops = refill(flow->ops, op_share, (double)(now - flow->refill_ns),
+                       op_share * RATE_BURST_NS / 1e9 + 1);
+    flow->refill_ns = now;
+
+    if (byte_share > 0) {
+        flow->bytes -= (double)bytes;
+        if (flow->bytes < 0) {
+            wait_ns = -flow->bytes / byte_share * 1e9;
+        }
+    }
+    if (op_share > 0) {
+        flow->ops -= 1;
+        if (flow->ops < 0 && -flow->ops / op_share * 1e9 > wait_ns) {
+            wait_ns = -flow->ops / op_share * 1e9;
+        }
+    }
+    // A flow asleep in its debt is still busy
+    flow->last_ns = now + (long)wait_ns;
+    pthread_mutex_unlock(&limits.lock);
+
+    if (wait_ns > 0) {
+        struct timespec delay = {
+            .tv_sec = (time_t)(wait_ns / 1e9),
+            .tv_nsec = (long)wait_ns % 1000000000L
+        };
+        STATS_TIMED(STATS_THROTTLE, {
+            while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+            }
+        });
+    }
+}
@@ -0,0 +1,568 @@
+#include "resume.h"
+#include "stats.h"
+#include <inttypes.h>
+#include <pthread.h>
+
+// Record types
+#define RECORD_DONE 'D'         // D size mtime_sec mtime_nsec len:path
+#define RECORD_PARTIAL 'P'      // P offset size mtime_sec mtime_nsec len:path
+
+// Latest record of one path in the loaded journal
+typedef struct {
+    const char *key;            // Points into the loaded journal text
+    size_t key_len;
+    char type;                  // RECORD_DONE or RECORD_PARTIAL, 0 for an empty slot
+    int64_t offset;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} ResumeEntry;
+
+static struct {
+    int active;
+    int fd;
+    char *file;
+    char *src_root;             // Prefix of the paths callers pass in
+    size_t src_root_len;
+    int failed;                 // A record could not be written
+
+    // Journal of the earlier run: its text and a hash table over it
+    char *text;
+    ResumeEntry *entries;
+    size_t capacity;            // Power of two, 0 when empty
+
+    // Records waiting to be appended
+    pthread_mutex_t lock;
+    char buffer[RESUME_BUFFER];
+    size_t buffered;
+} journal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// File being copied on this thread, NULL when not checkpointing
+static _Thread_local ResumeFile *active_file = NULL;
+
+void resume_default_journal(const char *dest_root, char *path, size_t size) {
+    size_t len = strlen(dest_root);
+
+    // "dest/" and "dest" share a journal
+    while (len > 1 && dest_root[len - 1] == '/') {
+        len--;
+    }
+    snprintf(path, size, "%.*s.filecopy-resume", (int)len, dest_root);
+}
+
+// Absolute form of a root, so a run from another directory still matches.
+// A destination the first run has yet to create resolves through its
+// parent, giving the name later runs see once it exists.
+static char *resolve_root(const char *path) {
+    char *resolved = realpath(path, NULL);
+    size_t len = strlen(path);
+    const char *name;
+    char *parent;
+    char *joined;
+
+    if (resolved != NULL || errno != ENOENT) {
+        return resolved != NULL ? resolved : strdup(path);
+    }
+
+    // "dest/" names the same root as "dest"
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    name = memrchr(path, '/', len);
+    if (name == NULL) {
+        parent = realpath(".", NULL);
+        name = path;
+    } else {
+        char *dir = strndup(path, name > path ? (size_t)(name - path) : 1);
+        parent = dir != NULL ? realpath(dir, NULL) : NULL;
+        free(dir);
+        name++;
+    }
+    if (parent == NULL) {
+        return strdup(path);
+    }
+
+    size_t name_len = len - (size_t)(name - path);
+    size_t parent_len = strlen(parent);
+    joined = malloc(parent_len + name_len + 2);
+    if (joined != NULL) {
+        // The root directory is the only parent that already ends in '/'
+        int slash = parent_len > 0 && parent[parent_len - 1] != '/';
+        memcpy(joined, parent, parent_len);
+        if (slash) {
+            joined[parent_len] = '/';
+        }
+        memcpy(joined + parent_len + slash, name, name_len);
+        joined[parent_len + slash + name_len] = '\0';
+    }
+    free(parent);
+    return joined;
+}
+
+// FNV-1a over a relative path
+static uint64_t key_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Slot holding key, or the empty slot it belongs in
+static ResumeEntry *find_slot(ResumeEntry *entries, size_t capacity, const char *key, size_t len) {
+    size_t i = key_hash(key, len) & (capacity - 1);
+
+    while (entries[i].type != 0 &&
+           (entries[i].key_len != len || memcmp(entries[i].key, key, len) != 0)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+// Add or replace the record of a path; later records win
+static int table_put(const ResumeEntry *entry, size_t *count) {
+    if ((*count + 1) * 2 > journal.capacity) {
+        size_t capacity = journal.capacity > 0 ? journal.capacity * 2 : 1024;
+        ResumeEntry *entries = calloc(capacity, sizeof(ResumeEntry));
+        if (entries == NULL) {
+            return ERROR_FILE_READ;
+        }
+        for (size_t i = 0; i < journal.capacity; i++) {
+            const ResumeEntry *e = &journal.entries[i];
+            if (e->type != 0) {
+                *find_slot(entries, capacity, e->key, e->key_len) = *e;
+            }
+        }
+        free(journal.entries);
+        journal.entries = entries;
+        journal.capacity = capacity;
+    }
+
+    ResumeEntry *slot = find_slot(journal.entries, journal.capacity, entry->key, entry->key_len);
+    *count += slot->type == 0;
+    *slot = *entry;
+    return SUCCESS;
+}
+
+// Record of path from the earlier run, NULL if there is none
+static const ResumeEntry *find_entry(const char *key, size_t len) {
+    if (journal.capacity == 0) {
+        return NULL;
+    }
+    const ResumeEntry *entry = find_slot(journal.entries, journal.capacity, key, len);
+    return entry->type != 0 ? entry : NULL;
+}
+
+// Path relative to the source root, or NULL if path is outside it
+static const char *resume_key(const char *path, size_t *len) {
+    if (strncmp(path, journal.src_root, journal.src_root_len) != 0) {
+        return NULL;
+    }
+    path += journal.src_root_len;
+    if (*path != '/' && *path != '\0') {
+        return NULL;
+    }
+    while (*path == '/') {
+        path++;
+    }
+    *len = strlen(path);
+    return path;
+}
+
+// Read a decimal number followed by term; returns 0 on malformed text
+static int parse_number(const char **p, const char *end, int64_t *value, char term) {
+    const char *s = *p;
+    int negative = 0;
+    int64_t v = 0;
+
+    if (s < end && *s == '-') {
+        negative = 1;
+        s++;
+    }
+    if (s >= end || *s < '0' || *s > '9') {
+        return 0;
+    }
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (v > (INT64_MAX - 9) / 10) {
+            return 0;
+        }
+        v = v * 10 + (*s++ - '0');
+    }
+    if (s >= end || *s != term) {
+        return 0;
+    }
+    *value = negative ? -v : v;
+    *p = s + 1;
+    return 1;
+}
+
+// Read "len:bytes"; returns 0 on malformed text
+static int parse_string(const char **p, const char *end, const char **s, size_t *len) {
+    int64_t n;
+
+    if (!parse_number(p, end, &n, ':') || n < 0 || n > end - *p) {
+        return 0;
+    }
+    *s = *p;
+    *len = (size_t)n;
+    *p += n;
+    return 1;
+}
+
+// Parse the journal text; returns the length of its valid prefix, 0 if
+// it is not a journal of these roots
+static size_t parse_journal(const char *text, size_t size, const char *src_id,
+                            const char *dest_id) {
+    const char *p = text, *end = text + size;
+    const char *src, *dest;
+    size_t src_len, dest_len, count = 0;
+    size_t magic_len = strlen(RESUME_MAGIC);
+
+    if (size <= magic_len || memcmp(p, RESUME_MAGIC " ", magic_len + 1) != 0) {
+        return 0;
+    }
+    p += magic_len + 1;
+    if (!parse_string(&p, end, &src, &src_len) || p >= end || *p++ != ' ' ||
+        !parse_string(&p, end, &dest, &dest_len) || p >= end || *p++ != '\n') {
+        return 0;
+    }
+    if (src_len != strlen(src_id) || memcmp(src, src_id, src_len) != 0 ||
+        dest_len != strlen(dest_id) || memcmp(dest, dest_id, dest_len) != 0) {
+        return 0;
+    }
+
+    // A record cut short by a crash ends the valid part
+    const char *valid = p;
+    while (p < end) {
+        ResumeEntry entry;
+
+        memset(&entry, 0, sizeof(entry));
+        entry.type = *p;
+        if ((entry.type != RECORD_DONE && entry.type != RECORD_PARTIAL) ||
+            p + 1 >= end || p[1] != ' ') {
+            break;
+        }
+        p += 2;
+        if (entry.type == RECORD_PARTIAL && !parse_number(&p, end, &entry.offset, ' ')) {
+            break;
+        }
+        if (!parse_number(&p, end, &entry.size, ' ') ||
+            !parse_number(&p, end, &entry.mtime_sec, ' ') ||
+            !parse_number(&p, end, &entry.mtime_nsec, ' ') ||
+            !parse_string(&p, end, &entry.key, &entry.key_len) || p >= end || *p++ != '\n') {
+            break;
+        }
+        if (table_put(&entry, &count) != SUCCESS) {
+            break;
+        }
+        valid = p;
+    }
+    return (size_t)(valid - text);
+}
+
+// Read a whole file; returns NULL if it cannot be read
+static char *read_journal(const char *path, size_t *size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *text = NULL;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (text = malloc((size_t)st.st_size + 1)) != NULL) {
+        size_t done = 0;
+        while (done < (size_t)st.st_size) {
+            ssize_t n = read(fd, text + done, (size_t)st.st_size - done);
+            if (n <= 0) {
+                break;
+            }
+            done += (size_t)n;
+        }
+        text[done] = '\0';
+        *size = done;
+    }
+    close(fd);
+    return text;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERROR_FILE_WRITE;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return SUCCESS;
+}
+
+// Write out buffered records; journal.lock must be held
+static void flush_records(void) {
+    if (journal.buffered > 0 && write_all(journal.fd, journal.buffer, journal.buffered) != SUCCESS) {
+        journal.failed = 1;
+    }
+    journal.buffered = 0;
+}
+
+// Queue one record; journal.lock must be held
+static void add_record(const char *record, size_t len) {
+    if (journal.buffered + len > sizeof(journal.buffer)) {
+        flush_records();
+    }
+    if (len > sizeof(journal.buffer)) {
+        if (write_all(journal.fd, record, len) != SUCCESS) {
+            journal.failed = 1;
+        }
+        return;
+    }
+    memcpy(journal.buffer + journal.buffered, record, len);
+    journal.buffered += len;
+}
+
+// Format and queue a record for key; offset is used by checkpoints only
+static void append_record(char type, off_t offset, const struct stat *st,
+                          const char *key, size_t len) {
+    char head[128];
+    int n;
+
+    if (type == RECORD_PARTIAL) {
+        n = snprintf(head, sizeof(head), "%c %" PRId64 " %" PRId64 " %" PRId64 " %ld %zu:",
+                     type, (int64_t)offset, (int64_t)st->st_size, (int64_t)st->st_mtim.tv_sec,
+                     (long)st->st_mtim.tv_nsec, len);
+    } else {
+        n = snprintf(head, sizeof(head), "%c %" PRId64 " %" PRId64 " %ld %zu:",
+                     type, (int64_t)st->st_size, (int64_t)st->st_mtim.tv_sec,
+                     (long)st->st_mtim.tv_nsec, len);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    add_record(head, (size_t)n);
+    add_record(key, len);
+    add_record("\n", 1);
+    // A checkpoint is worth nothing until it reaches the file
+    if (type == RECORD_PARTIAL) {
+        flush_records();
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+int resume_open(const char *path, const char *src_root, const char *dest_root) {
+    char *src_id, *dest_id;
+    size_t size = 0, valid = 0;
+    int result = SUCCESS;
+
+    if (journal.active) {
+        return ERROR_INVALID_PATH;
+    }
+
+    journal.file = strdup(path);
+    journal.src_root = strdup(src_root);
+    src_id = resolve_root(src_root);
+    dest_id = resolve_root(dest_root);
+    if (journal.file == NULL || journal.src_root == NULL || src_id == NULL || dest_id == NULL) {
+        result = ERROR_FILE_OPEN;
+        goto out;
+    }
+
+    // "dir/" and "dir" name the same root
+    journal.src_root_len = strlen(journal.src_root);
+    while (journal.src_root_len > 1 && journal.src_root[journal.src_root_len - 1] == '/') {
+        journal.src_root[--journal.src_root_len] = '\0';
+    }
+
+    journal.text = read_journal(path, &size);
+    if (journal.text != NULL) {
+        valid = parse_journal(journal.text, size, src_id, dest_id);
+        if (valid == 0 && size > 0) {
+            fprintf(stderr, "Warning: %s is not a journal of this copy, starting over\n", path);
+        }
+    }
+
+    journal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal.fd < 0) {
+        result = ERROR_FILE_OPEN;
+        goto out;
+    }
+    // Records are appended after the last complete one
+    if (ftruncate(journal.fd, (off_t)valid) != 0) {
+        result = ERROR_FILE_OPEN;
+        goto out;
+    }
+    if (valid == 0) {
+        size_t len = strlen(RESUME_MAGIC) + strlen(src_id) + strlen(dest_id) + 64;
+        char *head = malloc(len);
+        int n = head != NULL ? snprintf(head, len, "%s %zu:%s %zu:%s\n", RESUME_MAGIC,
+                                        strlen(src_id), src_id, strlen(dest_id), dest_id) : -1;
+        if (n < 0 || write_all(journal.fd, head, (size_t)n) != SUCCESS) {
+            result = ERROR_FILE_OPEN;
+        }
+        free(head);
+        if (result != SUCCESS) {
+            goto out;
+        }
+    }
+
+    journal.failed = 0;
+    journal.buffered = 0;
+    journal.active = 1;
+
+out:
+    free(src_id);
+    free(dest_id);
+    if (result != SUCCESS) {
+        resume_close(0);
+    }
+    return result;
+}
+
+int resume_close(int finished) {
+    int result = SUCCESS;
+
+    if (journal.fd >= 0) {
+        pthread_mutex_lock(&journal.lock);
+        flush_records();
+        pthread_mutex_unlock(&journal.lock);
+        if (close(journal.fd) != 0 || journal.failed) {
+            result = ERROR_FILE_WRITE;
+        }
+        if (finished && journal.active) {
+            unlink(journal.file);
+        }
+    }
+
+    free(journal.file);
+    free(journal.src_root);
+    free(journal.text);
+    free(journal.entries);
+    journal.file = NULL;
+    journal.src_root = NULL;
+    journal.text = NULL;
+    journal.entries = NULL;
+    journal.capacity = 0;
+    journal.fd = -1;
+    journal.active = 0;
+    return result;
+}
+
+int resume_active(void) {
+    return journal.active;
+}
+
+// Earlier record of path if the source is still what it was made from
+static const ResumeEntry *find_unchanged(const char *path, const struct stat *src_stat,
+                                         char type) {
+    size_t len;
+    const char *key;
+
+    if (!journal.active || (key = resume_key(path, &len)) == NULL) {
+        return NULL;
+    }
+    const ResumeEntry *entry = find_entry(key, len);
+    if (entry == NULL || entry->type != type || entry->size != (int64_t)src_stat->st_size ||
+        entry->mtime_sec != (int64_t)src_stat->st_mtim.tv_sec ||
+        entry->mtime_nsec != (int64_t)src_stat->st_mtim.tv_nsec) {
+        return NULL;
+    }
+    return entry;
+}
+
+int resume_skip_file(const char *path, const struct stat *src_stat,
+                     int dest_dirfd, const char *dest_name) {
+    struct stat dest_stat;
+    int result;
+
+    if (find_unchanged(path, src_stat, RECORD_DONE) == NULL) {
+        return 0;
+    }
+    STATS_TIMED(STATS_METADATA, result = fstatat(dest_dirfd, dest_name, &dest_stat, 0));
+    return result == 0 && S_ISREG(dest_stat.st_mode) && dest_stat.st_size == src_stat->st_size;
+}
+
+off_t resume_offset(const char *path, const struct stat *src_stat) {
+    const ResumeEntry *entry = find_unchanged(path, src_stat, RECORD_PARTIAL);
+
+    if (entry == NULL || entry->offset <= 0 || entry->offset > entry->size) {
+        return 0;
+    }
+    return (off_t)entry->offset;
+}
+
+int resume_verify(int src_fd, int dest_fd, off_t offset) {
+    off_t start = offset > RESUME_VERIFY_SIZE ? offset - RESUME_VERIFY_SIZE : 0;
+    size_t len = (size_t)(offset - start);
+    struct stat dest_stat;
+    int same = 0;
+
+    if (fstat(dest_fd, &dest_stat) != 0 || dest_stat.st_size < offset) {
+        return 0;
+    }
+
+    // Aligned buffers, in case the source was opened with O_DIRECT
+    char *src = io_buffer_alloc(len), *dest = io_buffer_alloc(len);
+    if (src != NULL && dest != NULL) {
+        ssize_t a, b;
+        STATS_TIMED(STATS_READ, a = pread_full(src_fd, src, len, start));
+        STATS_TIMED(STATS_READ, b = pread_full(dest_fd, dest, len, start));
+        same = a == (ssize_t)len && b == (ssize_t)len && memcmp(src, dest, len) == 0;
+    }
+    free(src);
+    free(dest);
+    return same;
+}
+
+void resume_begin(ResumeFile *file, const char *path, const struct stat *src_stat,
+                  int dest_fd, off_t offset) {
+    active_file = NULL;
+    if (!journal.active || !S_ISREG(src_stat->st_mode) ||
+        src_stat->st_size < RESUME_CHECKPOINT_SIZE ||
+        (file->key = resume_key(path, &file->key_len)) == NULL) {
+        return;
+    }
+    file->src_stat = src_stat;
+    file->dest_fd = dest_fd;
+    file->next = offset + RESUME_CHECKPOINT_SIZE;
+    active_file = file;
+}
+
+void resume_checkpoint(off_t end) {
+    ResumeFile *file = active_file;
+    int result;
+
+    if (file == NULL || end < file->next) {
+        return;
+    }
+
+    // The journal must never claim data the disk does not have
+    STATS_TIMED(STATS_FSYNC, result = fdatasync(file->dest_fd));
+    if (result != 0) {
+        active_file = NULL;
+        return;
+    }
+    append_record(RECORD_PARTIAL, end, file->src_stat, file->key, file->key_len);
+    file->next = end + RESUME_CHECKPOINT_SIZE;
+}
+
+ResumeFile *resume_bind(ResumeFile *file) {
+    ResumeFile *previous = active_file;
+    active_file = file;
+    return previous;
+}
+
+void resume_end(void) {
+    active_file = NULL;
+}
+
+void resume_record_file(const char *path, const struct stat *src_stat) {
+    size_t len;
+    const char *key;
+
+    if (!journal.active || (key = resume_key(path, &len)) == NULL) {
+        return;
+    }
+    append_record(RECORD_DONE, 0, src_stat, key, len);
+}
@@ -0,0 +1,216 @@
+#include "stats.h"
+#include "copy_engine.h"
+#include <stdatomic.h>
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "walk",
+    "open",
+    "read",
+    "write",
+    "fsync",
+    "metadata",
+    "hash",
+    "throttle",
+};
+
+// Timings of the calling thread not yet added to its bound statistics
+static _Thread_local CopyStats *bound_stats = NULL;
+static _Thread_local long pending_ns[STATS_PHASE_COUNT];
+static _Thread_local long pending_calls[STATS_PHASE_COUNT];
+
+CopyStats *stats_bind(CopyStats *stats) {
+    CopyStats *previous = bound_stats;
+
+    if (stats != previous) {
+        stats_flush();
+        bound_stats = stats;
+    }
+    return previous;
+}
+
+long stats_clock(void) {
+    return bound_stats != NULL ? monotonic_ns() : 0;
+}
+
+void stats_charge(StatsPhase phase, long start) {
+    int saved_errno = errno;
+
+    if (start != 0) {
+        pending_ns[phase] += monotonic_ns() - start;
+        pending_calls[phase]++;
+    }
+    errno = saved_errno;
+}
+
+void stats_flush(void) {
+    if (bound_stats == NULL) {
+        return;
+    }
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if (pending_calls[i] == 0) {
+            continue;
+        }
+        bound_stats->phase_ns[i] += pending_ns[i];
+        bound_stats->phase_calls[i] += pending_calls[i];
+        pending_ns[i] = 0;
+        pending_calls[i] = 0;
+    }
+}
+
+// Histogram bucket of a file copy time
+static int latency_bucket(long ns) {
+    long us = ns / 1000;
+    int bucket = 0;
+
+    while (us > 0 && bucket < STATS_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void stats_file_done(CopyStats *stats, long start) {
+    if (stats == NULL || start == 0) {
+        return;
+    }
+
+    long ns = monotonic_ns() - start;
+    stats->file_latency[latency_bucket(ns)]++;
+
+    // A failed exchange reloads max; retry while ns is still larger
+    long max = stats->file_latency_max_ns;
+    while (ns > max) {
+        if (atomic_compare_exchange_weak(&stats->file_latency_max_ns, &max, ns)) {
+            break;
+        }
+    }
+
+    stats_flush();
+}
+
+void stats_stop(CopyStats *stats) {
+    stats->current_ns = monotonic_ns();
+}
+
+const char *stats_phase_name(StatsPhase phase) {
+    return phase >= 0 && phase < STATS_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+// Upper bound of a histogram bucket in nanoseconds
+static long bucket_limit_ns(int bucket) {
+    return (1L << bucket) * 1000L;
+}
+
+long stats_latency_percentile(const CopyStats *stats, double percentile) {
+    long total = 0, seen = 0;
+
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        total += stats->file_latency[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    double wanted = total * percentile / 100.0;
+    for (int i = 0; i < STATS_LATENCY_BUCKETS - 1; i++) {
+        seen += stats->file_latency[i];
+        if (seen >= wanted) {
+            long limit = bucket_limit_ns(i);
+            return limit < stats->file_latency_max_ns ? limit : stats->file_latency_max_ns;
+        }
+    }
+    return stats->file_latency_max_ns;
+}
+
+int stats_write_json(const CopyStats *stats, const char *path) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    long syscalls = 0;
+    long files = 0;
+    int first;
+
+    if (out == NULL) {
+        return ERROR_FILE_WRITE;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"files\": %ld,\n", stats->total_files);
+    fprintf(out, "  \"directories\": %ld,\n", stats->total_dirs);
+    fprintf(out, "  \"bytes\": %ld,\n", stats->total_bytes);
+    fprintf(out, "  \"physical_bytes\": %ld,\n", stats->physical_bytes);
+    fprintf(out, "  \"sparse_files\": %ld,\n", stats->sparse_files);
+    fprintf(out, "  \"verified_files\": %ld,\n", stats->verified_files);
+    fprintf(out, "  \"skipped_files\": %ld,\n", stats->skipped_files);
+    fprintf(out, "  \"skipped_bytes\": %ld,\n", stats->skipped_bytes);
+    fprintf(out, "  \"delta_files\": %ld,\n", stats->delta_files);
+    fprintf(out, "  \"deleted_entries\": %ld,\n", stats->deleted_files);
+    fprintf(out, "  \"linked_files\": %ld,\n", stats->linked_files);
+    fprintf(out, "  \"deduped_files\": %ld,\n", stats->deduped_files);
+    fprintf(out, "  \"deduped_bytes\": %ld,\n", stats->deduped_bytes);
+    fprintf(out, "  \"compressed_files\": %ld,\n", stats->compressed_files);
+    fprintf(out, "  \"decompressed_files\": %ld,\n", stats->decompressed_files);
+    fprintf(out, "  \"plain_bytes\": %ld,\n", stats->plain_bytes);
+    fprintf(out, "  \"packed_bytes\": %ld,\n", stats->packed_bytes);
+    fprintf(out, "  \"compression_ratio\": %.3f,\n",
+            stats->packed_bytes > 0 ? (double)stats->plain_bytes / stats->packed_bytes : 0.0);
+    fprintf(out, "  \"codec_cpu_ns\": %ld,\n", stats->codec_cpu_ns);
+    fprintf(out, "  \"resumed_files\": %ld,\n", stats->resumed_files);
+    fprintf(out, "  \"resumed_bytes\": %ld,\n", stats->resumed_bytes);
+    fprintf(out, "  \"elapsed_ns\": %ld,\n", stats_elapsed_ns(stats));
+    fprintf(out, "  \"bytes_per_second\": %.0f,\n", calculate_speed(stats));
+
+    fprintf(out, "  \"engines\": {");
+    first = 1;
+    for (int i = COPY_ENGINE_REFLINK; i < COPY_ENGINE_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %ld", first ? "" : ", ", copy_engine_name((CopyEngine)i),
+                stats->engine_files[i]);
+        first = 0;
+    }
+    fprintf(out, "},\n");
+
+    fprintf(out, "  \"phases\": {\n");
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(out, "    \"%s\": {\"ns\": %ld, \"calls\": %ld}%s\n", phase_names[i],
+                stats->phase_ns[i], stats->phase_calls[i], i + 1 < STATS_PHASE_COUNT ? "," : "");
+        if (i != STATS_HASH) {
+            syscalls += stats->phase_calls[i];
+        }
+    }
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"syscalls\": %ld,\n", syscalls);
+
+    // Buckets as (upper bound, count) pairs; empty ones are left out
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        files += stats->file_latency[i];
+    }
+    fprintf(out, "  \"file_latency\": {\n");
+    fprintf(out, "    \"count\": %ld,\n", files);
+    fprintf(out, "    \"p50_ns\": %ld,\n", stats_latency_percentile(stats, 50));
+    fprintf(out, "    \"p99_ns\": %ld,\n", stats_latency_percentile(stats, 99));
+    fprintf(out, "    \"max_ns\": %ld,\n", stats->file_latency_max_ns);
+    fprintf(out, "    \"buckets\": [");
+    first = 1;
+    for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (stats->file_latency[i] == 0) {
+            continue;
+        }
+        if (i < STATS_LATENCY_BUCKETS - 1) {
+            fprintf(out, "%s{\"le_ns\": %ld, \"count\": %ld}", first ? "" : ", ",
+                    bucket_limit_ns(i), stats->file_latency[i]);
+        } else {
+            fprintf(out, "%s{\"le_ns\": null, \"count\": %ld}", first ? "" : ", ",
+                    stats->file_latency[i]);
+        }
+        first = 0;
+    }
+    fprintf(out, "]\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+
+    int failed = ferror(out);
+    if (out != stdout) {
+        failed |= fclose(out) != 0;
+    } else {
+        fflush(out);
+    }
+    return failed ? ERROR_FILE_WRITE : SUCCESS;
+}
@@ -0,0 +1,255 @@
+#include "sync.h"
+#include "compare.h"
+#include "filter.h"
+#include "path_arena.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include "tree_remove.h"
+
+// Destination already carries the source's size and modification time
+static int same_size_and_mtime(const struct stat *src, const struct stat *dest) {
+    return src->st_size == dest->st_size &&
+           src->st_mtim.tv_sec == dest->st_mtim.tv_sec &&
+           src->st_mtim.tv_nsec == dest->st_mtim.tv_nsec;
+}
+
+// Give the destination the source's mode and times
+static void copy_metadata(int dest_fd, const struct stat *src_stat) {
+    struct timespec times[2] = { src_stat->st_atim, src_stat->st_mtim };
+
+    STATS_TIMED(STATS_METADATA, fchmod(dest_fd, src_stat->st_mode));
+    STATS_TIMED(STATS_METADATA, futimens(dest_fd, times));
+}
+
+// Write a block to the destination at offset
+static int write_block(int fd, const char *data, size_t len, off_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n;
+        STATS_TIMED(STATS_WRITE, n = pwrite(fd, data + done, len - done, offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return ERROR_FILE_WRITE;
+        }
+        done += n;
+    }
+    return SUCCESS;
+}
+
+// Rewrite only the blocks of dest_fd that differ from src_fd, then fix the size
+static int update_changed_blocks(int src_fd, int dest_fd, const struct stat *src_stat,
+                                 const struct stat *dest_stat, const char *label,
+                                 off_t *written) {
+    size_t chunk = io_buffer_size(src_stat);
+    char *src_buf, *dest_buf;
+    off_t size = src_stat->st_size;
+    off_t offset = 0;
+    int result = SUCCESS;
+
+    // Whole blocks per read so a block never straddles two chunks
+    chunk -= chunk % SYNC_BLOCK_SIZE;
+    if (chunk == 0) {
+        chunk = SYNC_BLOCK_SIZE;
+    }
+
+    src_buf = io_buffer_alloc(chunk);
+    dest_buf = io_buffer_alloc(chunk);
+    if (src_buf == NULL || dest_buf == NULL) {
+        free(src_buf);
+        free(dest_buf);
+        return ERROR_FILE_READ;
+    }
+
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(dest_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < size) {
+        ssize_t src_len;
+        STATS_TIMED(STATS_READ, src_len = pread_full(src_fd, src_buf, chunk, offset));
+        if (src_len <= 0) {
+            result = src_len < 0 ? ERROR_FILE_READ : SUCCESS;
+            break;
+        }
+
+        ssize_t dest_len = 0;
+        if (offset < dest_stat->st_size) {
+            STATS_TIMED(STATS_READ,
+                        dest_len = pread_full(dest_fd, dest_buf, (size_t)src_len, offset));
+            if (dest_len < 0) {
+                result = ERROR_FILE_READ;
+                break;
+            }
+        }
+
+        for (ssize_t block = 0; block < src_len && result == SUCCESS; block += SYNC_BLOCK_SIZE) {
+            size_t len = (size_t)(src_len - block) < SYNC_BLOCK_SIZE ?
+                         (size_t)(src_len - block) : SYNC_BLOCK_SIZE;
+            if (block + (ssize_t)len <= dest_len &&
+                compare_buffers(src_buf + block, dest_buf + block, len) == len) {
+                continue;
+            }
+            result = write_block(dest_fd, src_buf + block, len, offset + block);
+            *written += len;
+        }
+        if (result != SUCCESS) {
+            break;
+        }
+
+        offset += src_len;
+        display_progress(offset, size, label);
+        rate_limit_account((size_t)src_len);
+    }
+
+    free(src_buf);
+    free(dest_buf);
+
+    if (result == SUCCESS && dest_stat->st_size != size && ftruncate(dest_fd, size) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+
+    return result;
+}
+
+int sync_file(int src_fd, const struct stat *src_stat, const char *label,
+              int dest_dirfd, const char *dest_name, SyncAction *action, off_t *written) {
+    const CopyOptions *opts = get_copy_options();
+    struct stat dest_stat;
+    int dest_fd;
+    int result;
+
+    *action = SYNC_ACTION_COPY;
+    *written = 0;
+
+    if (!S_ISREG(src_stat->st_mode) || fstatat(dest_dirfd, dest_name, &dest_stat, 0) != 0 ||
+        !S_ISREG(dest_stat.st_mode)) {
+        return SUCCESS;
+    }
+
+    int large = src_stat->st_size >= SYNC_DELTA_MIN_SIZE && dest_stat.st_size > 0;
+
+    if (opts->sync == SYNC_MTIME && same_size_and_mtime(src_stat, &dest_stat)) {
+        *action = SYNC_ACTION_SKIP;
+        return SUCCESS;
+    }
+
+    // Contents decide: large files are checked by the block pass itself
+    if (opts->sync == SYNC_CHECKSUM && !large && src_stat->st_size == dest_stat.st_size) {
+        // Opened for writing so matching files can get the source times
+        dest_fd = openat(dest_dirfd, dest_name, O_RDWR);
+        if (dest_fd < 0) {
+            return SUCCESS;
+        }
+        result = compare_fds(src_fd, src_stat, dest_fd, &dest_stat, NULL);
+        if (result == SUCCESS) {
+            *action = SYNC_ACTION_SKIP;
+            // Matching times let the next --sync run skip it without reading
+            copy_metadata(dest_fd, src_stat);
+        }
+        close(dest_fd);
+        if (result != ERROR_FILES_DIFFER) {
+            return result;
+        }
+    }
+
+    // Small files, verified copies and --durable ones (a patch in place
+    // cannot be atomic) are simply copied again
+    if (!large || opts->verify != VERIFY_NONE || opts->durable != DURABLE_OFF) {
+        return SUCCESS;
+    }
+
+    dest_fd = openat(dest_dirfd, dest_name, O_RDWR);
+    if (dest_fd < 0) {
+        return SUCCESS;
+    }
+
+    result = update_changed_blocks(src_fd, dest_fd, src_stat, &dest_stat, label, written);
+    if (result == SUCCESS) {
+        copy_metadata(dest_fd, src_stat);
+        *action = *written > 0 ? SYNC_ACTION_DELTA : SYNC_ACTION_SKIP;
+    }
+    close(dest_fd);
+
+    return result;
+}
+
+int sync_delete_extraneous(int src_dirfd, int dest_dirfd, const char *src_dir,
+                           const char *dest_dir, const CopyFilter *filter, size_t root_len,
+                           CopyStats *stats) {
+    DIR *dir;
+    struct dirent *entry;
+    PathBuf src_file, dest_file;
+    struct stat st;
+    int result = SUCCESS;
+    int fd;
+
+    // The stream gets its own descriptor; dest_dirfd may be O_PATH
+    fd = openat(dest_dirfd, ".", O_RDONLY | O_DIRECTORY);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ERROR_DIR_OPEN;
+    }
+    if (path_buf_init(&src_file, src_dir) != 0 || path_buf_init(&dest_file, dest_dir) != 0) {
+        path_buf_free(&src_file);
+        closedir(dir);
+        return ERROR_DIR_OPEN;
+    }
+    size_t src_len = src_file.len, dest_len = dest_file.len;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (fstatat(src_dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+            continue;
+        }
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        path_buf_pop(&src_file, src_len);
+        path_buf_pop(&dest_file, dest_len);
+        if (path_buf_push(&src_file, entry->d_name) != 0 ||
+            path_buf_push(&dest_file, entry->d_name) != 0) {
+            result = ERROR_FILE_WRITE;
+            break;
+        }
+
+        // Excluded entries were never synced; leave them alone
+        const char *relative = filter_relative_path(src_file.data, root_len);
+        if (S_ISDIR(st.st_mode)) {
+            if (!filter_wants_dir(filter, relative)) {
+                continue;
+            }
+            if (tree_remove_at(dirfd(dir), entry->d_name, dest_file.data,
+                               get_copy_options()->jobs, 0) != SUCCESS) {
+                result = ERROR_FILE_WRITE;
+                continue;
+            }
+        } else {
+            if (!filter_wants_file(filter, relative)) {
+                continue;
+            }
+            if (unlinkat(dirfd(dir), entry->d_name, 0) != 0) {
+                result = ERROR_FILE_WRITE;
+                continue;
+            }
+        }
+
+        if (stats != NULL) {
+            stats->deleted_files++;
+        }
+        if (effective_progress_mode() != PROGRESS_TREE) {
+            printf("Deleted: %s\n", dest_file.data);
+        }
+    }
+
+    closedir(dir);
+    path_buf_free(&src_file);
+    path_buf_free(&dest_file);
+    return result;
+}
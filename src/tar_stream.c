@@ -0,0 +1,1315 @@
+#include "tar_stream.h"
+#include "copy_engine.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include <assert.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+
+// Source hardlinks remembered while writing, keyed by device and inode
+#define TAR_LINK_BUCKETS 1024
+
+// pax extended headers larger than this are not taken from a stream
+#define TAR_PAX_MAX (1024 * 1024)
+
+// ustar header block (POSIX.1-1988 layout, all numbers in octal)
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "tar header must be one block");
+
+// Member types
+#define TAR_REGULAR '0'
+#define TAR_HARDLINK '1'
+#define TAR_SYMLINK '2'
+#define TAR_CHAR '3'
+#define TAR_BLOCK '4'
+#define TAR_DIRECTORY '5'
+#define TAR_FIFO '6'
+#define TAR_CONTIGUOUS '7'
+#define TAR_PAX_LOCAL 'x'
+#define TAR_PAX_GLOBAL 'g'
+#define TAR_GNU_LONGNAME 'L'
+#define TAR_GNU_LONGLINK 'K'
+
+static const char zero_block[TAR_BLOCK_SIZE];
+
+// Write all of buffer, across short writes to pipes and sockets
+static int write_all(int fd, const void *buffer, size_t len) {
+    const char *p = buffer;
+
+    while (len > 0) {
+        ssize_t n;
+        STATS_TIMED(STATS_WRITE, n = write(fd, p, len));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERROR_FILE_WRITE;
+        }
+        p += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+// Read until len bytes are in or the stream ends; -1 on error
+static ssize_t read_stream(int fd, void *buffer, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n;
+        STATS_TIMED(STATS_READ, n = read(fd, (char *)buffer + done, len - done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+static size_t padding_of(unsigned long long size) {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+// ============================================================================
+// WRITING
+// ============================================================================
+
+typedef struct TarLink {
+    dev_t dev;
+    ino_t ino;
+    struct TarLink *next;
+    char name[];            // Member name of the first copy
+} TarLink;
+
+// pax records of one member ("<len> key=value\n" each)
+typedef struct {
+    char data[3 * MAX_PATH + 256];
+    size_t len;
+} PaxRecords;
+
+typedef struct {
+    int out_fd;
+    const CopyFilter *filter;
+    int selects_files;      // Include patterns: unpacking creates directories on demand
+    int use_sendfile;       // Cleared once the kernel refuses this pair of descriptors
+    CopyStats *stats;
+    char *buffer;
+    size_t buffer_size;
+    TarLink *links[TAR_LINK_BUCKETS];
+    uid_t cached_uid;       // Last owner looked up, so a tree costs few lookups
+    gid_t cached_gid;
+    char uname[32];
+    char gname[32];
+} TarWriter;
+
+// Octal number filling a field; -1 if it does not fit
+static int put_octal(char *field, size_t size, unsigned long long value) {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%0*llo", (int)size - 1, value);
+
+    if (len < 0 || (size_t)len > size - 1) {
+        return -1;
+    }
+    memcpy(field, digits, (size_t)len + 1);
+    return 0;
+}
+
+static void add_pax(PaxRecords *pax, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;     // ' ', '=', '\n'
+    size_t len = body + 1;
+
+    // The length counts its own digits
+    while (len != body + (size_t)snprintf(NULL, 0, "%zu", len)) {
+        len = body + (size_t)snprintf(NULL, 0, "%zu", len);
+    }
+    if (pax->len + len < sizeof(pax->data)) {
+        pax->len += (size_t)snprintf(pax->data + pax->len, sizeof(pax->data) - pax->len,
+                                     "%zu %s=%s\n", len, key, value);
+    }
+}
+
+static void add_pax_number(PaxRecords *pax, const char *key, unsigned long long value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%llu", value);
+    add_pax(pax, key, text);
+}
+
+// Store a string in a zeroed header field, cut to the field size; a string
+// filling the whole field is stored without a terminating NUL
+static void put_string(char *field, size_t size, const char *s) {
+    memcpy(field, s, strnlen(s, size));
+}
+
+// Fit a name into prefix/name at a slash; -1 if it needs a pax path
+static int split_name(const char *path, TarHeader *header) {
+    size_t len = strlen(path);
+
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, path, len);
+        return 0;
+    }
+    for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t prefix_len = (size_t)(slash - path);
+        size_t name_len = len - prefix_len - 1;
+        if (prefix_len > sizeof(header->prefix)) {
+            break;
+        }
+        if (name_len > 0 && name_len <= sizeof(header->name)) {
+            memcpy(header->prefix, path, prefix_len);
+            memcpy(header->name, slash + 1, name_len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void owner_names(TarWriter *w, const struct stat *st, TarHeader *header) {
+    if (st->st_uid != w->cached_uid) {
+        struct passwd *pw = getpwuid(st->st_uid);
+        w->cached_uid = st->st_uid;
+        snprintf(w->uname, sizeof(w->uname), "%s", pw != NULL ? pw->pw_name : "");
+    }
+    if (st->st_gid != w->cached_gid) {
+        struct group *gr = getgrgid(st->st_gid);
+        w->cached_gid = st->st_gid;
+        snprintf(w->gname, sizeof(w->gname), "%s", gr != NULL ? gr->gr_name : "");
+    }
+    strncpy(header->uname, w->uname, sizeof(header->uname));
+    strncpy(header->gname, w->gname, sizeof(header->gname));
+}
+
+static void seal_header(TarHeader *header) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned sum = 0;
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+// Header of one member, preceded by a pax header for what ustar cannot hold
+static int write_header(TarWriter *w, const char *name, const struct stat *st, char type,
+                        const char *linkname, unsigned long long size) {
+    TarHeader header;
+    PaxRecords pax;
+    int result;
+
+    memset(&header, 0, sizeof(header));
+    pax.len = 0;
+
+    if (split_name(name, &header) != 0) {
+        add_pax(&pax, "path", name);
+        put_string(header.name, sizeof(header.name), name);
+    }
+    put_octal(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    if (put_octal(header.uid, sizeof(header.uid), st->st_uid) != 0) {
+        add_pax_number(&pax, "uid", st->st_uid);
+        put_octal(header.uid, sizeof(header.uid), 0);
+    }
+    if (put_octal(header.gid, sizeof(header.gid), st->st_gid) != 0) {
+        add_pax_number(&pax, "gid", st->st_gid);
+        put_octal(header.gid, sizeof(header.gid), 0);
+    }
+    if (put_octal(header.size, sizeof(header.size), size) != 0) {
+        add_pax_number(&pax, "size", size);
+        put_octal(header.size, sizeof(header.size), 0);
+    }
+    if (st->st_mtime < 0 || put_octal(header.mtime, sizeof(header.mtime), st->st_mtime) != 0) {
+        char text[48];
+        snprintf(text, sizeof(text), "%lld", (long long)st->st_mtime);
+        add_pax(&pax, "mtime", text);
+        put_octal(header.mtime, sizeof(header.mtime), 0);
+    }
+    header.typeflag = type;
+    if (linkname != NULL) {
+        if (strlen(linkname) > sizeof(header.linkname)) {
+            add_pax(&pax, "linkpath", linkname);
+        }
+        put_string(header.linkname, sizeof(header.linkname), linkname);
+    }
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    owner_names(w, st, &header);
+    if (type == TAR_CHAR || type == TAR_BLOCK) {
+        put_octal(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        put_octal(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+    seal_header(&header);
+
+    if (pax.len > 0) {
+        TarHeader ext;
+        const char *base = strrchr(name, '/');
+
+        memset(&ext, 0, sizeof(ext));
+        snprintf(ext.name, sizeof(ext.name), "PaxHeaders/%.88s",
+                 base != NULL && base[1] != '\0' ? base + 1 : name);
+        put_octal(ext.mode, sizeof(ext.mode), 0644);
+        put_octal(ext.uid, sizeof(ext.uid), 0);
+        put_octal(ext.gid, sizeof(ext.gid), 0);
+        put_octal(ext.size, sizeof(ext.size), pax.len);
+        put_octal(ext.mtime, sizeof(ext.mtime), st->st_mtime > 0 ? (unsigned long long)st->st_mtime : 0);
+        ext.typeflag = TAR_PAX_LOCAL;
+        memcpy(ext.magic, "ustar", 6);
+        memcpy(ext.version, "00", 2);
+        seal_header(&ext);
+
+        result = write_all(w->out_fd, &ext, sizeof(ext));
+        if (result == SUCCESS) {
+            result = write_all(w->out_fd, pax.data, pax.len);
+        }
+        if (result == SUCCESS) {
+            result = write_all(w->out_fd, zero_block, padding_of(pax.len));
+        }
+        if (result != SUCCESS) {
+            return result;
+        }
+    }
+
+    return write_all(w->out_fd, &header, sizeof(header));
+}
+
+// Stream exactly size bytes of a file, then pad to a block boundary
+static int write_data(TarWriter *w, int fd, off_t size, const char *name) {
+    off_t sent = 0;
+
+    while (sent < size && w->use_sendfile) {
+        size_t want = rate_limit_request(ENGINE_CHUNK_SIZE);
+        ssize_t n;
+        if ((off_t)want > size - sent) {
+            want = (size_t)(size - sent);
+        }
+        STATS_TIMED(STATS_WRITE, n = sendfile(w->out_fd, fd, NULL, want));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            w->use_sendfile = 0;
+            break;
+        }
+        if (n < 0) {
+            return ERROR_FILE_WRITE;
+        }
+        if (n == 0) {
+            break;
+        }
+        sent += n;
+        display_progress(sent, size, name);
+        rate_limit_account((size_t)n);
+    }
+
+    if (sent < size && w->buffer == NULL) {
+        w->buffer_size = MAX_BUFFER_SIZE / 4;
+        w->buffer = io_buffer_alloc(w->buffer_size);
+        if (w->buffer == NULL) {
+            return ERROR_FILE_READ;
+        }
+    }
+    while (sent < size) {
+        size_t want = rate_limit_request(w->buffer_size);
+        ssize_t n;
+        if ((off_t)want > size - sent) {
+            want = (size_t)(size - sent);
+        }
+        STATS_TIMED(STATS_READ, n = read(fd, w->buffer, want));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return ERROR_FILE_READ;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (write_all(w->out_fd, w->buffer, (size_t)n) != SUCCESS) {
+            return ERROR_FILE_WRITE;
+        }
+        sent += n;
+        display_progress(sent, size, name);
+        rate_limit_account((size_t)n);
+    }
+
+    // A file that shrank while being archived still fills its header size
+    while (sent < size) {
+        size_t n = size - sent < TAR_BLOCK_SIZE ? (size_t)(size - sent) : TAR_BLOCK_SIZE;
+        if (write_all(w->out_fd, zero_block, n) != SUCCESS) {
+            return ERROR_FILE_WRITE;
+        }
+        sent += n;
+    }
+    return write_all(w->out_fd, zero_block, padding_of((unsigned long long)size));
+}
+
+// Name of an earlier member sharing this inode, recording this one if none
+static const char *find_link(TarWriter *w, const struct stat *st, const char *name) {
+    size_t bucket = ((size_t)st->st_ino ^ ((size_t)st->st_dev << 7)) % TAR_LINK_BUCKETS;
+
+    for (TarLink *link = w->links[bucket]; link != NULL; link = link->next) {
+        if (link->dev == st->st_dev && link->ino == st->st_ino) {
+            return link->name;
+        }
+    }
+
+    TarLink *link = malloc(sizeof(TarLink) + strlen(name) + 1);
+    if (link != NULL) {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        strcpy(link->name, name);
+        link->next = w->links[bucket];
+        w->links[bucket] = link;
+    }
+    return NULL;
+}
+
+// One non-directory entry of the tree
+static int archive_entry(TarWriter *w, int dirfd, const char *entry_name, const char *name,
+                         const struct stat *st) {
+    char target[MAX_PATH];
+    int result;
+
+    if (S_ISLNK(st->st_mode)) {
+        ssize_t len;
+        STATS_TIMED(STATS_METADATA, len = readlinkat(dirfd, entry_name, target, sizeof(target) - 1));
+        if (len < 0) {
+            return ERROR_FILE_READ;
+        }
+        target[len] = '\0';
+        return write_header(w, name, st, TAR_SYMLINK, target, 0);
+    }
+    if (S_ISFIFO(st->st_mode) || S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+        char type = S_ISFIFO(st->st_mode) ? TAR_FIFO : S_ISCHR(st->st_mode) ? TAR_CHAR : TAR_BLOCK;
+        return write_header(w, name, st, type, NULL, 0);
+    }
+    if (!S_ISREG(st->st_mode)) {
+        fprintf(stderr, "Warning (%s): Sockets cannot be archived, skipped\n", name);
+        return SUCCESS;
+    }
+
+    // Later names of a hardlinked file only point at the first one
+    if (st->st_nlink > 1) {
+        const char *first = find_link(w, st, name);
+        if (first != NULL) {
+            result = write_header(w, name, st, TAR_HARDLINK, first, 0);
+            if (result == SUCCESS && w->stats != NULL) {
+                w->stats->linked_files++;
+            }
+            return result;
+        }
+    }
+
+    long start = stats_clock();
+    int fd;
+    STATS_TIMED(STATS_OPEN, fd = openat(dirfd, entry_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+    if (st->st_size >= COPY_HINT_MIN_SIZE) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    result = write_header(w, name, st, TAR_REGULAR, NULL, (unsigned long long)st->st_size);
+    if (result == SUCCESS) {
+        result = write_data(w, fd, st->st_size, name);
+    }
+    if (progress_enabled() && effective_progress_mode() == PROGRESS_FILE) {
+        finish_progress();
+    }
+    STATS_TIMED(STATS_OPEN, close(fd));
+
+    if (result == SUCCESS && w->stats != NULL) {
+        w->stats->total_files++;
+        w->stats->total_bytes += st->st_size;
+        w->stats->physical_bytes += st->st_size;
+        w->stats->engine_files[w->use_sendfile ? COPY_ENGINE_SENDFILE : COPY_ENGINE_READ_WRITE]++;
+        update_stats(w->stats, st->st_size);
+        stats_file_done(w->stats, start);
+    }
+    return result;
+}
+
+// Archive the contents of a directory; takes ownership of fd
+static int archive_dir(TarWriter *w, int fd, const char *dir_name) {
+    DIR *dir = fdopendir(fd);
+    struct dirent *entry;
+    char name[MAX_PATH];
+    int result = SUCCESS;
+
+    if (dir == NULL) {
+        close(fd);
+        return ERROR_DIR_OPEN;
+    }
+
+    while (result == SUCCESS && (entry = readdir(dir)) != NULL) {
+        struct stat st;
+        int stat_result;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((size_t)snprintf(name, MAX_PATH, "%s%s%s", dir_name, *dir_name != '\0' ? "/" : "",
+                             entry->d_name) >= MAX_PATH) {
+            result = ERROR_INVALID_PATH;
+            break;
+        }
+        STATS_TIMED(STATS_METADATA,
+                    stat_result = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW));
+        if (stat_result != 0) {
+            result = ERROR_FILE_OPEN;
+            break;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            if (filter_wants_file(w->filter, name)) {
+                result = archive_entry(w, dirfd(dir), entry->d_name, name, &st);
+            }
+            continue;
+        }
+
+        // Excluded subtrees are never opened
+        if (!filter_wants_dir(w->filter, name)) {
+            continue;
+        }
+        int child;
+        STATS_TIMED(STATS_OPEN, child = openat(dirfd(dir), entry->d_name,
+                                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (child < 0) {
+            result = ERROR_DIR_OPEN;
+            break;
+        }
+        if (!w->selects_files) {
+            char dir_member[MAX_PATH + 1];
+            snprintf(dir_member, sizeof(dir_member), "%s/", name);
+            result = write_header(w, dir_member, &st, TAR_DIRECTORY, NULL, 0);
+            if (result != SUCCESS) {
+                close(child);
+                break;
+            }
+            if (w->stats != NULL) {
+                w->stats->total_dirs++;
+            }
+        }
+        result = archive_dir(w, child, name);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+int tar_write_tree(const char *src_path, int out_fd, const CopyFilter *filter, CopyStats *stats) {
+    TarWriter w;
+    struct stat st;
+    int result;
+
+    memset(&w, 0, sizeof(w));
+    w.out_fd = out_fd;
+    w.filter = filter;
+    w.selects_files = filter_selects_files(filter);
+    w.use_sendfile = 1;
+    w.stats = stats;
+    w.cached_uid = (uid_t)-1;
+    w.cached_gid = (gid_t)-1;
+
+    CopyStats *outer = stats_bind(stats);
+    if (lstat(src_path, &st) != 0) {
+        result = ERROR_FILE_OPEN;
+    } else if (S_ISDIR(st.st_mode)) {
+        // The root is "./", so unpacking restores its mode and mtime too
+        int fd = open(src_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            result = ERROR_DIR_OPEN;
+        } else if ((result = write_header(&w, "./", &st, TAR_DIRECTORY, NULL, 0)) != SUCCESS) {
+            close(fd);
+        } else {
+            result = archive_dir(&w, fd, "");
+        }
+    } else {
+        const char *slash = strrchr(src_path, '/');
+        char parent[MAX_PATH];
+        int fd;
+
+        // A single file is stored under its own name
+        get_parent_directory(src_path, parent, sizeof(parent));
+        fd = open(slash != NULL ? parent : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            result = ERROR_DIR_OPEN;
+        } else {
+            const char *base = slash != NULL ? slash + 1 : src_path;
+            result = archive_entry(&w, fd, base, base, &st);
+            close(fd);
+        }
+    }
+
+    // End of archive: two zero blocks
+    if (result == SUCCESS) {
+        result = write_all(out_fd, zero_block, TAR_BLOCK_SIZE);
+    }
+    if (result == SUCCESS) {
+        result = write_all(out_fd, zero_block, TAR_BLOCK_SIZE);
+    }
+    stats_bind(outer);
+
+    for (int i = 0; i < TAR_LINK_BUCKETS; i++) {
+        while (w.links[i] != NULL) {
+            TarLink *next = w.links[i]->next;
+            free(w.links[i]);
+            w.links[i] = next;
+        }
+    }
+    free(w.buffer);
+    return result;
+}
+
+// ============================================================================
+// READING
+// ============================================================================
+
+// Attributes of the member being unpacked, pax overrides applied
+typedef struct {
+    char path[MAX_PATH];
+    char linkpath[MAX_PATH];
+    unsigned long long size;
+    unsigned long long uid;
+    unsigned long long gid;
+    mode_t mode;
+    struct timespec mtime;
+    char type;
+    unsigned devmajor;
+    unsigned devminor;
+} TarMember;
+
+// Values from a pax or GNU long-name header, for the next member only
+typedef struct {
+    char path[MAX_PATH];
+    char linkpath[MAX_PATH];
+    unsigned long long size;
+    unsigned long long uid;
+    unsigned long long gid;
+    struct timespec mtime;
+    int has_path, has_linkpath, has_size, has_uid, has_gid, has_mtime;
+} TarOverrides;
+
+// Directory whose mode and mtime are set once nothing more goes into it
+typedef struct {
+    char *path;
+    mode_t mode;
+    struct timespec mtime;
+    unsigned long long uid;
+    unsigned long long gid;
+} TarDir;
+
+typedef struct {
+    int in_fd;
+    int root_fd;
+    int use_splice;         // Input is a pipe (cleared if splice is refused)
+    int privileged;         // Running as root: restore owners, devices, setuid bits
+    CopyStats *stats;
+    char *buffer;
+    size_t buffer_size;
+    TarDir *dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+    char parent_path[MAX_PATH];     // Directory last opened for a member
+    int parent_fd;
+} TarReader;
+
+// Octal field, or GNU base-256 for values too large for octal
+static unsigned long long get_number(const char *field, size_t size) {
+    const unsigned char *p = (const unsigned char *)field;
+    unsigned long long value = 0;
+
+    if (p[0] & 0x80) {
+        for (size_t i = 1; i < size; i++) {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < size && p[i] == ' ') {
+        i++;
+    }
+    for (; i < size && p[i] >= '0' && p[i] <= '7'; i++) {
+        value = (value << 3) | (unsigned)(p[i] - '0');
+    }
+    return value;
+}
+
+static int header_valid(const TarHeader *header) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned long long expected = get_number(header->chksum, sizeof(header->chksum));
+    unsigned sum = 0;
+
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : bytes[i];
+    }
+    return sum == expected;
+}
+
+// Seconds with an optional fraction, as pax writes mtime
+static struct timespec parse_pax_time(const char *value) {
+    struct timespec ts = { strtoll(value, NULL, 10), 0 };
+    const char *dot = strchr(value, '.');
+
+    if (dot != NULL) {
+        long scale = 100000000L;
+        for (const char *p = dot + 1; *p >= '0' && *p <= '9' && scale > 0; p++, scale /= 10) {
+            ts.tv_nsec += (*p - '0') * scale;
+        }
+        // "-5.25" is a quarter second before -5
+        if (value[0] == '-' && ts.tv_nsec > 0) {
+            ts.tv_sec--;
+            ts.tv_nsec = 1000000000L - ts.tv_nsec;
+        }
+    }
+    return ts;
+}
+
+// Apply "LEN key=value\n" records; ERROR_FILE_READ if one is malformed
+static int parse_pax(const char *data, size_t len, TarOverrides *over) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        char *end;
+        unsigned long record = strtoul(data + pos, &end, 10);
+        if (end == data + pos || *end != ' ' || record == 0 || record > len - pos) {
+            return ERROR_FILE_READ;
+        }
+
+        const char *key = end + 1;
+        const char *last = data + pos + record - 1;     // The record's '\n'
+        // The length must cover its own digits, the space and "key="
+        if (key >= last) {
+            return ERROR_FILE_READ;
+        }
+        const char *eq = memchr(key, '=', (size_t)(last - key));
+        if (eq == NULL || *last != '\n') {
+            return ERROR_FILE_READ;
+        }
+        char value[MAX_PATH];
+        size_t key_len = (size_t)(eq - key);
+        size_t value_len = (size_t)(last - eq - 1);
+        if (value_len >= sizeof(value)) {
+            value_len = sizeof(value) - 1;
+        }
+        memcpy(value, eq + 1, value_len);
+        value[value_len] = '\0';
+
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            strcpy(over->path, value);
+            over->has_path = 1;
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            strcpy(over->linkpath, value);
+            over->has_linkpath = 1;
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            over->size = strtoull(value, NULL, 10);
+            over->has_size = 1;
+        } else if (key_len == 3 && memcmp(key, "uid", 3) == 0) {
+            over->uid = strtoull(value, NULL, 10);
+            over->has_uid = 1;
+        } else if (key_len == 3 && memcmp(key, "gid", 3) == 0) {
+            over->gid = strtoull(value, NULL, 10);
+            over->has_gid = 1;
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            over->mtime = parse_pax_time(value);
+            over->has_mtime = 1;
+        }
+        pos += record;
+    }
+    return SUCCESS;
+}
+
+// Member name below the destination: no leading '/', no "." parts, no ".."
+static int clean_member_path(const char *path, char *clean) {
+    size_t len = 0;
+    const char *p = path;
+
+    while (*p != '\0') {
+        const char *end = strchr(p, '/');
+        size_t part = end != NULL ? (size_t)(end - p) : strlen(p);
+
+        if (part == 2 && p[0] == '.' && p[1] == '.') {
+            return ERROR_INVALID_PATH;
+        }
+        if (part > 0 && !(part == 1 && p[0] == '.')) {
+            if (len + part + 2 > MAX_PATH) {
+                return ERROR_INVALID_PATH;
+            }
+            if (len > 0) {
+                clean[len++] = '/';
+            }
+            memcpy(clean + len, p, part);
+            len += part;
+        }
+        p += part;
+        while (*p == '/') {
+            p++;
+        }
+    }
+    clean[len] = '\0';
+    return SUCCESS;
+}
+
+// Directory holding a member, opened one component at a time without
+// following symlinks; missing directories are created when create is set.
+// Returns a descriptor owned by the reader, or -1.
+static int open_parent(TarReader *r, const char *path, int create, const char **name) {
+    const char *slash = strrchr(path, '/');
+    size_t dir_len = slash != NULL ? (size_t)(slash - path) : 0;
+    char dir[MAX_PATH];
+    int fd;
+
+    *name = slash != NULL ? slash + 1 : path;
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+
+    // Members of one directory usually come in a row
+    if (r->parent_fd >= 0 && strcmp(dir, r->parent_path) == 0) {
+        return r->parent_fd;
+    }
+    if (dir_len == 0) {
+        return r->root_fd;
+    }
+
+    fd = dup(r->root_fd);
+    for (char *part = dir; fd >= 0 && part != NULL;) {
+        char *next = strchr(part, '/');
+        int child;
+
+        if (next != NULL) {
+            *next = '\0';
+        }
+        STATS_TIMED(STATS_OPEN, child = openat(fd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (child < 0 && errno == ENOENT && create) {
+            int made;
+            STATS_TIMED(STATS_METADATA, made = mkdirat(fd, part, 0755));
+            if (made == 0 && r->stats != NULL) {
+                r->stats->total_dirs++;
+            }
+            STATS_TIMED(STATS_OPEN, child = openat(fd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        }
+        close(fd);
+        fd = child;
+        if (next != NULL) {
+            *next = '/';
+            part = next + 1;
+        } else {
+            part = NULL;
+        }
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (r->parent_fd >= 0) {
+        close(r->parent_fd);
+    }
+    r->parent_fd = fd;
+    memcpy(r->parent_path, dir, dir_len + 1);
+    return fd;
+}
+
+// Move size bytes of member data from the stream into fd (or drop them)
+static int read_data(TarReader *r, int fd, unsigned long long size, const char *name) {
+    unsigned long long done = 0;
+
+    while (fd >= 0 && done < size && r->use_splice) {
+        size_t want = size - done < ENGINE_CHUNK_SIZE ? (size_t)(size - done) : ENGINE_CHUNK_SIZE;
+        ssize_t n;
+        STATS_TIMED(STATS_WRITE, n = splice(r->in_fd, NULL, fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            r->use_splice = 0;
+            break;
+        }
+        if (n == 0) {
+            errno = EPIPE;      // The stream ended inside this member
+            return ERROR_FILE_READ;
+        }
+        if (n < 0) {
+            return ERROR_FILE_WRITE;
+        }
+        done += n;
+        display_progress((long)done, (long)size, name);
+    }
+
+    if (done < size && r->buffer == NULL) {
+        r->buffer_size = MAX_BUFFER_SIZE / 4;
+        r->buffer = io_buffer_alloc(r->buffer_size);
+        if (r->buffer == NULL) {
+            return ERROR_FILE_READ;
+        }
+    }
+    while (done < size) {
+        size_t want = size - done < r->buffer_size ? (size_t)(size - done) : r->buffer_size;
+        ssize_t n = read_stream(r->in_fd, r->buffer, want);
+        if (n <= 0) {
+            errno = n < 0 ? errno : EPIPE;
+            return ERROR_FILE_READ;
+        }
+        if (fd >= 0 && write_all(fd, r->buffer, (size_t)n) != SUCCESS) {
+            return ERROR_FILE_WRITE;
+        }
+        done += n;
+        if (fd >= 0) {
+            display_progress((long)done, (long)size, name);
+        }
+    }
+
+    // Padding to the next block
+    char pad[TAR_BLOCK_SIZE];
+    size_t pad_len = padding_of(size);
+    if (pad_len > 0 && read_stream(r->in_fd, pad, pad_len) != (ssize_t)pad_len) {
+        errno = EPIPE;
+        return ERROR_FILE_READ;
+    }
+    return SUCCESS;
+}
+
+static mode_t member_mode(const TarReader *r, const TarMember *m) {
+    return m->mode & (r->privileged ? 07777 : 0777);
+}
+
+// Remove whatever is in the way of a new non-directory entry
+static void clear_entry(int dirfd, const char *name) {
+    STATS_TIMED(STATS_METADATA, unlinkat(dirfd, name, 0));
+}
+
+static int extract_file(TarReader *r, const TarMember *m) {
+    const char *name;
+    int dirfd = open_parent(r, m->path, 1, &name);
+    int fd, result;
+    long start = stats_clock();
+
+    if (dirfd < 0) {
+        read_data(r, -1, m->size, m->path);
+        return ERROR_DIR_CREATE;
+    }
+    clear_entry(dirfd, name);
+    STATS_TIMED(STATS_OPEN, fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                                        0600));
+    if (fd < 0) {
+        int saved_errno = errno;
+        read_data(r, -1, m->size, m->path);
+        errno = saved_errno;
+        return ERROR_FILE_OPEN;
+    }
+    if (m->size >= COPY_HINT_MIN_SIZE) {
+        STATS_TIMED(STATS_METADATA, fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)m->size));
+    }
+
+    result = read_data(r, fd, m->size, m->path);
+    if (progress_enabled() && effective_progress_mode() == PROGRESS_FILE) {
+        finish_progress();
+    }
+    if (result == SUCCESS) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, m->mtime };
+        if (r->privileged) {
+            STATS_TIMED(STATS_METADATA, fchown(fd, (uid_t)m->uid, (gid_t)m->gid));
+        }
+        STATS_TIMED(STATS_METADATA, fchmod(fd, member_mode(r, m)));
+        STATS_TIMED(STATS_METADATA, futimens(fd, times));
+    }
+    STATS_TIMED(STATS_OPEN, close(fd));
+
+    if (result == SUCCESS && r->stats != NULL) {
+        r->stats->total_files++;
+        r->stats->total_bytes += m->size;
+        r->stats->physical_bytes += m->size;
+        // splice() is counted with sendfile(), the other in-kernel stream copy
+        r->stats->engine_files[r->use_splice ? COPY_ENGINE_SENDFILE : COPY_ENGINE_READ_WRITE]++;
+        update_stats(r->stats, (long)m->size);
+        stats_file_done(r->stats, start);
+    }
+    return result;
+}
+
+static int extract_dir(TarReader *r, const TarMember *m) {
+    TarDir *dir;
+
+    if (m->path[0] != '\0') {
+        const char *name;
+        int dirfd = open_parent(r, m->path, 1, &name);
+        struct stat st;
+        int made, existing = 0;
+
+        if (dirfd < 0) {
+            return ERROR_DIR_CREATE;
+        }
+        // Owner-only until its contents are in; the real mode comes last
+        STATS_TIMED(STATS_METADATA, made = mkdirat(dirfd, name, 0700));
+        if (made != 0 && errno == EEXIST) {
+            if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+                existing = 1;
+            } else {
+                clear_entry(dirfd, name);
+                STATS_TIMED(STATS_METADATA, made = mkdirat(dirfd, name, 0700));
+            }
+        }
+        if (made != 0 && !existing) {
+            return ERROR_DIR_CREATE;
+        }
+        if (made == 0 && r->stats != NULL) {
+            r->stats->total_dirs++;
+        }
+    }
+
+    if (r->dir_count == r->dir_capacity) {
+        size_t capacity = r->dir_capacity > 0 ? r->dir_capacity * 2 : 256;
+        TarDir *grown = realloc(r->dirs, capacity * sizeof(TarDir));
+        if (grown == NULL) {
+            return SUCCESS;     // Only the final mode and mtime are lost
+        }
+        r->dirs = grown;
+        r->dir_capacity = capacity;
+    }
+    dir = &r->dirs[r->dir_count];
+    dir->path = strdup(m->path);
+    if (dir->path != NULL) {
+        dir->mode = member_mode(r, m);
+        dir->mtime = m->mtime;
+        dir->uid = m->uid;
+        dir->gid = m->gid;
+        r->dir_count++;
+    }
+    return SUCCESS;
+}
+
+static int extract_link(TarReader *r, const TarMember *m) {
+    const char *name;
+    int dirfd, result;
+
+    if (m->type == TAR_HARDLINK) {
+        char target[MAX_PATH], target_base[MAX_PATH];
+        const char *target_name;
+        int target_fd;
+
+        // Targets are members too, confined the same way
+        if (clean_member_path(m->linkpath, target) != SUCCESS || target[0] == '\0') {
+            return ERROR_INVALID_PATH;
+        }
+        target_fd = open_parent(r, target, 0, &target_name);
+        if (target_fd < 0) {
+            return ERROR_FILE_OPEN;
+        }
+        // open_parent reuses one descriptor; keep the target's across the next call
+        target_fd = dup(target_fd);
+        snprintf(target_base, sizeof(target_base), "%s", target_name);
+        dirfd = target_fd >= 0 ? open_parent(r, m->path, 1, &name) : -1;
+        if (dirfd < 0) {
+            if (target_fd >= 0) {
+                close(target_fd);
+            }
+            return ERROR_DIR_CREATE;
+        }
+        clear_entry(dirfd, name);
+        STATS_TIMED(STATS_METADATA, result = linkat(target_fd, target_base, dirfd, name, 0));
+        close(target_fd);
+        if (result != 0) {
+            return ERROR_FILE_WRITE;
+        }
+        if (r->stats != NULL) {
+            r->stats->linked_files++;
+        }
+        return m->size > 0 ? read_data(r, -1, m->size, m->path) : SUCCESS;
+    }
+
+    dirfd = open_parent(r, m->path, 1, &name);
+    if (dirfd < 0) {
+        return ERROR_DIR_CREATE;
+    }
+    clear_entry(dirfd, name);
+
+    if (m->type == TAR_SYMLINK) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, m->mtime };
+        STATS_TIMED(STATS_METADATA, result = symlinkat(m->linkpath, dirfd, name));
+        if (result != 0) {
+            return ERROR_FILE_WRITE;
+        }
+        if (r->privileged) {
+            fchownat(dirfd, name, (uid_t)m->uid, (gid_t)m->gid, AT_SYMLINK_NOFOLLOW);
+        }
+        STATS_TIMED(STATS_METADATA, utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW));
+        return SUCCESS;
+    }
+
+    // FIFOs and, as root, device nodes
+    if (m->type != TAR_FIFO && !r->privileged) {
+        fprintf(stderr, "Warning (%s): Device nodes need root, skipped\n", m->path);
+        return SUCCESS;
+    }
+    mode_t kind = m->type == TAR_FIFO ? S_IFIFO : m->type == TAR_CHAR ? S_IFCHR : S_IFBLK;
+    STATS_TIMED(STATS_METADATA,
+                result = mknodat(dirfd, name, kind | member_mode(r, m), makedev(m->devmajor, m->devminor)));
+    if (result != 0) {
+        return ERROR_FILE_WRITE;
+    }
+    if (r->privileged) {
+        fchownat(dirfd, name, (uid_t)m->uid, (gid_t)m->gid, AT_SYMLINK_NOFOLLOW);
+    }
+    fchmodat(dirfd, name, member_mode(r, m), 0);
+    return SUCCESS;
+}
+
+// Directory modes and mtimes, deepest (latest created) first
+static void finish_dirs(TarReader *r) {
+    for (size_t i = r->dir_count; i-- > 0;) {
+        TarDir *dir = &r->dirs[i];
+        struct timespec times[2] = { { 0, UTIME_OMIT }, dir->mtime };
+        int fd = -1;
+
+        if (dir->path[0] == '\0') {
+            fd = dup(r->root_fd);
+        } else {
+            const char *name;
+            int dirfd = open_parent(r, dir->path, 0, &name);
+            if (dirfd >= 0) {
+                fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+        }
+        if (fd >= 0) {
+            if (r->privileged) {
+                fchown(fd, (uid_t)dir->uid, (gid_t)dir->gid);
+            }
+            STATS_TIMED(STATS_METADATA, fchmod(fd, dir->mode));
+            STATS_TIMED(STATS_METADATA, futimens(fd, times));
+            close(fd);
+        }
+        free(dir->path);
+    }
+    free(r->dirs);
+    r->dirs = NULL;
+    r->dir_count = 0;
+}
+
+// Apply a header (and pending overrides) to a member
+static int parse_member(const TarHeader *header, TarOverrides *over, TarMember *m) {
+    char raw[MAX_PATH];
+
+    if (over->has_path) {
+        snprintf(raw, sizeof(raw), "%s", over->path);
+    } else if (memcmp(header->magic, "ustar", 5) == 0 && header->prefix[0] != '\0') {
+        snprintf(raw, sizeof(raw), "%.155s/%.100s", header->prefix, header->name);
+    } else {
+        snprintf(raw, sizeof(raw), "%.100s", header->name);
+    }
+    if (over->has_linkpath) {
+        snprintf(m->linkpath, sizeof(m->linkpath), "%s", over->linkpath);
+    } else {
+        snprintf(m->linkpath, sizeof(m->linkpath), "%.100s", header->linkname);
+    }
+
+    m->type = header->typeflag == '\0' ? TAR_REGULAR : header->typeflag;
+    m->mode = (mode_t)get_number(header->mode, sizeof(header->mode));
+    m->uid = over->has_uid ? over->uid : get_number(header->uid, sizeof(header->uid));
+    m->gid = over->has_gid ? over->gid : get_number(header->gid, sizeof(header->gid));
+    m->size = over->has_size ? over->size : get_number(header->size, sizeof(header->size));
+    if (over->has_mtime) {
+        m->mtime = over->mtime;
+    } else {
+        m->mtime.tv_sec = (time_t)get_number(header->mtime, sizeof(header->mtime));
+        m->mtime.tv_nsec = 0;
+    }
+    m->devmajor = (unsigned)get_number(header->devmajor, sizeof(header->devmajor));
+    m->devminor = (unsigned)get_number(header->devminor, sizeof(header->devminor));
+
+    // Old archives mark directories only by a trailing slash
+    if (m->type == TAR_REGULAR && raw[0] != '\0' && raw[strlen(raw) - 1] == '/') {
+        m->type = TAR_DIRECTORY;
+    }
+    memset(over, 0, sizeof(*over));
+
+    if (clean_member_path(raw, m->path) != SUCCESS) {
+        fprintf(stderr, "Error (%s): Member would be unpacked outside the destination\n", raw);
+        return ERROR_INVALID_PATH;
+    }
+    return SUCCESS;
+}
+
+// Data of an extended header, NUL-terminated
+static char *read_extension(TarReader *r, unsigned long long size) {
+    char *data;
+
+    if (size > TAR_PAX_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+    data = malloc((size_t)size + 1);
+    if (data == NULL) {
+        return NULL;
+    }
+    if (read_stream(r->in_fd, data, (size_t)size) != (ssize_t)size) {
+        free(data);
+        errno = EPIPE;
+        return NULL;
+    }
+
+    char pad[TAR_BLOCK_SIZE];
+    size_t pad_len = padding_of(size);
+    if (pad_len > 0 && read_stream(r->in_fd, pad, pad_len) != (ssize_t)pad_len) {
+        free(data);
+        errno = EPIPE;
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+int tar_extract(int in_fd, const char *dest_path, CopyStats *stats) {
+    TarReader r;
+    TarOverrides over;
+    TarMember member;
+    TarHeader header;
+    struct stat in_st;
+    int zero_blocks = 0;
+    int result;
+
+    memset(&r, 0, sizeof(r));
+    memset(&over, 0, sizeof(over));
+    r.in_fd = in_fd;
+    r.use_splice = fstat(in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode);
+    r.privileged = geteuid() == 0;
+    r.stats = stats;
+    r.parent_fd = -1;
+
+    result = create_directory(dest_path);
+    if (result != SUCCESS) {
+        return result;
+    }
+    r.root_fd = open(dest_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (r.root_fd < 0) {
+        return ERROR_DIR_OPEN;
+    }
+
+    CopyStats *outer = stats_bind(stats);
+    while (result == SUCCESS) {
+        ssize_t n = read_stream(in_fd, &header, sizeof(header));
+
+        // Streams cut right after a member are accepted, like tar does
+        if (n == 0) {
+            break;
+        }
+        if (n != (ssize_t)sizeof(header)) {
+            errno = n < 0 ? errno : EPIPE;
+            result = ERROR_FILE_READ;
+            break;
+        }
+        if (memcmp(&header, zero_block, sizeof(header)) == 0) {
+            if (++zero_blocks == 2) {
+                break;
+            }
+            continue;
+        }
+        zero_blocks = 0;
+        if (!header_valid(&header)) {
+            fprintf(stderr, "Error: Not a tar stream (bad header checksum)\n");
+            result = ERROR_FILE_READ;
+            break;
+        }
+
+        unsigned long long size = get_number(header.size, sizeof(header.size));
+        char *data;
+        switch (header.typeflag) {
+            case TAR_PAX_LOCAL:
+            case TAR_PAX_GLOBAL:
+            case TAR_GNU_LONGNAME:
+            case TAR_GNU_LONGLINK:
+                data = read_extension(&r, size);
+                if (data == NULL) {
+                    result = ERROR_FILE_READ;
+                    break;
+                }
+                // Global headers would apply to every later member; their
+                // usual contents (comments, charset) do not matter here
+                if (header.typeflag == TAR_PAX_LOCAL) {
+                    result = parse_pax(data, (size_t)size, &over);
+                    if (result != SUCCESS) {
+                        fprintf(stderr, "Error: Corrupt tar stream (bad pax header)\n");
+                        free(data);
+                        break;
+                    }
+                } else if (header.typeflag == TAR_GNU_LONGNAME) {
+                    snprintf(over.path, sizeof(over.path), "%s", data);
+                    over.has_path = 1;
+                } else if (header.typeflag == TAR_GNU_LONGLINK) {
+                    snprintf(over.linkpath, sizeof(over.linkpath), "%s", data);
+                    over.has_linkpath = 1;
+                }
+                free(data);
+                continue;
+            default:
+                break;
+        }
+        if (result != SUCCESS) {
+            break;
+        }
+
+        result = parse_member(&header, &over, &member);
+        if (result != SUCCESS) {
+            break;
+        }
+        switch (member.type) {
+            case TAR_REGULAR:
+            case TAR_CONTIGUOUS:
+                result = member.path[0] != '\0' ? extract_file(&r, &member) : ERROR_INVALID_PATH;
+                break;
+            case TAR_DIRECTORY:
+                result = extract_dir(&r, &member);
+                break;
+            case TAR_HARDLINK:
+            case TAR_SYMLINK:
+            case TAR_CHAR:
+            case TAR_BLOCK:
+            case TAR_FIFO:
+                result = member.path[0] != '\0' ? extract_link(&r, &member) : ERROR_INVALID_PATH;
+                break;
+            default:
+                fprintf(stderr, "Warning (%s): Unsupported member type '%c', skipped\n",
+                        member.path, member.type);
+                result = read_data(&r, -1, member.size, member.path);
+                break;
+        }
+        if (result != SUCCESS) {
+            print_error(result, member.path);
+        }
+    }
+
+    finish_dirs(&r);
+    stats_bind(outer);
+
+    if (r.parent_fd >= 0) {
+        close(r.parent_fd);
+    }
+    close(r.root_fd);
+    free(r.buffer);
+    return result;
+}
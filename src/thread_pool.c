@@ -0,0 +1,257 @@
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+
+typedef struct {
+    TaskFunc func;
+    void *arg;
+} Task;
+
+// Growable ring buffer; the owner works at the tail, thieves at the head
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} TaskDeque;
+
+struct ThreadPool {
+    int num_threads;
+    int num_deques;
+    pthread_t *threads;
+    TaskDeque *deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+    int shutdown;
+
+    atomic_long queued;       // tasks sitting in some deque
+    atomic_long pending;      // tasks submitted but not finished
+    atomic_uint next_deque;   // round-robin cursor for external submits
+};
+
+static _Thread_local ThreadPool *current_pool = NULL;
+static _Thread_local int current_worker = -1;
+
+static int deque_push(TaskDeque *dq, Task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : 64;
+        Task *grown = malloc(new_capacity * sizeof(Task));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            grown[i] = dq->tasks[(dq->head + i) % dq->capacity];
+        }
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->capacity = new_capacity;
+        dq->head = 0;
+    }
+    dq->tasks[(dq->head + dq->count) % dq->capacity] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Owner side: newest task first (keeps a worker on the subtree it just expanded)
+static int deque_pop(TaskDeque *dq, Task *task) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *task = dq->tasks[(dq->head + dq->count) % dq->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Thief side: oldest task first
+static int deque_steal(TaskDeque *dq, Task *task) {
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0) {
+        return 0;
+    }
+    if (dq->count > 0) {
+        *task = dq->tasks[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int find_task(ThreadPool *pool, int self, Task *task) {
+    if (deque_pop(&pool->deques[self], task)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->num_threads; i++) {
+        int victim = (self + i) % pool->num_threads;
+        if (deque_steal(&pool->deques[victim], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    ThreadPool *pool = arg;
+    int self;
+    Task task;
+
+    pthread_mutex_lock(&pool->lock);
+    for (self = 0; self < pool->num_threads; self++) {
+        if (pthread_equal(pool->threads[self], pthread_self())) break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    current_pool = pool;
+    current_worker = self;
+
+    while (1) {
+        if (atomic_load(&pool->queued) > 0 && find_task(pool, self, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            task.func(task.arg);
+
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->all_done);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+        if (pool->shutdown && atomic_load(&pool->queued) == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+ThreadPool *thread_pool_create(int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_WORKERS) num_threads = MAX_WORKERS;
+
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    pool->deques = calloc(num_threads, sizeof(TaskDeque));
+    if (pool->threads == NULL || pool->deques == NULL) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next_deque, 0);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pool->num_deques = num_threads;
+
+    // Workers look themselves up in pool->threads, so hold the lock while
+    // the array is being filled in
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            break;
+        }
+        pool->num_threads++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->num_threads == 0) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int thread_pool_submit(ThreadPool *pool, TaskFunc func, void *arg) {
+    Task task = { func, arg };
+    int target;
+
+    if (current_pool == pool && current_worker >= 0) {
+        target = current_worker;
+    } else {
+        target = (int)(atomic_fetch_add(&pool->next_deque, 1) % (unsigned)pool->num_threads);
+    }
+
+    atomic_fetch_add(&pool->pending, 1);
+    if (deque_push(&pool->deques[target], task) != 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i < pool->num_deques; i++) {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+int thread_pool_size(const ThreadPool *pool) {
+    return pool->num_threads;
+}
+
+int thread_pool_worker_index(void) {
+    return current_worker;
+}
@@ -0,0 +1,218 @@
+#include "tree_remove.h"
+#include "path_arena.h"
+#include "thread_pool.h"
+#include <stdatomic.h>
+
+typedef struct {
+    ThreadPool *pool;           // NULL: subdirectories are removed inline
+    const char *root;           // For error messages
+    int empty_dirs_only;
+    atomic_long failures;
+} RemoveJob;
+
+// A directory being emptied
+typedef struct RemoveNode {
+    struct RemoveNode *parent;  // NULL for the root
+    RemoveJob *job;
+    int fd;                     // Open directory, -1 until (or unless) opened
+    atomic_long pending;        // Own scan plus subdirectories not removed yet
+    char name[];                // Name in the parent directory
+} RemoveNode;
+
+static RemoveNode *new_node(RemoveJob *job, RemoveNode *parent, const char *name) {
+    size_t len = strlen(name);
+    RemoveNode *node = malloc(sizeof(RemoveNode) + len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->parent = parent;
+    node->job = job;
+    node->fd = -1;
+    atomic_init(&node->pending, 1);
+    memcpy(node->name, name, len + 1);
+    return node;
+}
+
+// Rebuild the full path of dir/name for a message
+static int node_path(const RemoveNode *dir, const char *name, PathBuf *path) {
+    if (dir->parent == NULL) {
+        return path_buf_init(path, dir->job->root) != 0 ? -1 : path_buf_push(path, name);
+    }
+    return node_path(dir->parent, dir->name, path) != 0 ? -1 : path_buf_push(path, name);
+}
+
+static void remove_failed(const RemoveNode *dir, const char *name) {
+    RemoveJob *job = dir->job;
+    int saved_errno = errno;
+    PathBuf path;
+
+    atomic_fetch_add(&job->failures, 1);
+
+    // Directories kept non-empty by files a move could not take are expected
+    if (job->empty_dirs_only && (saved_errno == ENOTEMPTY || saved_errno == EEXIST)) {
+        return;
+    }
+    int built = node_path(dir, name, &path) == 0;
+    errno = saved_errno;
+    print_error(ERROR_FILE_WRITE, built ? path.data : name);
+    path_buf_free(&path);
+}
+
+// Drop one reference; the last one removes the directory from its parent,
+// which may in turn finish the parent
+static void release_node(RemoveNode *node) {
+    while (node != NULL && atomic_fetch_sub(&node->pending, 1) == 1) {
+        RemoveNode *parent = node->parent;
+
+        if (node->fd >= 0) {
+            close(node->fd);
+            if (parent != NULL && unlinkat(parent->fd, node->name, AT_REMOVEDIR) != 0 &&
+                errno != ENOENT) {
+                remove_failed(parent, node->name);
+            }
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+static void scan_node(RemoveNode *node);
+
+static void scan_task(void *arg) {
+    scan_node(arg);
+}
+
+static void remove_subdirectory(RemoveNode *dir, const char *name) {
+    RemoveJob *job = dir->job;
+    RemoveNode *child = new_node(job, dir, name);
+
+    if (child == NULL) {
+        errno = ENOMEM;
+        remove_failed(dir, name);
+        return;
+    }
+
+    atomic_fetch_add(&dir->pending, 1);
+    if (job->pool == NULL || thread_pool_submit(job->pool, scan_task, child) != 0) {
+        scan_node(child);
+    }
+}
+
+// Check whether an entry is a directory without following symlinks
+static int entry_is_directory(int dirfd, const struct dirent *entry) {
+    struct stat st;
+
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type == DT_DIR;
+    }
+    return fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Remove the files of a directory and queue its subdirectories
+static void scan_node(RemoveNode *node) {
+    RemoveJob *job = node->job;
+    struct dirent *entry;
+    DIR *dir = NULL;
+    int scan_fd;
+
+    if (node->parent != NULL) {
+        node->fd = openat(node->parent->fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (node->fd < 0) {
+            remove_failed(node->parent, node->name);
+            release_node(node);
+            return;
+        }
+    }
+
+    // The stream gets its own descriptor: node->fd outlives the scan,
+    // as subdirectories are removed relative to it
+    scan_fd = dup(node->fd);
+    if (scan_fd >= 0) {
+        dir = fdopendir(scan_fd);
+    }
+    if (dir == NULL) {
+        if (scan_fd >= 0) {
+            close(scan_fd);
+        }
+        remove_failed(node, ".");
+        release_node(node);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (entry->d_type == DT_DIR) {
+            remove_subdirectory(node, entry->d_name);
+            continue;
+        }
+
+        if (job->empty_dirs_only) {
+            if (entry->d_type == DT_UNKNOWN && entry_is_directory(node->fd, entry)) {
+                remove_subdirectory(node, entry->d_name);
+            }
+            continue;
+        }
+
+        if (unlinkat(node->fd, entry->d_name, 0) == 0 || errno == ENOENT) {
+            continue;
+        }
+        // Without d_type the unlink attempt is the type check
+        if (entry->d_type == DT_UNKNOWN && entry_is_directory(node->fd, entry)) {
+            remove_subdirectory(node, entry->d_name);
+            continue;
+        }
+        remove_failed(node, entry->d_name);
+    }
+
+    closedir(dir);
+    release_node(node);
+}
+
+int tree_remove(const char *path, int jobs, int empty_dirs_only) {
+    return tree_remove_at(AT_FDCWD, path, path, jobs, empty_dirs_only);
+}
+
+int tree_remove_at(int dirfd, const char *name, const char *path, int jobs, int empty_dirs_only) {
+    RemoveJob job;
+    RemoveNode *root;
+
+    memset(&job, 0, sizeof(job));
+    job.root = path;
+    job.empty_dirs_only = empty_dirs_only;
+    atomic_init(&job.failures, 0);
+
+    root = new_node(&job, NULL, "");
+    if (root == NULL) {
+        return ERROR_DIR_OPEN;
+    }
+    root->fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (root->fd < 0) {
+        free(root);
+        return ERROR_DIR_OPEN;
+    }
+
+    // A pool worker (e.g. --delete in a parallel copy) must not wait on a pool
+    if (jobs > 1 && thread_pool_worker_index() < 0) {
+        job.pool = thread_pool_create(jobs);
+    }
+
+    scan_node(root);
+
+    if (job.pool != NULL) {
+        thread_pool_wait(job.pool);
+        thread_pool_destroy(job.pool);
+    }
+
+    // ENOTEMPTY: whatever is left was reported above
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0) {
+        if (errno != ENOTEMPTY) {
+            print_error(ERROR_FILE_WRITE, path);
+        }
+        return ERROR_FILE_WRITE;
+    }
+
+    return atomic_load(&job.failures) > 0 ? ERROR_FILE_WRITE : SUCCESS;
+}
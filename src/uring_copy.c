@@ -0,0 +1,448 @@
+#include "uring_copy.h"
+#include "rate_limit.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <stdint.h>
+#endif
+
+int uring_copy_enabled(void) {
+#ifdef HAVE_LIBURING
+    // Verified, synced, indexed, durable, cache-neutral, deduplicated,
+    // compressed, journaled and rate-limited copies need the per-file path
+    const CopyOptions *opts = get_copy_options();
+    return opts->use_io_uring && opts->verify == VERIFY_NONE && opts->sync == SYNC_OFF &&
+           opts->index_path == NULL && opts->durable == DURABLE_OFF && !opts->cache_neutral &&
+           opts->dedup == DEDUP_OFF && opts->compress == COMPRESS_NONE && !opts->decompress &&
+           opts->resume_path == NULL && !rate_limit_active();
+#else
+    return 0;
+#endif
+}
+
+int uring_wants_file(const struct stat *st) {
+    // Hardlinked sources are linked, not copied, after the first name
+    return uring_copy_enabled() && S_ISREG(st->st_mode) && st->st_nlink < 2 &&
+           st->st_size <= URING_MAX_FILE_SIZE;
+}
+
+UringBatch *uring_batch_new(void) {
+    return calloc(1, sizeof(UringBatch));
+}
+
+int uring_batch_add(UringBatch *batch, const char *src_path, const char *dest_path,
+                    const struct stat *st) {
+    UringCopyItem *item = &batch->items[batch->count];
+
+    item->src_path = strdup(src_path);
+    item->dest_path = strdup(dest_path);
+    if (item->src_path == NULL || item->dest_path == NULL) {
+        free(item->src_path);
+        free(item->dest_path);
+        return ERROR_FILE_OPEN;
+    }
+    item->size = st->st_size;
+    item->mode = st->st_mode;
+    batch->count++;
+
+    return SUCCESS;
+}
+
+int uring_batch_full(const UringBatch *batch) {
+    return batch->count >= URING_BATCH_FILES;
+}
+
+static void batch_clear(UringBatch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->items[i].src_path);
+        free(batch->items[i].dest_path);
+    }
+    batch->count = 0;
+}
+
+void uring_batch_free(UringBatch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+    batch_clear(batch);
+    free(batch);
+}
+
+// Synchronous path: used when io_uring is not compiled in or not permitted
+static int copy_items_directly(const UringCopyItem *items, size_t count, CopyStats *stats,
+                               UringErrorFunc on_error, void *ctx) {
+    int first_error = SUCCESS;
+
+    for (size_t i = 0; i < count; i++) {
+        int result = copy_file_with_stats(items[i].src_path, items[i].dest_path, stats);
+        if (result != SUCCESS) {
+            if (on_error != NULL) {
+                on_error(ctx, &items[i], result, errno);
+            }
+            if (first_error == SUCCESS) {
+                first_error = result;
+            }
+        }
+    }
+
+    return first_error;
+}
+
+#ifdef HAVE_LIBURING
+
+// Operation tags stored in the low bits of each request's user data
+enum {
+    OP_OPEN_SRC,
+    OP_OPEN_DEST,
+    OP_READ,
+    OP_WRITE,
+    OP_CLOSE
+};
+
+#define OP_BITS 4
+
+// Slot states
+enum {
+    SLOT_IDLE,
+    SLOT_OPENING,
+    SLOT_COPYING,
+    SLOT_CLOSING
+};
+
+typedef struct {
+    const UringCopyItem *item;
+    char *buffer;
+    int state;
+    int inflight;           // requests submitted but not completed
+    int src_fd;
+    int dest_fd;
+    int error_code;
+    int saved_errno;
+    int fallback;           // kernel refused the opcode, use copy_file
+    off_t offset;           // bytes fully written
+    size_t chunk;           // bytes in buffer
+    size_t chunk_written;   // bytes of buffer already written
+} UringSlot;
+
+typedef struct {
+    struct io_uring ring;
+    UringSlot *slots;
+    CopyStats *stats;
+    UringErrorFunc on_error;
+    void *ctx;
+    int first_error;
+} UringCopier;
+
+static struct io_uring_sqe *get_sqe(UringCopier *copier) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&copier->ring);
+    if (sqe == NULL) {
+        // Submission queue full: push what we have and try again
+        io_uring_submit(&copier->ring);
+        sqe = io_uring_get_sqe(&copier->ring);
+    }
+    return sqe;
+}
+
+static void queue_op(UringCopier *copier, size_t index, int op, struct io_uring_sqe *sqe) {
+    UringSlot *slot = &copier->slots[index];
+    io_uring_sqe_set_data64(sqe, ((uint64_t)index << OP_BITS) | (uint64_t)op);
+    slot->inflight++;
+}
+
+static void slot_fail(UringSlot *slot, int error_code, int err) {
+    if (slot->error_code == SUCCESS) {
+        slot->error_code = error_code;
+        slot->saved_errno = err;
+    }
+}
+
+static int slot_start(UringCopier *copier, size_t index, const UringCopyItem *item) {
+    UringSlot *slot = &copier->slots[index];
+    struct io_uring_sqe *sqe;
+
+    slot->item = item;
+    slot->state = SLOT_OPENING;
+    slot->inflight = 0;
+    slot->src_fd = -1;
+    slot->dest_fd = -1;
+    slot->error_code = SUCCESS;
+    slot->saved_errno = 0;
+    slot->fallback = 0;
+    slot->offset = 0;
+
+    // Source and destination opens are independent, issue both at once
+    sqe = get_sqe(copier);
+    if (sqe == NULL) return -1;
+    io_uring_prep_openat(sqe, AT_FDCWD, item->src_path, O_RDONLY | O_CLOEXEC, 0);
+    queue_op(copier, index, OP_OPEN_SRC, sqe);
+
+    sqe = get_sqe(copier);
+    if (sqe == NULL) return -1;
+    io_uring_prep_openat(sqe, AT_FDCWD, item->dest_path,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    queue_op(copier, index, OP_OPEN_DEST, sqe);
+
+    return 0;
+}
+
+static void slot_read(UringCopier *copier, size_t index) {
+    UringSlot *slot = &copier->slots[index];
+    struct io_uring_sqe *sqe = get_sqe(copier);
+
+    if (sqe == NULL) {
+        slot_fail(slot, ERROR_FILE_READ, EBUSY);
+        return;
+    }
+    io_uring_prep_read(sqe, slot->src_fd, slot->buffer, URING_BUFFER_SIZE, slot->offset);
+    queue_op(copier, index, OP_READ, sqe);
+}
+
+static void slot_write(UringCopier *copier, size_t index) {
+    UringSlot *slot = &copier->slots[index];
+    struct io_uring_sqe *sqe = get_sqe(copier);
+
+    if (sqe == NULL) {
+        slot_fail(slot, ERROR_FILE_WRITE, EBUSY);
+        return;
+    }
+    io_uring_prep_write(sqe, slot->dest_fd, slot->buffer + slot->chunk_written,
+                        slot->chunk - slot->chunk_written,
+                        slot->offset + slot->chunk_written);
+    queue_op(copier, index, OP_WRITE, sqe);
+}
+
+// Apply permissions and queue the closes; the slot is done once both complete
+static void slot_close(UringCopier *copier, size_t index) {
+    UringSlot *slot = &copier->slots[index];
+    int fds[2] = { slot->src_fd, slot->dest_fd };
+
+    if (slot->error_code == SUCCESS && slot->dest_fd >= 0) {
+        fchmod(slot->dest_fd, slot->item->mode);
+    }
+
+    slot->state = SLOT_CLOSING;
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0) continue;
+        struct io_uring_sqe *sqe = get_sqe(copier);
+        if (sqe == NULL) {
+            close(fds[i]);
+            continue;
+        }
+        io_uring_prep_close(sqe, fds[i]);
+        queue_op(copier, index, OP_CLOSE, sqe);
+    }
+    slot->src_fd = -1;
+    slot->dest_fd = -1;
+}
+
+static void slot_finish(UringCopier *copier, UringSlot *slot) {
+    const UringCopyItem *item = slot->item;
+
+    slot->state = SLOT_IDLE;
+
+    if (slot->fallback) {
+        int result = copy_items_directly(item, 1, copier->stats, copier->on_error, copier->ctx);
+        if (result != SUCCESS && copier->first_error == SUCCESS) {
+            copier->first_error = result;
+        }
+        return;
+    }
+
+    if (slot->error_code != SUCCESS) {
+        if (copier->on_error != NULL) {
+            copier->on_error(copier->ctx, item, slot->error_code, slot->saved_errno);
+        }
+        if (copier->first_error == SUCCESS) {
+            copier->first_error = slot->error_code;
+        }
+        return;
+    }
+
+    if (copier->stats != NULL) {
+        copier->stats->total_files++;
+        copier->stats->total_bytes += slot->offset;
+        copier->stats->physical_bytes += slot->offset;
+        copier->stats->engine_files[COPY_ENGINE_IO_URING]++;
+        update_stats(copier->stats, slot->offset);
+    }
+}
+
+// Advance a slot's state machine for one completion
+// Returns 1 when the slot has finished its file
+static int slot_complete(UringCopier *copier, size_t index, int op, int res) {
+    UringSlot *slot = &copier->slots[index];
+
+    slot->inflight--;
+
+    switch (op) {
+        case OP_OPEN_SRC:
+        case OP_OPEN_DEST:
+            if (res < 0) {
+                if (res == -EINVAL || res == -EOPNOTSUPP) {
+                    slot->fallback = 1;
+                }
+                slot_fail(slot, ERROR_FILE_OPEN, -res);
+            } else if (op == OP_OPEN_SRC) {
+                slot->src_fd = res;
+            } else {
+                slot->dest_fd = res;
+            }
+            if (slot->inflight > 0) {
+                return 0;
+            }
+            if (slot->error_code != SUCCESS || slot->item->size == 0) {
+                slot_close(copier, index);
+            } else {
+                slot->state = SLOT_COPYING;
+                slot_read(copier, index);
+            }
+            break;
+
+        case OP_READ:
+            if (res < 0) {
+                slot_fail(slot, ERROR_FILE_READ, -res);
+                slot_close(copier, index);
+            } else if (res == 0) {
+                slot_close(copier, index);
+            } else {
+                slot->chunk = (size_t)res;
+                slot->chunk_written = 0;
+                slot_write(copier, index);
+            }
+            break;
+
+        case OP_WRITE:
+            if (res <= 0) {
+                slot_fail(slot, ERROR_FILE_WRITE, res < 0 ? -res : EIO);
+                slot_close(copier, index);
+                break;
+            }
+            slot->chunk_written += (size_t)res;
+            if (slot->chunk_written < slot->chunk) {
+                slot_write(copier, index);
+                break;
+            }
+            slot->offset += (off_t)slot->chunk;
+            if (slot->offset >= slot->item->size) {
+                slot_close(copier, index);
+            } else {
+                slot_read(copier, index);
+            }
+            break;
+
+        case OP_CLOSE:
+            break;
+    }
+
+    // A failed submit leaves nothing in flight; close out the slot
+    if (slot->inflight == 0 && slot->state != SLOT_CLOSING) {
+        slot_close(copier, index);
+    }
+
+    return slot->state == SLOT_CLOSING && slot->inflight == 0;
+}
+
+static int uring_copy_items(const UringCopyItem *items, size_t count, CopyStats *stats,
+                            UringErrorFunc on_error, void *ctx) {
+    UringCopier copier;
+    int depth = get_copy_options()->queue_depth;
+    char *buffers;
+    size_t next = 0;
+    size_t active = 0;
+
+    if (depth < 1) depth = 1;
+    if (depth > URING_MAX_QUEUE_DEPTH) depth = URING_MAX_QUEUE_DEPTH;
+    if ((size_t)depth > count) depth = (int)count;
+
+    memset(&copier, 0, sizeof(copier));
+    copier.stats = stats;
+    copier.on_error = on_error;
+    copier.ctx = ctx;
+    copier.first_error = SUCCESS;
+
+    // Each file has at most two requests in flight (two opens or two closes)
+    if (io_uring_queue_init((unsigned)depth * 2, &copier.ring, 0) < 0) {
+        return copy_items_directly(items, count, stats, on_error, ctx);
+    }
+
+    copier.slots = calloc((size_t)depth, sizeof(UringSlot));
+    buffers = malloc((size_t)depth * URING_BUFFER_SIZE);
+    if (copier.slots == NULL || buffers == NULL) {
+        free(copier.slots);
+        free(buffers);
+        io_uring_queue_exit(&copier.ring);
+        return copy_items_directly(items, count, stats, on_error, ctx);
+    }
+
+    for (int i = 0; i < depth; i++) {
+        copier.slots[i].buffer = buffers + (size_t)i * URING_BUFFER_SIZE;
+        if (next < count && slot_start(&copier, (size_t)i, &items[next]) == 0) {
+            next++;
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        struct io_uring_cqe *cqe;
+
+        int ret = io_uring_submit_and_wait(&copier.ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            if (copier.first_error == SUCCESS) {
+                copier.first_error = ERROR_FILE_WRITE;
+            }
+            break;
+        }
+
+        while (io_uring_peek_cqe(&copier.ring, &cqe) == 0) {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            size_t index = (size_t)(data >> OP_BITS);
+            int op = (int)(data & ((1u << OP_BITS) - 1));
+            int res = cqe->res;
+
+            io_uring_cqe_seen(&copier.ring, cqe);
+
+            if (slot_complete(&copier, index, op, res)) {
+                slot_finish(&copier, &copier.slots[index]);
+                if (next < count && slot_start(&copier, index, &items[next]) == 0) {
+                    next++;
+                } else {
+                    active--;
+                }
+            }
+        }
+    }
+
+    io_uring_queue_exit(&copier.ring);
+    free(buffers);
+    free(copier.slots);
+
+    // Anything never started (ring failure) still gets copied
+    if (next < count) {
+        int result = copy_items_directly(items + next, count - next, stats, on_error, ctx);
+        if (result != SUCCESS && copier.first_error == SUCCESS) {
+            copier.first_error = result;
+        }
+    }
+
+    return copier.first_error;
+}
+
+#endif // HAVE_LIBURING
+
+int uring_batch_flush(UringBatch *batch, CopyStats *stats,
+                      UringErrorFunc on_error, void *ctx) {
+    int result = SUCCESS;
+
+    if (batch == NULL || batch->count == 0) {
+        return SUCCESS;
+    }
+
+#ifdef HAVE_LIBURING
+    result = uring_copy_items(batch->items, batch->count, stats, on_error, ctx);
+#else
+    result = copy_items_directly(batch->items, batch->count, stats, on_error, ctx);
+#endif
+
+    batch_clear(batch);
+    return result;
+}
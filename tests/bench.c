@@ -0,0 +1,755 @@
+// Benchmark harness (make bench)
+// Generates the standard corpora once, then times copy_file,
+// copy_directory, compare_files and calculate_md5 across copy engines,
+// buffer sizes and thread counts. Every run is one CSV row:
+//
+//   operation,corpus,engine,engine_used,buffer_size,jobs,cache,run,status,
+//   files,bytes,seconds,mib_per_s,files_per_s,p50_us,p99_us
+//
+// Per-file latencies of single-file operations are exact; for
+// copy_directory they come from the CopyStats histogram (bucket upper
+// bounds). Caches are dropped before every run when we may write
+// /proc/sys/vm/drop_caches ("cold"), otherwise runs are "warm".
+
+#include "file_operations.h"
+#include "compare.h"
+#include "copy_engine.h"
+#include "hash.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "tree_remove.h"
+#include <getopt.h>
+#include <stdint.h>
+
+#define BENCH_DEFAULT_DIR "/tmp/filecopy-bench"
+#define BENCH_MAX_LIST 16
+#define FILES_PER_DIR 1000
+#define DATA_CHUNK (1024 * 1024)    // Sparse corpus: data written per stride
+
+#define KB 1024L
+#define MB (1024L * 1024L)
+#define GB (1024L * 1024L * 1024L)
+
+/**
+ * Corpus description at scale 1
+ */
+typedef struct {
+    const char *name;
+    int tree;               // Many files under subdirectories (copy_directory)
+    long files;
+    off_t min_size;
+    off_t max_size;
+    off_t data_stride;      // Sparse: one DATA_CHUNK every data_stride bytes, 0 for dense
+} CorpusSpec;
+
+static const CorpusSpec corpus_specs[] = {
+    { "tiny",   1, 1000000, 1,        4 * KB,   0 },
+    { "medium", 1, 10000,   16 * KB,  256 * KB, 0 },
+    { "huge",   0, 4,       1 * GB,   1 * GB,   0 },
+    { "sparse", 0, 2,       4 * GB,   4 * GB,   64 * MB },
+};
+#define CORPUS_COUNT (int)(sizeof(corpus_specs) / sizeof(corpus_specs[0]))
+
+// A corpus scaled for this run
+typedef struct {
+    const CorpusSpec *spec;
+    long files;
+    off_t min_size;
+    off_t max_size;
+    off_t data_stride;
+    char path[MAX_PATH];
+} Corpus;
+
+typedef enum {
+    OP_COPY_FILE = 0,
+    OP_COPY_DIRECTORY,
+    OP_COMPARE_FILES,
+    OP_CALCULATE_MD5,
+    OP_COUNT
+} BenchOp;
+
+static const char *op_names[OP_COUNT] = {
+    "copy_file",
+    "copy_directory",
+    "compare_files",
+    "calculate_md5",
+};
+
+typedef struct {
+    const char *dir;
+    double scale;
+    int repeats;
+    int drop_caches;
+    int ops[OP_COUNT];
+    int corpora[CORPUS_COUNT];
+    CopyEngine engines[BENCH_MAX_LIST];
+    int engine_count;
+    size_t buffers[BENCH_MAX_LIST];     // 0: sized per file
+    int buffer_count;
+    int jobs[BENCH_MAX_LIST];
+    int job_count;
+    FILE *csv;
+} Bench;
+
+// One measured run
+typedef struct {
+    int status;
+    long files;
+    long bytes;
+    long elapsed_ns;
+    long p50_ns;
+    long p99_ns;
+    CopyEngine engine_used;     // COPY_ENGINE_AUTO when not a copy
+} RunResult;
+
+// ============================================================================
+// Corpus generation
+// ============================================================================
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Source of file contents: random bytes, read at a random offset per write
+static char noise[DATA_CHUNK + 4096];
+
+static void fill_noise(void) {
+    for (size_t i = 0; i + sizeof(uint64_t) <= sizeof(noise); i += sizeof(uint64_t)) {
+        uint64_t value = rng_next();
+        memcpy(noise + i, &value, sizeof(value));
+    }
+}
+
+static int write_corpus_file(const char *path, off_t size, off_t data_stride) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    off_t offset = 0;
+    int result = SUCCESS;
+
+    if (fd < 0) {
+        return ERROR_FILE_OPEN;
+    }
+
+    if (data_stride > 0) {
+        if (ftruncate(fd, size) != 0) {
+            result = ERROR_FILE_WRITE;
+        }
+        for (; result == SUCCESS && offset < size; offset += data_stride) {
+            size_t len = size - offset < DATA_CHUNK ? (size_t)(size - offset) : DATA_CHUNK;
+            if (pwrite(fd, noise + rng_next() % 4096, len, offset) != (ssize_t)len) {
+                result = ERROR_FILE_WRITE;
+            }
+        }
+    } else {
+        while (result == SUCCESS && offset < size) {
+            size_t len = size - offset < DATA_CHUNK ? (size_t)(size - offset) : DATA_CHUNK;
+            if (write(fd, noise + rng_next() % 4096, len) != (ssize_t)len) {
+                result = ERROR_FILE_WRITE;
+            }
+            offset += len;
+        }
+    }
+
+    if (close(fd) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+    return result;
+}
+
+// Path of the index-th file of a corpus below root; ERROR_INVALID_PATH if
+// it does not fit in buffer
+static int corpus_file_path(const Corpus *corpus, const char *root, long index,
+                            char *buffer, size_t size) {
+    int len;
+
+    if (corpus->spec->tree) {
+        len = snprintf(buffer, size, "%s/d%04ld/f%06ld", root, index / FILES_PER_DIR, index);
+    } else {
+        len = snprintf(buffer, size, "%s/f%03ld", root, index);
+    }
+    return len >= 0 && (size_t)len < size ? SUCCESS : ERROR_INVALID_PATH;
+}
+
+// Corpus parameters, stored next to a finished corpus to detect rescaling
+static void corpus_signature(const Corpus *corpus, char *buffer, size_t size) {
+    snprintf(buffer, size, "%ld %lld %lld %lld\n", corpus->files,
+             (long long)corpus->min_size, (long long)corpus->max_size,
+             (long long)corpus->data_stride);
+}
+
+static int corpus_is_current(const Corpus *corpus, const char *marker) {
+    char expected[128], actual[128] = "";
+    FILE *f = fopen(marker, "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    if (fgets(actual, sizeof(actual), f) == NULL) {
+        actual[0] = '\0';
+    }
+    fclose(f);
+    corpus_signature(corpus, expected, sizeof(expected));
+    return strcmp(actual, expected) == 0;
+}
+
+static int prepare_corpus(const Bench *bench, Corpus *corpus) {
+    char marker[MAX_PATH], reference[MAX_PATH], path[MAX_PATH];
+    char signature[128];
+    FILE *f;
+
+    snprintf(corpus->path, sizeof(corpus->path), "%s/corpus/%s", bench->dir, corpus->spec->name);
+    snprintf(marker, sizeof(marker), "%s/corpus/%s.done", bench->dir, corpus->spec->name);
+    if (corpus_is_current(corpus, marker)) {
+        return SUCCESS;
+    }
+
+    fprintf(stderr, "bench: generating %s corpus (%ld files) in %s\n",
+            corpus->spec->name, corpus->files, corpus->path);
+    unlink(marker);
+    snprintf(reference, sizeof(reference), "%s/reference/%s", bench->dir, corpus->spec->name);
+    if (path_exists(reference)) {
+        tree_remove(reference, 1, 0);
+    }
+    if (path_exists(corpus->path)) {
+        tree_remove(corpus->path, 1, 0);
+    }
+
+    rng_state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)(corpus->spec - corpus_specs);
+    for (long i = 0; i < corpus->files; i++) {
+        off_t size = corpus->min_size;
+        if (corpus->max_size > corpus->min_size) {
+            size += rng_next() % (uint64_t)(corpus->max_size - corpus->min_size + 1);
+        }
+        if (corpus->spec->tree && i % FILES_PER_DIR == 0) {
+            if ((size_t)snprintf(path, sizeof(path), "%s/d%04ld", corpus->path,
+                                 i / FILES_PER_DIR) >= sizeof(path)) {
+                print_error(ERROR_INVALID_PATH, corpus->path);
+                return ERROR_INVALID_PATH;
+            }
+            if (create_directory(path) != SUCCESS) {
+                print_error(ERROR_DIR_CREATE, path);
+                return ERROR_DIR_CREATE;
+            }
+        } else if (i == 0 && create_directory(corpus->path) != SUCCESS) {
+            print_error(ERROR_DIR_CREATE, corpus->path);
+            return ERROR_DIR_CREATE;
+        }
+        if (corpus_file_path(corpus, corpus->path, i, path, sizeof(path)) != SUCCESS) {
+            print_error(ERROR_INVALID_PATH, corpus->path);
+            return ERROR_INVALID_PATH;
+        }
+        if (write_corpus_file(path, size, corpus->data_stride) != SUCCESS) {
+            print_error(ERROR_FILE_WRITE, path);
+            return ERROR_FILE_WRITE;
+        }
+    }
+
+    corpus_signature(corpus, signature, sizeof(signature));
+    f = fopen(marker, "w");
+    if (f == NULL || fputs(signature, f) < 0 || fclose(f) != 0) {
+        print_error(ERROR_FILE_WRITE, marker);
+        return ERROR_FILE_WRITE;
+    }
+    return SUCCESS;
+}
+
+// Untimed copy of a file corpus for compare_files to compare against
+static int prepare_reference(const Bench *bench, const Corpus *corpus, char *root, size_t size) {
+    char src[MAX_PATH], dest[MAX_PATH];
+
+    snprintf(root, size, "%s/reference/%s", bench->dir, corpus->spec->name);
+    if (create_directory(root) != SUCCESS) {
+        return ERROR_DIR_CREATE;
+    }
+    for (long i = 0; i < corpus->files; i++) {
+        if (corpus_file_path(corpus, corpus->path, i, src, sizeof(src)) != SUCCESS ||
+            corpus_file_path(corpus, root, i, dest, sizeof(dest)) != SUCCESS) {
+            print_error(ERROR_INVALID_PATH, root);
+            return ERROR_INVALID_PATH;
+        }
+        if (!path_exists(dest) && copy_file_with_stats(src, dest, NULL) != SUCCESS) {
+            print_error(ERROR_FILE_WRITE, dest);
+            return ERROR_FILE_WRITE;
+        }
+    }
+    return SUCCESS;
+}
+
+// ============================================================================
+// Runs
+// ============================================================================
+
+// Empty the page cache; returns 1 if it was dropped
+static int drop_caches(const Bench *bench) {
+    int fd, dropped;
+
+    if (!bench->drop_caches || geteuid() != 0) {
+        return 0;
+    }
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    dropped = write(fd, "3\n", 2) == 2;
+    close(fd);
+    return dropped;
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static long percentile(const long *sorted, long count, double pct) {
+    long rank = (long)((pct * count + 99) / 100);
+    if (count == 0) {
+        return 0;
+    }
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static CopyEngine main_engine(const CopyStats *stats) {
+    CopyEngine best = COPY_ENGINE_AUTO;
+    long most = 0;
+
+    for (int i = COPY_ENGINE_REFLINK; i < COPY_ENGINE_COUNT; i++) {
+        if (stats->engine_files[i] > most) {
+            most = stats->engine_files[i];
+            best = (CopyEngine)i;
+        }
+    }
+    return best;
+}
+
+// Run one operation over every file of a file corpus, timing each file
+static void run_file_op(BenchOp op, const Corpus *corpus, const char *out,
+                        const char *reference, RunResult *result) {
+    long *times = calloc(corpus->files, sizeof(long));
+    char src[MAX_PATH], dest[MAX_PATH], hex[HASH_MAX_HEX];
+    CopyStats stats;
+    struct stat st;
+    off_t diff_offset;
+
+    init_stats(&stats);
+    if (times == NULL) {
+        result->status = ERROR_FILE_READ;
+        return;
+    }
+
+    long run_start = monotonic_ns();
+    for (long i = 0; i < corpus->files && result->status == SUCCESS; i++) {
+        // Paths are built before the clock starts
+        if (corpus_file_path(corpus, corpus->path, i, src, sizeof(src)) != SUCCESS ||
+            (op == OP_COPY_FILE &&
+             corpus_file_path(corpus, out, i, dest, sizeof(dest)) != SUCCESS) ||
+            (op == OP_COMPARE_FILES &&
+             corpus_file_path(corpus, reference, i, dest, sizeof(dest)) != SUCCESS)) {
+            result->status = ERROR_INVALID_PATH;
+            break;
+        }
+        long start = monotonic_ns();
+        switch (op) {
+            case OP_COPY_FILE:
+                result->status = copy_file_with_stats(src, dest, &stats);
+                break;
+            case OP_COMPARE_FILES:
+                result->status = compare_files_at(src, dest, &diff_offset);
+                break;
+            default:
+                result->status = calculate_md5(src, hex);
+                break;
+        }
+        times[i] = monotonic_ns() - start;
+        if (stat(src, &st) == 0) {
+            result->bytes += st.st_size;
+        }
+        result->files++;
+    }
+    result->elapsed_ns = monotonic_ns() - run_start;
+
+    qsort(times, result->files, sizeof(long), compare_longs);
+    result->p50_ns = percentile(times, result->files, 50);
+    result->p99_ns = percentile(times, result->files, 99);
+    if (op == OP_COPY_FILE) {
+        result->engine_used = main_engine(&stats);
+    }
+    free(times);
+}
+
+static void run_directory_op(const Corpus *corpus, const char *out, RunResult *result) {
+    CopyStats stats;
+
+    init_stats(&stats);
+    long start = monotonic_ns();
+    result->status = copy_directory_with_stats(corpus->path, out, &stats);
+    result->elapsed_ns = monotonic_ns() - start;
+    stats_stop(&stats);
+
+    result->files = stats.total_files;
+    result->bytes = stats.total_bytes;
+    result->p50_ns = stats_latency_percentile(&stats, 50);
+    result->p99_ns = stats_latency_percentile(&stats, 99);
+    result->engine_used = main_engine(&stats);
+}
+
+static void format_buffer_size(size_t size, char *buffer, size_t len) {
+    if (size == 0) {
+        snprintf(buffer, len, "auto");
+    } else if (size % MB == 0) {
+        snprintf(buffer, len, "%zuM", size / MB);
+    } else if (size % KB == 0) {
+        snprintf(buffer, len, "%zuK", size / KB);
+    } else {
+        snprintf(buffer, len, "%zu", size);
+    }
+}
+
+// Run one configuration bench->repeats times and print a row per run
+static void run_config(const Bench *bench, BenchOp op, const Corpus *corpus,
+                       CopyEngine engine, size_t buffer_size, int jobs) {
+    char out[MAX_PATH], reference[MAX_PATH] = "", buffer_label[32];
+    int copies = op == OP_COPY_FILE || op == OP_COPY_DIRECTORY;
+    CopyOptions opts;
+
+    init_copy_options(&opts);
+    opts.engine = engine;
+    opts.jobs = jobs;
+    opts.use_io_uring = engine == COPY_ENGINE_IO_URING;
+    opts.buffer_size = buffer_size;
+    opts.progress = PROGRESS_NONE;
+    set_copy_options(&opts);
+
+    format_buffer_size(buffer_size, buffer_label, sizeof(buffer_label));
+    snprintf(out, sizeof(out), "%s/out", bench->dir);
+    if (op == OP_COMPARE_FILES &&
+        prepare_reference(bench, corpus, reference, sizeof(reference)) != SUCCESS) {
+        return;
+    }
+
+    for (int run = 1; run <= bench->repeats; run++) {
+        RunResult result;
+
+        memset(&result, 0, sizeof(result));
+        result.engine_used = COPY_ENGINE_AUTO;
+        if (path_exists(out)) {
+            tree_remove(out, jobs, 0);
+        }
+        if (op == OP_COPY_FILE && create_directory(out) != SUCCESS) {
+            print_error(ERROR_DIR_CREATE, out);
+            return;
+        }
+        int cold = drop_caches(bench);
+
+        if (op == OP_COPY_DIRECTORY) {
+            run_directory_op(corpus, out, &result);
+        } else {
+            run_file_op(op, corpus, out, reference, &result);
+        }
+
+        double seconds = result.elapsed_ns / 1e9;
+        fprintf(bench->csv, "%s,%s,%s,%s,%s,%d,%s,%d,%s,%ld,%ld,%.6f,%.2f,%.2f,%.1f,%.1f\n",
+                op_names[op], corpus->spec->name, copies ? copy_engine_name(engine) : "-",
+                copies && result.engine_used != COPY_ENGINE_AUTO ?
+                    copy_engine_name(result.engine_used) : "-",
+                buffer_label, jobs, cold ? "cold" : "warm", run,
+                result.status == SUCCESS ? "ok" : "error", result.files, result.bytes, seconds,
+                seconds > 0 ? result.bytes / (double)MB / seconds : 0.0,
+                seconds > 0 ? result.files / seconds : 0.0,
+                result.p50_ns / 1e3, result.p99_ns / 1e3);
+        fflush(bench->csv);
+        fprintf(stderr, "bench: %s %s engine=%s buffer=%s jobs=%d run %d/%d: %.3f s%s\n",
+                op_names[op], corpus->spec->name, copies ? copy_engine_name(engine) : "-",
+                buffer_label, jobs, run, bench->repeats, seconds,
+                result.status == SUCCESS ? "" : " (failed)");
+    }
+
+    if (path_exists(out)) {
+        tree_remove(out, jobs, 0);
+    }
+}
+
+// Buffer sizes only matter where data passes through a userspace buffer
+static int uses_buffer(BenchOp op, CopyEngine engine) {
+    return op == OP_COMPARE_FILES || op == OP_CALCULATE_MD5 || engine == COPY_ENGINE_READ_WRITE;
+}
+
+static void run_op(const Bench *bench, BenchOp op, const Corpus *corpus) {
+    int copies = op == OP_COPY_FILE || op == OP_COPY_DIRECTORY;
+    int engine_count = copies ? bench->engine_count : 1;
+    int job_count = op == OP_COPY_DIRECTORY ? bench->job_count : 1;
+
+    for (int e = 0; e < engine_count; e++) {
+        CopyEngine engine = copies ? bench->engines[e] : COPY_ENGINE_AUTO;
+        int buffer_count = uses_buffer(op, engine) ? bench->buffer_count : 1;
+
+        for (int b = 0; b < buffer_count; b++) {
+            size_t buffer_size = uses_buffer(op, engine) ? bench->buffers[b] : 0;
+
+            for (int j = 0; j < job_count; j++) {
+                run_config(bench, op, corpus, engine, buffer_size,
+                           op == OP_COPY_DIRECTORY ? bench->jobs[j] : 1);
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Command line
+// ============================================================================
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -d, --dir DIR       Work directory for corpora and copies (default: %s)\n",
+           BENCH_DEFAULT_DIR);
+    printf("  -o, --output FILE   Write CSV to FILE (default: stdout)\n");
+    printf("  -s, --scale F       Corpus scale: 1 is 1M tiny, 10k medium, 4 x 1 GB huge\n");
+    printf("                      and 2 x 4 GB sparse files (default: 1)\n");
+    printf("  -r, --repeats N     Runs per configuration (default: 3)\n");
+    printf("  --ops LIST          copy_file,copy_directory,compare_files,calculate_md5\n");
+    printf("  --corpora LIST      tiny,medium,huge,sparse\n");
+    printf("  --engines LIST      Copy engines (default: every engine built in)\n");
+    printf("  --buffers LIST      Buffer sizes, e.g. auto,64K,1M,16M (default)\n");
+    printf("  --jobs LIST         Thread counts for copy_directory (default: 1,4,nproc)\n");
+    printf("  --no-drop-caches    Keep the page cache between runs\n");
+    printf("  -h, --help          Display this help message\n");
+}
+
+// Mark the names of a comma-separated list in flags[] (one per name in names[])
+static int parse_name_list(char *list, const char *const names[], int count, int flags[]) {
+    memset(flags, 0, count * sizeof(int));
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int i = 0;
+        while (i < count && strcmp(name, names[i]) != 0) {
+            i++;
+        }
+        if (i == count) {
+            fprintf(stderr, "Error: Unknown name '%s'\n", name);
+            return ERROR_INVALID_PATH;
+        }
+        flags[i] = 1;
+    }
+    return SUCCESS;
+}
+
+static int parse_engine_list(Bench *bench, char *list) {
+    bench->engine_count = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (bench->engine_count == BENCH_MAX_LIST ||
+            parse_copy_engine(name, &bench->engines[bench->engine_count]) != SUCCESS) {
+            fprintf(stderr, "Error: Unknown copy engine '%s'\n", name);
+            return ERROR_INVALID_PATH;
+        }
+        bench->engine_count++;
+    }
+    return bench->engine_count > 0 ? SUCCESS : ERROR_INVALID_PATH;
+}
+
+static int parse_buffer_list(Bench *bench, char *list) {
+    bench->buffer_count = 0;
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *end;
+        unsigned long long size = 0;
+
+        if (strcmp(item, "auto") != 0) {
+            size = strtoull(item, &end, 10);
+            if (*end == 'K' || *end == 'k') {
+                size *= KB;
+                end++;
+            } else if (*end == 'M' || *end == 'm') {
+                size *= MB;
+                end++;
+            }
+            if (end == item || *end != '\0' || size == 0 || size > MAX_BUFFER_SIZE) {
+                fprintf(stderr, "Error: Bad buffer size '%s'\n", item);
+                return ERROR_INVALID_PATH;
+            }
+        }
+        if (bench->buffer_count == BENCH_MAX_LIST) {
+            return ERROR_INVALID_PATH;
+        }
+        bench->buffers[bench->buffer_count++] = (size_t)size;
+    }
+    return bench->buffer_count > 0 ? SUCCESS : ERROR_INVALID_PATH;
+}
+
+static int parse_job_list(Bench *bench, char *list) {
+    bench->job_count = 0;
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+        int jobs = atoi(item);
+        if (jobs < 1 || jobs > MAX_WORKERS || bench->job_count == BENCH_MAX_LIST) {
+            fprintf(stderr, "Error: Bad thread count '%s'\n", item);
+            return ERROR_INVALID_PATH;
+        }
+        bench->jobs[bench->job_count++] = jobs;
+    }
+    return bench->job_count > 0 ? SUCCESS : ERROR_INVALID_PATH;
+}
+
+static void add_jobs(Bench *bench, int jobs) {
+    for (int i = 0; i < bench->job_count; i++) {
+        if (bench->jobs[i] == jobs) {
+            return;
+        }
+    }
+    bench->jobs[bench->job_count++] = jobs;
+}
+
+static void init_bench(Bench *bench) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(bench, 0, sizeof(*bench));
+    bench->dir = BENCH_DEFAULT_DIR;
+    bench->scale = 1.0;
+    bench->repeats = 3;
+    bench->drop_caches = 1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        bench->ops[i] = 1;
+    }
+    for (int i = 0; i < CORPUS_COUNT; i++) {
+        bench->corpora[i] = 1;
+    }
+
+    bench->engines[bench->engine_count++] = COPY_ENGINE_REFLINK;
+    bench->engines[bench->engine_count++] = COPY_ENGINE_COPY_FILE_RANGE;
+    bench->engines[bench->engine_count++] = COPY_ENGINE_SENDFILE;
+    bench->engines[bench->engine_count++] = COPY_ENGINE_READ_WRITE;
+#ifdef HAVE_LIBURING
+    bench->engines[bench->engine_count++] = COPY_ENGINE_IO_URING;
+#endif
+
+    bench->buffers[bench->buffer_count++] = 0;
+    bench->buffers[bench->buffer_count++] = 64 * KB;
+    bench->buffers[bench->buffer_count++] = 1 * MB;
+    bench->buffers[bench->buffer_count++] = 16 * MB;
+
+    add_jobs(bench, 1);
+    add_jobs(bench, 4);
+    add_jobs(bench, cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus);
+}
+
+static long scaled(long value, double scale, long minimum) {
+    long result = (long)(value * scale);
+    return result < minimum ? minimum : result;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"dir",     required_argument, NULL, 'd'},
+        {"output",  required_argument, NULL, 'o'},
+        {"scale",   required_argument, NULL, 's'},
+        {"repeats", required_argument, NULL, 'r'},
+        {"ops",     required_argument, NULL, 'O'},
+        {"corpora", required_argument, NULL, 'C'},
+        {"engines", required_argument, NULL, 'E'},
+        {"buffers", required_argument, NULL, 'B'},
+        {"jobs",    required_argument, NULL, 'j'},
+        {"no-drop-caches", no_argument, NULL, 'N'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *corpus_names[CORPUS_COUNT];
+    const char *output = NULL;
+    Bench bench;
+    int opt, result = SUCCESS;
+
+    init_bench(&bench);
+    for (int i = 0; i < CORPUS_COUNT; i++) {
+        corpus_names[i] = corpus_specs[i].name;
+    }
+
+    while ((opt = getopt_long(argc, argv, "d:o:s:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': bench.dir = optarg; break;
+            case 'o': output = optarg; break;
+            case 's': bench.scale = atof(optarg); break;
+            case 'r': bench.repeats = atoi(optarg); break;
+            case 'O': result = parse_name_list(optarg, op_names, OP_COUNT, bench.ops); break;
+            case 'C':
+                result = parse_name_list(optarg, corpus_names, CORPUS_COUNT, bench.corpora);
+                break;
+            case 'E': result = parse_engine_list(&bench, optarg); break;
+            case 'B': result = parse_buffer_list(&bench, optarg); break;
+            case 'j': result = parse_job_list(&bench, optarg); break;
+            case 'N': bench.drop_caches = 0; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+        if (result != SUCCESS) {
+            return 1;
+        }
+    }
+    if (bench.scale <= 0 || bench.repeats < 1) {
+        fprintf(stderr, "Error: --scale and --repeats must be positive\n");
+        return 1;
+    }
+
+    // The library reports progress on stdout; rows must not mix with it
+    bench.csv = output != NULL ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (bench.csv == NULL) {
+        perror(output != NULL ? output : "stdout");
+        return 1;
+    }
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("/dev/null");
+        return 1;
+    }
+    fprintf(bench.csv, "operation,corpus,engine,engine_used,buffer_size,jobs,cache,run,status,"
+                       "files,bytes,seconds,mib_per_s,files_per_s,p50_us,p99_us\n");
+
+    fill_noise();
+    for (int c = 0; c < CORPUS_COUNT; c++) {
+        const CorpusSpec *spec = &corpus_specs[c];
+        Corpus corpus;
+
+        if (!bench.corpora[c]) {
+            continue;
+        }
+        memset(&corpus, 0, sizeof(corpus));
+        corpus.spec = spec;
+        if (spec->tree) {
+            corpus.files = scaled(spec->files, bench.scale, 1);
+            corpus.min_size = spec->min_size;
+            corpus.max_size = spec->max_size;
+        } else {
+            corpus.files = spec->files;
+            corpus.min_size = scaled(spec->min_size, bench.scale, MB);
+            corpus.max_size = scaled(spec->max_size, bench.scale, MB);
+            corpus.data_stride = spec->data_stride ?
+                scaled(spec->data_stride, bench.scale, 2 * DATA_CHUNK) : 0;
+        }
+
+        // Trees are copied whole; the few large files one at a time
+        int wanted = 0;
+        for (int op = 0; op < OP_COUNT; op++) {
+            wanted |= bench.ops[op] && (op == OP_COPY_DIRECTORY) == spec->tree;
+        }
+        if (!wanted) {
+            continue;
+        }
+        if (prepare_corpus(&bench, &corpus) != SUCCESS) {
+            result = ERROR_FILE_WRITE;
+            continue;
+        }
+
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (bench.ops[op] && (op == OP_COPY_DIRECTORY) == spec->tree) {
+                run_op(&bench, (BenchOp)op, &corpus);
+            }
+        }
+    }
+
+    if (fclose(bench.csv) != 0) {
+        result = ERROR_FILE_WRITE;
+    }
+    return result == SUCCESS ? 0 : 1;
+}